@@ -0,0 +1,73 @@
+'use strict';
+
+// Server-sent events to every open dashboard. A client first gets a snapshot
+// event with the current state, then each reading and alert as it arrives;
+// EventSource reconnects by itself and gets a fresh snapshot.
+
+// A client whose connection has this much unsent data is dropped instead of
+// buffering without bound; it reconnects and starts from a snapshot.
+var MAX_BUFFERED_BYTES = 64 * 1024;
+var HEARTBEAT_MS = 15000;
+
+function format(event, data) {
+    return 'event: ' + event + '\ndata: ' + JSON.stringify(data) + '\n\n';
+}
+
+function LiveStream(snapshot) {
+    var self = this;
+    this.snapshot = snapshot;
+    this.clients = [];
+    // Keeps proxies from closing quiet connections
+    this.heartbeat = setInterval(function() {
+        self.send(': heartbeat\n\n');
+    }, HEARTBEAT_MS);
+    this.heartbeat.unref();
+}
+
+// Request handler for the stream
+LiveStream.prototype.handler = function() {
+    var self = this;
+    return function(req, res) {
+        res.writeHead(200, {
+            'Content-Type': 'text/event-stream',
+            'Cache-Control': 'no-cache',
+            'Connection': 'keep-alive',
+            'X-Accel-Buffering': 'no'
+        });
+        res.write('retry: 5000\n\n' + format('snapshot', self.snapshot()));
+        self.clients.push(res);
+        req.on('close', function() {
+            self.remove(res);
+        });
+    };
+};
+
+LiveStream.prototype.remove = function(res) {
+    var index = this.clients.indexOf(res);
+    if (index >= 0) {
+        this.clients.splice(index, 1);
+    }
+};
+
+// Writes one already formatted message to every client
+LiveStream.prototype.send = function(text) {
+    var clients = this.clients.slice();
+    for (var i = 0; i < clients.length; i++) {
+        var res = clients[i];
+        if (res.writableLength > MAX_BUFFERED_BYTES) {
+            this.remove(res);
+            res.end();
+        } else {
+            res.write(text);
+        }
+    }
+};
+
+// Serializes the data once for all clients
+LiveStream.prototype.publish = function(event, data) {
+    if (this.clients.length > 0) {
+        this.send(format(event, data));
+    }
+};
+
+module.exports = LiveStream;
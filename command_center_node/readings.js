@@ -0,0 +1,125 @@
+'use strict';
+
+// Temperature readings as the dashboard shows them:
+//   { deviceid: 'pi', temperature: 21.5, eventtime: <ms since the epoch> }
+// They come from device telemetry (MTemperature or Temperature, one sample
+// or a batch of them as a JSON array) or from rows of the Stream Analytics
+// table (temperaturereading).
+
+// Fixed size ring of the most recent readings
+function ReadingRing(capacity) {
+    this.capacity = capacity;
+    this.items = new Array(capacity);
+    this.next = 0;
+    this.count = 0;
+}
+
+ReadingRing.prototype.push = function(reading) {
+    this.items[this.next] = reading;
+    this.next = (this.next + 1) % this.capacity;
+    if (this.count < this.capacity) {
+        this.count++;
+    }
+};
+
+// The last n readings (all of them without n), oldest first
+ReadingRing.prototype.last = function(n) {
+    var count = (n === undefined || n > this.count) ? this.count : n;
+    var result = new Array(count);
+    var start = (this.next - count + this.capacity) % this.capacity;
+    for (var i = 0; i < count; i++) {
+        result[i] = this.items[(start + i) % this.capacity];
+    }
+    return result;
+};
+
+// Looks a property up without regard to case, as Stream Analytics lowercases names
+function property(body, names) {
+    for (var key in body) {
+        if (names.indexOf(key.toLowerCase()) >= 0) {
+            var value = body[key];
+            // Table entities wrap every value as { _: value }
+            return (value !== null && typeof value === 'object' && '_' in value) ? value._ : value;
+        }
+    }
+    return undefined;
+}
+
+// Seconds since the epoch, as written by Stream Analytics, or an ISO-8601 string
+function toTime(value, fallback) {
+    if (typeof value === 'number') {
+        return value * 1000;
+    }
+    var parsed = (typeof value === 'string' || value instanceof Date) ? new Date(value).getTime() : NaN;
+    return isNaN(parsed) ? fallback : parsed;
+}
+
+// A reading from one sample or table entity, or null if it has no temperature
+function toReading(body, defaultTime) {
+    if (body === null || typeof body !== 'object' || Array.isArray(body)) {
+        return null;
+    }
+    var temperature = Number(property(body, ['temperaturereading', 'mtemperature', 'temperature']));
+    if (isNaN(temperature)) {
+        return null;
+    }
+    return {
+        deviceid: property(body, ['deviceid']),
+        temperature: temperature,
+        eventtime: toTime(property(body, ['eventtime', 'sampletime']), defaultTime)
+    };
+}
+
+// The readings in a message body or table entity, oldest first; a batch is a
+// JSON array of samples. Entries without a temperature are left out.
+function toReadings(body, defaultTime) {
+    if (Buffer.isBuffer(body)) {
+        body = body.toString();
+    }
+    if (typeof body === 'string') {
+        try {
+            body = JSON.parse(body);
+        } catch (err) {
+            return [];
+        }
+    }
+    var samples = Array.isArray(body) ? body : [body];
+    var result = [];
+    for (var i = 0; i < samples.length; i++) {
+        var reading = toReading(samples[i], defaultTime);
+        if (reading !== null) {
+            result.push(reading);
+        }
+    }
+    return result;
+}
+
+// Why a message body cannot be read as JSON, from the content type and content
+// encoding system properties the device set, or null if it can. Devices send
+// CBOR with --encoding cbor and deflate bodies with --compress deflate.
+function unsupportedEncoding(contentType, contentEncoding) {
+    if (contentEncoding && contentEncoding.toLowerCase() !== 'utf-8') {
+        return 'content encoding ' + contentEncoding;
+    }
+    if (contentType && contentType.toLowerCase().indexOf('json') < 0) {
+        return 'content type ' + contentType;
+    }
+    return null;
+}
+
+// The shape /api/temperatures had when it returned table entities
+function toTableEntity(reading) {
+    return {
+        deviceid: { _: reading.deviceid },
+        temperaturereading: { _: reading.temperature },
+        eventtime: { _: Math.floor(reading.eventtime / 1000) }
+    };
+}
+
+module.exports = {
+    ReadingRing: ReadingRing,
+    toReading: toReading,
+    toReadings: toReadings,
+    unsupportedEncoding: unsupportedEncoding,
+    toTableEntity: toTableEntity
+};
@@ -10,7 +10,12 @@ var DeviceConnectionString = require('azure-iot-device').ConnectionString;
 var azure = require('azure-storage');
 var nconf = require('nconf');
 
+var readings = require('./readings');
+var LiveStream = require('./live_stream');
+var standins = require('./standins');
+
 nconf.argv().env().file('./config.json');
+nconf.defaults({ telemetryConsumerGroup: '$Default', recentReadings: 100, standInIntervalMs: 1000 });
 var eventHubName = nconf.get('eventHubName');
 var ehConnString = nconf.get('ehConnString');
 var deviceConnString = nconf.get('deviceConnString');
@@ -18,31 +23,168 @@ var storageAcountName = nconf.get('storageAcountName');
 var storageAccountKey = nconf.get('storageAccountKey');
 var storageTable = nconf.get('storageTable');
 var iotHubConnString = nconf.get('iotHubConnString');
+// Event Hub-compatible endpoint of the IoT hub, for live readings
+var telemetryEventHubName = nconf.get('telemetryEventHubName');
+var telemetryEhConnString = nconf.get('telemetryEhConnString');
+var telemetryConsumerGroup = nconf.get('telemetryConsumerGroup');
 
 var deviceId = DeviceConnectionString.parse(deviceConnString).DeviceId;
-var iotHubClient = ServiceClient.fromConnectionString(iotHubConnString);
 
-// event hub alerts
+// Azure services, or local stand-ins with --standIn
+var services = {
+    eventHubClient: function(connectionString, name) {
+        return EventHubClient.fromConnectionString(connectionString, name);
+    },
+    serviceClient: function() {
+        return ServiceClient.fromConnectionString(iotHubConnString);
+    },
+    tableService: function() {
+        return azure.createTableService(storageAcountName, storageAccountKey);
+    }
+};
+if (nconf.get('standIn')) {
+    console.log('using local stand-ins for the Azure services');
+    services = standins.create(deviceId, Number(nconf.get('standInIntervalMs')));
+    telemetryEventHubName = telemetryEventHubName || 'telemetry';
+}
+
+// recent readings and alerts, pushed to the dashboards as they arrive
+var recent = new readings.ReadingRing(Number(nconf.get('recentReadings')));
 var alerts = [];
-var ehclient = EventHubClient.fromConnectionString(ehConnString, eventHubName)
-ehclient.createReceiver('$Default', '0', { startAfterTime: Date.now() })
-    .then(function(rx) {
-        rx.on('errorReceived', function(err) { console.log(err); });
-        rx.on('message', function(message) {
-            alerts.push(message.body);
-            alerts = alerts.slice(-5); // keep last 5
+var stream = new LiveStream(function() {
+    return { readings: recent.last(), alerts: alerts };
+});
+
+function addReading(reading) {
+    if (reading.deviceid === undefined || reading.deviceid === deviceId) {
+        recent.push(reading);
+        stream.publish('reading', reading);
+    }
+}
+
+// Telemetry messages left out because the dashboard cannot decode them, by reason.
+// The first of each reason is logged, then every 100th.
+var skipped = {};
+
+function skip(reason) {
+    skipped[reason] = (skipped[reason] || 0) + 1;
+    if (skipped[reason] % 100 === 1) {
+        console.log('skipped ' + skipped[reason] + ' telemetry message(s) with ' + reason +
+            '; send JSON without compression for live readings');
+    }
+}
+
+// A property the device set on the message, such as contentType
+function messageProperty(message, name) {
+    return message.properties ? message.properties[name] : undefined;
+}
+
+function enqueuedTime(message) {
+    var time = message.annotations && message.annotations['x-opt-enqueued-time'];
+    return time ? new Date(time).getTime() : Date.now();
+}
+
+// Receives from every partition of an event hub, from now on
+function receive(client, consumerGroup, onMessage) {
+    return client.open()
+        .then(function() { return client.getPartitionIds(); })
+        .then(function(partitionIds) {
+            return Promise.all(partitionIds.map(function(partitionId) {
+                return client.createReceiver(consumerGroup, partitionId, { startAfterTime: Date.now() })
+                    .then(function(rx) {
+                        rx.on('errorReceived', function(err) { console.log(err); });
+                        rx.on('message', onMessage);
+                    });
+            }));
         });
-    });
+}
+
+function startReceivers() {
+    // event hub alerts
+    receive(services.eventHubClient(ehConnString, eventHubName, false), '$Default', function(message) {
+        alerts.push(message.body);
+        alerts = alerts.slice(-5); // keep last 5
+        stream.publish('alert', message.body);
+    }).catch(function(err) { console.log('error receiving alerts: ' + err); });
+
+    // device telemetry
+    if (!telemetryEventHubName || (!telemetryEhConnString && !nconf.get('standIn'))) {
+        console.log('telemetryEventHubName and telemetryEhConnString are not set, readings are not updated live');
+        return;
+    }
+    receive(services.eventHubClient(telemetryEhConnString, telemetryEventHubName, true), telemetryConsumerGroup, function(message) {
+        var reason = readings.unsupportedEncoding(messageProperty(message, 'contentType'),
+            messageProperty(message, 'contentEncoding'));
+        if (reason !== null) {
+            skip(reason);
+        } else {
+            readings.toReadings(message.body, enqueuedTime(message)).forEach(addReading);
+        }
+    }).catch(function(err) { console.log('error receiving telemetry: ' + err); });
+}
 
-// table storage
-var tableSvc = azure.createTableService(storageAcountName, storageAccountKey);
+// table storage, read once at startup for the readings from before it
+var tableSvc = services.tableService();
 tableSvc.createTableIfNotExists(storageTable, function(err, result, response) {
     if (err) {
         console.log('error looking up table');
         console.log(err)
     }
+    var query = new azure.TableQuery()
+        .select(['eventtime', 'temperaturereading', 'deviceid'])
+        .where('PartitionKey eq ?', deviceId);
+    tableSvc.queryEntities(storageTable, query, null, function(err, result, response) {
+        if (err) {
+            console.log('error reading the temperature history');
+            console.log(err);
+        } else {
+            result.entries.slice(-recent.capacity).forEach(function(entity) {
+                readings.toReadings(entity, Date.now()).forEach(addReading);
+            });
+        }
+        startReceivers();
+    });
 });
 
+// One service connection for all commands, opened on first use and again after it is lost
+var iotHubClient = null;
+var iotHubState = 'closed';
+var waitingForOpen = [];
+
+function withServiceClient(callback) {
+    if (iotHubState === 'open') {
+        callback(null, iotHubClient);
+        return;
+    }
+    waitingForOpen.push(callback);
+    if (iotHubState === 'opening') {
+        return;
+    }
+    iotHubState = 'opening';
+    var client = services.serviceClient();
+    iotHubClient = client;
+    client.on('disconnect', function() {
+        if (client === iotHubClient) {
+            console.log('service connection lost');
+            iotHubState = 'closed';
+        }
+    });
+    client.open(function(err) {
+        var waiting = waitingForOpen;
+        waitingForOpen = [];
+        iotHubState = err ? 'closed' : 'open';
+        waiting.forEach(function(waiter) { waiter(err, client); });
+    });
+}
+
+// After a failed send the next command opens a new connection
+function dropServiceClient(client) {
+    if (client === iotHubClient && iotHubState === 'open') {
+        iotHubState = 'closed';
+        client.close(function() {});
+    }
+}
+
 // website setup
 var app = express();
 var port = nconf.get('port');
@@ -51,24 +193,17 @@ app.use(express.static('bower_components'));
 app.use(bodyParser.json());
 
 // app api
+app.get('/api/stream', stream.handler());
+
 app.get('/api/alerts', function(req, res) {
     res.json(alerts);
 });
 
+// the 10 most recent readings, as table entities
 app.get('/api/temperatures', function(req, res) {
-    var query = new azure.TableQuery()
-        .select(['eventtime', 'temperaturereading', 'deviceid'])
-        .where('PartitionKey eq ?', deviceId);
-    tableSvc.queryEntities(storageTable, query, null, function(err, result, response) {
-        res.json(result.entries.slice(-10));
-    })
+    res.json(recent.last(10).map(readings.toTableEntity));
 })
 
-var completedCallback = function(err, res) {
-    if (err) { console.log(err); }
-    else { console.log(res); }
-};
-
 app.post('/api/command', function(req, res) {
     console.log('command received: ' + req.body.command);
 
@@ -76,29 +211,28 @@ app.post('/api/command', function(req, res) {
     if (req.body.command === 1) {
         command = "TurnFanOn";
     }
+    var started = Date.now();
 
-    iotHubClient.open(function(err) {
+    withServiceClient(function(err, client) {
         if (err) {
             console.error('Could not connect: ' + err.message);
-        } else { // {"Name":"TurnFanOn","Parameters":""}
-            var data = JSON.stringify({ "Name":command,"Parameters":"" });
-            console.log('Sending message: ' + data);
-            iotHubClient.send(deviceId, data, printResultFor('send'));
+            res.status(502).end();
+            return;
         }
-    });
-
-    // Helper function to print results in the console
-    function printResultFor(op) {
-        return function printResult(err, res) {
+        // {"Name":"TurnFanOn","Parameters":""}
+        var data = JSON.stringify({ "Name":command,"Parameters":"" });
+        console.log('Sending message: ' + data);
+        client.send(deviceId, data, function(err, result) {
             if (err) {
-                console.log(op + ' error: ' + err.toString());
+                console.log('send error: ' + err.toString());
+                dropServiceClient(client);
+                res.status(502).end();
             } else {
-                console.log(op + ' status: ' + res.constructor.name);
+                console.log('send status: ' + result.constructor.name + ' in ' + (Date.now() - started) + ' ms');
+                res.status(204).end();
             }
-        };
-    }
-
-    res.end();
+        });
+    });
 });
 
 app.listen(port, function() {
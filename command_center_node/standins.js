@@ -0,0 +1,108 @@
+'use strict';
+
+// Local stand-ins for the Azure services the server uses, so it can run and
+// be tested without a subscription: node server.js --standIn
+//
+// A simulated device sends a reading every standInIntervalMs. Its
+// temperature drifts up while the fan is off and down while it is on, and
+// readings above 25 degrees also arrive as alerts, like the Stream Analytics
+// job of the tutorial sends them.
+
+var EventEmitter = require('events').EventEmitter;
+
+var ALERT_THRESHOLD = 25;
+
+function SimulatedDevice(deviceId, intervalMs) {
+    var self = this;
+    EventEmitter.call(this);
+    this.deviceId = deviceId;
+    this.temperature = 22;
+    this.fanOn = false;
+    this.timer = setInterval(function() {
+        self.temperature += (self.fanOn ? -0.3 : 0.2) + (Math.random() - 0.5) * 0.2;
+        self.emit('reading', {
+            DeviceId: self.deviceId,
+            MTemperature: Math.round(self.temperature * 100) / 100,
+            EventTime: new Date().toISOString()
+        });
+    }, intervalMs);
+}
+SimulatedDevice.prototype = Object.create(EventEmitter.prototype);
+
+// Stands in for azure-event-hubs: the telemetry hub gets every reading, any
+// other hub the alerts
+function eventHubClient(device, isTelemetry) {
+    return {
+        open: function() { return Promise.resolve(); },
+        getPartitionIds: function() { return Promise.resolve(['0']); },
+        createReceiver: function() {
+            var receiver = new EventEmitter();
+            device.on('reading', function(reading) {
+                var now = Date.now();
+                if (isTelemetry) {
+                    receiver.emit('message', { body: reading, annotations: { 'x-opt-enqueued-time': now } });
+                } else if (reading.MTemperature > ALERT_THRESHOLD) {
+                    receiver.emit('message', {
+                        body: {
+                            deviceid: reading.DeviceId,
+                            eventtime: reading.EventTime,
+                            temperaturereading: reading.MTemperature
+                        },
+                        annotations: { 'x-opt-enqueued-time': now }
+                    });
+                }
+            });
+            return Promise.resolve(receiver);
+        }
+    };
+}
+
+function MessageEnqueued() {}
+
+// Stands in for the azure-iothub service client; commands reach the simulated device
+function serviceClient(device) {
+    var client = new EventEmitter();
+    client.open = function(callback) {
+        setImmediate(callback, null);
+    };
+    client.send = function(deviceId, data, callback) {
+        var command = JSON.parse(data.toString());
+        if (deviceId !== device.deviceId) {
+            setImmediate(callback, new Error('device ' + deviceId + ' not found'));
+            return;
+        }
+        device.fanOn = (command.Name === 'TurnFanOn');
+        setImmediate(callback, null, new MessageEnqueued());
+    };
+    client.close = function(callback) {
+        setImmediate(callback, null);
+    };
+    return client;
+}
+
+// Stands in for the azure-storage table service, with an empty table
+function tableService() {
+    return {
+        createTableIfNotExists: function(table, callback) {
+            setImmediate(callback, null);
+        },
+        queryEntities: function(table, query, token, callback) {
+            setImmediate(callback, null, { entries: [] });
+        }
+    };
+}
+
+function create(deviceId, intervalMs) {
+    var device = new SimulatedDevice(deviceId, intervalMs);
+    return {
+        eventHubClient: function(connectionString, name, isTelemetry) {
+            return eventHubClient(device, isTelemetry);
+        },
+        serviceClient: function() {
+            return serviceClient(device);
+        },
+        tableService: tableService
+    };
+}
+
+module.exports = { create: create };
@@ -0,0 +1,93 @@
+'use strict';
+
+// Tests of readings.js; run with npm test. Needs nothing beyond node.
+
+var assert = require('assert');
+var readings = require('../readings');
+
+var failures = 0;
+
+function test(name, body) {
+    try {
+        body();
+        console.log('ok - ' + name);
+    } catch (err) {
+        failures++;
+        console.log('not ok - ' + name);
+        console.log(err.stack);
+    }
+}
+
+var T0 = Date.UTC(2026, 9, 18, 9, 30, 0);
+
+test('reads a sample from a JSON body', function() {
+    var body = Buffer.from(JSON.stringify({ DeviceId: 'pi', MTemperature: 21.5, SampleTime: '2026-10-18T09:30:00.250Z' }));
+    assert.deepEqual(readings.toReadings(body, 0), [
+        { deviceid: 'pi', temperature: 21.5, eventtime: T0 + 250 }
+    ]);
+});
+
+test('reads every sample of a batch, oldest first', function() {
+    var body = JSON.stringify([
+        { DeviceId: 'pi', Temperature: 21, SampleTime: '2026-10-18T09:30:00.000Z' },
+        { DeviceId: 'pi', Humidity: 40 },
+        { DeviceId: 'pi', Temperature: 22, SampleTime: '2026-10-18T09:30:01.000Z' }
+    ]);
+    assert.deepEqual(readings.toReadings(body, 0), [
+        { deviceid: 'pi', temperature: 21, eventtime: T0 },
+        { deviceid: 'pi', temperature: 22, eventtime: T0 + 1000 }
+    ]);
+});
+
+test('reads a table entity, with times in seconds', function() {
+    var entity = { deviceid: { _: 'pi' }, temperaturereading: { _: 23.5 }, eventtime: { _: T0 / 1000 } };
+    assert.deepEqual(readings.toReadings(entity, 0), [
+        { deviceid: 'pi', temperature: 23.5, eventtime: T0 }
+    ]);
+    assert.deepEqual(readings.toTableEntity(readings.toReading(entity, 0)), entity);
+});
+
+test('uses the default time when a sample has none', function() {
+    assert.deepEqual(readings.toReadings({ Temperature: '20.25' }, 42), [
+        { deviceid: undefined, temperature: 20.25, eventtime: 42 }
+    ]);
+});
+
+test('leaves out bodies without readings', function() {
+    assert.deepEqual(readings.toReadings('not json', 0), []);
+    assert.deepEqual(readings.toReadings(Buffer.from([0xa2, 0x01, 0x02]), 0), []);
+    assert.deepEqual(readings.toReadings('{"Humidity": 40}', 0), []);
+    assert.deepEqual(readings.toReadings('[]', 0), []);
+    assert.deepEqual(readings.toReadings('21.5', 0), []);
+    assert.deepEqual(readings.toReadings(null, 0), []);
+    assert.strictEqual(readings.toReading([{ Temperature: 1 }], 0), null);
+});
+
+test('tells which encodings cannot be read', function() {
+    assert.strictEqual(readings.unsupportedEncoding(undefined, undefined), null);
+    assert.strictEqual(readings.unsupportedEncoding('application/json', undefined), null);
+    assert.strictEqual(readings.unsupportedEncoding('application/json', 'utf-8'), null);
+    assert.strictEqual(readings.unsupportedEncoding('application/cbor', undefined), 'content type application/cbor');
+    assert.strictEqual(readings.unsupportedEncoding('application/json', 'deflate'), 'content encoding deflate');
+});
+
+test('the ring keeps the most recent readings, oldest first', function() {
+    var ring = new readings.ReadingRing(3);
+    assert.deepEqual(ring.last(), []);
+    ring.push(1);
+    ring.push(2);
+    assert.deepEqual(ring.last(), [1, 2]);
+    ring.push(3);
+    ring.push(4);
+    ring.push(5);
+    assert.deepEqual(ring.last(), [3, 4, 5]);
+    assert.deepEqual(ring.last(2), [4, 5]);
+    assert.deepEqual(ring.last(10), [3, 4, 5]);
+    assert.deepEqual(ring.last(0), []);
+    assert.strictEqual(ring.count, 3);
+});
+
+if (failures > 0) {
+    console.log(failures + ' test(s) failed');
+    process.exit(1);
+}
@@ -0,0 +1,425 @@
+// Copyright (c) Microsoft. All rights reserved.
+// Licensed under the MIT license. See LICENSE file in the project root for full license information.
+
+/* Microbenchmarks of the hot functions of the platform library and of the
+   remote_monitoring helpers. Iteration counts are fixed so that results of
+   different builds and boards can be compared line by line. */
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "serializer.h"
+#include "azure_c_shared_utility/platform.h"
+
+#include "bme280.h"
+#include "bme280_sim.h"
+#include "device_utils.h"
+#include "event_trace.h"
+#include "readings_shm.h"
+#include "telemetry_codec.h"
+#include "time_service.h"
+#include "bench_util.h"
+
+/* Number of distinct raw samples cycled through, a power of two */
+#define FRAME_COUNT 64
+
+/* Registers answered by benchSpiXfer, as the driver addresses them */
+#define BENCH_REG_STATUS 0xF3
+#define BENCH_REG_PRESDATA 0xF7
+
+static uint8_t frames[FRAME_COUNT][BME280_FRAME_LEN];
+static int32_t adcTemperature[FRAME_COUNT];
+static int32_t adcPressure[FRAME_COUNT];
+static int32_t adcHumidity[FRAME_COUNT];
+static unsigned int nextFrame;
+
+static const char* deviceId = "raspberrypi-thermostat-0001";
+
+/* Same telemetry fields as the Thermostat model of remote_monitoring */
+BEGIN_NAMESPACE(Contoso);
+
+DECLARE_MODEL(Thermostat,
+WITH_DATA(double, Temperature),
+WITH_DATA(double, Humidity),
+WITH_DATA(ascii_char_ptr, DeviceId)
+);
+
+END_NAMESPACE(Contoso);
+
+/* Readings of the simulated sensor over one simulated hour, as raw frames */
+static void makeFrames(void)
+{
+    unsigned int i;
+
+    for (i = 0; i < FRAME_COUNT; i++)
+    {
+        double temperature, pressure, humidity;
+        uint8_t* frame = frames[i];
+
+        bme280_sim_readings(0, i * 60.0, &temperature, &pressure, &humidity);
+        bme280_sim_encode_frame(temperature, pressure, humidity, frame);
+        adcPressure[i] = ((int32_t)frame[0] << 12) | ((int32_t)frame[1] << 4) | (frame[2] & 0x04);
+        adcTemperature[i] = ((int32_t)frame[3] << 12) | ((int32_t)frame[4] << 4) | (frame[5] & 0x04);
+        adcHumidity[i] = ((int32_t)frame[6] << 8) | frame[7];
+    }
+}
+
+/* Answers the driver like a sensor that always has a sample ready, so that
+   bme280_read_sensors is measured without the bus and without the simulator */
+static int benchSpiXfer(int channel, unsigned char* data, int length)
+{
+    (void)channel;
+    if (length > 1 && data[0] == BENCH_REG_PRESDATA)
+    {
+        size_t count = (length - 1 < BME280_FRAME_LEN) ? (size_t)(length - 1) : BME280_FRAME_LEN;
+        memcpy(data + 1, frames[nextFrame++ & (FRAME_COUNT - 1)], count);
+    }
+    else if (length > 1)
+    {
+        memset(data + 1, 0, (size_t)(length - 1));
+    }
+    return length;
+}
+
+static size_t benchCompensateT(void* context, uint32_t iterations)
+{
+    uint32_t i;
+    int32_t sum = 0;
+    (void)context;
+    for (i = 0; i < iterations; i++)
+    {
+        sum += bme280_compensate_T_int32(adcTemperature[i & (FRAME_COUNT - 1)]);
+    }
+    bench_sink = (uint32_t)sum;
+    return 0;
+}
+
+static size_t benchCompensateP(void* context, uint32_t iterations)
+{
+    uint32_t i;
+    uint32_t sum = 0;
+    (void)context;
+    (void)bme280_compensate_T_int32(adcTemperature[0]);
+    for (i = 0; i < iterations; i++)
+    {
+        sum += bme280_compensate_P_int64(adcPressure[i & (FRAME_COUNT - 1)]);
+    }
+    bench_sink = sum;
+    return 0;
+}
+
+static size_t benchCompensateH(void* context, uint32_t iterations)
+{
+    uint32_t i;
+    uint32_t sum = 0;
+    (void)context;
+    (void)bme280_compensate_T_int32(adcTemperature[0]);
+    for (i = 0; i < iterations; i++)
+    {
+        sum += bme280_compensate_H_int32(adcHumidity[i & (FRAME_COUNT - 1)]);
+    }
+    bench_sink = sum;
+    return 0;
+}
+
+static size_t benchCompensateFrame(void* context, uint32_t iterations)
+{
+    uint32_t i;
+    float sum = 0;
+    (void)context;
+    for (i = 0; i < iterations; i++)
+    {
+        float temperature, pressure, humidity;
+        bme280_compensate_frame(frames[i & (FRAME_COUNT - 1)], &temperature, &pressure, &humidity);
+        sum += temperature + pressure + humidity;
+    }
+    bench_sink = (uint32_t)sum;
+    return 0;
+}
+
+static size_t benchReadSensors(void* context, uint32_t iterations)
+{
+    uint32_t i;
+    float sum = 0;
+    (void)context;
+    for (i = 0; i < iterations; i++)
+    {
+        float temperature, pressure, humidity;
+        if (bme280_read_sensors(&temperature, &pressure, &humidity) == 1)
+        {
+            sum += temperature + pressure + humidity;
+        }
+    }
+    bench_sink = (uint32_t)sum;
+    return 0;
+}
+
+/* The writer and a reader of the shared memory readings, in one process */
+typedef struct READINGS_SHM_BENCH_TAG
+{
+    readings_shm_writer_t* writer;
+    readings_shm_reader_t* reader;
+} READINGS_SHM_BENCH;
+
+static size_t benchReadingsShmPublish(void* context, uint32_t iterations)
+{
+    READINGS_SHM_BENCH* bench = (READINGS_SHM_BENCH*)context;
+    float values[3] = { 21.5f, 101325.0f, 40.0f };
+    uint32_t i;
+    for (i = 0; i < iterations; i++)
+    {
+        values[0] = (float)(i & 0xff);
+        readings_shm_publish(bench->writer, 0, i, i, values);
+    }
+    return 0;
+}
+
+/* What a local control loop pays for the latest reading, instead of a sensor read */
+static size_t benchReadingsShmLatest(void* context, uint32_t iterations)
+{
+    READINGS_SHM_BENCH* bench = (READINGS_SHM_BENCH*)context;
+    readings_shm_record_t record;
+    float sum = 0;
+    uint32_t i;
+    for (i = 0; i < iterations; i++)
+    {
+        if (readings_shm_latest(bench->reader, 0, &record) == 0)
+        {
+            sum += record.Values__fa[0];
+        }
+    }
+    bench_sink = (uint32_t)sum;
+    return 0;
+}
+
+/* What every span of --trace adds to the sampling path */
+static size_t benchEventTraceRecord(void* context, uint32_t iterations)
+{
+    uint32_t i;
+    (void)context;
+    for (i = 0; i < iterations; i++)
+    {
+        event_trace_record(EVENT_TRACE_BEGIN, "bench", i);
+    }
+    return 0;
+}
+
+static size_t benchGetNumberFromString(void* context, uint32_t iterations)
+{
+    /* What the twin callback of remote_monitoring looks at */
+    static const unsigned char desired[] = "{\"desired\":{\"Config\":{\"TelemetryInterval\":45},\"$version\":12}}";
+    uint32_t i;
+    int sum = 0;
+    (void)context;
+    for (i = 0; i < iterations; i++)
+    {
+        int value;
+        if (GetNumberFromString(desired, sizeof(desired) - 1, &value))
+        {
+            sum += value;
+        }
+    }
+    bench_sink = (uint32_t)sum;
+    return 0;
+}
+
+static size_t benchFormatTime(void* context, uint32_t iterations)
+{
+    uint32_t i;
+    size_t bytes = 0;
+    time_t base = 1500000000;
+    (void)context;
+    for (i = 0; i < iterations; i++)
+    {
+        time_t when = base + (time_t)i;
+        bytes += strlen(FormatTime(&when));
+    }
+    return bytes;
+}
+
+static size_t benchFormatIso8601(void* context, uint32_t iterations)
+{
+    uint32_t i;
+    size_t bytes = 0;
+    uint64_t baseUs = 1500000000000000ULL;
+    char buffer[TIME_ISO8601_LEN];
+    (void)context;
+    for (i = 0; i < iterations; i++)
+    {
+        bytes += time_format_iso8601(baseUs + (uint64_t)i * 1000123, buffer, sizeof(buffer));
+    }
+    return bytes;
+}
+
+static void allocAndPrintf(unsigned char** buffer, size_t* size, const char* format, ...)
+{
+    va_list args;
+    va_start(args, format);
+    AllocAndVPrintf(buffer, size, format, args);
+    va_end(args);
+}
+
+static size_t benchAllocAndVPrintf(void* context, uint32_t iterations)
+{
+    uint32_t i;
+    size_t bytes = 0;
+    (void)context;
+    for (i = 0; i < iterations; i++)
+    {
+        unsigned char* report;
+        size_t length;
+        /* A firmware update progress report of remote_monitoring */
+        allocAndPrintf(&report, &length,
+            "{ 'Method' : { 'UpdateFirmware': { 'Download' : { 'Duration-s': %u, 'LastUpdate': '%s', 'Status': 'Complete' } } } }",
+            i & 0xFF, "2017-07-14 02:40:00");
+        bytes += length;
+        free(report);
+    }
+    return bytes;
+}
+
+static void nextReading(Thermostat* thermostat, uint32_t i)
+{
+    float temperature, pressure, humidity;
+    bme280_compensate_frame(frames[i & (FRAME_COUNT - 1)], &temperature, &pressure, &humidity);
+    thermostat->Temperature = temperature;
+    thermostat->Humidity = humidity;
+}
+
+static size_t benchSerialize(void* context, uint32_t iterations)
+{
+    Thermostat* thermostat = (Thermostat*)context;
+    uint32_t i;
+    size_t bytes = 0;
+    for (i = 0; i < iterations; i++)
+    {
+        unsigned char* buffer;
+        size_t bufferSize;
+
+        nextReading(thermostat, i);
+        if (SERIALIZE(&buffer, &bufferSize, thermostat->DeviceId, thermostat->Temperature, thermostat->Humidity) == CODEFIRST_OK)
+        {
+            bytes += bufferSize;
+            free(buffer);
+        }
+    }
+    return bytes;
+}
+
+static size_t benchEncodeCbor(void* context, uint32_t iterations)
+{
+    Thermostat* thermostat = (Thermostat*)context;
+    uint32_t i;
+    size_t bytes = 0;
+    for (i = 0; i < iterations; i++)
+    {
+        uint8_t buffer[TELEMETRY_CBOR_MAX_SAMPLE_SIZE];
+        telemetry_sample_t sample;
+
+        nextReading(thermostat, i);
+        sample.Temperature = thermostat->Temperature;
+        sample.Humidity = thermostat->Humidity;
+        sample.Time_ms = 0;
+        bytes += telemetry_encode_cbor(&sample, NULL, buffer, sizeof(buffer));
+    }
+    return bytes;
+}
+
+int main(void)
+{
+    int result;
+
+    /* The simulator provides the calibration, the benchmark hook the samples */
+    bme280_sim_install();
+    if (bme280_init(0) != 1)
+    {
+        (void)printf("Failed to initialize the simulated BME280\r\n");
+        result = 1;
+    }
+    else if (platform_init() != 0)
+    {
+        (void)printf("Failed to initialize the platform.\r\n");
+        result = 1;
+    }
+    else
+    {
+        makeFrames();
+        bme280_set_spi_xfer(benchSpiXfer);
+
+        bench_run("bme280_compensate_T_int32", benchCompensateT, NULL, 1000000);
+        bench_run("bme280_compensate_P_int64", benchCompensateP, NULL, 1000000);
+        bench_run("bme280_compensate_H_int32", benchCompensateH, NULL, 1000000);
+        bench_run("bme280_compensate_frame", benchCompensateFrame, NULL, 1000000);
+        bme280_correction_t correction;
+        if (bme280_correction_parse("Temperature=-1.5;Pressure=1.0002,12;Humidity=20:22.5,50:51,80:78", &correction) == 0 &&
+            bme280_set_correction(&correction) == 0)
+        {
+            bench_run("bme280_compensate_frame (corrected)", benchCompensateFrame, NULL, 1000000);
+            (void)bme280_correction_parse("", &correction);
+            (void)bme280_set_correction(&correction);
+        }
+        bench_run("bme280_read_sensors", benchReadSensors, NULL, 200000);
+        bench_run("GetNumberFromString", benchGetNumberFromString, NULL, 1000000);
+        bench_run("FormatTime", benchFormatTime, NULL, 200000);
+        bench_run("time_format_iso8601", benchFormatIso8601, NULL, 200000);
+        bench_run("AllocAndVPrintf", benchAllocAndVPrintf, NULL, 200000);
+
+        READINGS_SHM_BENCH readingsShm;
+        static const char* const valueNames[] = { "Temperature", "Pressure", "Humidity" };
+        readingsShm.writer = readings_shm_create("/aziotplatform_bench", 1024);
+        readingsShm.reader = NULL;
+        if (readingsShm.writer == NULL ||
+            readings_shm_add_channel(readingsShm.writer, "bme280", 3, valueNames) < 0 ||
+            (readingsShm.reader = readings_shm_open("/aziotplatform_bench")) == NULL)
+        {
+            (void)printf("Failed to create the shared memory readings, skipped\r\n");
+        }
+        else
+        {
+            bench_run("readings_shm_publish", benchReadingsShmPublish, &readingsShm, 1000000);
+            bench_run("readings_shm_latest", benchReadingsShmLatest, &readingsShm, 1000000);
+        }
+        readings_shm_close(readingsShm.reader);
+        readings_shm_destroy(readingsShm.writer);
+
+        if (event_trace_start(4096) != 0)
+        {
+            (void)printf("Failed to start the event trace, skipped\r\n");
+        }
+        else
+        {
+            bench_run("event_trace_record", benchEventTraceRecord, NULL, 1000000);
+            event_trace_stop();
+        }
+
+        if (serializer_init(NULL) != SERIALIZER_OK)
+        {
+            (void)printf("Failed on serializer_init\r\n");
+            result = 1;
+        }
+        else
+        {
+            Thermostat* thermostat = CREATE_MODEL_INSTANCE(Contoso, Thermostat);
+            if (thermostat == NULL)
+            {
+                (void)printf("Failed on CREATE_MODEL_INSTANCE\r\n");
+                result = 1;
+            }
+            else
+            {
+                thermostat->DeviceId = (char*)deviceId;
+                bench_run("telemetry SERIALIZE (json)", benchSerialize, thermostat, 50000);
+                bench_run("telemetry_encode_cbor", benchEncodeCbor, thermostat, 1000000);
+                DESTROY_MODEL_INSTANCE(thermostat);
+                result = 0;
+            }
+            serializer_deinit();
+        }
+        platform_deinit();
+    }
+
+    return result;
+}
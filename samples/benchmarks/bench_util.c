@@ -0,0 +1,86 @@
+// Copyright (c) Microsoft. All rights reserved.
+// Licensed under the MIT license. See LICENSE file in the project root for full license information.
+
+#define _POSIX_C_SOURCE 200112L
+#include "bench_util.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define BENCH_REPEATS 5
+
+volatile uint32_t bench_sink;
+
+static uint64_t allocCount = 0;
+
+void* __real_malloc(size_t size);
+void* __real_calloc(size_t count, size_t size);
+void* __real_realloc(void* pointer, size_t size);
+
+void* __wrap_malloc(size_t size)
+{
+    allocCount++;
+    return __real_malloc(size);
+}
+
+void* __wrap_calloc(size_t count, size_t size)
+{
+    allocCount++;
+    return __real_calloc(count, size);
+}
+
+void* __wrap_realloc(void* pointer, size_t size)
+{
+    allocCount++;
+    return __real_realloc(pointer, size);
+}
+
+uint64_t bench_alloc_count(void)
+{
+    return allocCount;
+}
+
+uint64_t bench_now_ns(void)
+{
+    struct timespec ts;
+    (void)clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+void bench_report(const char* name, uint64_t iterations, uint64_t elapsedNs, double bytesPerOp)
+{
+    (void)printf("%-32s %10llu iterations %12.1f ns/op %10.1f bytes/op\r\n",
+        name, (unsigned long long)iterations, (double)elapsedNs / (double)iterations, bytesPerOp);
+}
+
+static int compareTimes(const void* left, const void* right)
+{
+    uint64_t a = *(const uint64_t*)left;
+    uint64_t b = *(const uint64_t*)right;
+    return (a > b) - (a < b);
+}
+
+void bench_run(const char* name, BENCH_FUNCTION function, void* context, uint32_t iterations)
+{
+    uint64_t elapsedNs[BENCH_REPEATS];
+    uint64_t allocs = 0;
+    size_t bytes = 0;
+    int i;
+
+    (void)function(context, iterations);
+
+    for (i = 0; i < BENCH_REPEATS; i++)
+    {
+        uint64_t allocsBefore = allocCount;
+        uint64_t begin = bench_now_ns();
+        bytes = function(context, iterations);
+        elapsedNs[i] = bench_now_ns() - begin;
+        allocs = allocCount - allocsBefore;
+    }
+    qsort(elapsedNs, BENCH_REPEATS, sizeof(elapsedNs[0]), compareTimes);
+
+    (void)printf("%-32s %10lu iterations %12.1f ns/op %10.1f bytes/op %8.2f allocs/op\r\n",
+        name, (unsigned long)iterations, (double)elapsedNs[BENCH_REPEATS / 2] / (double)iterations,
+        (double)bytes / (double)iterations, (double)allocs / (double)iterations);
+}
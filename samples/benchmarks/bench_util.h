@@ -0,0 +1,39 @@
+// Copyright (c) Microsoft. All rights reserved.
+// Licensed under the MIT license. See LICENSE file in the project root for full license information.
+
+#ifndef BENCH_UTIL_H
+#define BENCH_UTIL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+    /* Monotonic clock in nanoseconds */
+    uint64_t bench_now_ns(void);
+
+    /* Prints one result line: name, iterations, ns/op and bytes/op */
+    void bench_report(const char* name, uint64_t iterations, uint64_t elapsedNs, double bytesPerOp);
+
+    /* Number of malloc, calloc and realloc calls so far. Benchmarks are linked with
+       --wrap for these, so calls from the SDK and the platform library are counted;
+       allocations inside the C library itself are not. */
+    uint64_t bench_alloc_count(void);
+
+    /* Runs iterations operations and returns the number of bytes they produced, or 0 */
+    typedef size_t(*BENCH_FUNCTION)(void* context, uint32_t iterations);
+
+    /* Runs the function once to warm up, then BENCH_REPEATS times with the same fixed
+       iteration count, and reports the median ns/op with bytes/op and allocs/op */
+    void bench_run(const char* name, BENCH_FUNCTION function, void* context, uint32_t iterations);
+
+    /* Keeps results alive so the compiler cannot drop the work producing them */
+    extern volatile uint32_t bench_sink;
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* BENCH_UTIL_H */
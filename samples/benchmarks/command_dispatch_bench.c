@@ -0,0 +1,219 @@
+// Copyright (c) Microsoft. All rights reserved.
+// Licensed under the MIT license. See LICENSE file in the project root for full license information.
+
+/* Compares the cloud-to-device command path of simplesample_amqp before and after
+   command_dispatch: copying the message to terminate it and EXECUTE_COMMAND, against
+   parsing it in place and the perfect hash table, for single and batched commands */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "serializer.h"
+#include "azure_c_shared_utility/platform.h"
+
+#include "command_dispatch.h"
+#include "bench_util.h"
+
+#define BATCH_SIZE 10
+
+/* Same actions as the ContosoAnemometer model of simplesample_amqp, without the printing */
+BEGIN_NAMESPACE(WeatherStation);
+
+DECLARE_MODEL(ContosoAnemometer,
+WITH_DATA(ascii_char_ptr, DeviceId),
+WITH_DATA(int, WindSpeed),
+WITH_ACTION(TurnFanOn),
+WITH_ACTION(TurnFanOff),
+WITH_ACTION(SetAirResistance, int, Position)
+);
+
+END_NAMESPACE(WeatherStation);
+
+static unsigned int g_executed;
+
+EXECUTE_COMMAND_RESULT TurnFanOn(ContosoAnemometer* device)
+{
+    (void)device;
+    g_executed++;
+    return EXECUTE_COMMAND_SUCCESS;
+}
+
+EXECUTE_COMMAND_RESULT TurnFanOff(ContosoAnemometer* device)
+{
+    (void)device;
+    g_executed++;
+    return EXECUTE_COMMAND_SUCCESS;
+}
+
+EXECUTE_COMMAND_RESULT SetAirResistance(ContosoAnemometer* device, int Position)
+{
+    (void)device;
+    g_executed += (unsigned int)Position & 1;
+    return EXECUTE_COMMAND_SUCCESS;
+}
+
+static COMMAND_RESULT dispatchTurnFanOn(void* context, const command_args_t* args)
+{
+    (void)args;
+    return (TurnFanOn((ContosoAnemometer*)context) == EXECUTE_COMMAND_SUCCESS) ? COMMAND_SUCCESS : COMMAND_FAILED;
+}
+
+static COMMAND_RESULT dispatchTurnFanOff(void* context, const command_args_t* args)
+{
+    (void)args;
+    return (TurnFanOff((ContosoAnemometer*)context) == EXECUTE_COMMAND_SUCCESS) ? COMMAND_SUCCESS : COMMAND_FAILED;
+}
+
+static COMMAND_RESULT dispatchSetAirResistance(void* context, const command_args_t* args)
+{
+    int position;
+    if (command_arg_int(args, "Position", &position) != 0)
+    {
+        return COMMAND_FAILED;
+    }
+    return (SetAirResistance((ContosoAnemometer*)context, position) == EXECUTE_COMMAND_SUCCESS) ? COMMAND_SUCCESS : COMMAND_FAILED;
+}
+
+static const command_entry_t commandEntries[] =
+{
+    { "TurnFanOn", dispatchTurnFanOn },
+    { "TurnFanOff", dispatchTurnFanOff },
+    { "SetAirResistance", dispatchSetAirResistance }
+};
+
+/* The messages as the IoT Hub client hands them over: not zero terminated */
+static const char commandMessage[] = "{\"Name\":\"SetAirResistance\",\"Parameters\":{\"Position\":5}}";
+static char batchMessage[BATCH_SIZE * (sizeof(commandMessage) + 1) + 2];
+static size_t batchMessageSize;
+
+typedef struct BENCH_CONTEXT_TAG
+{
+    ContosoAnemometer* device;
+    command_table_t* table;
+    const char* message;
+    size_t messageSize;
+} BENCH_CONTEXT;
+
+static void makeBatchMessage(void)
+{
+    unsigned int i;
+    char* out = batchMessage;
+
+    *out++ = '[';
+    for (i = 0; i < BATCH_SIZE; i++)
+    {
+        if (i > 0)
+        {
+            *out++ = ',';
+        }
+        (void)memcpy(out, commandMessage, sizeof(commandMessage) - 1);
+        out += sizeof(commandMessage) - 1;
+    }
+    *out++ = ']';
+    batchMessageSize = (size_t)(out - batchMessage);
+}
+
+/* What IoTHubMessage of simplesample_amqp did before command_dispatch */
+static size_t benchExecuteCommand(void* context, uint32_t iterations)
+{
+    BENCH_CONTEXT* bench = (BENCH_CONTEXT*)context;
+    uint32_t i;
+
+    for (i = 0; i < iterations; i++)
+    {
+        char* temp = malloc(bench->messageSize + 1);
+        if (temp == NULL)
+        {
+            return 0;
+        }
+        (void)memcpy(temp, bench->message, bench->messageSize);
+        temp[bench->messageSize] = '\0';
+        bench_sink += (uint32_t)EXECUTE_COMMAND(bench->device, temp);
+        free(temp);
+    }
+    return bench->messageSize * iterations;
+}
+
+static size_t benchCommandDispatch(void* context, uint32_t iterations)
+{
+    BENCH_CONTEXT* bench = (BENCH_CONTEXT*)context;
+    uint32_t i;
+
+    for (i = 0; i < iterations; i++)
+    {
+        bench_sink += (uint32_t)command_dispatch(bench->table, bench->message, bench->messageSize, bench->device, NULL);
+    }
+    return bench->messageSize * iterations;
+}
+
+/* Prints the usual per message line, then the commands per second of one more run */
+static void benchCommandRate(const char* name, BENCH_FUNCTION function, BENCH_CONTEXT* context,
+    uint32_t messages, unsigned int commandsPerMessage)
+{
+    uint64_t begin;
+    uint64_t elapsedNs;
+
+    bench_run(name, function, context, messages);
+
+    begin = bench_now_ns();
+    (void)function(context, messages);
+    elapsedNs = bench_now_ns() - begin;
+    (void)printf("%-32s %10.0f commands/s\r\n", name,
+        (elapsedNs > 0) ? (double)messages * commandsPerMessage * 1e9 / (double)elapsedNs : 0.0);
+}
+
+int main(void)
+{
+    int result;
+
+    if (platform_init() != 0)
+    {
+        (void)printf("Failed to initialize the platform.\r\n");
+        result = 1;
+    }
+    else
+    {
+        if (serializer_init(NULL) != SERIALIZER_OK)
+        {
+            (void)printf("Failed on serializer_init\r\n");
+            result = 1;
+        }
+        else
+        {
+            BENCH_CONTEXT context;
+            context.device = CREATE_MODEL_INSTANCE(WeatherStation, ContosoAnemometer);
+            context.table = command_table_create(commandEntries, sizeof(commandEntries) / sizeof(commandEntries[0]));
+            if (context.device == NULL || context.table == NULL)
+            {
+                (void)printf("Failed to create the model instance or the command table\r\n");
+                result = 1;
+            }
+            else
+            {
+                makeBatchMessage();
+
+                context.message = commandMessage;
+                context.messageSize = sizeof(commandMessage) - 1;
+                benchCommandRate("EXECUTE_COMMAND", benchExecuteCommand, &context, 100000, 1);
+                benchCommandRate("command_dispatch", benchCommandDispatch, &context, 1000000, 1);
+
+                /* The serializer takes one command per message */
+                context.message = batchMessage;
+                context.messageSize = batchMessageSize;
+                benchCommandRate("command_dispatch batch of 10", benchCommandDispatch, &context, 100000, BATCH_SIZE);
+
+                result = 0;
+            }
+            command_table_destroy(context.table);
+            if (context.device != NULL)
+            {
+                DESTROY_MODEL_INSTANCE(context.device);
+            }
+            serializer_deinit();
+        }
+        platform_deinit();
+    }
+
+    return result;
+}
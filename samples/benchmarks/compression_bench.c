@@ -0,0 +1,125 @@
+// Copyright (c) Microsoft. All rights reserved.
+// Licensed under the MIT license. See LICENSE file in the project root for full license information.
+
+/* Measures the CPU cost of deflating batched telemetry against the bytes it saves,
+   for the JSON and CBOR encodings of the remote_monitoring sample */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "telemetry_codec.h"
+#include "time_service.h"
+#include "payload_compress.h"
+#include "bench_util.h"
+
+#define BENCH_ITERATIONS 2000
+#define MAX_BATCH_SIZE 60
+#define MAX_BODY_SIZE (MAX_BATCH_SIZE * 160)
+
+static const char* deviceId = "raspberrypi-thermostat-0001";
+static const unsigned int batchSizes[] = { 1, 5, 10, 30, 60 };
+static const int levels[] = { 1, 6, 9 };
+
+static void nextSample(telemetry_sample_t* sample, unsigned int i)
+{
+    sample->Temperature = (float)(21.0 + (i % 500) * 0.01);
+    sample->Humidity = (float)(40.0 + (i % 300) * 0.03);
+    sample->Time_ms = 1500000000000ULL + i * 1000ULL;
+}
+
+/* Same shape as the JSON batches sent by remote_monitoring */
+static size_t buildJsonBatch(unsigned int batchSize, unsigned char* body)
+{
+    unsigned int i;
+    size_t size = 0;
+
+    if (batchSize > 1)
+    {
+        body[size++] = '[';
+    }
+    for (i = 0; i < batchSize; i++)
+    {
+        telemetry_sample_t sample;
+        char sampleTime[TIME_ISO8601_LEN];
+        nextSample(&sample, i);
+        (void)time_format_iso8601(sample.Time_ms * 1000, sampleTime, sizeof(sampleTime));
+        size += (size_t)sprintf((char*)body + size, "%s{\"DeviceId\":\"%s\",\"Temperature\":%.6f,\"Humidity\":%.6f,\"SampleTime\":\"%s\"}",
+            (i > 0) ? "," : "", deviceId, sample.Temperature, sample.Humidity, sampleTime);
+    }
+    if (batchSize > 1)
+    {
+        body[size++] = ']';
+    }
+    return size;
+}
+
+static size_t buildCborBatch(unsigned int batchSize, unsigned char* body)
+{
+    unsigned int i;
+    size_t size = 0;
+
+    if (batchSize > 1)
+    {
+        size += telemetry_encode_cbor_array_head(batchSize, body, MAX_BODY_SIZE);
+    }
+    for (i = 0; i < batchSize; i++)
+    {
+        telemetry_sample_t sample;
+        nextSample(&sample, i);
+        size += telemetry_encode_cbor(&sample, NULL, body + size, MAX_BODY_SIZE - size);
+    }
+    return size;
+}
+
+static void benchBody(const char* encoding, unsigned int batchSize, int level, const unsigned char* body, size_t bodySize)
+{
+    static unsigned char compressed[MAX_BODY_SIZE];
+    payload_compressor_t* compressor = payload_compressor_create(level);
+    if (compressor == NULL)
+    {
+        (void)printf("Failed to create the compressor\r\n");
+    }
+    else
+    {
+        unsigned int i;
+        size_t compressedSize = 0;
+        uint64_t begin = bench_now_ns();
+        uint64_t elapsed;
+
+        for (i = 0; i < BENCH_ITERATIONS; i++)
+        {
+            compressedSize = payload_compress(compressor, body, bodySize, compressed, sizeof(compressed));
+        }
+        elapsed = bench_now_ns() - begin;
+
+        (void)printf("%-4s batch %2u level %d: %5u -> %5u bytes (%5.1f%% saved) %9.1f ns/msg %6.2f ns/byte, %u bytes working set\r\n",
+            encoding, batchSize, level, (unsigned int)bodySize, (unsigned int)compressedSize,
+            (compressedSize == 0) ? 0.0 : 100.0 * (1.0 - (double)compressedSize / (double)bodySize),
+            (double)elapsed / BENCH_ITERATIONS, (double)elapsed / BENCH_ITERATIONS / (double)bodySize,
+            (unsigned int)payload_compressor_memory(compressor));
+
+        payload_compressor_destroy(compressor);
+    }
+}
+
+int main(void)
+{
+    static unsigned char body[MAX_BODY_SIZE];
+    size_t b;
+    size_t l;
+
+    for (b = 0; b < sizeof(batchSizes) / sizeof(batchSizes[0]); b++)
+    {
+        for (l = 0; l < sizeof(levels) / sizeof(levels[0]); l++)
+        {
+            size_t bodySize = buildJsonBatch(batchSizes[b], body);
+            benchBody("json", batchSizes[b], levels[l], body, bodySize);
+
+            bodySize = buildCborBatch(batchSizes[b], body);
+            benchBody("cbor", batchSizes[b], levels[l], body, bodySize);
+        }
+    }
+
+    return 0;
+}
@@ -0,0 +1,53 @@
+# Copyright (c) Microsoft. All rights reserved.
+# Licensed under the MIT license. See LICENSE file in the project root for full license information.
+#
+# A local mosquitto over TLS for the benchmark scripts, sourced by them. It
+# leaves the throwaway files in $work_dir, which goes away with the script.
+
+work_dir=$(mktemp -d)
+broker_pids=
+
+cleanup ()
+{
+    for pid in $broker_pids
+    do
+        kill $pid 2> /dev/null || true
+    done
+    rm -rf "$work_dir"
+}
+trap cleanup EXIT
+
+# A throwaway CA and a server certificate for the local broker
+make_certificates ()
+{
+    openssl req -x509 -newkey rsa:2048 -nodes -days 1 -subj "/CN=e2e bench CA" \
+        -keyout "$work_dir/ca.key" -out "$work_dir/ca.pem" 2> /dev/null
+    openssl req -newkey rsa:2048 -nodes -subj "/CN=127.0.0.1" \
+        -keyout "$work_dir/server.key" -out "$work_dir/server.csr" 2> /dev/null
+    printf "subjectAltName=IP:127.0.0.1,DNS:localhost\n" > "$work_dir/san.ext"
+    openssl x509 -req -in "$work_dir/server.csr" -CA "$work_dir/ca.pem" -CAkey "$work_dir/ca.key" \
+        -CAcreateserial -days 1 -extfile "$work_dir/san.ext" -out "$work_dir/server.pem" 2> /dev/null
+}
+
+# mosquitto accepts the IoT Hub topics and acknowledges QoS 1 telemetry like the hub does.
+# Usage: start_mqtt_broker <name> <port> [protocol]; returns 1 if it did not start.
+start_mqtt_broker ()
+{
+    cat > "$work_dir/$1.conf" <<CONF
+listener $2 127.0.0.1
+${3:+protocol $3}
+cafile $work_dir/ca.pem
+certfile $work_dir/server.pem
+keyfile $work_dir/server.key
+allow_anonymous true
+persistence false
+CONF
+    mosquitto -c "$work_dir/$1.conf" > "$work_dir/$1.log" 2>&1 &
+    pid=$!
+    sleep 1
+    if ! kill -0 $pid 2> /dev/null
+    then
+        return 1
+    fi
+    broker_pids="$broker_pids $pid"
+}
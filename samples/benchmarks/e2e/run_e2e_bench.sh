@@ -0,0 +1,209 @@
+#!/bin/bash
+# Copyright (c) Microsoft. All rights reserved.
+# Licensed under the MIT license. See LICENSE file in the project root for full license information.
+#
+# End-to-end benchmark of the device samples against local broker stand-ins.
+#
+# remote_monitoring runs with the simulated BME280 against a local mosquitto,
+# which stands in for the IoT Hub MQTT endpoint over TLS on port 8883, and
+# over a WebSocket on port 443 when mosquitto may bind that port (as root, or
+# after setcap cap_net_bind_service=+ep on mosquitto). The AMQP scenarios of
+# both samples run only when an AMQP stand-in is given, because there is no
+# common local broker that speaks the IoT Hub AMQP authentication:
+#
+#   AMQP_STANDIN_CONNECTION_STRING  device connection string of the stand-in
+#   AMQP_STANDIN_CA                 PEM certificates to trust for it (optional)
+#   AMQP_STANDIN_WS                 set to 1 if it also serves AMQP over a
+#                                   WebSocket on port 443
+#
+# For every scenario the script prints confirmed messages per second, p50/p99
+# sample-to-broker latency (the sample until the broker's acknowledgement),
+# bytes on the wire per confirmed message, CPU% and peak RSS of the sample
+# process. Bytes on the wire are counted by the loopback interface, both
+# directions with TCP/IP, TLS and WebSocket overhead, so other loopback
+# traffic during a run inflates them.
+#
+# Other settings: SAMPLES (default 500), INTERVAL_MS (default 20), TRANSPORTS
+# (default "mqtt mqtt-ws amqp amqp-ws") and RM_ARGS, extra options for every
+# remote_monitoring run.
+#
+# Usage: run_e2e_bench.sh <remote_monitoring> [simplesample_amqp]
+
+set -e
+
+remote_monitoring=$1
+simplesample_amqp=$2
+samples=${SAMPLES:-500}
+interval_ms=${INTERVAL_MS:-20}
+transports=${TRANSPORTS:-mqtt mqtt-ws amqp amqp-ws}
+
+if [ -z "$remote_monitoring" ]
+then
+    echo "Usage: $0 <remote_monitoring> [simplesample_amqp]"
+    exit 1
+fi
+
+for tool in mosquitto openssl /usr/bin/time
+do
+    if ! command -v $tool > /dev/null
+    then
+        echo "$tool is needed for the end-to-end benchmark (sudo apt-get install mosquitto openssl time)"
+        exit 1
+    fi
+done
+
+script_dir=$(cd "$(dirname "$0")" && pwd)
+. "$script_dir/broker_util.sh"
+ws_broker=0
+
+# Bytes sent over the loopback interface so far; every local byte is sent once
+loopback_bytes ()
+{
+    awk -F '[: ]+' '$2 == "lo" { print $11 }' /proc/net/dev
+}
+
+# Runs a command under /usr/bin/time; leaves its output in $work_dir/run.log
+timed_run ()
+{
+    wire_start=$(loopback_bytes)
+    /usr/bin/time -f "%e %U %S %M" -o "$work_dir/time.txt" "$@" > "$work_dir/run.log" 2>&1 || true
+    wire_bytes=$(( $(loopback_bytes) - wire_start ))
+    read elapsed user_s system_s rss_kb < <(tail -n 1 "$work_dir/time.txt")
+    cpu_pct=$(awk -v e=$elapsed -v u=$user_s -v s=$system_s 'BEGIN { printf "%.1f", (e > 0) ? 100 * (u + s) / e : 0 }')
+    rss_mb=$(awk -v r=$rss_kb 'BEGIN { printf "%.1f", r / 1024 }')
+}
+
+print_header ()
+{
+    printf "%-36s %10s %10s %10s %9s %8s %9s\n" "scenario" "msg/s" "p50 ms" "p99 ms" "wire B/msg" "CPU %" "RSS MB"
+}
+
+# Usage: print_row <scenario> <msg/s> <p50> <p99> <confirmed>
+print_row ()
+{
+    per_message=$(awk -v b=$wire_bytes -v c=$5 'BEGIN { printf "%.0f", (c > 0) ? b / c : 0 }')
+    printf "%-36s %10s %10s %10s %9s %8s %9s\n" "$1" "$2" "$3" "$4" "$per_message" "$cpu_pct" "$rss_mb"
+}
+
+# remote_monitoring prints the outbox statistics once the sample limit is reached:
+#   Sent N samples per device in S s, U messages unconfirmed
+#   bulk lane: ... sample-to-confirmation p50 X ms p99 Y ms (C confirmed)
+run_remote_monitoring ()
+{
+    name=$1
+    shift
+    timed_run "$remote_monitoring" --simulate --trusted-certs "$work_dir/ca.pem" \
+        --connection-string "HostName=127.0.0.1;DeviceId=e2e-bench-device;SharedAccessKey=ZTJlLWJlbmNoLWtleQ==" \
+        --samples $samples $RM_ARGS "$@"
+
+    seconds=$(sed -n 's/^Sent [0-9]* samples per device in \([0-9.]*\) s.*/\1/p' "$work_dir/run.log" | tail -n 1)
+    stats=$(grep "^bulk lane:" "$work_dir/run.log" | tail -n 1)
+    if [ -z "$seconds" ] || [ -z "$stats" ]
+    then
+        echo "$name: remote_monitoring did not finish, last output:"
+        tail -n 20 "$work_dir/run.log"
+        return
+    fi
+    p50=$(echo "$stats" | sed -n 's/.*sample-to-confirmation p50 \([0-9.]*\) ms.*/\1/p')
+    p99=$(echo "$stats" | sed -n 's/.*sample-to-confirmation p50 [0-9.]* ms p99 \([0-9.]*\) ms.*/\1/p')
+    confirmed=$(echo "$stats" | sed -n 's/.*(\([0-9]*\) confirmed).*/\1/p')
+    rate=$(awk -v c=$confirmed -v s=$seconds 'BEGIN { printf "%.1f", (s > 0) ? c / s : 0 }')
+    print_row "$name" "$rate" "$p50" "$p99" "$confirmed"
+}
+
+# simplesample_amqp --messages prints:
+#   Sent N messages in S s, C confirmed, F failed, sample-to-confirmation p50 X ms p99 Y ms
+run_simplesample_amqp ()
+{
+    name=$1
+    shift
+    certs=
+    if [ -n "$AMQP_STANDIN_CA" ]
+    then
+        certs="--trusted-certs $AMQP_STANDIN_CA"
+    fi
+    timed_run "$simplesample_amqp" --no-trace --connection-string "$AMQP_STANDIN_CONNECTION_STRING" $certs \
+        --messages $samples "$@"
+
+    line=$(grep "^Sent [0-9]* messages in" "$work_dir/run.log" | tail -n 1)
+    if [ -z "$line" ]
+    then
+        echo "$name: simplesample_amqp did not finish, last output:"
+        tail -n 20 "$work_dir/run.log"
+        return
+    fi
+    seconds=$(echo "$line" | sed -n 's/^Sent [0-9]* messages in \([0-9.]*\) s.*/\1/p')
+    confirmed=$(echo "$line" | sed -n 's/.*, \([0-9]*\) confirmed,.*/\1/p')
+    p50=$(echo "$line" | sed -n 's/.*p50 \([0-9.]*\) ms.*/\1/p')
+    p99=$(echo "$line" | sed -n 's/.*p99 \([0-9.]*\) ms.*/\1/p')
+    rate=$(awk -v c=$confirmed -v s=$seconds 'BEGIN { printf "%.1f", (s > 0) ? c / s : 0 }')
+    print_row "$name" "$rate" "$p50" "$p99" "$confirmed"
+}
+
+# The same telemetry over every transport, against the stand-ins that are available
+compare_transports ()
+{
+    amqp_certs=
+    if [ -n "$AMQP_STANDIN_CA" ]
+    then
+        amqp_certs="--trusted-certs $AMQP_STANDIN_CA"
+    fi
+    for transport in $transports
+    do
+        case $transport in
+            mqtt )
+                run_remote_monitoring "remote_monitoring mqtt json" --transport mqtt --interval-ms $interval_ms;;
+            mqtt-ws )
+                if [ $ws_broker == 1 ]
+                then
+                    run_remote_monitoring "remote_monitoring mqtt-ws json" --transport mqtt-ws --interval-ms $interval_ms
+                else
+                    echo "mqtt-ws skipped: mosquitto may not listen on port 443 (see the top of $0)"
+                fi;;
+            amqp | amqp-ws )
+                if [ -z "$AMQP_STANDIN_CONNECTION_STRING" ]
+                then
+                    echo "$transport skipped: set AMQP_STANDIN_CONNECTION_STRING to an AMQP stand-in"
+                elif [ $transport == amqp-ws ] && [ "$AMQP_STANDIN_WS" != 1 ]
+                then
+                    echo "amqp-ws skipped: set AMQP_STANDIN_WS=1 if the stand-in serves WebSockets"
+                else
+                    run_remote_monitoring "remote_monitoring $transport json" --transport $transport --interval-ms $interval_ms \
+                        --connection-string "$AMQP_STANDIN_CONNECTION_STRING" $amqp_certs
+                fi;;
+            * )
+                echo "Unknown transport $transport";;
+        esac
+    done
+}
+
+make_certificates
+if ! start_mqtt_broker mosquitto 8883
+then
+    echo "mosquitto failed to start:"
+    cat "$work_dir/mosquitto.log"
+    exit 1
+fi
+if start_mqtt_broker mosquitto-ws 443 websockets
+then
+    ws_broker=1
+fi
+
+echo "$samples samples per scenario, $interval_ms ms apart unless noted"
+print_header
+compare_transports
+run_remote_monitoring "remote_monitoring mqtt cbor" --interval-ms $interval_ms --encoding cbor
+run_remote_monitoring "remote_monitoring mqtt cbor batch 10" --interval-ms $interval_ms --encoding cbor --batch 10 --compress deflate
+run_remote_monitoring "remote_monitoring mqtt json flat out" --interval-ms 0
+
+if [ -n "$simplesample_amqp" ] && [ -n "$AMQP_STANDIN_CONNECTION_STRING" ]
+then
+    run_simplesample_amqp "simplesample_amqp amqp" --interval-ms $interval_ms
+    if [ "$AMQP_STANDIN_WS" == 1 ]
+    then
+        run_simplesample_amqp "simplesample_amqp amqp-ws" --transport amqp-ws --interval-ms $interval_ms
+    fi
+    run_simplesample_amqp "simplesample_amqp amqp flat out" --interval-ms 0
+else
+    echo "simplesample_amqp skipped: set AMQP_STANDIN_CONNECTION_STRING to an AMQP stand-in"
+fi
@@ -0,0 +1,145 @@
+#!/bin/bash
+# Copyright (c) Microsoft. All rights reserved.
+# Licensed under the MIT license. See LICENSE file in the project root for full license information.
+#
+# Memory budget of remote_monitoring: binary size, and resident memory while it
+# sends simulated telemetry to a local mosquitto (see run_e2e_bench.sh).
+#
+#   binary_bytes    size of the executable file
+#   text_bytes      code and read-only data, from size(1)
+#   data_bss_bytes  initialized and zeroed data, from size(1)
+#   startup_rss_kb  VmRSS one second after start, connected and sending
+#   steady_rss_kb   VmRSS after SETTLE_S seconds (default 30)
+#   peak_rss_kb     VmHWM at the same time
+#
+# The figures are compared with the budget in BUDGET_FILE (default
+# memory_budget.txt next to this script), one "name value" line per figure,
+# "#" starting a comment. A figure more than TOLERANCE_PCT percent (default 10)
+# over its budget fails the check with exit status 1, and so does a missing
+# budget file. With RECORD=1 the measured figures become the budget instead;
+# record it on the target board with the build that is to be shipped, as sizes
+# differ between compilers and architectures.
+#
+# Usage: run_memory_budget.sh <remote_monitoring>
+
+set -e
+
+remote_monitoring=$1
+settle_s=${SETTLE_S:-30}
+tolerance_pct=${TOLERANCE_PCT:-10}
+script_dir=$(cd "$(dirname "$0")" && pwd)
+budget_file=${BUDGET_FILE:-$script_dir/memory_budget.txt}
+
+if [ -z "$remote_monitoring" ]
+then
+    echo "Usage: $0 <remote_monitoring>"
+    exit 1
+fi
+
+# Checked before measuring, which takes SETTLE_S seconds
+if [ ! -f "$budget_file" ] && [ "$RECORD" != 1 ]
+then
+    echo "No memory budget in $budget_file; run with RECORD=1 to record one"
+    exit 1
+fi
+
+for tool in mosquitto openssl size
+do
+    if ! command -v $tool > /dev/null
+    then
+        echo "$tool is needed for the memory budget (sudo apt-get install mosquitto openssl binutils)"
+        exit 1
+    fi
+done
+
+. "$script_dir/broker_util.sh"
+sample_pid=
+
+stop_sample ()
+{
+    if [ -n "$sample_pid" ]
+    then
+        kill $sample_pid 2> /dev/null || true
+        wait $sample_pid 2> /dev/null || true
+        sample_pid=
+    fi
+}
+trap 'stop_sample; cleanup' EXIT
+
+# Usage: status_kb <field>; a field of /proc/<pid>/status in kB
+status_kb ()
+{
+    awk -v field="$1:" '$1 == field { print $2 }' /proc/$sample_pid/status
+}
+
+# Fails if the sample has exited, with its last output
+check_running ()
+{
+    if ! kill -0 $sample_pid 2> /dev/null
+    then
+        echo "remote_monitoring exited, last output:"
+        tail -n 20 "$work_dir/run.log"
+        exit 1
+    fi
+}
+
+make_certificates
+if ! start_mqtt_broker mosquitto 8883
+then
+    echo "mosquitto failed to start:"
+    cat "$work_dir/mosquitto.log"
+    exit 1
+fi
+
+binary_bytes=$(stat -c %s "$remote_monitoring")
+read text_bytes data_bytes bss_bytes < <(size "$remote_monitoring" | awk 'NR == 2 { print $1, $2, $3 }')
+data_bss_bytes=$(( data_bytes + bss_bytes ))
+
+"$remote_monitoring" --simulate --trusted-certs "$work_dir/ca.pem" \
+    --connection-string "HostName=127.0.0.1;DeviceId=memory-budget-device;SharedAccessKey=bWVtb3J5LWJ1ZGdldA==" \
+    --interval-ms 100 > "$work_dir/run.log" 2>&1 &
+sample_pid=$!
+
+sleep 1
+check_running
+startup_rss_kb=$(status_kb VmRSS)
+sleep $(( settle_s > 1 ? settle_s - 1 : 0 ))
+check_running
+steady_rss_kb=$(status_kb VmRSS)
+peak_rss_kb=$(status_kb VmHWM)
+stop_sample
+
+measured="binary_bytes $binary_bytes
+text_bytes $text_bytes
+data_bss_bytes $data_bss_bytes
+startup_rss_kb $startup_rss_kb
+steady_rss_kb $steady_rss_kb
+peak_rss_kb $peak_rss_kb"
+
+if [ "$RECORD" == 1 ]
+then
+    echo "$measured" > "$budget_file"
+    echo "Recorded the budget in $budget_file:"
+    echo "$measured"
+    exit 0
+fi
+
+printf "%-16s %12s %12s %8s\n" "figure" "measured" "budget" "change"
+echo "$measured" | awk -v tolerance=$tolerance_pct '
+    NR == FNR { if ($1 !~ /^#/ && NF >= 2) budget[$1] = $2; next }
+    {
+        if (!($1 in budget) || budget[$1] <= 0) {
+            printf "%-16s %12d %12s %8s\n", $1, $2, "-", "-"
+            next
+        }
+        change = 100 * ($2 - budget[$1]) / budget[$1]
+        over = change > tolerance
+        failed = failed || over
+        printf "%-16s %12d %12d %+7.1f%%%s\n", $1, $2, budget[$1], change, over ? "  over budget" : ""
+    }
+    END {
+        if (failed) {
+            printf "Over the memory budget by more than %s%%\n", tolerance
+            exit 1
+        }
+    }' "$budget_file" -
@@ -0,0 +1,132 @@
+// Copyright (c) Microsoft. All rights reserved.
+// Licensed under the MIT license. See LICENSE file in the project root for full license information.
+
+/* Compares size and encode time of the JSON telemetry produced by SERIALIZE
+   with the CBOR encoding from telemetry_codec for the remote_monitoring sample */
+
+#include <stdlib.h>
+#include <stdio.h>
+
+#include "serializer.h"
+#include "azure_c_shared_utility/platform.h"
+
+#include "telemetry_codec.h"
+#include "bench_util.h"
+
+#define BENCH_ITERATIONS 100000
+
+static const char* deviceId = "raspberrypi-thermostat-0001";
+
+/* Same telemetry fields as the Thermostat model of remote_monitoring */
+BEGIN_NAMESPACE(Contoso);
+
+DECLARE_MODEL(Thermostat,
+WITH_DATA(double, Temperature),
+WITH_DATA(double, Humidity),
+WITH_DATA(ascii_char_ptr, DeviceId)
+);
+
+END_NAMESPACE(Contoso);
+
+static void nextReading(Thermostat* thermostat, unsigned int i)
+{
+    /* Readings as they come out of the BME280, which reports floats */
+    thermostat->Temperature = (float)(21.0 + (i % 500) * 0.01);
+    thermostat->Humidity = (float)(40.0 + (i % 300) * 0.03);
+}
+
+static void benchJson(Thermostat* thermostat)
+{
+    unsigned int i;
+    size_t totalBytes = 0;
+    uint64_t begin = bench_now_ns();
+
+    for (i = 0; i < BENCH_ITERATIONS; i++)
+    {
+        unsigned char* buffer;
+        size_t bufferSize;
+
+        nextReading(thermostat, i);
+        if (SERIALIZE(&buffer, &bufferSize, thermostat->DeviceId, thermostat->Temperature, thermostat->Humidity) != CODEFIRST_OK)
+        {
+            (void)printf("Failed to serialize\r\n");
+            return;
+        }
+        totalBytes += bufferSize;
+        free(buffer);
+    }
+
+    bench_report("json (SERIALIZE)", BENCH_ITERATIONS, bench_now_ns() - begin, (double)totalBytes / BENCH_ITERATIONS);
+}
+
+static void benchCbor(Thermostat* thermostat, const char* name, const char* includedDeviceId)
+{
+    unsigned int i;
+    size_t totalBytes = 0;
+    uint8_t buffer[TELEMETRY_CBOR_MAX_SAMPLE_SIZE + 64];
+    uint64_t begin = bench_now_ns();
+
+    for (i = 0; i < BENCH_ITERATIONS; i++)
+    {
+        telemetry_sample_t sample;
+        size_t bufferSize;
+
+        nextReading(thermostat, i);
+        sample.Temperature = thermostat->Temperature;
+        sample.Humidity = thermostat->Humidity;
+        sample.Time_ms = 0;
+
+        bufferSize = telemetry_encode_cbor(&sample, includedDeviceId, buffer, sizeof(buffer));
+        if (bufferSize == 0)
+        {
+            (void)printf("Failed to encode\r\n");
+            return;
+        }
+        totalBytes += bufferSize;
+    }
+
+    bench_report(name, BENCH_ITERATIONS, bench_now_ns() - begin, (double)totalBytes / BENCH_ITERATIONS);
+}
+
+int main(void)
+{
+    int result;
+
+    if (platform_init() != 0)
+    {
+        (void)printf("Failed to initialize the platform.\r\n");
+        result = 1;
+    }
+    else
+    {
+        if (serializer_init(NULL) != SERIALIZER_OK)
+        {
+            (void)printf("Failed on serializer_init\r\n");
+            result = 1;
+        }
+        else
+        {
+            Thermostat* thermostat = CREATE_MODEL_INSTANCE(Contoso, Thermostat);
+            if (thermostat == NULL)
+            {
+                (void)printf("Failed on CREATE_MODEL_INSTANCE\r\n");
+                result = 1;
+            }
+            else
+            {
+                thermostat->DeviceId = (char*)deviceId;
+
+                benchJson(thermostat);
+                benchCbor(thermostat, "cbor (with DeviceId)", deviceId);
+                benchCbor(thermostat, "cbor", NULL);
+
+                DESTROY_MODEL_INSTANCE(thermostat);
+                result = 0;
+            }
+            serializer_deinit();
+        }
+        platform_deinit();
+    }
+
+    return result;
+}
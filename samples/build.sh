@@ -13,6 +13,8 @@ build_amqp=ON
 build_http=ON
 build_mqtt=ON
 skip_unittests=ON
+build_benchmarks=OFF
+low_footprint=OFF
 
 echo "Building Remote Monitoring for Raspberry Pi."
 echo "  Script directory:      "$script_dir
@@ -32,6 +34,8 @@ usage ()
     echo " --no-amqp                     do no build AMQP transport and samples"
     echo " --no-http                     do no build HTTP transport and samples"
     echo " --no-mqtt                     do no build MQTT transport and samples"
+    echo " --build-benchmarks            build the benchmarks in samples/benchmarks"
+    echo " --low-footprint               build only remote_monitoring, MQTT only and optimized for size"
     exit 1
 }
 
@@ -56,6 +60,8 @@ process_args ()
               "--no-amqp" ) build_amqp=OFF;;
               "--no-http" ) build_http=OFF;;
               "--no-mqtt" ) build_mqtt=OFF;;
+              "--build-benchmarks" ) build_benchmarks=ON;;
+              "--low-footprint" ) low_footprint=ON;;
               * ) usage;;
           esac
       fi
@@ -64,10 +70,20 @@ process_args ()
 
 process_args $*
 
+# The profile is an initial cache; the options below would override it
+cache_options=
+if [ $low_footprint == ON ]
+then
+    cache_options="-C $script_dir/low_footprint.cmake"
+    build_amqp=OFF
+    build_http=OFF
+    build_benchmarks=OFF
+fi
+
 rm -r -f ~/cmake
 mkdir ~/cmake
 pushd ~/cmake
-cmake -DcompileOption_C:STRING="$extracloptions" -Drun_e2e_tests:BOOL=$run_e2e_tests -Drun_longhaul_tests=$run_longhaul_tests -Duse_amqp:BOOL=$build_amqp -Duse_http:BOOL=$build_http -Duse_mqtt:BOOL=$build_mqtt -Dskip_unittests:BOOL=$skip_unittests $build_root
+cmake $cache_options -DcompileOption_C:STRING="$extracloptions" -Drun_e2e_tests:BOOL=$run_e2e_tests -Drun_longhaul_tests=$run_longhaul_tests -Duse_amqp:BOOL=$build_amqp -Duse_http:BOOL=$build_http -Duse_mqtt:BOOL=$build_mqtt -Dskip_unittests:BOOL=$skip_unittests -Dbuild_benchmarks:BOOL=$build_benchmarks $build_root
 make --jobs=$(nproc)
 ctest -C "Debug" -V
 popd
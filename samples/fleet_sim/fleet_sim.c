@@ -0,0 +1,669 @@
+// Copyright (c) Microsoft. All rights reserved.
+// Licensed under the MIT license. See LICENSE file in the project root for full license information.
+
+/* Load generator: runs many virtual remote_monitoring devices in one process. Every
+   device has its own IoT Hub connection and Contoso Thermostat model, and reads a
+   simulated BME280 through the same decoding and compensation as the real sensor.
+   Devices are spread over a small pool of worker threads driving the LL client. */
+
+#include "iothubtransportmqtt.h"
+#include "schemalib.h"
+#include "iothub_client_ll.h"
+#include "azure_c_shared_utility/threadapi.h"
+#include "azure_c_shared_utility/platform.h"
+
+#include <getopt.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bme280.h"
+#include "bme280_sim.h"
+#include "device_utils.h"
+#include "latency_histogram.h"
+#include "thermostat_model.h"
+
+#define MAX_LINE_LENGTH 1024
+
+/* How often every client gets IoTHubClient_LL_DoWork when no sample is due */
+static const uint64_t DoWork_period_us = 10000;
+/* Longest --interval-ms, as the TelemetryInterval of the model is a uint8_t in seconds */
+static const unsigned int Max_interval_ms = 255000;
+
+typedef struct FLEET_OPTIONS_TAG
+{
+	const char* devicesFile;
+	unsigned int count;
+	unsigned int workers;
+	unsigned int intervalMs;
+	unsigned int durationS;
+	unsigned int reportS;
+	const char* trustedCertsFile;
+	int useTwin;
+} FLEET_OPTIONS;
+
+static FLEET_OPTIONS g_options =
+{
+	NULL,
+	0,
+	4,
+	1000,
+	0,
+	5,
+	NULL,
+	1
+};
+
+struct WORKER_TAG;
+
+typedef struct VIRTUAL_DEVICE_TAG
+{
+	char* connectionString;
+	char* deviceId;
+	IOTHUB_CLIENT_LL_HANDLE client;
+	Thermostat* thermostat;
+	uint32_t seed;
+	uint64_t nextSampleUs;
+} VIRTUAL_DEVICE;
+
+typedef struct WORKER_TAG
+{
+	pthread_t thread;
+	VIRTUAL_DEVICE* devices;
+	size_t deviceCount;
+
+	/* Statistics, read by the reporting thread */
+	pthread_mutex_t lock;
+	unsigned long long sent;
+	unsigned long long confirmed;
+	unsigned long long failed;
+	unsigned long long behind;
+	latency_histogram_t latency;
+} WORKER;
+
+typedef struct SEND_CONTEXT_TAG
+{
+	WORKER* worker;
+	uint64_t sampleTimeUs;
+} SEND_CONTEXT;
+
+static volatile sig_atomic_t g_stop = 0;
+static uint64_t g_startUs;
+static unsigned long long g_desiredUpdates = 0;
+
+/* The serializer is not documented as thread safe, so SERIALIZE is serialized, and so
+   is IoTHubClient_LL_DoWork while devices have twins, as it runs the twin and method
+   callbacks of the model. That also serializes the network I/O of the workers; with
+   --no-twin no callback enters the serializer and DoWork runs in parallel. */
+static pthread_mutex_t g_serializerLock = PTHREAD_MUTEX_INITIALIZER;
+
+void onDesiredTelemetryInterval(void* argument)
+{
+	(void)argument;
+	(void)__sync_fetch_and_add(&g_desiredUpdates, 1);
+}
+
+void onDesiredCalibration(void* argument)
+{
+	(void)argument;
+	(void)__sync_fetch_and_add(&g_desiredUpdates, 1);
+}
+
+METHODRETURN_HANDLE ChangeLightStatus(Thermostat* thermostat, int lightstatus)
+{
+	(void)thermostat;
+	(void)lightstatus;
+	return MethodReturn_Create(201, "\"light status changed\"");
+}
+
+METHODRETURN_HANDLE LightBlink(Thermostat* thermostat)
+{
+	(void)thermostat;
+	return MethodReturn_Create(201, "\"light blink success\"");
+}
+
+METHODRETURN_HANDLE InitiateFirmwareUpdate(Thermostat* thermostat, ascii_char_ptr FwPackageURI)
+{
+	(void)thermostat;
+	(void)FwPackageURI;
+	return MethodReturn_Create(400, "\"firmware update is not simulated\"");
+}
+
+METHODRETURN_HANDLE DumpTrace(Thermostat* thermostat)
+{
+	(void)thermostat;
+	return MethodReturn_Create(400, "\"tracing is not simulated\"");
+}
+
+static void onSignal(int signalNumber)
+{
+	(void)signalNumber;
+	g_stop = 1;
+}
+
+/* One connection string per line; empty lines and lines starting with # are skipped */
+static VIRTUAL_DEVICE* loadDevices(const char* path, size_t* deviceCount)
+{
+	VIRTUAL_DEVICE* devices = NULL;
+	size_t count = 0;
+	size_t capacity = 0;
+	char line[MAX_LINE_LENGTH];
+	FILE* fp = fopen(path, "r");
+
+	if (fp == NULL)
+	{
+		printf("Failed to open the devices file %s\r\n", path);
+		return NULL;
+	}
+
+	while (fgets(line, sizeof(line), fp) != NULL && (g_options.count == 0 || count < g_options.count))
+	{
+		size_t length = strcspn(line, "\r\n");
+		const char* deviceIdStart = strstr(line, "DeviceId=");
+		if (length == 0 || line[0] == '#')
+		{
+			continue;
+		}
+		if (deviceIdStart == NULL)
+		{
+			printf("Skipping a line without DeviceId in %s\r\n", path);
+			continue;
+		}
+
+		if (count == capacity)
+		{
+			VIRTUAL_DEVICE* grown = realloc(devices, (capacity + 64) * sizeof(VIRTUAL_DEVICE));
+			if (grown == NULL)
+			{
+				break;
+			}
+			devices = grown;
+			capacity += 64;
+		}
+
+		deviceIdStart += strlen("DeviceId=");
+		memset(&devices[count], 0, sizeof(VIRTUAL_DEVICE));
+		devices[count].connectionString = CopyString(line, length);
+		devices[count].deviceId = CopyString(deviceIdStart, strcspn(deviceIdStart, ";\r\n"));
+		devices[count].seed = (uint32_t)count;
+		count++;
+	}
+	fclose(fp);
+
+	*deviceCount = count;
+	return devices;
+}
+
+static void sendCallback(IOTHUB_CLIENT_CONFIRMATION_RESULT result, void* userContextCallback)
+{
+	SEND_CONTEXT* context = (SEND_CONTEXT*)userContextCallback;
+	WORKER* worker = context->worker;
+	uint64_t latencyUs = latency_clock_us() - context->sampleTimeUs;
+
+	(void)pthread_mutex_lock(&worker->lock);
+	if (result == IOTHUB_CLIENT_CONFIRMATION_OK)
+	{
+		worker->confirmed++;
+		latency_histogram_record(&worker->latency, latencyUs);
+	}
+	else
+	{
+		worker->failed++;
+	}
+	(void)pthread_mutex_unlock(&worker->lock);
+	free(context);
+}
+
+static void sendSample(WORKER* worker, VIRTUAL_DEVICE* device, uint64_t nowUs)
+{
+	double temperature, pressure, humidity;
+	float tempC, pressurePa, humidityPct;
+	uint8_t frame[BME280_FRAME_LEN];
+	unsigned char* buffer;
+	size_t bufferSize;
+	int serializeResult;
+
+	/* Go through the raw frame so the driver's decoding is part of the load */
+	bme280_sim_readings(device->seed, (double)(nowUs - g_startUs) / 1e6, &temperature, &pressure, &humidity);
+	bme280_sim_encode_frame(temperature, pressure, humidity, frame);
+	bme280_compensate_frame(frame, &tempC, &pressurePa, &humidityPct);
+
+	device->thermostat->Temperature = tempC;
+	device->thermostat->Humidity = humidityPct;
+
+	(void)pthread_mutex_lock(&g_serializerLock);
+	serializeResult = SERIALIZE(&buffer, &bufferSize, device->thermostat->DeviceId, device->thermostat->Temperature, device->thermostat->Humidity);
+	(void)pthread_mutex_unlock(&g_serializerLock);
+
+	if (serializeResult != CODEFIRST_OK)
+	{
+		(void)printf("%s: failed to serialize\r\n", device->deviceId);
+	}
+	else
+	{
+		IOTHUB_MESSAGE_HANDLE messageHandle = IoTHubMessage_CreateFromByteArray(buffer, bufferSize);
+		SEND_CONTEXT* context = malloc(sizeof(SEND_CONTEXT));
+		if (messageHandle == NULL || context == NULL)
+		{
+			(void)printf("%s: unable to create a new IoTHubMessage\r\n", device->deviceId);
+			free(context);
+		}
+		else
+		{
+			context->worker = worker;
+			context->sampleTimeUs = nowUs;
+			if (IoTHubClient_LL_SendEventAsync(device->client, messageHandle, sendCallback, context) != IOTHUB_CLIENT_OK)
+			{
+				(void)printf("%s: failed to hand over the message\r\n", device->deviceId);
+				free(context);
+				(void)pthread_mutex_lock(&worker->lock);
+				worker->failed++;
+				(void)pthread_mutex_unlock(&worker->lock);
+			}
+			else
+			{
+				(void)pthread_mutex_lock(&worker->lock);
+				worker->sent++;
+				(void)pthread_mutex_unlock(&worker->lock);
+			}
+		}
+		if (messageHandle != NULL)
+		{
+			IoTHubMessage_Destroy(messageHandle);
+		}
+		free(buffer);
+	}
+}
+
+static void* workerThread(void* arg)
+{
+	WORKER* worker = (WORKER*)arg;
+	uint64_t intervalUs = (uint64_t)g_options.intervalMs * 1000;
+
+	while (!g_stop)
+	{
+		size_t i;
+		uint64_t nowUs = latency_clock_us();
+		uint64_t nextDueUs = nowUs + DoWork_period_us;
+
+		for (i = 0; i < worker->deviceCount; i++)
+		{
+			VIRTUAL_DEVICE* device = &worker->devices[i];
+			if (nowUs >= device->nextSampleUs)
+			{
+				sendSample(worker, device, nowUs);
+				device->nextSampleUs += intervalUs;
+				if (device->nextSampleUs <= nowUs)
+				{
+					/* A whole interval late: the worker cannot keep up with the requested rate */
+					device->nextSampleUs = nowUs + intervalUs;
+					(void)pthread_mutex_lock(&worker->lock);
+					worker->behind++;
+					(void)pthread_mutex_unlock(&worker->lock);
+				}
+			}
+			if (device->nextSampleUs < nextDueUs)
+			{
+				nextDueUs = device->nextSampleUs;
+			}
+			if (g_options.useTwin)
+			{
+				(void)pthread_mutex_lock(&g_serializerLock);
+				IoTHubClient_LL_DoWork(device->client);
+				(void)pthread_mutex_unlock(&g_serializerLock);
+			}
+			else
+			{
+				IoTHubClient_LL_DoWork(device->client);
+			}
+		}
+
+		nowUs = latency_clock_us();
+		if (nextDueUs > nowUs)
+		{
+			ThreadAPI_Sleep((unsigned int)((nextDueUs - nowUs + 999) / 1000));
+		}
+	}
+	return NULL;
+}
+
+static int createDevice(VIRTUAL_DEVICE* device, const char* trustedCerts)
+{
+	int result;
+
+	device->client = IoTHubClient_LL_CreateFromConnectionString(device->connectionString, MQTT_Protocol);
+	if (device->client == NULL)
+	{
+		printf("%s: failure in IoTHubClient_LL_CreateFromConnectionString\r\n", device->deviceId);
+		result = 1;
+	}
+	else
+	{
+		if (trustedCerts != NULL && IoTHubClient_LL_SetOption(device->client, "TrustedCerts", trustedCerts) != IOTHUB_CLIENT_OK)
+		{
+			printf("%s: failed to set option \"TrustedCerts\"\r\n", device->deviceId);
+		}
+
+		device->thermostat = g_options.useTwin ?
+			IoTHubDeviceTwin_LL_CreateThermostat(device->client) :
+			CREATE_MODEL_INSTANCE(Contoso, Thermostat);
+		if (device->thermostat == NULL)
+		{
+			printf("%s: failure creating the Thermostat model\r\n", device->deviceId);
+			IoTHubClient_LL_Destroy(device->client);
+			device->client = NULL;
+			result = 1;
+		}
+		else
+		{
+			device->thermostat->DeviceId = device->deviceId;
+			device->thermostat->TelemetryInterval = (uint8_t)((g_options.intervalMs + 999) / 1000);
+			device->thermostat->Config.TelemetryInterval = device->thermostat->TelemetryInterval;
+			device->thermostat->System.FirmwareVersion = "1.0";
+			device->thermostat->SupportedMethods = "{}";
+			if (g_options.useTwin &&
+				IoTHubDeviceTwin_LL_SendReportedStateThermostat(device->thermostat, NULL, NULL) != IOTHUB_CLIENT_OK)
+			{
+				printf("%s: failed sending serialized reported state\r\n", device->deviceId);
+			}
+			result = 0;
+		}
+	}
+	return result;
+}
+
+static void destroyDevice(VIRTUAL_DEVICE* device)
+{
+	if (device->thermostat != NULL)
+	{
+		if (g_options.useTwin)
+		{
+			IoTHubDeviceTwin_LL_DestroyThermostat(device->thermostat);
+		}
+		else
+		{
+			DESTROY_MODEL_INSTANCE(device->thermostat);
+		}
+	}
+	if (device->client != NULL)
+	{
+		IoTHubClient_LL_Destroy(device->client);
+	}
+	free(device->connectionString);
+	free(device->deviceId);
+}
+
+static void report(WORKER* workers, unsigned int workerCount, size_t deviceCount, double elapsedS, double intervalS, unsigned long long* lastSent, unsigned long long* lastConfirmed)
+{
+	unsigned int w;
+	unsigned long long sent = 0, confirmed = 0, failed = 0, behind = 0;
+	latency_histogram_t latency;
+	latency_histogram_reset(&latency);
+
+	for (w = 0; w < workerCount; w++)
+	{
+		(void)pthread_mutex_lock(&workers[w].lock);
+		sent += workers[w].sent;
+		confirmed += workers[w].confirmed;
+		failed += workers[w].failed;
+		behind += workers[w].behind;
+		latency_histogram_merge(&latency, &workers[w].latency);
+		latency_histogram_reset(&workers[w].latency);
+		(void)pthread_mutex_unlock(&workers[w].lock);
+	}
+
+	(void)printf("[%7.1fs] %u devices: sent %llu (%.1f msg/s), confirmed %llu (%.1f msg/s), failed %llu, late %llu, "
+		"sample-to-confirmation p50 %.1f ms p99 %.1f ms max %.1f ms, desired updates %llu\r\n",
+		elapsedS, (unsigned int)deviceCount,
+		sent, (double)(sent - *lastSent) / intervalS,
+		confirmed, (double)(confirmed - *lastConfirmed) / intervalS,
+		failed, behind,
+		(double)latency_histogram_percentile(&latency, 50) / 1000.0,
+		(double)latency_histogram_percentile(&latency, 99) / 1000.0,
+		(latency.Count__u64 == 0) ? 0.0 : (double)latency.Max__u64 / 1000.0,
+		g_desiredUpdates);
+
+	*lastSent = sent;
+	*lastConfirmed = confirmed;
+}
+
+static void fleet_sim_run(VIRTUAL_DEVICE* devices, size_t deviceCount, const char* trustedCerts)
+{
+	unsigned int workerCount = g_options.workers;
+	WORKER* workers;
+	size_t i;
+	size_t created = 0;
+	unsigned int started = 0;
+
+	if (workerCount > deviceCount)
+	{
+		workerCount = (unsigned int)deviceCount;
+	}
+	workers = calloc(workerCount, sizeof(WORKER));
+	if (workers == NULL)
+	{
+		printf("Failed to allocate the workers\r\n");
+		return;
+	}
+
+	for (i = 0; i < deviceCount; i++)
+	{
+		if (createDevice(&devices[i], trustedCerts) == 0)
+		{
+			created++;
+		}
+	}
+	printf("Created %u of %u devices on %u workers, one sample every %u ms per device\r\n",
+		(unsigned int)created, (unsigned int)deviceCount, workerCount, g_options.intervalMs);
+
+	/* Contiguous slices of the device array, first samples staggered over one interval */
+	g_startUs = latency_clock_us();
+	for (i = 0; i < deviceCount; i++)
+	{
+		devices[i].nextSampleUs = g_startUs + (uint64_t)g_options.intervalMs * 1000 * i / deviceCount;
+	}
+
+	for (started = 0; started < workerCount; started++)
+	{
+		WORKER* worker = &workers[started];
+		size_t first = deviceCount * started / workerCount;
+		size_t last = deviceCount * (started + 1) / workerCount;
+		size_t used = 0;
+
+		/* Failed devices are moved out of the slice so workers never see them */
+		for (i = first; i < last; i++)
+		{
+			if (devices[i].client != NULL)
+			{
+				VIRTUAL_DEVICE swap = devices[first + used];
+				devices[first + used] = devices[i];
+				devices[i] = swap;
+				used++;
+			}
+		}
+
+		worker->devices = &devices[first];
+		worker->deviceCount = used;
+		latency_histogram_reset(&worker->latency);
+		(void)pthread_mutex_init(&worker->lock, NULL);
+		if (pthread_create(&worker->thread, NULL, workerThread, worker) != 0)
+		{
+			printf("Failed to start worker %u\r\n", started);
+			(void)pthread_mutex_destroy(&worker->lock);
+			break;
+		}
+	}
+
+	{
+		unsigned long long lastSent = 0;
+		unsigned long long lastConfirmed = 0;
+		uint64_t lastReportUs = g_startUs;
+
+		while (!g_stop)
+		{
+			uint64_t nowUs;
+			ThreadAPI_Sleep(g_options.reportS * 1000);
+			nowUs = latency_clock_us();
+			report(workers, started, created, (double)(nowUs - g_startUs) / 1e6, (double)(nowUs - lastReportUs) / 1e6, &lastSent, &lastConfirmed);
+			lastReportUs = nowUs;
+			if (g_options.durationS != 0 && nowUs - g_startUs >= (uint64_t)g_options.durationS * 1000000)
+			{
+				g_stop = 1;
+			}
+		}
+	}
+
+	for (i = 0; i < started; i++)
+	{
+		(void)pthread_join(workers[i].thread, NULL);
+	}
+	for (i = 0; i < deviceCount; i++)
+	{
+		destroyDevice(&devices[i]);
+	}
+	for (i = 0; i < started; i++)
+	{
+		(void)pthread_mutex_destroy(&workers[i].lock);
+	}
+	free(workers);
+}
+
+static void fleet_sim_usage(const char* program)
+{
+	printf("Usage: %s --devices FILE [options]\n", program);
+	printf("  --devices FILE         device connection strings, one per line\n");
+	printf("  --count N              only use the first N devices of the file\n");
+	printf("  --workers N            worker threads (default 4)\n");
+	printf("  --interval-ms MS       time between samples of one device, at most 255000 (default 1000)\n");
+	printf("  --duration-s S         stop after S seconds (default: run until Ctrl-C)\n");
+	printf("  --report-s S           seconds between throughput reports (default 5)\n");
+	printf("  --trusted-certs FILE   PEM certificates to trust, e.g. of a local broker stand-in\n");
+	printf("  --no-twin              do not create device twins (telemetry only); with twins the\n");
+	printf("                         workers take turns in IoTHubClient_LL_DoWork, so only --no-twin\n");
+	printf("                         sends in parallel\n");
+}
+
+static int fleet_sim_parse_options(int argc, char** argv)
+{
+	static const struct option longOptions[] =
+	{
+		{ "devices", required_argument, NULL, 'd' },
+		{ "count", required_argument, NULL, 'n' },
+		{ "workers", required_argument, NULL, 'w' },
+		{ "interval-ms", required_argument, NULL, 'i' },
+		{ "duration-s", required_argument, NULL, 'D' },
+		{ "report-s", required_argument, NULL, 'r' },
+		{ "trusted-certs", required_argument, NULL, 'c' },
+		{ "no-twin", no_argument, NULL, 'T' },
+		{ "help", no_argument, NULL, 'h' },
+		{ NULL, 0, NULL, 0 }
+	};
+	int result = 0;
+	int opt;
+
+	while (result == 0 && (opt = getopt_long(argc, argv, "h", longOptions, NULL)) != -1)
+	{
+		switch (opt)
+		{
+		case 'd':
+			g_options.devicesFile = optarg;
+			break;
+		case 'n':
+			result = ParseUnsigned(optarg, &g_options.count);
+			break;
+		case 'w':
+			result = ParseUnsigned(optarg, &g_options.workers);
+			break;
+		case 'i':
+			result = ParseUnsigned(optarg, &g_options.intervalMs);
+			break;
+		case 'D':
+			result = ParseUnsigned(optarg, &g_options.durationS);
+			break;
+		case 'r':
+			result = ParseUnsigned(optarg, &g_options.reportS);
+			break;
+		case 'c':
+			g_options.trustedCertsFile = optarg;
+			break;
+		case 'T':
+			g_options.useTwin = 0;
+			break;
+		default:
+			result = 1;
+			break;
+		}
+	}
+
+	if (result == 0 && g_options.intervalMs > Max_interval_ms)
+	{
+		printf("--interval-ms can be at most %u, the longest TelemetryInterval the twin reports\n", Max_interval_ms);
+		result = 1;
+	}
+	if (result == 0 && (g_options.devicesFile == NULL || g_options.workers == 0 || g_options.intervalMs == 0 || g_options.reportS == 0))
+	{
+		result = 1;
+	}
+	if (result != 0)
+	{
+		fleet_sim_usage(argv[0]);
+	}
+	return result;
+}
+
+int main(int argc, char** argv)
+{
+	int result = fleet_sim_parse_options(argc, argv);
+	if (result == 0)
+	{
+		size_t deviceCount = 0;
+		char* trustedCerts = NULL;
+		VIRTUAL_DEVICE* devices = loadDevices(g_options.devicesFile, &deviceCount);
+
+		if (devices == NULL || deviceCount == 0)
+		{
+			printf("No devices to simulate\r\n");
+			result = 1;
+		}
+		else if (g_options.trustedCertsFile != NULL && (trustedCerts = ReadTextFile(g_options.trustedCertsFile)) == NULL)
+		{
+			result = 1;
+		}
+		else
+		{
+			/* All virtual devices share the simulated chip's calibration */
+			bme280_sim_install();
+			if (bme280_init(0) != 1)
+			{
+				printf("Failed to initialize the simulated BME280\r\n");
+				result = 1;
+			}
+			else if (platform_init() != 0)
+			{
+				printf("Failed to initialize the platform.\r\n");
+				result = 1;
+			}
+			else
+			{
+				if (SERIALIZER_REGISTER_NAMESPACE(Contoso) == NULL)
+				{
+					printf("Unable to SERIALIZER_REGISTER_NAMESPACE\r\n");
+					result = 1;
+				}
+				else
+				{
+					(void)signal(SIGINT, onSignal);
+					(void)signal(SIGTERM, onSignal);
+					fleet_sim_run(devices, deviceCount, trustedCerts);
+					serializer_deinit();
+				}
+				platform_deinit();
+			}
+		}
+		free(trustedCerts);
+		free(devices);
+	}
+	return result;
+}
@@ -0,0 +1,186 @@
+// Copyright (c) Microsoft. All rights reserved.
+// Licensed under the MIT license. See LICENSE file in the project root for full license information.
+
+/* Prints readings kept by the on-device historian of remote_monitoring (--history DIR)
+   as CSV, for technicians and for a local dashboard. It opens the tier files read-only,
+   so it can run next to remote_monitoring; points that remote_monitoring has not
+   flushed yet are not seen. */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <getopt.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "historian.h"
+
+typedef struct HISTORIAN_QUERY_OPTIONS_TAG
+{
+	const char* dir;
+	int autoTier;
+	HISTORIAN_TIER tier;
+	unsigned long long fromS;
+	unsigned long long toS;
+	unsigned long long lastS;
+	unsigned int maxPoints;
+} HISTORIAN_QUERY_OPTIONS;
+
+static HISTORIAN_QUERY_OPTIONS g_options =
+{
+	NULL,
+	1,
+	HISTORIAN_TIER_RAW,
+	0,
+	0,
+	0,
+	1000
+};
+
+static void printPoint(void* context, const historian_point_t* point)
+{
+	time_t seconds = (time_t)(point->Time_us__u64 / 1000000);
+	struct tm utc;
+	char text[32];
+	(void)context;
+
+	if (gmtime_r(&seconds, &utc) == NULL || strftime(text, sizeof(text), "%Y-%m-%dT%H:%M:%S", &utc) == 0)
+	{
+		text[0] = '\0';
+	}
+	printf("%s.%03uZ,%.2f,%.2f,%.2f,%.1f,%.1f,%.1f,%.1f,%.1f,%.1f\n", text,
+		(unsigned int)(point->Time_us__u64 / 1000 % 1000),
+		point->Mean__fa[0], point->Min__fa[0], point->Max__fa[0],
+		point->Mean__fa[1], point->Min__fa[1], point->Max__fa[1],
+		point->Mean__fa[2], point->Min__fa[2], point->Max__fa[2]);
+}
+
+static void historian_query_usage(const char* program)
+{
+	printf("Usage: %s --dir DIR [options]\n", program);
+	printf("  --dir DIR              directory given to remote_monitoring --history\n");
+	printf("  --tier raw|1min|1h|auto  tier to read (default auto: the finest with at most --max-points)\n");
+	printf("  --from S               first time, seconds since the epoch (default: oldest)\n");
+	printf("  --to S                 last time, seconds since the epoch (default: newest)\n");
+	printf("  --last S               the last S seconds, instead of --from\n");
+	printf("  --max-points N         point budget of --tier auto (default 1000)\n");
+}
+
+static int parseUnsignedLongLong(const char* text, unsigned long long* value)
+{
+	char* end;
+	unsigned long long parsed = strtoull(text, &end, 10);
+	if (*text == '\0' || *end != '\0' || parsed > ULLONG_MAX / 1000000)
+	{
+		printf("Invalid number: %s\n", text);
+		return 1;
+	}
+	*value = parsed;
+	return 0;
+}
+
+static int historian_query_parse_options(int argc, char** argv)
+{
+	static const struct option longOptions[] =
+	{
+		{ "dir", required_argument, NULL, 'd' },
+		{ "tier", required_argument, NULL, 't' },
+		{ "from", required_argument, NULL, 'f' },
+		{ "to", required_argument, NULL, 'T' },
+		{ "last", required_argument, NULL, 'l' },
+		{ "max-points", required_argument, NULL, 'm' },
+		{ "help", no_argument, NULL, 'h' },
+		{ NULL, 0, NULL, 0 }
+	};
+	int result = 0;
+	int opt;
+
+	while (result == 0 && (opt = getopt_long(argc, argv, "h", longOptions, NULL)) != -1)
+	{
+		unsigned long long maxPoints;
+		switch (opt)
+		{
+		case 'd':
+			g_options.dir = optarg;
+			break;
+		case 't':
+			if (strcmp(optarg, "auto") == 0)
+			{
+				g_options.autoTier = 1;
+			}
+			else if (historian_tier_from_string(optarg, &g_options.tier) == 0)
+			{
+				g_options.autoTier = 0;
+			}
+			else
+			{
+				printf("Unknown tier: %s\n", optarg);
+				result = 1;
+			}
+			break;
+		case 'f':
+			result = parseUnsignedLongLong(optarg, &g_options.fromS);
+			break;
+		case 'T':
+			result = parseUnsignedLongLong(optarg, &g_options.toS);
+			break;
+		case 'l':
+			result = parseUnsignedLongLong(optarg, &g_options.lastS);
+			break;
+		case 'm':
+			result = parseUnsignedLongLong(optarg, &maxPoints);
+			g_options.maxPoints = (maxPoints > UINT_MAX) ? UINT_MAX : (unsigned int)maxPoints;
+			break;
+		default:
+			result = 1;
+			break;
+		}
+	}
+
+	if (result == 0 && g_options.dir == NULL)
+	{
+		result = 1;
+	}
+	if (result != 0)
+	{
+		historian_query_usage(argv[0]);
+	}
+	return result;
+}
+
+int main(int argc, char** argv)
+{
+	int result = historian_query_parse_options(argc, argv);
+	if (result == 0)
+	{
+		historian_t* historian = historian_open(g_options.dir, NULL, 1);
+		if (historian == NULL)
+		{
+			printf("Failed to open the historian in %s\n", g_options.dir);
+			result = 1;
+		}
+		else
+		{
+			uint64_t fromUs = g_options.fromS * 1000000;
+			uint64_t toUs = (g_options.toS == 0) ? UINT64_MAX : g_options.toS * 1000000 + 999999;
+			HISTORIAN_TIER tier = g_options.tier;
+
+			if (g_options.lastS != 0)
+			{
+				uint64_t nowUs = (uint64_t)time(NULL) * 1000000;
+				fromUs = (nowUs > g_options.lastS * 1000000) ? nowUs - g_options.lastS * 1000000 : 0;
+			}
+			if (g_options.autoTier)
+			{
+				tier = historian_pick_tier(historian, fromUs, toUs, g_options.maxPoints);
+			}
+
+			printf("time,temperature,temperature_min,temperature_max,humidity,humidity_min,humidity_max,pressure,pressure_min,pressure_max\n");
+			(void)historian_query(historian, tier, fromUs, toUs, printPoint, NULL);
+			historian_close(historian);
+		}
+	}
+	return result;
+}
@@ -0,0 +1,27 @@
+#Copyright (c) Microsoft. All rights reserved.
+#Licensed under the MIT license. See LICENSE file in the project root for full license information.
+
+#Initial cache for a size-optimized build of remote_monitoring, for boards such as a
+#512 MB Pi Zero that run it next to other services:
+#
+#   cmake -C samples/low_footprint.cmake <repository root>
+#
+#or build.sh --low-footprint. Only remote_monitoring is built, with the MQTT transport
+#alone: no AMQP, uAMQP, HTTP or WebSocket stacks, no blob upload and no SDK logging.
+#Code and data sections the binary does not use are dropped at link time and the
+#binary is stripped. Check the result with "make memory_budget".
+
+set(low_footprint ON CACHE BOOL "build only remote_monitoring, optimized for size")
+set(CMAKE_BUILD_TYPE MinSizeRel CACHE STRING "")
+
+set(use_mqtt ON CACHE BOOL "")
+set(use_amqp OFF CACHE BOOL "")
+set(use_http OFF CACHE BOOL "")
+set(use_wsio OFF CACHE BOOL "")
+set(dont_use_uploadtoblob ON CACHE BOOL "")
+set(no_logging ON CACHE BOOL "")
+set(skip_samples ON CACHE BOOL "")
+set(build_benchmarks OFF CACHE BOOL "")
+
+set(CMAKE_C_FLAGS_MINSIZEREL "-Os -DNDEBUG -ffunction-sections -fdata-sections" CACHE STRING "")
+set(CMAKE_EXE_LINKER_FLAGS_MINSIZEREL "-Wl,--gc-sections -s" CACHE STRING "")
@@ -0,0 +1,59 @@
+///////////////////////////////////////////////////////////////////////////////
+//
+// alert_rules.h:
+// Threshold and rate-of-change rules evaluated on the device for every
+// sample, so breaches can be reported ahead of routine telemetry.
+//
+///////////////////////////////////////////////////////////////////////////////
+
+#ifndef __ALERT_RULES_H
+#define __ALERT_RULES_H
+
+#include <stdint.h>
+#include "telemetry_codec.h"
+
+
+typedef enum
+{
+    ALERT_RULE_ABOVE    // Value > Limit
+  , ALERT_RULE_BELOW    // Value < Limit
+  , ALERT_RULE_RATE     // |change| / second > Limit
+} ALERT_RULE_KIND;
+
+#define ALERT_RULE_MAX_SPEC_LEN (32)
+
+typedef struct
+{
+  char Spec__ca[ALERT_RULE_MAX_SPEC_LEN];
+  int Field_id__i;          // eTelemetryField_TEMPERATURE or _HUMIDITY
+  ALERT_RULE_KIND Kind__e;
+  double Limit__d;
+
+  // Evaluation state.
+  int Active__i;
+  int Has_previous__i;
+  double Previous_value__d;
+  uint64_t Previous_time_us__u64;
+} alert_rule_t;
+
+///////////////////////////////////////////////////////////////////////////////
+// Param: Spec__cp  <field><op><limit>, where field is a name from the
+//                  telemetry field dictionary and op is '>' (above), '<'
+//                  (below) or '~' (maximum change per second).
+//                  For example "Temperature>30" or "Humidity~2.5".
+// Return: 0 and initializes *Rule__p if the spec is valid, otherwise 1.
+int alert_rule_parse(const char * Spec__cp, alert_rule_t * Rule__p);
+
+///////////////////////////////////////////////////////////////////////////////
+// Evaluates the rule against one sample. A rule fires once when the value
+// enters the breached state and re-arms when it leaves it, so a sustained
+// breach does not flood the alert lane.
+// Param: Time_us__u64  Monotonic acquisition time of the sample.
+// Param: Value__dp  Receives the value the rule looked at (the rate for
+//                   ALERT_RULE_RATE). May be NULL.
+// Return: 1 if the rule fired for this sample, otherwise 0.
+int alert_rule_evaluate(alert_rule_t * Rule__p,
+  const telemetry_sample_t * Sample__p, uint64_t Time_us__u64,
+  double * Value__dp);
+
+#endif//__ALERT_RULES_H
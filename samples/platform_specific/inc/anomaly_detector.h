@@ -0,0 +1,55 @@
+///////////////////////////////////////////////////////////////////////////////
+//
+// anomaly_detector.h:
+// Streaming detector of readings that deviate from the recent behaviour of
+// a quantity. It keeps an exponentially weighted moving average (EWMA) of
+// the value and of its variance, and flags a value whose z-score, its
+// distance from the average in standard deviations, exceeds a threshold.
+// Unlike alert_rules it needs no limit chosen in advance: the baseline
+// follows slow drift, such as the daily temperature cycle, while a fast
+// change stands out. Constant time and memory per value.
+//
+///////////////////////////////////////////////////////////////////////////////
+
+#ifndef __ANOMALY_DETECTOR_H
+#define __ANOMALY_DETECTOR_H
+
+#include <stdint.h>
+
+
+typedef struct
+{
+  // Weight of a new value in the averages, 0 < Alpha__d <= 1; about the
+  // sample period divided by the time constant of the baseline.
+  double Alpha__d;
+  double Threshold__d;
+  // Values taken in before one can be flagged.
+  uint32_t Warmup__u32;
+  // Lower bound of the standard deviation, in the unit of the value, so
+  // that a value steadier than the sensor resolution does not make a
+  // single step of it an anomaly.
+  double Min_stddev__d;
+
+  // State.
+  uint32_t Count__u32;
+  double Mean__d;
+  double Variance__d;
+} anomaly_detector_t;
+
+///////////////////////////////////////////////////////////////////////////////
+// Return: 0 and initializes *Detector__p if the settings are valid,
+//         otherwise 1.
+int anomaly_detector_init(anomaly_detector_t * Detector__p, double Alpha__d,
+  double Threshold__d, uint32_t Warmup__u32, double Min_stddev__d);
+
+///////////////////////////////////////////////////////////////////////////////
+// Scores a value against the baseline so far, then takes it into the
+// baseline, so a lasting step is learned and stops being flagged after a
+// few time constants.
+// Param: Z_score__dp  Receives the z-score of the value, signed, 0 during
+//                     the warmup. May be NULL.
+// Return: 1 if the value is an anomaly, otherwise 0.
+int anomaly_detector_update(anomaly_detector_t * Detector__p,
+  double Value__d, double * Z_score__dp);
+
+#endif//__ANOMALY_DETECTOR_H
@@ -9,6 +9,14 @@
 #ifndef __BME280_H
 #define __BME280_H
 
+#include <stdint.h>
+#include "sensor_correction.h"
+
+// Length of the PRESDATA..HUM burst holding one raw sample.
+#define BME280_FRAME_LEN (8)
+// Length of the calibration registers: 0x88 ~ 0x9F, 0xA1 and 0xE1 ~ 0xE7.
+#define BME280_CALIB_LEN (32)
+
 
 ///////////////////////////////////////////////////////////////////////////////
 // Call this after setting the chip select (or SPI Enable) pin (via
@@ -44,5 +52,132 @@ int bme280_init(int Chip_enable_to_use__i);
 int bme280_read_sensors(float * Temp_C__fp, float * Pres_Pa__fp,
   float * Hum_pct__fp);
 
+///////////////////////////////////////////////////////////////////////////////
+// The raw half of bme280_read_sensors: waits for the sensor to finish a
+// conversion and reads the BME280_FRAME_LEN byte PRESDATA..HUM burst.
+// Pass the frame to bme280_compensate_frame to get the readings.
+// Return: 1 if the frame was read, 0 otherwise.
+int bme280_read_frame(uint8_t * Frame__u8p);
+
+///////////////////////////////////////////////////////////////////////////////
+// Copies the BME280_CALIB_LEN calibration bytes read by bme280_init, in
+// register order, so that raw frames can be compensated later elsewhere.
+void bme280_get_calibration(uint8_t * Calib__u8p);
+
+///////////////////////////////////////////////////////////////////////////////
+// Same signature as wiringPiSPIDataRW, which is used by default. Lets another
+// SPI backend, or a simulated sensor, stand in for the bus. Call before
+// bme280_init.
+typedef int (*bme280_spi_xfer_fn)(int Channel__i, unsigned char * Data__u8p,
+  int Len__i);
+void bme280_set_spi_xfer(bme280_spi_xfer_fn Xfer__fp);
+
+///////////////////////////////////////////////////////////////////////////////
+// Optional backend for reads the driver issues together: the chip ID and
+// calibration blocks in bme280_init, the status and data burst in
+// bme280_read_frame. Each segment is a separate transfer, with chip select
+// released in between, but all of them go out in one call (one
+// SPI_IOC_MESSAGE ioctl with the spidev backend). Without one, the driver
+// makes one bme280_spi_xfer_fn call per segment. bme280_set_spi_xfer
+// removes it, so set it after the single transfer backend.
+// Return of the backend: the number of bytes transferred over all segments,
+// or < 0 on error.
+typedef struct
+{
+  unsigned char * Data__u8p;
+  int Len__i;
+} bme280_spi_segment_t;
+typedef int (*bme280_spi_xfer_batch_fn)(int Channel__i,
+  bme280_spi_segment_t * Segments__p, int Num_segments__i);
+void bme280_set_spi_xfer_batch(bme280_spi_xfer_batch_fn Xfer_batch__fp);
+
+///////////////////////////////////////////////////////////////////////////////
+// Calls into the SPI backend (each one a system call on hardware), the
+// transfers and bytes they carried and the time spent in them, since the
+// start or the last bme280_reset_bus_stats. Safe while another thread reads
+// the sensor; each counter is read whole, though not all four at one instant.
+typedef struct
+{
+  uint64_t Calls__u64;
+  uint64_t Transfers__u64;
+  uint64_t Bytes__u64;
+  uint64_t Time_ns__u64;
+} bme280_bus_stats_t;
+void bme280_get_bus_stats(bme280_bus_stats_t * Stats__p);
+void bme280_reset_bus_stats(void);
+
+///////////////////////////////////////////////////////////////////////////////
+// Measurement settings. The sensor converts continuously and a read gets
+// the last complete conversion, so the profile bounds how often a read can
+// see a new value.
+typedef enum
+{
+    // What bme280_init sets: pressure oversampled 16 times for low noise,
+    // about 40 ms per conversion.
+    BME280_PROFILE_DEFAULT
+    // Pressure oversampled twice, about 8 ms per conversion, for sampling
+    // at up to 100 Hz with about 3 times the pressure noise.
+  , BME280_PROFILE_FAST
+} bme280_profile_t;
+
+///////////////////////////////////////////////////////////////////////////////
+// Switches the measurement settings; the next conversion uses them.
+// Return: 0 on success, 1 if the control register could not be written.
+int bme280_set_profile(bme280_profile_t Profile__e);
+
+///////////////////////////////////////////////////////////////////////////////
+// The compensation formulas of the BME280 datasheet, on raw ADC values.
+// bme280_compensate_T_int32 returns 0.01 DegC and sets the global t_fine
+// that the other two use, so call it first.
+// bme280_compensate_P_int64 returns Pa in Q24.8, bme280_compensate_H_int32
+// %RH in Q22.10.
+int32_t bme280_compensate_T_int32(int32_t adc_T);
+uint32_t bme280_compensate_P_int64(int32_t adc_P);
+uint32_t bme280_compensate_H_int32(int32_t adc_H);
+
+///////////////////////////////////////////////////////////////////////////////
+// Decodes a raw BME280_FRAME_LEN byte burst and compensates it with the
+// calibration read by bme280_init, then applies the corrections of
+// bme280_set_correction. Unlike the bme280_compensate_* functions it does
+// not touch the global t_fine, so it can be called from several threads at
+// once.
+void bme280_compensate_frame(const uint8_t * Frame__u8p, float * Temp_C__fp,
+  float * Pres_Pa__fp, float * Hum_pct__fp);
+
+///////////////////////////////////////////////////////////////////////////////
+// bme280_compensate_frame without the corrections, in the units of the
+// bme280_compensate_* functions: 0.01 DegC, Pa in Q24.8 and %RH in Q22.10.
+void bme280_decode_frame(const uint8_t * Frame__u8p, int32_t * Temp_cC__i32p,
+  uint32_t * Pres_q24_8__u32p, uint32_t * Hum_q22_10__u32p);
+
+///////////////////////////////////////////////////////////////////////////////
+// Corrections of this particular sensor, applied by bme280_compensate_frame
+// in the fixed point units of bme280_decode_frame. Pressure and humidity are
+// kept within 0 and 100 %RH afterwards.
+typedef struct
+{
+  sensor_correction_t Temperature__s;
+  sensor_correction_t Pressure__s;
+  sensor_correction_t Humidity__s;
+} bme280_correction_t;
+
+///////////////////////////////////////////////////////////////////////////////
+// Param: Spec__cp  "Temperature=SPEC;Pressure=SPEC;Humidity=SPEC" with the
+//                  SPEC of sensor_correction_parse in C, Pa and %RH, in any
+//                  order. Quantities left out are not corrected, so ""
+//                  clears all corrections.
+//                  For example "Temperature=-1.5;Humidity=20:22.5,80:78".
+// Return: 0 and sets *Correction__p if the spec is valid, otherwise 1.
+int bme280_correction_parse(const char * Spec__cp,
+  bme280_correction_t * Correction__p);
+
+///////////////////////////////////////////////////////////////////////////////
+// Replaces the corrections. Safe while other threads compensate frames:
+// each frame gets either the old or the new corrections in full. A thread
+// compensating while an update is in progress never waits for it, and may
+// use the old corrections for a frame or two after it.
+// Return: 0 on success, 1 if out of memory (on the first call only).
+int bme280_set_correction(const bme280_correction_t * Correction__p);
+
 #endif//__BME280_H
 
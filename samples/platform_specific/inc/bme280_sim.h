@@ -0,0 +1,36 @@
+///////////////////////////////////////////////////////////////////////////////
+//
+// bme280_sim.h:
+// A simulated BME280 that answers register reads over the bme280 SPI hook,
+// so the driver, decoding and compensation run unchanged without hardware.
+//
+///////////////////////////////////////////////////////////////////////////////
+
+#ifndef __BME280_SIM_H
+#define __BME280_SIM_H
+
+#include <stdint.h>
+
+
+///////////////////////////////////////////////////////////////////////////////
+// Routes the bme280 driver to the simulated chip. Call before bme280_init,
+// which then reads the simulated chip ID and calibration. Afterwards
+// bme280_read_sensors returns bme280_sim_readings for Seed 0 at the current
+// time.
+void bme280_sim_install(void);
+
+///////////////////////////////////////////////////////////////////////////////
+// Smooth, slowly drifting readings with a little noise, distinct for every
+// Seed__u32 so a fleet of virtual devices does not report identical values.
+// Param: Time_s__d  Seconds since any fixed origin.
+void bme280_sim_readings(uint32_t Seed__u32, double Time_s__d,
+  double * Temp_C__dp, double * Pres_Pa__dp, double * Hum_pct__dp);
+
+///////////////////////////////////////////////////////////////////////////////
+// Builds the raw BME280_FRAME_LEN byte burst that decodes (through
+// bme280_compensate_frame) to the closest representable readings.
+// Prerequisite: bme280_init has loaded the simulated calibration.
+void bme280_sim_encode_frame(double Temp_C__d, double Pres_Pa__d,
+  double Hum_pct__d, uint8_t * Frame__u8p);
+
+#endif//__BME280_SIM_H
@@ -0,0 +1,35 @@
+///////////////////////////////////////////////////////////////////////////////
+//
+// bme280_spidev.h:
+// SPI backend for the bme280 driver on the Linux spidev interface, chaining
+// the reads the driver issues together into one SPI_IOC_MESSAGE ioctl.
+//
+///////////////////////////////////////////////////////////////////////////////
+
+#ifndef __BME280_SPIDEV_H
+#define __BME280_SPIDEV_H
+
+#include "bme280.h"
+
+///////////////////////////////////////////////////////////////////////////////
+// Opens /dev/spidev0.<Channel__i> in SPI mode 0 with 8 bit words and sets
+// both bme280 SPI hooks to it. Use instead of wiringPiSPISetup, before
+// bme280_init.
+// Param: Speed_hz__i  Clock of the bus, as given to wiringPiSPISetup.
+// Return: 0 on success, 1 if the device could not be opened or set up.
+int bme280_spidev_open(int Channel__i, int Speed_hz__i);
+
+///////////////////////////////////////////////////////////////////////////////
+// Closes the devices opened by bme280_spidev_open. The bme280 hooks must be
+// set to another backend before the sensor is read again.
+void bme280_spidev_close(void);
+
+///////////////////////////////////////////////////////////////////////////////
+// The backend functions, see bme280_spi_xfer_fn and bme280_spi_xfer_batch_fn
+// in bme280.h. One ioctl per call.
+int bme280_spidev_xfer(int Channel__i, unsigned char * Data__u8p, int Len__i);
+
+int bme280_spidev_xfer_batch(int Channel__i,
+  bme280_spi_segment_t * Segments__p, int Num_segments__i);
+
+#endif//__BME280_SPIDEV_H
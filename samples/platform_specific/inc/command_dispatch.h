@@ -0,0 +1,99 @@
+///////////////////////////////////////////////////////////////////////////////
+//
+// command_dispatch.h:
+// Cloud-to-device commands in the serializer's format,
+// {"Name":"SetAirResistance","Parameters":{"Position":5}}, dispatched to
+// handlers without copying or allocating: the message is parsed where the
+// IoT Hub client keeps it, which needs no terminating zero, and the name is
+// resolved through a perfect hash built once for the table. A message may
+// also hold an array of such commands, run in order.
+//
+///////////////////////////////////////////////////////////////////////////////
+
+#ifndef __COMMAND_DISPATCH_H
+#define __COMMAND_DISPATCH_H
+
+#include <stddef.h>
+
+
+// Parameters of one command beyond this make the message invalid.
+#define COMMAND_MAX_PARAMS (8)
+
+// Same meaning as EXECUTE_COMMAND_RESULT of the serializer: a failed command
+// is rejected, one that hit an error is abandoned so the hub redelivers it.
+typedef enum
+{
+    COMMAND_SUCCESS
+  , COMMAND_FAILED
+  , COMMAND_ERROR
+} COMMAND_RESULT;
+
+// Spans into the message, not zero terminated. A value is its raw JSON
+// text, with the quotes of a string.
+typedef struct
+{
+  const char * Name__cp;
+  size_t Name_len__z;
+  const char * Value__cp;
+  size_t Value_len__z;
+} command_param_t;
+
+typedef struct
+{
+  command_param_t Params__a[COMMAND_MAX_PARAMS];
+  size_t Count__z;
+} command_args_t;
+
+typedef COMMAND_RESULT (*command_handler_fn)(void * Context__p,
+  const command_args_t * Args__p);
+
+typedef struct
+{
+  const char * Name__cp;
+  command_handler_fn Handler__fp;
+} command_entry_t;
+
+typedef struct command_table_tag command_table_t;
+
+///////////////////////////////////////////////////////////////////////////////
+// Searches a seed under which every name hashes to a slot of its own.
+// Param: Entries__p  Kept by the table, so it must outlive it; usually a
+//                    static array.
+// Return: NULL if out of memory or names repeat.
+command_table_t * command_table_create(const command_entry_t * Entries__p,
+  size_t Count__z);
+
+void command_table_destroy(command_table_t * Table__p);
+
+///////////////////////////////////////////////////////////////////////////////
+// Return: the entry of the name, or NULL.
+const command_entry_t * command_table_find(const command_table_t * Table__p,
+  const char * Name__cp, size_t Name_len__z);
+
+///////////////////////////////////////////////////////////////////////////////
+// Checks the whole message first, so that a malformed batch or one naming
+// an unknown command runs nothing and is COMMAND_FAILED. Otherwise every
+// command runs, in order, and the worst of their results is returned.
+// Param: Executed__zp  Receives the number of commands run. May be NULL.
+COMMAND_RESULT command_dispatch(const command_table_t * Table__p,
+  const char * Message__cp, size_t Len__z, void * Context__p,
+  size_t * Executed__zp);
+
+///////////////////////////////////////////////////////////////////////////////
+// Return: the parameter of that name, or NULL.
+const command_param_t * command_arg_find(const command_args_t * Args__p,
+  const char * Name__cp);
+
+///////////////////////////////////////////////////////////////////////////////
+// Return: 0 and sets *Value__ip if the parameter is a JSON integer that fits
+//         an int, otherwise 1.
+int command_arg_int(const command_args_t * Args__p, const char * Name__cp,
+  int * Value__ip);
+
+///////////////////////////////////////////////////////////////////////////////
+// Return: 0 and sets *Value__dp if the parameter is a JSON number,
+//         otherwise 1.
+int command_arg_double(const command_args_t * Args__p, const char * Name__cp,
+  double * Value__dp);
+
+#endif//__COMMAND_DISPATCH_H
@@ -0,0 +1,64 @@
+///////////////////////////////////////////////////////////////////////////////
+//
+// device_state.h:
+// A snapshot of state that callbacks on other threads (twin desired
+// properties, direct methods, a firmware update) change and the sampling
+// loop reads on every sample. The state is a plain struct of the caller,
+// copied in and out under a sequence lock: readers never take a lock or
+// make a system call, and retry if an update ran while they copied. A
+// reader that must not wait at all uses device_state_try_read.
+// Updates are serialized among themselves by the same sequence, so any
+// number of threads may update. Keep the state small; it is copied whole.
+//
+///////////////////////////////////////////////////////////////////////////////
+
+#ifndef __DEVICE_STATE_H
+#define __DEVICE_STATE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+
+typedef struct device_state_tag device_state_t;
+
+///////////////////////////////////////////////////////////////////////////////
+// Changes the state in place. Runs with other updates held off, so it must
+// not block or update the same state.
+// Param: State__p  The state, as long as it was created with.
+// Return: anything; passed on by device_state_update.
+typedef int (*device_state_update_fn)(void * State__p, void * Context__p);
+
+///////////////////////////////////////////////////////////////////////////////
+// Return: a state holding a copy of Initial__p, or NULL if out of memory.
+device_state_t * device_state_create(const void * Initial__p, size_t Len__z);
+void device_state_destroy(device_state_t * State__p);
+
+///////////////////////////////////////////////////////////////////////////////
+// Copies the state, as it was between two updates, to Copy__p.
+// Return: the version of the copy; see device_state_version.
+uint32_t device_state_read(const device_state_t * State__p, void * Copy__p);
+
+///////////////////////////////////////////////////////////////////////////////
+// Like device_state_read, but gives up instead of waiting for an update in
+// progress. For a real-time thread, which may have preempted the updater on
+// its core and would spin until its time slice ends.
+// Param: Attempts__u32  Copies tried before giving up, at least 1.
+//        Version__u32p  Receives the version of the copy; see
+//                       device_state_version.
+// Return: 0 with the copy in Copy__p, or 1 if an update ran during every
+//         attempt; Copy__p is then garbage.
+int device_state_try_read(const device_state_t * State__p, void * Copy__p,
+  uint32_t Attempts__u32, uint32_t * Version__u32p);
+
+///////////////////////////////////////////////////////////////////////////////
+// Applies Update__fp to the state and publishes the result.
+// Return: what Update__fp returned.
+int device_state_update(device_state_t * State__p,
+  device_state_update_fn Update__fp, void * Context__p);
+
+///////////////////////////////////////////////////////////////////////////////
+// Return: the number of updates so far, to tell cheaply whether a copy is
+//         still current.
+uint32_t device_state_version(const device_state_t * State__p);
+
+#endif//__DEVICE_STATE_H
@@ -0,0 +1,63 @@
+///////////////////////////////////////////////////////////////////////////////
+//
+// device_utils.h:
+// Text helpers of the samples: device twin and direct method payloads of
+// remote_monitoring, kept in the platform library so they can be
+// benchmarked, and the strings, files and numbers of the command lines.
+//
+///////////////////////////////////////////////////////////////////////////////
+
+#ifndef __DEVICE_UTILS_H
+#define __DEVICE_UTILS_H
+
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <time.h>
+
+
+///////////////////////////////////////////////////////////////////////////////
+// Parses the first run of decimal digits in the size bytes at text, which
+// need not be zero terminated.
+// Return: false if there are no digits.
+bool GetNumberFromString(const unsigned char* text, size_t size, int* pValue);
+
+// "YYYY-MM-DD hh:mm:ss" and the terminating zero.
+#define FORMAT_TIME_LEN (20)
+
+///////////////////////////////////////////////////////////////////////////////
+// Formats a time as "YYYY-MM-DD hh:mm:ss" UTC into buffer, which should
+// hold FORMAT_TIME_LEN bytes. Thread safe.
+// Return: buffer, empty if it is too small or the time is out of range.
+char* FormatTime_r(const time_t* time, char* buffer, size_t size);
+
+///////////////////////////////////////////////////////////////////////////////
+// Formats a time as "YYYY-MM-DD hh:mm:ss" UTC.
+// Return: a static buffer that is overwritten by the next call. Not thread
+//         safe; prefer FormatTime_r.
+char* FormatTime(time_t* time);
+
+///////////////////////////////////////////////////////////////////////////////
+// vsprintf into a buffer allocated to fit. The caller frees *buffer; *size is
+// the length without the terminating zero.
+void AllocAndVPrintf(unsigned char** buffer, size_t* size, const char* format,
+  va_list argptr);
+
+///////////////////////////////////////////////////////////////////////////////
+// Return: a zero terminated copy of the length bytes at text, which the
+//         caller frees, or NULL if out of memory.
+char* CopyString(const char* text, size_t length);
+
+///////////////////////////////////////////////////////////////////////////////
+// Reads a whole text file, such as the PEM certificates of a local broker.
+// Return: the zero terminated contents, which the caller frees, or NULL if
+//         the file cannot be read; a message says why it cannot be opened.
+char* ReadTextFile(const char* path);
+
+///////////////////////////////////////////////////////////////////////////////
+// Parses a command line value that must be a decimal number in the range of
+// unsigned int, and nothing else.
+// Return: 0 and sets *value on success, otherwise 1 after a message.
+int ParseUnsigned(const char* text, unsigned int* value);
+
+#endif//__DEVICE_UTILS_H
@@ -0,0 +1,82 @@
+///////////////////////////////////////////////////////////////////////////////
+//
+// event_trace.h:
+// A fixed-size ring of timestamped pipeline events (a sensor read, a
+// message handed to the IoT Hub client, a twin callback, ...) from any
+// thread, written out on demand in the Chrome trace event format. Load the
+// file in chrome://tracing or https://ui.perfetto.dev to see where a single
+// slow sample spent its time, which the latency histograms cannot tell.
+//
+// Recording takes no lock and no system call: a thread claims the next
+// slot with an atomic increment and fills it under a per-slot sequence, so
+// a dump running at the same time skips a slot being overwritten instead
+// of reading it torn. The ring keeps the latest events; older ones are
+// overwritten. Until event_trace_start, recording only tests a pointer.
+//
+///////////////////////////////////////////////////////////////////////////////
+
+#ifndef __EVENT_TRACE_H
+#define __EVENT_TRACE_H
+
+#include <stdint.h>
+
+
+typedef enum
+{
+    // Nested spans of one thread.
+    EVENT_TRACE_BEGIN
+  , EVENT_TRACE_END
+  , EVENT_TRACE_INSTANT
+    // Spans that may end on another thread, such as a message from its
+    // hand-off to its confirmation, matched by name and Arg__u64.
+  , EVENT_TRACE_ASYNC_BEGIN
+  , EVENT_TRACE_ASYNC_END
+} event_trace_phase_t;
+
+typedef struct
+{
+  uint64_t Recorded__u64;
+  // Events overwritten before they were written out.
+  uint64_t Overwritten__u64;
+  uint32_t Capacity__u32;
+} event_trace_stats_t;
+
+///////////////////////////////////////////////////////////////////////////////
+// Allocates the ring and starts recording.
+// Param: Events__u32  Events kept, rounded up to a power of two.
+// Return: 0 on success, 1 if already started, out of memory or
+//         Events__u32 is 0 or above 2^30.
+int event_trace_start(uint32_t Events__u32);
+
+///////////////////////////////////////////////////////////////////////////////
+// Stops recording and frees the ring. Only call it once no other thread
+// can record any more, for example at exit.
+void event_trace_stop(void);
+
+///////////////////////////////////////////////////////////////////////////////
+// Records an event of the calling thread; does nothing unless started.
+// Param: Name__cp  A string literal or other string that lives as long as
+//                  the process, without characters JSON has to escape; only
+//                  the pointer is kept.
+// Param: Arg__u64  The id matching an asynchronous begin and end, otherwise
+//                  a value shown with the event, 0 for none.
+void event_trace_record(event_trace_phase_t Phase__e, const char * Name__cp,
+  uint64_t Arg__u64);
+
+///////////////////////////////////////////////////////////////////////////////
+// Names the calling thread in the trace, for up to 16 threads. Name__cp is
+// kept like the name of an event. Works before event_trace_start as well.
+void event_trace_name_thread(const char * Name__cp);
+
+///////////////////////////////////////////////////////////////////////////////
+// Writes the events in the ring, oldest first, as Chrome trace event JSON
+// with timestamps in CLOCK_MONOTONIC microseconds (latency_clock_us). The
+// file is written next to Path__cp and renamed over it when complete.
+// Recording continues meanwhile. Thread safe.
+// Param: Events__u32p  Optional. Set to the number of events written.
+// Return: 0 on success, 1 if not started or the file cannot be written.
+int event_trace_write_json(const char * Path__cp, uint32_t * Events__u32p);
+
+void event_trace_get_stats(event_trace_stats_t * Stats__p);
+
+#endif//__EVENT_TRACE_H
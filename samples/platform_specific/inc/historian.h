@@ -0,0 +1,112 @@
+///////////////////////////////////////////////////////////////////////////////
+//
+// historian.h:
+// On-device history of the sensor readings in three tiers: every sample,
+// one minute and one hour roll-ups (mean, min and max), each kept in a
+// fixed size ring file so the device holds weeks of data in bounded space.
+//
+// Each tier file is a ring of HISTORIAN_BLOCK_LEN byte blocks. A block holds
+// the points of one time span column by column: timestamps as delta of
+// delta varints, values as the XOR with the previous value of the same
+// column, with only the non-zero bytes stored. A block is written once it
+// is full, with one aligned write, so an SD card sees one page program per
+// block instead of one per sample. Points of the block being filled only
+// reach the card on historian_flush and historian_close.
+//
+///////////////////////////////////////////////////////////////////////////////
+
+#ifndef __HISTORIAN_H
+#define __HISTORIAN_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+
+#define HISTORIAN_BLOCK_LEN (4096)
+
+// Temperature (C), humidity (%) and pressure (Pa), in this order.
+#define HISTORIAN_MEASUREMENTS (3)
+
+typedef enum
+{
+    HISTORIAN_TIER_RAW
+  , HISTORIAN_TIER_MINUTE
+  , HISTORIAN_TIER_HOUR
+
+  , HISTORIAN_TIER_COUNT
+} HISTORIAN_TIER;
+
+typedef struct historian_tag historian_t;
+
+///////////////////////////////////////////////////////////////////////////////
+// One point of a tier. Roll-up points are stamped with the start of their
+// minute or hour; the hour mean is the mean of the minute means. Raw points
+// have Min and Max equal to Mean.
+typedef struct
+{
+  uint64_t Time_us__u64;
+  float Mean__fa[HISTORIAN_MEASUREMENTS];
+  float Min__fa[HISTORIAN_MEASUREMENTS];
+  float Max__fa[HISTORIAN_MEASUREMENTS];
+} historian_point_t;
+
+typedef void (*historian_point_fn)(void * Context__p,
+  const historian_point_t * Point__p);
+
+///////////////////////////////////////////////////////////////////////////////
+// Opens the tier files raw.hist, 1min.hist and 1h.hist in Dir__cp, creating
+// missing ones. Existing files keep the capacity they were created with.
+// The last block of every tier and the running roll-ups are restored, so
+// adding continues where the previous run stopped.
+// Param: Capacity_blocks__u32a  Blocks per tier for new files, or NULL for
+//                               4096/512/64 blocks (16 MB, 2 MB, 256 KB):
+//                               about two weeks of samples every second,
+//                               six weeks of minutes and half a year of
+//                               hours.
+// Param: Read_only__i  Non-zero to only query, for example next to a running
+//                      sampler. Only flushed points are seen then.
+// Return: NULL if a file could not be opened or created.
+historian_t * historian_open(const char * Dir__cp,
+  const uint32_t * Capacity_blocks__u32a, int Read_only__i);
+
+///////////////////////////////////////////////////////////////////////////////
+// Flushes (unless read-only) and frees the historian.
+void historian_close(historian_t * Historian__p);
+
+///////////////////////////////////////////////////////////////////////////////
+// Adds one sample and updates the roll-ups. Completed minutes and hours are
+// added to their tiers when the first sample of the next one arrives.
+// Param: Values__fap  HISTORIAN_MEASUREMENTS values.
+// Return: 0 on success, 1 if the historian is read-only, the time is not
+//         after the previous sample or a block could not be written.
+int historian_add(historian_t * Historian__p, uint64_t Time_us__u64,
+  const float * Values__fap);
+
+///////////////////////////////////////////////////////////////////////////////
+// Writes the partly filled block of every tier and waits for the card.
+// The same blocks are written again once full, so call this on shutdown
+// rather than after every sample.
+// Return: 0 on success, 1 otherwise.
+int historian_flush(historian_t * Historian__p);
+
+///////////////////////////////////////////////////////////////////////////////
+// Calls Point__fp for every point of the tier with From_us__u64 <= time <=
+// To_us__u64, oldest first. Only the blocks overlapping the range are read
+// and decoded, found from an index of the block headers kept in memory.
+// Return: the number of points passed to Point__fp.
+size_t historian_query(historian_t * Historian__p, HISTORIAN_TIER Tier__e,
+  uint64_t From_us__u64, uint64_t To_us__u64,
+  historian_point_fn Point__fp, void * Context__p);
+
+///////////////////////////////////////////////////////////////////////////////
+// Return: the finest tier with at most Max_points__z points in the range,
+//         as estimated from the block index, or HISTORIAN_TIER_HOUR.
+HISTORIAN_TIER historian_pick_tier(const historian_t * Historian__p,
+  uint64_t From_us__u64, uint64_t To_us__u64, size_t Max_points__z);
+
+///////////////////////////////////////////////////////////////////////////////
+// Param: Name__cp  "raw", "1min" or "1h".
+// Return: 0 and sets *Tier__ep if the name is known, otherwise 1.
+int historian_tier_from_string(const char * Name__cp, HISTORIAN_TIER * Tier__ep);
+
+#endif//__HISTORIAN_H
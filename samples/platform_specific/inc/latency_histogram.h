@@ -0,0 +1,51 @@
+///////////////////////////////////////////////////////////////////////////////
+//
+// latency_histogram.h:
+// Fixed size, allocation free histogram of latencies with about 12%
+// resolution, for p50/p99 reporting on the device.
+//
+///////////////////////////////////////////////////////////////////////////////
+
+#ifndef __LATENCY_HISTOGRAM_H
+#define __LATENCY_HISTOGRAM_H
+
+#include <stdint.h>
+
+
+// 8 linear sub-buckets for each power of two up to 2^63.
+#define LATENCY_HISTOGRAM_SUB_BUCKETS (8)
+#define LATENCY_HISTOGRAM_BUCKETS (62 * LATENCY_HISTOGRAM_SUB_BUCKETS)
+
+typedef struct
+{
+  uint32_t Counts__u32a[LATENCY_HISTOGRAM_BUCKETS];
+  uint64_t Count__u64;
+  uint64_t Sum__u64;
+  uint64_t Min__u64;
+  uint64_t Max__u64;
+} latency_histogram_t;
+
+///////////////////////////////////////////////////////////////////////////////
+// Return: a monotonic time in microseconds, for timing latencies.
+uint64_t latency_clock_us(void);
+
+void latency_histogram_reset(latency_histogram_t * Histogram__p);
+
+///////////////////////////////////////////////////////////////////////////////
+// Not thread safe; callers recording from several threads must serialize.
+void latency_histogram_record(latency_histogram_t * Histogram__p,
+  uint64_t Value__u64);
+
+///////////////////////////////////////////////////////////////////////////////
+// Adds the counts of Other__p into Histogram__p.
+void latency_histogram_merge(latency_histogram_t * Histogram__p,
+  const latency_histogram_t * Other__p);
+
+///////////////////////////////////////////////////////////////////////////////
+// Param: Percentile__d  0.0 ~ 100.0
+// Return: the middle of the bucket holding the requested percentile, or 0 if
+//         nothing was recorded.
+uint64_t latency_histogram_percentile(const latency_histogram_t * Histogram__p,
+  double Percentile__d);
+
+#endif//__LATENCY_HISTOGRAM_H
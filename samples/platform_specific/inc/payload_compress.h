@@ -0,0 +1,60 @@
+///////////////////////////////////////////////////////////////////////////////
+//
+// payload_compress.h:
+// Deflate (RFC 1950 zlib format) compression of outgoing message bodies with
+// a fixed, small working set so it can run next to the IoT client on a Pi.
+//
+///////////////////////////////////////////////////////////////////////////////
+
+#ifndef __PAYLOAD_COMPRESS_H
+#define __PAYLOAD_COMPRESS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+
+typedef enum
+{
+    PAYLOAD_COMPRESSION_NONE
+  , PAYLOAD_COMPRESSION_DEFLATE
+} PAYLOAD_COMPRESSION;
+
+typedef struct payload_compressor_tag payload_compressor_t;
+
+///////////////////////////////////////////////////////////////////////////////
+// Param: Name__cp  "none" or "deflate".
+// Return: 0 and sets *Compression__ep if the name is known, otherwise 1.
+int payload_compression_from_string(const char * Name__cp,
+  PAYLOAD_COMPRESSION * Compression__ep);
+
+///////////////////////////////////////////////////////////////////////////////
+// Return: the value for the content encoding system property, or NULL for
+//         PAYLOAD_COMPRESSION_NONE.
+const char * payload_content_encoding(PAYLOAD_COMPRESSION Compression__e);
+
+///////////////////////////////////////////////////////////////////////////////
+// Allocates the compressor and its whole working set up front (a 1 KB window
+// and a small hash table, roughly 20 KB in total). The compressor is reused
+// for every message, so compressing does not allocate.
+// Param: Level__i  zlib compression level, 1 (fastest) ~ 9 (smallest).
+// Return: NULL if the compressor could not be allocated.
+payload_compressor_t * payload_compressor_create(int Level__i);
+
+void payload_compressor_destroy(payload_compressor_t * Compressor__p);
+
+///////////////////////////////////////////////////////////////////////////////
+// Return: the number of bytes held by the compressor's working set.
+size_t payload_compressor_memory(const payload_compressor_t * Compressor__p);
+
+///////////////////////////////////////////////////////////////////////////////
+// Compresses In__u8p into Out__u8p. The input is fed through the compressor
+// in fixed size chunks, so the working set does not grow with the payload.
+// Pass an Out_size__z smaller than In_len__z to only accept results that
+// actually save bytes.
+// Return: the compressed size, or 0 if it does not fit into Out_size__z or
+//         compression failed. Either way the original body can be sent.
+size_t payload_compress(payload_compressor_t * Compressor__p,
+  const uint8_t * In__u8p, size_t In_len__z,
+  uint8_t * Out__u8p, size_t Out_size__z);
+
+#endif//__PAYLOAD_COMPRESS_H
@@ -0,0 +1,144 @@
+///////////////////////////////////////////////////////////////////////////////
+//
+// readings_shm.h:
+// Live readings for other processes on the same board, in a POSIX shared
+// memory object. The sampling process holds the sensor (and its lock file);
+// control loops and local dashboards map the object read-only and copy the
+// latest reading of a channel, or follow the history, without a system call
+// or a copy through the kernel.
+//
+// Every record is protected by a sequence lock: the writer makes its sequence
+// odd, writes the record and makes it even again, and a reader retries if
+// the sequence was odd or changed while it copied. Writers never wait for
+// readers, and a reader that is preempted only retries.
+//
+// Object layout, native byte order (the object never leaves the board):
+//   header (64 bytes)
+//     0  "RDNGSHM1"  magic
+//     8  uint16      format version, READINGS_SHM_VERSION
+//    10  uint16      header size
+//    12  uint16      channel descriptor size
+//    14  uint16      record size
+//    16  uint32      history slots, a power of two
+//    20  uint32      channels, at most READINGS_SHM_CHANNELS
+//    24  uint32      closed: set once the writer has gone
+//    28  int32       process id of the writer
+//    32  uint64      records written so far; the next history index
+//    40  uint8[24]   reserved, zero
+//   channel descriptors (READINGS_SHM_CHANNELS of 84 bytes)
+//     0  char[16]    sensor name
+//    16  uint32      number of values
+//    20  char[4][16] value names
+//   latest record of every channel (READINGS_SHM_CHANNELS records)
+//   history (slots records), record i at slot i % slots
+//   record (48 bytes)
+//     0  uint32      sequence
+//     4  uint32      channel
+//     8  uint64      history index
+//    16  uint64      sample time, microseconds since the epoch
+//    24  uint64      sample time, CLOCK_MONOTONIC microseconds
+//    32  float[4]    values
+//
+///////////////////////////////////////////////////////////////////////////////
+
+#ifndef __READINGS_SHM_H
+#define __READINGS_SHM_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+
+#define READINGS_SHM_VERSION (1)
+#define READINGS_SHM_CHANNELS (8)
+#define READINGS_SHM_VALUES (4)
+#define READINGS_SHM_NAME_LEN (16)
+
+typedef struct readings_shm_writer_tag readings_shm_writer_t;
+typedef struct readings_shm_reader_tag readings_shm_reader_t;
+
+typedef struct
+{
+  uint32_t Channel__u32;
+  uint64_t Index__u64;
+  uint64_t Time_us__u64;
+  uint64_t Mono_us__u64;
+  float Values__fa[READINGS_SHM_VALUES];
+} readings_shm_record_t;
+
+typedef struct
+{
+  char Name__ca[READINGS_SHM_NAME_LEN];
+  uint32_t Value_count__u32;
+  char Value_names__caa[READINGS_SHM_VALUES][READINGS_SHM_NAME_LEN];
+} readings_shm_channel_t;
+
+///////////////////////////////////////////////////////////////////////////////
+// Creates the object Name__cp ("/name", see shm_open), readable by every
+// user, replacing one left by an earlier writer. Readers of that one see it
+// as closed.
+// Param: Slots__u32  History records; rounded up to a power of two.
+// Return: NULL if the object could not be created and mapped.
+readings_shm_writer_t * readings_shm_create(const char * Name__cp,
+  uint32_t Slots__u32);
+
+///////////////////////////////////////////////////////////////////////////////
+// Describes the next channel. Names are cut to READINGS_SHM_NAME_LEN - 1
+// characters and values past READINGS_SHM_VALUES are left out.
+// Return: the channel number, or -1 if all READINGS_SHM_CHANNELS are taken.
+int readings_shm_add_channel(readings_shm_writer_t * Writer__p,
+  const char * Name__cp, size_t Value_count__z,
+  const char * const * Value_names__cpp);
+
+///////////////////////////////////////////////////////////////////////////////
+// Makes a reading the latest of its channel and appends it to the history.
+// A channel must only be published from one thread at a time; different
+// channels may be published from different threads.
+// Param: Values__fp  The values of the channel, as many as it was added with.
+void readings_shm_publish(readings_shm_writer_t * Writer__p, int Channel__i,
+  uint64_t Time_us__u64, uint64_t Mono_us__u64, const float * Values__fp);
+
+///////////////////////////////////////////////////////////////////////////////
+// Marks the object closed, removes its name and unmaps it.
+void readings_shm_destroy(readings_shm_writer_t * Writer__p);
+
+///////////////////////////////////////////////////////////////////////////////
+// Maps the object Name__cp read-only.
+// Return: NULL if it does not exist, cannot be read or has another layout.
+readings_shm_reader_t * readings_shm_open(const char * Name__cp);
+
+void readings_shm_close(readings_shm_reader_t * Reader__p);
+
+///////////////////////////////////////////////////////////////////////////////
+// Return: 1 if the writer has closed the object or replaced it with a new
+//         one, after which the reader should be closed and opened again;
+//         0 while it is live.
+int readings_shm_stale(const readings_shm_reader_t * Reader__p);
+
+///////////////////////////////////////////////////////////////////////////////
+// Return: the number of channels the writer has added so far.
+size_t readings_shm_channel_count(const readings_shm_reader_t * Reader__p);
+
+///////////////////////////////////////////////////////////////////////////////
+// Return: 0 and fills *Channel__p, or 1 if there is no such channel.
+int readings_shm_channel(const readings_shm_reader_t * Reader__p,
+  int Channel__i, readings_shm_channel_t * Channel__p);
+
+///////////////////////////////////////////////////////////////////////////////
+// Copies the latest reading of a channel.
+// Return: 0 on success, 1 if the channel has no reading yet.
+int readings_shm_latest(const readings_shm_reader_t * Reader__p,
+  int Channel__i, readings_shm_record_t * Record__p);
+
+///////////////////////////////////////////////////////////////////////////////
+// Copies the readings of all channels from history index *Next__u64p on, at
+// most Max__z, and moves *Next__u64p past them. Start with the index of the
+// latest reading of a channel, or 0 for all of the history still kept. A
+// reader that fell more than the history behind continues with the oldest
+// record still kept.
+// Param: Lost__u64p  Optional; set to the records skipped that way.
+// Return: the number of records copied.
+size_t readings_shm_read(const readings_shm_reader_t * Reader__p,
+  uint64_t * Next__u64p, readings_shm_record_t * Records__p, size_t Max__z,
+  uint64_t * Lost__u64p);
+
+#endif//__READINGS_SHM_H
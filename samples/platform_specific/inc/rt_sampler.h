@@ -0,0 +1,93 @@
+///////////////////////////////////////////////////////////////////////////////
+//
+// rt_sampler.h:
+// Periodic sampling thread for consistent sample times on a loaded Pi. The
+// thread wakes on absolute deadlines of CLOCK_MONOTONIC, optionally pinned
+// to one core and run under SCHED_FIFO with the process memory locked, and
+// hands the samples to the consumer through a lock-free single producer,
+// single consumer ring, so it never waits for the (lower priority)
+// consumer. The time from each deadline to the wake-up is kept in a
+// latency histogram.
+//
+///////////////////////////////////////////////////////////////////////////////
+
+#ifndef __RT_SAMPLER_H
+#define __RT_SAMPLER_H
+
+#include <stdint.h>
+#include "latency_histogram.h"
+
+
+// Samples the ring holds; a power of two.
+#define RT_SAMPLER_RING_LEN (256)
+#define RT_SAMPLER_VALUES (3)
+#define RT_SAMPLER_FRAME_LEN (16)
+
+typedef struct rt_sampler_tag rt_sampler_t;
+
+typedef struct
+{
+  // Set by the sampler: the monotonic time (latency_clock_us) of the
+  // wake-up, and how late it was.
+  uint64_t Time_us__u64;
+  uint64_t Latency_us__u64;
+  // Set by the read function.
+  uint64_t Wall_time_us__u64;
+  float Values__fa[RT_SAMPLER_VALUES];
+  int Result__i;
+  // Raw bytes of the read, for the consumer to record, since the sampling
+  // thread should not write files.
+  uint8_t Frame__u8a[RT_SAMPLER_FRAME_LEN];
+} rt_sampler_sample_t;
+
+///////////////////////////////////////////////////////////////////////////////
+// Called on the sampling thread once per period. Must not block for long.
+typedef void (*rt_sampler_read_fn)(void * Context__p,
+  rt_sampler_sample_t * Sample__p);
+
+typedef struct
+{
+  uint32_t Period_us__u32;
+  // Core to pin the thread to, or -1 to let it run anywhere.
+  int Cpu__i;
+  // SCHED_FIFO priority (1 ~ 99), or 0 for the normal scheduler.
+  int Priority__i;
+  // Non-zero to lock all current and future memory of the process.
+  int Lock_memory__i;
+} rt_sampler_config_t;
+
+typedef struct
+{
+  latency_histogram_t Wakeup_latency_us__s;
+  uint64_t Samples__u64;
+  // Periods skipped because a read ran past the next deadline.
+  uint64_t Missed__u64;
+  // Samples lost because the consumer let the ring fill up.
+  uint64_t Dropped__u64;
+} rt_sampler_stats_t;
+
+///////////////////////////////////////////////////////////////////////////////
+// Starts the sampling thread; the first sample is taken one period later.
+// Pinning, the priority and locking memory need root or CAP_SYS_NICE and
+// CAP_IPC_LOCK.
+// Return: NULL with errno set if memory could not be locked or the thread
+//         could not be created with the requested core and priority.
+rt_sampler_t * rt_sampler_start(const rt_sampler_config_t * Config__p,
+  rt_sampler_read_fn Read__fp, void * Context__p);
+
+///////////////////////////////////////////////////////////////////////////////
+// Stops and joins the thread, which can take up to one period, and frees
+// the sampler. Memory stays locked.
+void rt_sampler_stop(rt_sampler_t * Sampler__p);
+
+///////////////////////////////////////////////////////////////////////////////
+// Takes the oldest sample out of the ring. Only one thread may consume.
+// Return: 1 if a sample was copied to *Sample__p, 0 if the ring is empty.
+int rt_sampler_pop(rt_sampler_t * Sampler__p, rt_sampler_sample_t * Sample__p);
+
+///////////////////////////////////////////////////////////////////////////////
+// Copies the statistics since the start.
+void rt_sampler_get_stats(rt_sampler_t * Sampler__p,
+  rt_sampler_stats_t * Stats__p);
+
+#endif//__RT_SAMPLER_H
@@ -0,0 +1,52 @@
+///////////////////////////////////////////////////////////////////////////////
+//
+// sensor_correction.h:
+// Calibration corrections for one measured quantity, for sensors that
+// drift or sit near a heat source. A correction is either a gain and
+// offset or a piecewise-linear table of measured to true values, and is
+// applied in the fixed point unit of the driver (0.01 C, Q24.8 Pa, ...)
+// with integer arithmetic only. Slopes are worked out when the correction
+// is parsed, so applying one takes no division and no allocation.
+//
+///////////////////////////////////////////////////////////////////////////////
+
+#ifndef __SENSOR_CORRECTION_H
+#define __SENSOR_CORRECTION_H
+
+#include <stdint.h>
+
+
+#define SENSOR_CORRECTION_MAX_POINTS (8)
+
+typedef struct
+{
+  // 0 for no correction. Point i maps In__i32a[i] to Out__i32a[i] and
+  // values from it up to the next point along Slope_q16__i32a[i]. The first
+  // and last segments extend below and above the table.
+  uint32_t Num_points__u32;
+  int32_t In__i32a[SENSOR_CORRECTION_MAX_POINTS];
+  int32_t Out__i32a[SENSOR_CORRECTION_MAX_POINTS];
+  // Q15.16
+  int32_t Slope_q16__i32a[SENSOR_CORRECTION_MAX_POINTS];
+} sensor_correction_t;
+
+///////////////////////////////////////////////////////////////////////////////
+// Param: Spec__cp  In the unit of the quantity, one of
+//                  "OFFSET"              e.g. "-1.5"
+//                  "GAIN,OFFSET"         e.g. "1.02,-0.4"
+//                  "IN:OUT,IN:OUT,..."   measured and true value pairs in
+//                                        rising order, e.g. "10:10.4,30:29.5";
+//                                        a single pair is an offset
+//                  or "" for no correction.
+// Param: Scale__i32  Fixed point units per unit of the quantity, e.g. 100
+//                    for 0.01 C.
+// Return: 0 and sets *Correction__p if the spec is valid, otherwise 1.
+int sensor_correction_parse(const char * Spec__cp, int32_t Scale__i32,
+  sensor_correction_t * Correction__p);
+
+///////////////////////////////////////////////////////////////////////////////
+// Return: Value__i32 corrected, saturated to the int32_t range.
+int32_t sensor_correction_apply(const sensor_correction_t * Correction__p,
+  int32_t Value__i32);
+
+#endif//__SENSOR_CORRECTION_H
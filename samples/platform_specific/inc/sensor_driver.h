@@ -0,0 +1,163 @@
+///////////////////////////////////////////////////////////////////////////////
+//
+// sensor_driver.h:
+// A common interface for the sensors on a board, a registry to look them up
+// by name, and a scheduler that samples any number of sensor channels, each
+// at its own period, from one thread.
+//
+// A driver has up to four steps per sample: start a conversion, wait the
+// conversion time, read the raw bytes and decode them to values. Raw bytes
+// are kept so they can be recorded; decoding does not touch the bus. A
+// channel is one sensor on one bus (chip select, thermal zone, ...) with its
+// period.
+//
+///////////////////////////////////////////////////////////////////////////////
+
+#ifndef __SENSOR_DRIVER_H
+#define __SENSOR_DRIVER_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+
+// Most values a sensor decodes from one sample, and the longest raw sample.
+#define SENSOR_MAX_VALUES (4)
+#define SENSOR_MAX_FRAME_LEN (16)
+// Drivers the registry holds, the built-in ones included.
+#define SENSOR_REGISTRY_LEN (16)
+
+typedef struct
+{
+  // Name for the registry and the command line, and in published samples.
+  const char * Name__cp;
+  // Number and names of the decoded values, at most SENSOR_MAX_VALUES.
+  size_t Value_count__z;
+  const char * const * Value_names__cpp;
+  // Bytes of one raw sample, at most SENSOR_MAX_FRAME_LEN.
+  size_t Frame_len__z;
+  // Time from the start of a conversion until it can be read. Ignored
+  // without a Start__fp.
+  uint32_t Conversion_us__u32;
+
+  // Return of the functions taking a bus: 0 on success, 1 on failure.
+  int (*Init__fp)(int Bus__i);
+  // Optional; NULL for free-running sensors, whose latest conversion is
+  // read whenever a sample is due.
+  int (*Start__fp)(int Bus__i);
+  int (*Read_raw__fp)(int Bus__i, uint8_t * Frame__u8p);
+  void (*Decode__fp)(const uint8_t * Frame__u8p, float * Values__fp);
+} sensor_driver_t;
+
+///////////////////////////////////////////////////////////////////////////////
+// Built-in drivers, registered from the start.
+// bme280: Temperature (C), Pressure (Pa) and Humidity (%), through the bme280
+//         driver and its SPI backend. The bus is the chip select.
+// cpu-thermal: CpuTemperature (C) of the SoC, from
+//         /sys/class/thermal/thermal_zone<bus>/temp.
+extern const sensor_driver_t sensor_driver_bme280;
+extern const sensor_driver_t sensor_driver_cpu_thermal;
+
+///////////////////////////////////////////////////////////////////////////////
+// Adds a driver to the registry. The driver must stay valid.
+// Return: 0 on success, 1 if the name is taken, the driver exceeds the
+//         SENSOR_MAX_* limits or the registry is full.
+int sensor_registry_add(const sensor_driver_t * Driver__p);
+
+///////////////////////////////////////////////////////////////////////////////
+// Return: the driver registered as Name__cp, or NULL.
+const sensor_driver_t * sensor_registry_find(const char * Name__cp);
+
+///////////////////////////////////////////////////////////////////////////////
+// Return: the Index__z-th registered driver, or NULL past the last one.
+const sensor_driver_t * sensor_registry_get(size_t Index__z);
+
+
+typedef struct sensor_scheduler_tag sensor_scheduler_t;
+
+typedef struct
+{
+  int Channel__i;
+  // Monotonic time (latency_clock_us) the sample was due and was read.
+  uint64_t Due_us__u64;
+  uint64_t Time_us__u64;
+  // 0 if the sample was read, otherwise 1 and no values.
+  int Result__i;
+  uint8_t Frame__u8a[SENSOR_MAX_FRAME_LEN];
+  float Values__fa[SENSOR_MAX_VALUES];
+} sensor_sample_t;
+
+typedef struct
+{
+  uint64_t Samples__u64;
+  uint64_t Failed__u64;
+  // Periods skipped because the scheduler was polled too late for them.
+  uint64_t Missed__u64;
+} sensor_channel_stats_t;
+
+///////////////////////////////////////////////////////////////////////////////
+// Called from sensor_scheduler_poll for every sample taken, in time order.
+typedef void (*sensor_sample_fn)(void * Context__p,
+  const sensor_sample_t * Sample__p);
+
+sensor_scheduler_t * sensor_scheduler_create(void);
+void sensor_scheduler_destroy(sensor_scheduler_t * Scheduler__p);
+
+///////////////////////////////////////////////////////////////////////////////
+// Adds a channel. The driver must have been initialized on the bus. Its
+// first sample is due at the first poll.
+// Return: the channel number, counting from 0, or -1 if out of memory or
+//         Period_us__u32 is 0.
+int sensor_scheduler_add(sensor_scheduler_t * Scheduler__p,
+  const sensor_driver_t * Driver__p, int Bus__i, uint32_t Period_us__u32);
+
+///////////////////////////////////////////////////////////////////////////////
+// Changes the period of a channel: its next sample is due one new period
+// after the last one. Setting the period in force changes nothing.
+void sensor_scheduler_set_period(sensor_scheduler_t * Scheduler__p,
+  int Channel__i, uint32_t Period_us__u32);
+
+///////////////////////////////////////////////////////////////////////////////
+// Moves the next sample of a channel to Due_us__u64, for channels that do
+// not keep to a period, such as a replayed trace. The period applies again
+// after that sample.
+void sensor_scheduler_set_due(sensor_scheduler_t * Scheduler__p,
+  int Channel__i, uint64_t Due_us__u64);
+
+///////////////////////////////////////////////////////////////////////////////
+// Return: the monotonic time of the next step of any channel (a conversion
+//         to start or a sample to read), or UINT64_MAX without channels.
+uint64_t sensor_scheduler_next_us(const sensor_scheduler_t * Scheduler__p);
+
+///////////////////////////////////////////////////////////////////////////////
+// Takes every step due by Now_us__u64. A channel polled late samples once
+// and skips the periods it missed, staying on its period grid. Conversions
+// started here are read by a later poll, at sensor_scheduler_next_us.
+// Return: the number of samples passed to Sample__fp.
+size_t sensor_scheduler_poll(sensor_scheduler_t * Scheduler__p,
+  uint64_t Now_us__u64, sensor_sample_fn Sample__fp, void * Context__p);
+
+///////////////////////////////////////////////////////////////////////////////
+// Return: the driver of a channel, or NULL if there is no such channel.
+const sensor_driver_t * sensor_scheduler_driver(
+  const sensor_scheduler_t * Scheduler__p, int Channel__i);
+
+///////////////////////////////////////////////////////////////////////////////
+// Return: the number of channels.
+size_t sensor_scheduler_count(const sensor_scheduler_t * Scheduler__p);
+
+void sensor_scheduler_get_stats(const sensor_scheduler_t * Scheduler__p,
+  int Channel__i, sensor_channel_stats_t * Stats__p);
+
+///////////////////////////////////////////////////////////////////////////////
+// Formats a sample as a JSON telemetry message, with its values under the
+// value names of the driver:
+//   {"DeviceId":"pi","Sensor":"cpu-thermal","CpuTemperature":48.3,
+//    "SampleTime":"2017-01-01T00:00:00.000Z"}
+// Param: Sample_time__cp  ISO-8601 time of the sample.
+// Return: the length written without the terminating NUL, or 0 if the
+//         sample failed or Buffer_size__z is too small.
+size_t sensor_sample_format_json(const sensor_driver_t * Driver__p,
+  const sensor_sample_t * Sample__p, const char * Device_id__cp,
+  const char * Sample_time__cp, char * Buffer__cp, size_t Buffer_size__z);
+
+#endif//__SENSOR_DRIVER_H
@@ -0,0 +1,100 @@
+///////////////////////////////////////////////////////////////////////////////
+//
+// sensor_trace.h:
+// Append-only binary traces of raw BME280 frames, and their replay through
+// the bme280 SPI hook so the driver and compensation run unchanged.
+//
+// File layout, all integers little endian:
+//   header (64 bytes)
+//     0  "BMETRACE"  magic
+//     8  uint16      format version, SENSOR_TRACE_VERSION
+//    10  uint16      header size, SENSOR_TRACE_HEADER_LEN
+//    12  uint16      record size, SENSOR_TRACE_RECORD_LEN
+//    14  uint16      calibration size, BME280_CALIB_LEN
+//    16  uint8[32]   calibration registers as returned by
+//                    bme280_get_calibration
+//    48  uint64      creation time, microseconds since the epoch
+//    56  uint8[8]    reserved, zero
+//   records (16 bytes each)
+//     0  uint64      sample time, microseconds since the epoch
+//     8  uint8[8]    PRESDATA..HUM burst, BME280_FRAME_LEN bytes
+//
+// Records have a fixed size, so a mapped file is indexed directly and a
+// record torn by a power cut is recognised by the file length.
+//
+///////////////////////////////////////////////////////////////////////////////
+
+#ifndef __SENSOR_TRACE_H
+#define __SENSOR_TRACE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+
+#define SENSOR_TRACE_VERSION (1)
+#define SENSOR_TRACE_HEADER_LEN (64)
+#define SENSOR_TRACE_RECORD_LEN (16)
+
+typedef struct sensor_trace_writer_tag sensor_trace_writer_t;
+typedef struct sensor_trace_reader_tag sensor_trace_reader_t;
+
+///////////////////////////////////////////////////////////////////////////////
+// Return: the wall clock time in microseconds since the epoch, the time base
+//         of the records.
+uint64_t sensor_trace_now_us(void);
+
+///////////////////////////////////////////////////////////////////////////////
+// Opens a trace for appending, creating it with a header holding
+// Calib__u8p if it does not exist. An existing trace must have been
+// recorded with the same calibration, that is from the same sensor; a torn
+// record at its end is cut off first.
+// Param: Calib__u8p  BME280_CALIB_LEN bytes from bme280_get_calibration.
+// Return: NULL if the file could not be opened or belongs to another sensor.
+sensor_trace_writer_t * sensor_trace_writer_open(const char * Path__cp,
+  const uint8_t * Calib__u8p);
+
+///////////////////////////////////////////////////////////////////////////////
+// Appends one record with a single write(2), so readers never see part of
+// a record unless the system goes down halfway through it.
+// Return: 0 on success, 1 if the write failed.
+int sensor_trace_writer_append(sensor_trace_writer_t * Writer__p,
+  uint64_t Time_us__u64, const uint8_t * Frame__u8p);
+
+void sensor_trace_writer_close(sensor_trace_writer_t * Writer__p);
+
+///////////////////////////////////////////////////////////////////////////////
+// Maps a trace read-only. Records appended after opening are not seen.
+// Return: NULL if the file could not be mapped or is not a trace.
+sensor_trace_reader_t * sensor_trace_reader_open(const char * Path__cp);
+
+void sensor_trace_reader_close(sensor_trace_reader_t * Reader__p);
+
+///////////////////////////////////////////////////////////////////////////////
+// Return: the number of complete records in the trace.
+size_t sensor_trace_reader_count(const sensor_trace_reader_t * Reader__p);
+
+///////////////////////////////////////////////////////////////////////////////
+// Return: the BME280_CALIB_LEN calibration bytes stored in the header.
+const uint8_t * sensor_trace_reader_calibration(
+  const sensor_trace_reader_t * Reader__p);
+
+///////////////////////////////////////////////////////////////////////////////
+// Param: Frame__u8pp  Set to the BME280_FRAME_LEN bytes of the record,
+//                     inside the mapping. Valid until the reader is closed.
+// Return: 0 on success, 1 if Index__z is past the last record.
+int sensor_trace_reader_record(const sensor_trace_reader_t * Reader__p,
+  size_t Index__z, uint64_t * Time_us__u64p, const uint8_t ** Frame__u8pp);
+
+///////////////////////////////////////////////////////////////////////////////
+// Points the bme280 SPI hook at the trace: bme280_init reads the recorded
+// calibration and every bme280_read_frame (and so bme280_read_sensors)
+// returns the next recorded frame. Once the trace is exhausted the burst
+// reads fail. Call before bme280_init; the reader must stay open.
+void sensor_trace_replay_install(const sensor_trace_reader_t * Reader__p);
+
+///////////////////////////////////////////////////////////////////////////////
+// Return: the index of the record the next frame read will return; equals
+//         sensor_trace_reader_count when the replay is over.
+size_t sensor_trace_replay_position(void);
+
+#endif//__SENSOR_TRACE_H
@@ -0,0 +1,84 @@
+///////////////////////////////////////////////////////////////////////////////
+//
+// telemetry_codec.h:
+// Compact binary (CBOR, RFC 7049) encoding of telemetry samples, used as an
+// alternative to the JSON produced by the serializer's SERIALIZE macro.
+//
+///////////////////////////////////////////////////////////////////////////////
+
+#ifndef __TELEMETRY_CODEC_H
+#define __TELEMETRY_CODEC_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+
+typedef enum
+{
+    TELEMETRY_ENCODING_JSON
+  , TELEMETRY_ENCODING_CBOR
+} TELEMETRY_ENCODING;
+
+///////////////////////////////////////////////////////////////////////////////
+// Field dictionary. CBOR messages use these small integers as map keys instead
+// of repeating the field names of the Thermostat model in every message.
+// Every message carries eTelemetryField_SCHEMA so the cloud side can pick the
+// matching dictionary; bump TELEMETRY_SCHEMA_VERSION when the table changes.
+enum
+{
+    eTelemetryField_SCHEMA      = 0
+  , eTelemetryField_DEVICE_ID   = 1
+  , eTelemetryField_TEMPERATURE = 2
+  , eTelemetryField_HUMIDITY    = 3
+  , eTelemetryField_TIME        = 4
+
+  , eTelemetryField_COUNT
+};
+
+#define TELEMETRY_SCHEMA_VERSION (2)
+
+// Worst case size of one encoded sample without the DeviceId, and of the
+// head of an array of samples.
+#define TELEMETRY_CBOR_MAX_SAMPLE_SIZE (40)
+#define TELEMETRY_CBOR_MAX_ARRAY_HEAD_SIZE (5)
+
+typedef struct
+{
+  double Temperature;
+  double Humidity;
+  // When the sample was taken, milliseconds since the epoch, or 0 to leave
+  // it out.
+  uint64_t Time_ms;
+} telemetry_sample_t;
+
+///////////////////////////////////////////////////////////////////////////////
+// Return: the name used for Field_id__i in the JSON encoding, or NULL if the
+//         id is not part of the dictionary.
+const char * telemetry_field_name(int Field_id__i);
+
+///////////////////////////////////////////////////////////////////////////////
+// Return: the value for the content type system property.
+const char * telemetry_content_type(TELEMETRY_ENCODING Encoding__e);
+
+///////////////////////////////////////////////////////////////////////////////
+// Param: Name__cp  "json" or "cbor".
+// Return: 0 and sets *Encoding__ep if the name is known, otherwise 1.
+int telemetry_encoding_from_string(const char * Name__cp,
+  TELEMETRY_ENCODING * Encoding__ep);
+
+///////////////////////////////////////////////////////////////////////////////
+// Encodes one sample as a CBOR map keyed by the field dictionary.
+// Param: Device_id__cp  Optional. IoT Hub already stamps every message with
+//                       the sending device, so pass NULL to leave it out.
+// Return: the number of bytes written, or 0 if Buffer_size__z is too small.
+size_t telemetry_encode_cbor(const telemetry_sample_t * Sample__p,
+  const char * Device_id__cp, uint8_t * Buffer__u8p, size_t Buffer_size__z);
+
+///////////////////////////////////////////////////////////////////////////////
+// Writes the head of a CBOR array. A batch of samples is this head followed
+// by Num_samples__z encoded samples.
+// Return: the number of bytes written, or 0 if Buffer_size__z is too small.
+size_t telemetry_encode_cbor_array_head(size_t Num_samples__z,
+  uint8_t * Buffer__u8p, size_t Buffer_size__z);
+
+#endif//__TELEMETRY_CODEC_H
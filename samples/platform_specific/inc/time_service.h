@@ -0,0 +1,63 @@
+///////////////////////////////////////////////////////////////////////////////
+//
+// time_service.h:
+// Source timestamps for samples: the monotonic time, for intervals that are
+// immune to changes of the wall clock, together with UTC. The offset between
+// the two is tracked so that steps of the wall clock (set by hand, or the
+// first NTP sync of a Pi without a real time clock) are noticed, and an
+// ISO-8601 formatter that neither allocates nor touches shared state.
+//
+///////////////////////////////////////////////////////////////////////////////
+
+#ifndef __TIME_SERVICE_H
+#define __TIME_SERVICE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+
+// Changes of the UTC offset up to this, plus 1000 ppm of the time since the
+// previous stamp for NTP slewing, are not a step.
+#define TIME_SERVICE_STEP_US (100000)
+
+// "YYYY-MM-DDThh:mm:ss.sssZ" and the terminating zero.
+#define TIME_ISO8601_LEN (25)
+
+typedef struct
+{
+  // latency_clock_us time base, CLOCK_MONOTONIC.
+  uint64_t Mono_us__u64;
+  // Microseconds since the epoch, CLOCK_REALTIME.
+  uint64_t Utc_us__u64;
+} time_stamp_t;
+
+///////////////////////////////////////////////////////////////////////////////
+// Not thread safe; use one per sampling thread.
+typedef struct
+{
+  // UTC minus monotonic time at the last stamp.
+  int64_t Offset_us__i64;
+  uint64_t Last_mono_us__u64;
+  uint32_t Steps__u32;
+  // Size of the last step, negative if the clock went back.
+  int64_t Last_step_us__i64;
+} time_service_t;
+
+void time_service_init(time_service_t * Service__p);
+
+///////////////////////////////////////////////////////////////////////////////
+// Reads both clocks back to back.
+// Return: 1 if the wall clock was stepped since the previous stamp, which is
+//         then counted in Steps__u32 and Last_step_us__i64, 0 otherwise.
+int time_service_stamp(time_service_t * Service__p, time_stamp_t * Stamp__p);
+
+///////////////////////////////////////////////////////////////////////////////
+// Formats a UTC time as "YYYY-MM-DDThh:mm:ss.sssZ", truncated to the
+// millisecond. Thread safe and allocation free: unlike gmtime_r it takes no
+// time zone lock.
+// Return: the length without the terminating zero, or 0 if Size__z is less
+//         than TIME_ISO8601_LEN or the year is past 9999.
+size_t time_format_iso8601(uint64_t Utc_us__u64, char * Buffer__cp,
+  size_t Size__z);
+
+#endif//__TIME_SERVICE_H
@@ -0,0 +1,105 @@
+///////////////////////////////////////////////////////////////////////////////
+//
+// alert_rules.c:
+// Threshold and rate-of-change rules evaluated on the device for every
+// sample, so breaches can be reported ahead of routine telemetry.
+//
+///////////////////////////////////////////////////////////////////////////////
+
+#include "alert_rules.h"
+#include <stdlib.h>
+#include <string.h>
+
+
+///////////////////////////////////////////////////////////////////////////////
+static double alert_field_value(int Field_id__i,
+  const telemetry_sample_t * Sample__p)
+{
+  return (Field_id__i == eTelemetryField_TEMPERATURE) ? Sample__p->Temperature
+    : Sample__p->Humidity;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+int alert_rule_parse(const char * Spec__cp, alert_rule_t * Rule__p)
+{
+  const char * Op__cp = strpbrk(Spec__cp, "<>~");
+  char * End__cp;
+  size_t Name_len__z;
+
+  if ((Op__cp == NULL) || (strlen(Spec__cp) >= ALERT_RULE_MAX_SPEC_LEN))
+  {
+    return 1;
+  }
+  memset(Rule__p, 0, sizeof(alert_rule_t));
+  strcpy(Rule__p->Spec__ca, Spec__cp);
+
+  Name_len__z = (size_t)(Op__cp - Spec__cp);
+  if ((Name_len__z == strlen("Temperature"))
+    && (strncmp(Spec__cp, "Temperature", Name_len__z) == 0))
+  {
+    Rule__p->Field_id__i = eTelemetryField_TEMPERATURE;
+  }
+  else if ((Name_len__z == strlen("Humidity"))
+    && (strncmp(Spec__cp, "Humidity", Name_len__z) == 0))
+  {
+    Rule__p->Field_id__i = eTelemetryField_HUMIDITY;
+  }
+  else
+  {
+    return 1;
+  }
+
+  Rule__p->Kind__e = (*Op__cp == '>') ? ALERT_RULE_ABOVE
+    : (*Op__cp == '<') ? ALERT_RULE_BELOW : ALERT_RULE_RATE;
+
+  Rule__p->Limit__d = strtod(Op__cp + 1, &End__cp);
+  if ((End__cp == Op__cp + 1) || (*End__cp != '\0'))
+  {
+    return 1;
+  }
+  return 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+int alert_rule_evaluate(alert_rule_t * Rule__p,
+  const telemetry_sample_t * Sample__p, uint64_t Time_us__u64,
+  double * Value__dp)
+{
+  double Value__d = alert_field_value(Rule__p->Field_id__i, Sample__p);
+  double Checked__d = Value__d;
+  int Breached__i;
+  int Fired__i;
+
+  switch (Rule__p->Kind__e)
+  {
+  case ALERT_RULE_ABOVE:
+    Breached__i = (Value__d > Rule__p->Limit__d);
+    break;
+  case ALERT_RULE_BELOW:
+    Breached__i = (Value__d < Rule__p->Limit__d);
+    break;
+  default:
+    Breached__i = 0;
+    Checked__d = 0.0;
+    if (Rule__p->Has_previous__i && (Time_us__u64 > Rule__p->Previous_time_us__u64))
+    {
+      Checked__d = (Value__d - Rule__p->Previous_value__d) * 1000000.0
+        / (double)(Time_us__u64 - Rule__p->Previous_time_us__u64);
+      Breached__i = ((Checked__d > Rule__p->Limit__d) || (-Checked__d > Rule__p->Limit__d));
+    }
+    break;
+  }
+
+  Rule__p->Has_previous__i = 1;
+  Rule__p->Previous_value__d = Value__d;
+  Rule__p->Previous_time_us__u64 = Time_us__u64;
+
+  Fired__i = (Breached__i && !Rule__p->Active__i);
+  Rule__p->Active__i = Breached__i;
+
+  if (Value__dp != NULL)
+  {
+    *Value__dp = Checked__d;
+  }
+  return Fired__i;
+}
@@ -0,0 +1,75 @@
+///////////////////////////////////////////////////////////////////////////////
+//
+// anomaly_detector.c:
+// EWMA and z-score detector of readings that deviate from their baseline.
+//
+///////////////////////////////////////////////////////////////////////////////
+
+#include "anomaly_detector.h"
+#include <math.h>
+#include <string.h>
+
+
+///////////////////////////////////////////////////////////////////////////////
+int anomaly_detector_init(anomaly_detector_t * Detector__p, double Alpha__d,
+  double Threshold__d, uint32_t Warmup__u32, double Min_stddev__d)
+{
+  if (!(Alpha__d > 0.0 && Alpha__d <= 1.0) || !(Threshold__d > 0.0) ||
+    !(Min_stddev__d >= 0.0))
+  {
+    return 1;
+  }
+  memset(Detector__p, 0, sizeof(anomaly_detector_t));
+  Detector__p->Alpha__d = Alpha__d;
+  Detector__p->Threshold__d = Threshold__d;
+  Detector__p->Warmup__u32 = Warmup__u32;
+  Detector__p->Min_stddev__d = Min_stddev__d;
+  return 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+int anomaly_detector_update(anomaly_detector_t * Detector__p,
+  double Value__d, double * Z_score__dp)
+{
+  double Diff__d = Value__d - Detector__p->Mean__d;
+  double Increment__d = Detector__p->Alpha__d * Diff__d;
+  double Z_score__d = 0.0;
+  int Anomaly__i = 0;
+
+  if (Detector__p->Count__u32 == 0)
+  {
+    // Start from the first value rather than pulling the average up from 0.
+    Detector__p->Mean__d = Value__d;
+    Detector__p->Variance__d = 0.0;
+  }
+  else
+  {
+    if (Detector__p->Count__u32 >= Detector__p->Warmup__u32)
+    {
+      double Stddev__d = sqrt(Detector__p->Variance__d);
+      if (Stddev__d < Detector__p->Min_stddev__d)
+      {
+        Stddev__d = Detector__p->Min_stddev__d;
+      }
+      if (Stddev__d > 0.0)
+      {
+        Z_score__d = Diff__d / Stddev__d;
+        Anomaly__i = (fabs(Z_score__d) > Detector__p->Threshold__d);
+      }
+    }
+    // Incremental EWMA of the mean and variance (West 1979, Finch 2009).
+    Detector__p->Mean__d += Increment__d;
+    Detector__p->Variance__d = (1.0 - Detector__p->Alpha__d)
+      * (Detector__p->Variance__d + Diff__d * Increment__d);
+  }
+  if (Detector__p->Count__u32 < UINT32_MAX)
+  {
+    Detector__p->Count__u32++;
+  }
+
+  if (Z_score__dp != NULL)
+  {
+    *Z_score__dp = Z_score__d;
+  }
+  return Anomaly__i;
+}
@@ -6,17 +6,37 @@
 //
 ///////////////////////////////////////////////////////////////////////////////
 
+#define _POSIX_C_SOURCE 200112L
 #include "bme280.h"
+#include "device_state.h"
 #include <wiringPi.h>
 #include <wiringPiSPI.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
 
 #define SENSOR_MODULE_MAX_XFER_LEN (128)
 static int Num_allowed_retries__i = 3;
 static int Chip_enable_selected__i = -1;
+static bme280_spi_xfer_fn Spi_xfer__fp = wiringPiSPIDataRW;
+static bme280_spi_xfer_batch_fn Spi_xfer_batch__fp = NULL;
+// Updated by the sampling thread and read by others; every counter is
+// accessed atomically, as a uint64_t may be read torn on 32-bit ARM.
+static bme280_bus_stats_t Bus_stats__s;
+// NULL until corrections are first set.
+static device_state_t * Correction_state__p = NULL;
+// The corrections each compensating thread last read in full, and their
+// version, UINT32_MAX before the first read. A thread that finds an update
+// in progress goes on with these rather than wait for it.
+static __thread bme280_correction_t Correction_copy__s;
+static __thread uint32_t Correction_version__u32 = UINT32_MAX;
+#define BME280_CORRECTION_READ_ATTEMPTS (4)
+
+// Most reads chained into one bus call, see bme280_read_batch.
+#define SENSOR_MODULE_MAX_BATCH (4)
 
 #define SHOW_DEBUG_OUTPUT
 
@@ -84,6 +104,39 @@ typedef struct
 } bme280_calib_data_t;
 bme280_calib_data_t Calib_data;
 
+// The calibration registers exactly as read, kept for trace files.
+static uint8_t Calib_raw__u8a[BME280_CALIB_LEN];
+
+// Control register of each bme280_profile_t:
+// bits 7~5 = 001 = temperature oversampling * 1
+// bits 4~2 = 111 = pressure oversampling * 16, or 010 = * 2 when fast
+// bits 1~0 = 11  = normal power mode
+static const uint8_t Profile_control__u8a[] = { 0x3F, 0x2B };
+
+
+///////////////////////////////////////////////////////////////////////////////
+static uint64_t bme280_bus_clock_ns(void)
+{
+  struct timespec Now__s;
+  clock_gettime(CLOCK_MONOTONIC, &Now__s);
+  return (uint64_t)Now__s.tv_sec * 1000000000ULL + (uint64_t)Now__s.tv_nsec;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Counts one call into the SPI backend, which started at Start_ns__u64.
+static void bme280_bus_account(uint64_t Start_ns__u64, int Num_transfers__i,
+  int Num_bytes__i)
+{
+  uint64_t Time_ns__u64 = bme280_bus_clock_ns() - Start_ns__u64;
+
+  (void)__atomic_fetch_add(&Bus_stats__s.Calls__u64, 1, __ATOMIC_RELAXED);
+  (void)__atomic_fetch_add(&Bus_stats__s.Transfers__u64,
+    (uint64_t)Num_transfers__i, __ATOMIC_RELAXED);
+  (void)__atomic_fetch_add(&Bus_stats__s.Bytes__u64, (uint64_t)Num_bytes__i,
+    __ATOMIC_RELAXED);
+  (void)__atomic_fetch_add(&Bus_stats__s.Time_ns__u64, Time_ns__u64,
+    __ATOMIC_RELAXED);
+}
 
 ///////////////////////////////////////////////////////////////////////////////
 int bme280_read(const uint8_t Register__u8, uint8_t * Data__u8p, uint8_t Num_bytes__u8)
@@ -96,8 +149,10 @@ int bme280_read(const uint8_t Register__u8, uint8_t * Data__u8p, uint8_t Num_byt
 
   // Set bit 7 high to tell it to read.
   Buffer__u8a[0] = (0x80 | Register__u8);
+  uint64_t Start_ns__u64 = bme280_bus_clock_ns();
   int Result__i =
-    wiringPiSPIDataRW(Chip_enable_selected__i, Buffer__u8a, Num_bytes__u8 + 1);
+    Spi_xfer__fp(Chip_enable_selected__i, Buffer__u8a, Num_bytes__u8 + 1);
+  bme280_bus_account(Start_ns__u64, 1, Num_bytes__u8 + 1);
   int Out_idx__i = 0;
   while (Out_idx__i < (Result__i - 1))
   {
@@ -127,12 +182,98 @@ int bme280_write(const uint8_t Register__u8, const uint8_t * Data__u8p, uint8_t
     Data__u8p++;
   }
 
-  int Result__i = wiringPiSPIDataRW(Chip_enable_selected__i,
+  uint64_t Start_ns__u64 = bme280_bus_clock_ns();
+  int Result__i = Spi_xfer__fp(Chip_enable_selected__i,
     Buffer__u8a, Num_bytes__u8 * 2);
+  bme280_bus_account(Start_ns__u64, 1, Num_bytes__u8 * 2);
 
   return Result__i / 2;
 }
 
+///////////////////////////////////////////////////////////////////////////////
+// Reads several register blocks. With a batch backend they go out as one
+// bus call, with chip select released between them; otherwise one
+// bme280_read each.
+// Param: Bytes_read__ia  Receives the number of bytes read for each block.
+static void bme280_read_batch(const uint8_t * Registers__u8p,
+  uint8_t * const * Data__u8pp, const uint8_t * Num_bytes__u8p,
+  int * Bytes_read__ip, int Num_reads__i)
+{
+  int Read_idx__i;
+
+  if ((Spi_xfer_batch__fp == NULL) || (Chip_enable_selected__i == -1)
+    || (Num_reads__i > SENSOR_MODULE_MAX_BATCH))
+  {
+    for (Read_idx__i = 0; Read_idx__i < Num_reads__i; Read_idx__i++)
+    {
+      Bytes_read__ip[Read_idx__i] = bme280_read(Registers__u8p[Read_idx__i],
+        Data__u8pp[Read_idx__i], Num_bytes__u8p[Read_idx__i]);
+    }
+    return;
+  }
+
+  uint8_t Buffers__u8a[SENSOR_MODULE_MAX_BATCH][SENSOR_MODULE_MAX_XFER_LEN];
+  bme280_spi_segment_t Segments__sa[SENSOR_MODULE_MAX_BATCH];
+  int Total_len__i = 0;
+  for (Read_idx__i = 0; Read_idx__i < Num_reads__i; Read_idx__i++)
+  {
+    int Len__i = Num_bytes__u8p[Read_idx__i] + 1;
+    memset(Buffers__u8a[Read_idx__i], 0, (size_t)Len__i);
+    // Set bit 7 high to tell it to read.
+    Buffers__u8a[Read_idx__i][0] = (0x80 | Registers__u8p[Read_idx__i]);
+    Segments__sa[Read_idx__i].Data__u8p = Buffers__u8a[Read_idx__i];
+    Segments__sa[Read_idx__i].Len__i = Len__i;
+    Total_len__i += Len__i;
+  }
+
+  uint64_t Start_ns__u64 = bme280_bus_clock_ns();
+  int Result__i = Spi_xfer_batch__fp(Chip_enable_selected__i, Segments__sa,
+    Num_reads__i);
+  bme280_bus_account(Start_ns__u64, Num_reads__i, Total_len__i);
+
+  for (Read_idx__i = 0; Read_idx__i < Num_reads__i; Read_idx__i++)
+  {
+    Bytes_read__ip[Read_idx__i] = 0;
+    if (Result__i == Total_len__i)
+    {
+      memcpy(Data__u8pp[Read_idx__i], &Buffers__u8a[Read_idx__i][1],
+        Num_bytes__u8p[Read_idx__i]);
+      Bytes_read__ip[Read_idx__i] = Num_bytes__u8p[Read_idx__i];
+    }
+  }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+void bme280_set_spi_xfer(bme280_spi_xfer_fn Xfer__fp)
+{
+  Spi_xfer__fp = (Xfer__fp != NULL) ? Xfer__fp : wiringPiSPIDataRW;
+  Spi_xfer_batch__fp = NULL;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+void bme280_set_spi_xfer_batch(bme280_spi_xfer_batch_fn Xfer_batch__fp)
+{
+  Spi_xfer_batch__fp = Xfer_batch__fp;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+void bme280_get_bus_stats(bme280_bus_stats_t * Stats__p)
+{
+  Stats__p->Calls__u64 = __atomic_load_n(&Bus_stats__s.Calls__u64, __ATOMIC_RELAXED);
+  Stats__p->Transfers__u64 = __atomic_load_n(&Bus_stats__s.Transfers__u64, __ATOMIC_RELAXED);
+  Stats__p->Bytes__u64 = __atomic_load_n(&Bus_stats__s.Bytes__u64, __ATOMIC_RELAXED);
+  Stats__p->Time_ns__u64 = __atomic_load_n(&Bus_stats__s.Time_ns__u64, __ATOMIC_RELAXED);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+void bme280_reset_bus_stats(void)
+{
+  __atomic_store_n(&Bus_stats__s.Calls__u64, 0, __ATOMIC_RELAXED);
+  __atomic_store_n(&Bus_stats__s.Transfers__u64, 0, __ATOMIC_RELAXED);
+  __atomic_store_n(&Bus_stats__s.Bytes__u64, 0, __ATOMIC_RELAXED);
+  __atomic_store_n(&Bus_stats__s.Time_ns__u64, 0, __ATOMIC_RELAXED);
+}
+
 ///////////////////////////////////////////////////////////////////////////////
 int bme280_init(int Chip_enable_to_use__i)
 {
@@ -146,9 +287,26 @@ int bme280_init(int Chip_enable_to_use__i)
   }
   Chip_enable_selected__i = Chip_enable_to_use__i;
 
-  // Verify that the chip is really a BME280.
+  // The chip ID and the three calibration blocks, in one bus call when the
+  // backend can chain transfers.
+  #define T_P_CALIB_NUM_BYTES (24)
   uint8_t ID_value__u8 = 0;
-  int Bytes_read__i = bme280_read(eBME280reg_CHIPID, &ID_value__u8, 1);
+  uint8_t Hum_calib_buf__u8a[9];
+  const uint8_t Registers__u8a[4] =
+  {
+    eBME280reg_CHIPID, eBME280reg_DIG_T1, eBME280reg_DIG_H1, eBME280reg_DIG_H2
+  };
+  uint8_t * const Data__u8pa[4] =
+  {
+    &ID_value__u8, (uint8_t *)&Calib_data, &Hum_calib_buf__u8a[0],
+    &Hum_calib_buf__u8a[1]
+  };
+  const uint8_t Num_bytes__u8a[4] = { 1, T_P_CALIB_NUM_BYTES, 1, 7 };
+  int Bytes_read__ia[4];
+  bme280_read_batch(Registers__u8a, Data__u8pa, Num_bytes__u8a, Bytes_read__ia, 4);
+
+  // Verify that the chip is really a BME280.
+  int Bytes_read__i = Bytes_read__ia[0];
   if (Bytes_read__i != 1)
   {
     return 0;
@@ -166,9 +324,7 @@ int bme280_init(int Chip_enable_to_use__i)
     return 0;
   }
 
-  #define T_P_CALIB_NUM_BYTES (24)
-  Bytes_read__i = bme280_read(eBME280reg_DIG_T1, (uint8_t *)&Calib_data,
-    T_P_CALIB_NUM_BYTES);
+  Bytes_read__i = Bytes_read__ia[1];
   if (Bytes_read__i != T_P_CALIB_NUM_BYTES)
   {
     #ifdef SHOW_DEBUG_OUTPUT
@@ -177,8 +333,7 @@ int bme280_init(int Chip_enable_to_use__i)
     #endif
     return 0;
   }
-  uint8_t Hum_calib_buf__u8a[9];
-  Bytes_read__i += bme280_read(eBME280reg_DIG_H1, &Hum_calib_buf__u8a[0], 1);
+  Bytes_read__i += Bytes_read__ia[2];
   if (Bytes_read__i != T_P_CALIB_NUM_BYTES + 1)
   {
     #ifdef SHOW_DEBUG_OUTPUT
@@ -187,7 +342,7 @@ int bme280_init(int Chip_enable_to_use__i)
     #endif
     return 0;
   }
-  Bytes_read__i += bme280_read(eBME280reg_DIG_H2, &Hum_calib_buf__u8a[1], 7);
+  Bytes_read__i += Bytes_read__ia[3];
   if (Bytes_read__i != T_P_CALIB_NUM_BYTES + 8)
   {
     #ifdef SHOW_DEBUG_OUTPUT
@@ -201,6 +356,9 @@ int bme280_init(int Chip_enable_to_use__i)
     Bytes_read__i, eBME280reg_DIG_T1);
   #endif
 
+  memcpy(Calib_raw__u8a, &Calib_data, T_P_CALIB_NUM_BYTES);
+  memcpy(&Calib_raw__u8a[T_P_CALIB_NUM_BYTES], Hum_calib_buf__u8a, 8);
+
   // Decode the humidity compensation constants.
   Calib_data.dig_H1 = Hum_calib_buf__u8a[0];
   Calib_data.dig_H2 = (int16_t)(((uint16_t)Hum_calib_buf__u8a[1])
@@ -212,10 +370,7 @@ int bme280_init(int Chip_enable_to_use__i)
     + (((uint16_t)Hum_calib_buf__u8a[6]) << 4));
   Calib_data.dig_H6 = (int8_t)Hum_calib_buf__u8a[7];
 
-  // bits 7~5 = 001 = temperature oversampling * 1
-  // bits 4~2 = 111 = pressure oversampling * 16
-  // bits 1~0 = 11  = normal power mode
-  const uint8_t Control_setting__u8 = 0x3F;
+  const uint8_t Control_setting__u8 = Profile_control__u8a[BME280_PROFILE_DEFAULT];
   uint8_t Bytes_written__u8 = bme280_write(eBME280reg_CONTROL,
     &Control_setting__u8, 1);
   if (Bytes_written__u8 != 1)
@@ -234,6 +389,16 @@ int bme280_init(int Chip_enable_to_use__i)
   return 1;
 }
 
+///////////////////////////////////////////////////////////////////////////////
+int bme280_set_profile(bme280_profile_t Profile__e)
+{
+  if ((unsigned int)Profile__e >= sizeof(Profile_control__u8a))
+  {
+    return 1;
+  }
+  return (bme280_write(eBME280reg_CONTROL, &Profile_control__u8a[Profile__e], 1) == 1) ? 0 : 1;
+}
+
 ///////////////////////////////////////////////////////////////////////////////
 // Returns temperature in DegC, resolution is 0.01 DegC.
 // For example: Output value of “5123” equals 51.23 DegC.
@@ -241,7 +406,7 @@ int bme280_init(int Chip_enable_to_use__i)
 // Note: Must call this before calling compensate_P or compensate_H because of
 // the global t_fine variable.
 int32_t t_fine = 0;
-int32_t bme280_compensate_T_int32(int32_t adc_T)
+static int32_t bme280_compensate_T(int32_t adc_T, int32_t * t_fine__p)
 {
   int32_t var1, var2, T;
   var1 = ((((adc_T >> 3) - ((int32_t)Calib_data.dig_T1 << 1)))
@@ -249,11 +414,16 @@ int32_t bme280_compensate_T_int32(int32_t adc_T)
   var2 = (((((adc_T >> 4) - ((int32_t)Calib_data.dig_T1))
     * ((adc_T >> 4) - ((int32_t)Calib_data.dig_T1))) >> 12)
     * ((int32_t)Calib_data.dig_T3)) >> 14;
-  t_fine = var1 + var2;
-  T = (t_fine * 5 + 128) >> 8;
+  *t_fine__p = var1 + var2;
+  T = (*t_fine__p * 5 + 128) >> 8;
   return T;
 }
 
+int32_t bme280_compensate_T_int32(int32_t adc_T)
+{
+  return bme280_compensate_T(adc_T, &t_fine);
+}
+
 ///////////////////////////////////////////////////////////////////////////////
 // Returns pressure in Pa as unsigned 32 bit integer in Q24.8 format (24
 // integer bits and 8 fractional bits).
@@ -261,7 +431,7 @@ int32_t bme280_compensate_T_int32(int32_t adc_T)
 // = 963.862 hPa
 // Note: Must call compensate_T before calling this because of
 // the global t_fine variable.
-uint32_t bme280_compensate_P_int64(int32_t adc_P)
+static uint32_t bme280_compensate_P(int32_t adc_P, int32_t t_fine)
 {
   int64_t var1, var2, p;
   var1 = ((int64_t)t_fine) - 128000LL;
@@ -283,13 +453,18 @@ uint32_t bme280_compensate_P_int64(int32_t adc_P)
   return (uint32_t)p;
 }
 
+uint32_t bme280_compensate_P_int64(int32_t adc_P)
+{
+  return bme280_compensate_P(adc_P, t_fine);
+}
+
 ///////////////////////////////////////////////////////////////////////////////
 // Returns humidity as a relative percentage.
 // Encoded as Q22.10 format (22 integer bits and 10 fractional bits).
 // For example: Output value of “47445” represents 47445/1024 = 46.333 %RH
 // Note: Must call compensate_T before calling this because of
 // the global t_fine variable.
-uint32_t bme280_compensate_H_int32(int32_t adc_H)
+static uint32_t bme280_compensate_H(int32_t adc_H, int32_t t_fine)
 {
   int32_t v_x1_u32r;
   v_x1_u32r = (t_fine - ((int32_t)76800L));
@@ -306,72 +481,216 @@ uint32_t bme280_compensate_H_int32(int32_t adc_H)
   return (uint32_t)(v_x1_u32r >> 12);
 }
 
+uint32_t bme280_compensate_H_int32(int32_t adc_H)
+{
+  return bme280_compensate_H(adc_H, t_fine);
+}
+
 ///////////////////////////////////////////////////////////////////////////////
-int bme280_read_sensors(float * Temp_c__fp, float * Pres_Pa__fp,
-  float * Hum_pct__fp)
+void bme280_decode_frame(const uint8_t * Frame__u8p, int32_t * Temp_cC__i32p,
+  uint32_t * Pres_q24_8__u32p, uint32_t * Hum_q22_10__u32p)
 {
-  int Return_status__i = 0;
+  // Pressure is in registers 0xf7 ~ 0xf9.
+  // Most Significant Bits [19:12] of Pressure ADC value.
+  int32_t Pressure_raw_adc__i32 = ((int32_t)Frame__u8p[0]) << 12;
+  // Mid/lower Significant Bits [11:4] of Pressure ADC value.
+  Pressure_raw_adc__i32 += ((int32_t)Frame__u8p[1]) << 4;
+  // Least Significant Bits [3]|[3:2]|[3:1]|[3:0], depending on the
+  // resolution as determined by the oversampling setting.
+  Pressure_raw_adc__i32 += ((int32_t)Frame__u8p[2]) & 0x04;
+
+  // Temperature is in registers 0xfa ~ 0xfc.
+  // Most Significant Bits [19:12] of Temperature ADC value.
+  int32_t Temperature_raw_adc__i32 = ((int32_t)Frame__u8p[3]) << 12;
+  // Mid/lower Significant Bits [11:4] of Temperature ADC value.
+  Temperature_raw_adc__i32 += ((int32_t)Frame__u8p[4]) << 4;
+  // Least Significant Bits [3]|[3:2]|[3:1]|[3:0], depending on the
+  // resolution as determined by the oversampling setting.
+  Temperature_raw_adc__i32 += ((int32_t)Frame__u8p[5]) & 0x04;
+
+  // Humidity is in registers 0xfd ~ 0xfe.
+  // Most Significant Bits [15:8] of Humidity ADC value.
+  int32_t Humidity_raw_adc__i32 = (((int32_t)Frame__u8p[6]) << 8);
+  // Least Significant Bits [7:0] of Humidity ADC value.
+  Humidity_raw_adc__i32 += ((int32_t)Frame__u8p[7]);
+
+  int32_t T_fine__i32;
+  *Temp_cC__i32p = bme280_compensate_T(Temperature_raw_adc__i32, &T_fine__i32);
+  *Pres_q24_8__u32p = bme280_compensate_P(Pressure_raw_adc__i32, T_fine__i32);
+  *Hum_q22_10__u32p = bme280_compensate_H(Humidity_raw_adc__i32, T_fine__i32);
+}
 
-  // Make sure the sensor isn't busy updating values.
-  uint8_t Status__u8 = 0x01;
-  while ((Status__u8 & 0x01) != 0)
+///////////////////////////////////////////////////////////////////////////////
+void bme280_compensate_frame(const uint8_t * Frame__u8p, float * Temp_C__fp,
+  float * Pres_Pa__fp, float * Hum_pct__fp)
+{
+  const device_state_t * State__p = __atomic_load_n(&Correction_state__p, __ATOMIC_ACQUIRE);
+  int32_t Temp_cC__i32;
+  uint32_t Pres_q24_8__u32, Hum_q22_10__u32;
+
+  bme280_decode_frame(Frame__u8p, &Temp_cC__i32, &Pres_q24_8__u32, &Hum_q22_10__u32);
+  if (State__p != NULL)
+  {
+    int32_t Pres__i32, Hum__i32;
+
+    if (device_state_version(State__p) != Correction_version__u32)
+    {
+      bme280_correction_t Correction__s;
+      uint32_t Version__u32;
+
+      if (device_state_try_read(State__p, &Correction__s,
+        BME280_CORRECTION_READ_ATTEMPTS, &Version__u32) == 0)
+      {
+        Correction_copy__s = Correction__s;
+        Correction_version__u32 = Version__u32;
+      }
+    }
+    // Before the first full read the copy is zero, which corrects nothing.
+    Temp_cC__i32 = sensor_correction_apply(&Correction_copy__s.Temperature__s, Temp_cC__i32);
+    // Both fit an int32_t: at most 1100 hPa in Q24.8 and 100 %RH in Q22.10.
+    Pres__i32 = sensor_correction_apply(&Correction_copy__s.Pressure__s, (int32_t)Pres_q24_8__u32);
+    Hum__i32 = sensor_correction_apply(&Correction_copy__s.Humidity__s, (int32_t)Hum_q22_10__u32);
+    Pres_q24_8__u32 = (Pres__i32 < 0) ? 0 : (uint32_t)Pres__i32;
+    Hum_q22_10__u32 = (Hum__i32 < 0) ? 0 : (Hum__i32 > (100 << 10)) ? (100 << 10) : (uint32_t)Hum__i32;
+  }
+  *Temp_C__fp = Temp_cC__i32 / 100.0;
+  *Pres_Pa__fp = Pres_q24_8__u32 / 256.0;
+  *Hum_pct__fp = Hum_q22_10__u32 / 1024.0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+int bme280_correction_parse(const char * Spec__cp,
+  bme280_correction_t * Correction__p)
+{
+  // Fixed point units per C, Pa and %RH.
+  static const char * const Names__cpa[3] = { "Temperature", "Pressure", "Humidity" };
+  static const int32_t Scales__i32a[3] = { 100, 256, 1024 };
+  bme280_correction_t Parsed__s;
+  sensor_correction_t * const Quantities__pa[3] =
+    { &Parsed__s.Temperature__s, &Parsed__s.Pressure__s, &Parsed__s.Humidity__s };
+  const char * Text__cp = Spec__cp;
+
+  memset(&Parsed__s, 0, sizeof(Parsed__s));
+  while (*Text__cp != '\0')
   {
-    uint8_t Num_bytes_read__u8 = bme280_read(eBME280reg_STATUS, &Status__u8, 1);
-    if (Num_bytes_read__u8 != 1)
+    char Quantity_spec__ca[128];
+    size_t Len__z = strcspn(Text__cp, ";");
+    const char * Equals__cp = memchr(Text__cp, '=', Len__z);
+    size_t Index__z;
+
+    if (Equals__cp == NULL || Len__z >= sizeof(Quantity_spec__ca))
+    {
+      return 1;
+    }
+    for (Index__z = 0; Index__z < 3; Index__z++)
     {
-      return Return_status__i;
+      if (strlen(Names__cpa[Index__z]) == (size_t)(Equals__cp - Text__cp) &&
+        strncmp(Text__cp, Names__cpa[Index__z], (size_t)(Equals__cp - Text__cp)) == 0)
+      {
+        break;
+      }
+    }
+    memcpy(Quantity_spec__ca, Equals__cp + 1, Len__z - (size_t)(Equals__cp + 1 - Text__cp));
+    Quantity_spec__ca[Len__z - (size_t)(Equals__cp + 1 - Text__cp)] = '\0';
+    if (Index__z == 3 || sensor_correction_parse(Quantity_spec__ca,
+      Scales__i32a[Index__z], Quantities__pa[Index__z]) != 0)
+    {
+      return 1;
+    }
+    Text__cp += Len__z;
+    if (*Text__cp == ';')
+    {
+      Text__cp++;
     }
   }
+  *Correction__p = Parsed__s;
+  return 0;
+}
 
-  const uint8_t Num_bytes_to_read__u8 = 8;
-  uint8_t Buffer__u8a[Num_bytes_to_read__u8];
+///////////////////////////////////////////////////////////////////////////////
+static int bme280_copy_correction(void * State__p, void * Context__p)
+{
+  memcpy(State__p, Context__p, sizeof(bme280_correction_t));
+  return 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+int bme280_set_correction(const bme280_correction_t * Correction__p)
+{
+  device_state_t * State__p = __atomic_load_n(&Correction_state__p, __ATOMIC_ACQUIRE);
+
+  if (State__p == NULL)
+  {
+    device_state_t * Expected__p = NULL;
+    State__p = device_state_create(Correction__p, sizeof(bme280_correction_t));
+    if (State__p == NULL)
+    {
+      return 1;
+    }
+    if (__atomic_compare_exchange_n(&Correction_state__p, &Expected__p, State__p, 0,
+      __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+    {
+      return 0;
+    }
+    // Another thread set corrections first.
+    device_state_destroy(State__p);
+    State__p = Expected__p;
+  }
+  (void)device_state_update(State__p, bme280_copy_correction, (void *)Correction__p);
+  return 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+void bme280_get_calibration(uint8_t * Calib__u8p)
+{
+  memcpy(Calib__u8p, Calib_raw__u8a, BME280_CALIB_LEN);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+int bme280_read_frame(uint8_t * Frame__u8p)
+{
+  // The status and the data burst go out together; the burst is only used
+  // once the status shows the sensor isn't busy updating values.
+  uint8_t Status__u8 = 0x01;
+  const uint8_t Registers__u8a[2] = { eBME280reg_STATUS, eBME280reg_PRESDATA };
+  uint8_t * const Data__u8pa[2] = { &Status__u8, Frame__u8p };
+  const uint8_t Num_bytes__u8a[2] = { 1, BME280_FRAME_LEN };
   int Num_retries__i = 0;
   while (Num_retries__i <= Num_allowed_retries__i)
   {
-    uint8_t Register__u8 = eBME280reg_PRESDATA;
-    int Num_bytes_read__i = bme280_read(Register__u8, Buffer__u8a,
-      Num_bytes_to_read__u8);
-    if (Num_bytes_read__i == (int)Num_bytes_to_read__u8)
+    int Bytes_read__ia[2];
+    bme280_read_batch(Registers__u8a, Data__u8pa, Num_bytes__u8a,
+      Bytes_read__ia, 2);
+    if (Bytes_read__ia[0] != 1)
+    {
+      return 0;
+    }
+    if ((Status__u8 & 0x01) != 0)
     {
-      // Decode the fields.
-
-      // Pressure is in registers 0xf7 ~ 0xf9.
-      // Most Significant Bits [19:12] of Pressure ADC value.
-      int32_t Pressure_raw_adc__i32 = ((int32_t)Buffer__u8a[0]) << 12;
-      // Mid/lower Significant Bits [11:4] of Pressure ADC value.
-      Pressure_raw_adc__i32 += ((int32_t)Buffer__u8a[1]) << 4;
-      // Least Significant Bits [3]|[3:2]|[3:1]|[3:0], depending on the
-      // resolution as determined by the oversampling setting.
-      Pressure_raw_adc__i32 += ((int32_t)Buffer__u8a[2]) & 0x04;
-
-      // Temperature is in registers 0xfa ~ 0xfc.
-      // Most Significant Bits [19:12] of Temperature ADC value.
-      int32_t Temperature_raw_adc__i32 = ((int32_t)Buffer__u8a[3]) << 12;
-      // Mid/lower Significant Bits [11:4] of Temperature ADC value.
-      Temperature_raw_adc__i32 += ((int32_t)Buffer__u8a[4]) << 4;
-      // Least Significant Bits [3]|[3:2]|[3:1]|[3:0], depending on the
-      // resolution as determined by the oversampling setting.
-      Temperature_raw_adc__i32 += ((int32_t)Buffer__u8a[5]) & 0x04;
-
-      // Humidity is in registers 0xfd ~ 0xfe.
-      // Most Significant Bits [15:8] of Humidity ADC value.
-      int32_t Humidity_raw_adc__i32 = (((int32_t)Buffer__u8a[6]) << 8);
-      // Least Significant Bits [7:0] of Humidity ADC value.
-      Humidity_raw_adc__i32 += ((int32_t)Buffer__u8a[7]);
-printf("raw H = 0x%08x\n", Humidity_raw_adc__i32);
-
-      *Temp_c__fp = bme280_compensate_T_int32(Temperature_raw_adc__i32) / 100.0;
-      *Pres_Pa__fp = bme280_compensate_P_int64(Pressure_raw_adc__i32) / 256.0;
-      *Hum_pct__fp = bme280_compensate_H_int32(Humidity_raw_adc__i32) / 1024.0;
-
-      Return_status__i = 1;
-      break;
+      continue;
+    }
+    if (Bytes_read__ia[1] == BME280_FRAME_LEN)
+    {
+      return 1;
     }
 
     Num_retries__i++;
     delay(1);
   }
 
-  return Return_status__i;
+  return 0;
 }
 
+///////////////////////////////////////////////////////////////////////////////
+int bme280_read_sensors(float * Temp_c__fp, float * Pres_Pa__fp,
+  float * Hum_pct__fp)
+{
+  uint8_t Buffer__u8a[BME280_FRAME_LEN];
+  if (bme280_read_frame(Buffer__u8a) != 1)
+  {
+    return 0;
+  }
+
+  bme280_compensate_frame(Buffer__u8a, Temp_c__fp, Pres_Pa__fp, Hum_pct__fp);
+  return 1;
+}
@@ -0,0 +1,237 @@
+///////////////////////////////////////////////////////////////////////////////
+//
+// bme280_sim.c:
+// A simulated BME280 that answers register reads over the bme280 SPI hook,
+// so the driver, decoding and compensation run unchanged without hardware.
+//
+///////////////////////////////////////////////////////////////////////////////
+
+#define _POSIX_C_SOURCE 200112L
+#include "bme280_sim.h"
+#include "bme280.h"
+#include <math.h>
+#include <string.h>
+#include <time.h>
+
+
+#define SIM_PI (3.14159265358979323846)
+
+// Register addresses, see the device register enum in bme280.c.
+enum
+{
+    eSimReg_DIG_T1   = 0x88
+  , eSimReg_DIG_H1   = 0xA1
+  , eSimReg_DIG_H2   = 0xE1
+  , eSimReg_CHIPID   = 0xD0
+  , eSimReg_STATUS   = 0xF3
+  , eSimReg_PRESDATA = 0xF7
+};
+
+// Which field of the frame a search works on.
+enum
+{
+    eSimField_PRES
+  , eSimField_TEMP
+  , eSimField_HUM
+};
+
+// Typical calibration values from the Bosch BME280 datasheet examples,
+// in register order starting at 0x88 (dig_T1 ~ dig_P9).
+static const uint16_t Sim_calib_T_P__u16a[12] =
+{
+  27504, 26435, (uint16_t)-1000,
+  36477, (uint16_t)-10685, 3024, 2855, 140, (uint16_t)-7, 15500,
+  (uint16_t)-14600, 6000
+};
+static const uint8_t Sim_dig_H1__u8 = 75;
+static const int16_t Sim_dig_H2__i16 = 362;
+static const uint8_t Sim_dig_H3__u8 = 0;
+static const int16_t Sim_dig_H4__i16 = 313;
+static const int16_t Sim_dig_H5__i16 = 50;
+static const int8_t Sim_dig_H6__i8 = 30;
+
+static uint8_t Sim_registers__u8a[256];
+
+
+///////////////////////////////////////////////////////////////////////////////
+static double sim_now_s(void)
+{
+  struct timespec Now__s;
+  clock_gettime(CLOCK_MONOTONIC, &Now__s);
+  return (double)Now__s.tv_sec + (double)Now__s.tv_nsec / 1e9;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Small deterministic noise in [-1, 1] for a seed and time slot.
+static double sim_noise(uint32_t Seed__u32, uint32_t Slot__u32)
+{
+  uint32_t Hash__u32 = Seed__u32 * 0x9E3779B9u ^ Slot__u32 * 0x85EBCA6Bu;
+  Hash__u32 ^= Hash__u32 >> 16;
+  Hash__u32 *= 0x7FEB352Du;
+  Hash__u32 ^= Hash__u32 >> 15;
+  return (double)(Hash__u32 & 0xFFFF) / 32767.5 - 1.0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+static void sim_set_adc(uint8_t * Frame__u8p, int Field__i, int32_t Adc__i32)
+{
+  switch (Field__i)
+  {
+  case eSimField_PRES:
+  case eSimField_TEMP:
+    // 20 bit value; only the top 16 bits are used since the driver keeps a
+    // single bit of the xlsb register.
+    Frame__u8p[Field__i * 3 + 0] = (uint8_t)(Adc__i32 >> 12);
+    Frame__u8p[Field__i * 3 + 1] = (uint8_t)(Adc__i32 >> 4);
+    Frame__u8p[Field__i * 3 + 2] = 0;
+    break;
+  default:
+    Frame__u8p[6] = (uint8_t)(Adc__i32 >> 8);
+    Frame__u8p[7] = (uint8_t)Adc__i32;
+    break;
+  }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Without the corrections of bme280_set_correction: the simulated sensor
+// reads as uncorrected as a real one.
+static double sim_decode_field(const uint8_t * Frame__u8p, int Field__i)
+{
+  int32_t Temp_cC__i32;
+  uint32_t Pres_q24_8__u32, Hum_q22_10__u32;
+  bme280_decode_frame(Frame__u8p, &Temp_cC__i32, &Pres_q24_8__u32, &Hum_q22_10__u32);
+  return (Field__i == eSimField_PRES) ? Pres_q24_8__u32 / 256.0
+    : (Field__i == eSimField_TEMP) ? Temp_cC__i32 / 100.0 : Hum_q22_10__u32 / 1024.0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Binary search for the raw value decoding closest to Target__d. Each
+// compensation is monotonic in its raw value, either rising or falling.
+static void sim_search(uint8_t * Frame__u8p, int Field__i, double Target__d)
+{
+  int32_t Shift__i32 = (Field__i == eSimField_HUM) ? 0 : 4;
+  int32_t Low__i32 = 0;
+  // Pressure compensation goes negative, and wraps, for raw values near the
+  // top of the 20 bit range.
+  int32_t High__i32 = (Field__i == eSimField_HUM) ? 0xFFFF : 0xEFFF;
+  int Rising__i;
+
+  sim_set_adc(Frame__u8p, Field__i, Low__i32 << Shift__i32);
+  double Low_value__d = sim_decode_field(Frame__u8p, Field__i);
+  sim_set_adc(Frame__u8p, Field__i, High__i32 << Shift__i32);
+  Rising__i = sim_decode_field(Frame__u8p, Field__i) > Low_value__d;
+
+  while (High__i32 - Low__i32 > 1)
+  {
+    int32_t Middle__i32 = (Low__i32 + High__i32) / 2;
+    sim_set_adc(Frame__u8p, Field__i, Middle__i32 << Shift__i32);
+    if ((sim_decode_field(Frame__u8p, Field__i) < Target__d) == Rising__i)
+    {
+      Low__i32 = Middle__i32;
+    }
+    else
+    {
+      High__i32 = Middle__i32;
+    }
+  }
+
+  sim_set_adc(Frame__u8p, Field__i, Low__i32 << Shift__i32);
+  double Low_error__d = fabs(sim_decode_field(Frame__u8p, Field__i) - Target__d);
+  sim_set_adc(Frame__u8p, Field__i, High__i32 << Shift__i32);
+  if (fabs(sim_decode_field(Frame__u8p, Field__i) - Target__d) > Low_error__d)
+  {
+    sim_set_adc(Frame__u8p, Field__i, Low__i32 << Shift__i32);
+  }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Full duplex transfer in the wiringPiSPIDataRW format: bit 7 of the first
+// byte set means a burst read from that register, otherwise the buffer holds
+// (register, value) pairs to write.
+static int sim_spi_xfer(int Channel__i, unsigned char * Data__u8p, int Len__i)
+{
+  (void)Channel__i;
+  if ((Len__i > 0) && ((Data__u8p[0] & 0x80) != 0))
+  {
+    uint8_t Register__u8 = Data__u8p[0];
+    int Idx__i;
+
+    if (Register__u8 <= eSimReg_PRESDATA + BME280_FRAME_LEN - 1
+      && Register__u8 + Len__i - 1 > eSimReg_PRESDATA)
+    {
+      double Temp_C__d, Pres_Pa__d, Hum_pct__d;
+      bme280_sim_readings(0, sim_now_s(), &Temp_C__d, &Pres_Pa__d, &Hum_pct__d);
+      bme280_sim_encode_frame(Temp_C__d, Pres_Pa__d, Hum_pct__d,
+        &Sim_registers__u8a[eSimReg_PRESDATA]);
+    }
+    for (Idx__i = 1; Idx__i < Len__i; Idx__i++)
+    {
+      Data__u8p[Idx__i] = Sim_registers__u8a[(uint8_t)(Register__u8 + Idx__i - 1)];
+    }
+  }
+  else
+  {
+    int Idx__i;
+    for (Idx__i = 0; Idx__i + 1 < Len__i; Idx__i += 2)
+    {
+      Sim_registers__u8a[Data__u8p[Idx__i] | 0x80] = Data__u8p[Idx__i + 1];
+    }
+  }
+  return Len__i;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+void bme280_sim_install(void)
+{
+  int Idx__i;
+
+  memset(Sim_registers__u8a, 0, sizeof(Sim_registers__u8a));
+  Sim_registers__u8a[eSimReg_CHIPID] = 0x60;
+  Sim_registers__u8a[eSimReg_STATUS] = 0x00;
+
+  for (Idx__i = 0; Idx__i < 12; Idx__i++)
+  {
+    Sim_registers__u8a[eSimReg_DIG_T1 + Idx__i * 2] = (uint8_t)Sim_calib_T_P__u16a[Idx__i];
+    Sim_registers__u8a[eSimReg_DIG_T1 + Idx__i * 2 + 1] = (uint8_t)(Sim_calib_T_P__u16a[Idx__i] >> 8);
+  }
+  Sim_registers__u8a[eSimReg_DIG_H1] = Sim_dig_H1__u8;
+  Sim_registers__u8a[eSimReg_DIG_H2 + 0] = (uint8_t)Sim_dig_H2__i16;
+  Sim_registers__u8a[eSimReg_DIG_H2 + 1] = (uint8_t)((uint16_t)Sim_dig_H2__i16 >> 8);
+  Sim_registers__u8a[eSimReg_DIG_H2 + 2] = Sim_dig_H3__u8;
+  Sim_registers__u8a[eSimReg_DIG_H2 + 3] = (uint8_t)(Sim_dig_H4__i16 >> 4);
+  Sim_registers__u8a[eSimReg_DIG_H2 + 4] = (uint8_t)((Sim_dig_H4__i16 & 0x0F) | ((Sim_dig_H5__i16 & 0x0F) << 4));
+  Sim_registers__u8a[eSimReg_DIG_H2 + 5] = (uint8_t)(Sim_dig_H5__i16 >> 4);
+  Sim_registers__u8a[eSimReg_DIG_H2 + 6] = (uint8_t)Sim_dig_H6__i8;
+
+  bme280_set_spi_xfer(sim_spi_xfer);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+void bme280_sim_readings(uint32_t Seed__u32, double Time_s__d,
+  double * Temp_C__dp, double * Pres_Pa__dp, double * Hum_pct__dp)
+{
+  double Phase__d = (double)(Seed__u32 % 360) * SIM_PI / 180.0;
+  uint32_t Slot__u32 = (uint32_t)(Time_s__d * 10.0);
+
+  *Temp_C__dp = 21.0 + (double)(Seed__u32 % 7) * 0.5
+    + 3.0 * sin(2.0 * SIM_PI * Time_s__d / 600.0 + Phase__d)
+    + 0.05 * sim_noise(Seed__u32, Slot__u32);
+  *Pres_Pa__dp = 101325.0
+    + 150.0 * sin(2.0 * SIM_PI * Time_s__d / 3600.0 + Phase__d)
+    + 2.0 * sim_noise(Seed__u32 + 1, Slot__u32);
+  *Hum_pct__dp = 45.0
+    + 10.0 * sin(2.0 * SIM_PI * Time_s__d / 900.0 + Phase__d)
+    + 0.2 * sim_noise(Seed__u32 + 2, Slot__u32);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+void bme280_sim_encode_frame(double Temp_C__d, double Pres_Pa__d,
+  double Hum_pct__d, uint8_t * Frame__u8p)
+{
+  memset(Frame__u8p, 0, BME280_FRAME_LEN);
+  // Pressure and humidity compensation depend on the temperature, so it has
+  // to be found first.
+  sim_search(Frame__u8p, eSimField_TEMP, Temp_C__d);
+  sim_search(Frame__u8p, eSimField_PRES, Pres_Pa__d);
+  sim_search(Frame__u8p, eSimField_HUM, Hum_pct__d);
+}
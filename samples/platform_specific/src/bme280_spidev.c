@@ -0,0 +1,131 @@
+///////////////////////////////////////////////////////////////////////////////
+//
+// bme280_spidev.c:
+// SPI backend for the bme280 driver on the Linux spidev interface, chaining
+// the reads the driver issues together into one SPI_IOC_MESSAGE ioctl.
+//
+///////////////////////////////////////////////////////////////////////////////
+
+#include "bme280_spidev.h"
+#include <fcntl.h>
+#include <linux/spi/spidev.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+
+
+// The Pi has chip enables 0 and 1 on SPI bus 0.
+#define SPIDEV_NUM_CHANNELS (2)
+// Transfers chained into one ioctl at most.
+#define SPIDEV_MAX_SEGMENTS (8)
+
+static int Spidev_fd__ia[SPIDEV_NUM_CHANNELS] = { -1, -1 };
+static uint32_t Spidev_speed_hz__u32a[SPIDEV_NUM_CHANNELS];
+
+
+///////////////////////////////////////////////////////////////////////////////
+static void spidev_fill(struct spi_ioc_transfer * Transfer__p, int Channel__i,
+  unsigned char * Data__u8p, int Len__i)
+{
+  memset(Transfer__p, 0, sizeof(*Transfer__p));
+  // Full duplex in place, like wiringPiSPIDataRW.
+  Transfer__p->tx_buf = (unsigned long)Data__u8p;
+  Transfer__p->rx_buf = (unsigned long)Data__u8p;
+  Transfer__p->len = (uint32_t)Len__i;
+  Transfer__p->speed_hz = Spidev_speed_hz__u32a[Channel__i];
+  Transfer__p->bits_per_word = 8;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+int bme280_spidev_open(int Channel__i, int Speed_hz__i)
+{
+  char Path__ca[32];
+  uint8_t Mode__u8 = SPI_MODE_0;
+  uint8_t Bits__u8 = 8;
+  uint32_t Speed_hz__u32 = (uint32_t)Speed_hz__i;
+  int Fd__i;
+
+  if ((Channel__i < 0) || (Channel__i >= SPIDEV_NUM_CHANNELS))
+  {
+    return 1;
+  }
+  snprintf(Path__ca, sizeof(Path__ca), "/dev/spidev0.%i", Channel__i);
+  Fd__i = open(Path__ca, O_RDWR);
+  if (Fd__i < 0)
+  {
+    return 1;
+  }
+  if ((ioctl(Fd__i, SPI_IOC_WR_MODE, &Mode__u8) < 0)
+    || (ioctl(Fd__i, SPI_IOC_WR_BITS_PER_WORD, &Bits__u8) < 0)
+    || (ioctl(Fd__i, SPI_IOC_WR_MAX_SPEED_HZ, &Speed_hz__u32) < 0))
+  {
+    close(Fd__i);
+    return 1;
+  }
+
+  if (Spidev_fd__ia[Channel__i] >= 0)
+  {
+    close(Spidev_fd__ia[Channel__i]);
+  }
+  Spidev_fd__ia[Channel__i] = Fd__i;
+  Spidev_speed_hz__u32a[Channel__i] = Speed_hz__u32;
+
+  bme280_set_spi_xfer(bme280_spidev_xfer);
+  bme280_set_spi_xfer_batch(bme280_spidev_xfer_batch);
+  return 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+void bme280_spidev_close(void)
+{
+  int Channel__i;
+  for (Channel__i = 0; Channel__i < SPIDEV_NUM_CHANNELS; Channel__i++)
+  {
+    if (Spidev_fd__ia[Channel__i] >= 0)
+    {
+      close(Spidev_fd__ia[Channel__i]);
+      Spidev_fd__ia[Channel__i] = -1;
+    }
+  }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+int bme280_spidev_xfer(int Channel__i, unsigned char * Data__u8p, int Len__i)
+{
+  struct spi_ioc_transfer Transfer__s;
+
+  if ((Channel__i < 0) || (Channel__i >= SPIDEV_NUM_CHANNELS)
+    || (Spidev_fd__ia[Channel__i] < 0))
+  {
+    return -1;
+  }
+  spidev_fill(&Transfer__s, Channel__i, Data__u8p, Len__i);
+  return ioctl(Spidev_fd__ia[Channel__i], SPI_IOC_MESSAGE(1), &Transfer__s);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+int bme280_spidev_xfer_batch(int Channel__i,
+  bme280_spi_segment_t * Segments__p, int Num_segments__i)
+{
+  struct spi_ioc_transfer Transfers__sa[SPIDEV_MAX_SEGMENTS];
+  int Segment_idx__i;
+
+  if ((Channel__i < 0) || (Channel__i >= SPIDEV_NUM_CHANNELS)
+    || (Spidev_fd__ia[Channel__i] < 0)
+    || (Num_segments__i < 1) || (Num_segments__i > SPIDEV_MAX_SEGMENTS))
+  {
+    return -1;
+  }
+  for (Segment_idx__i = 0; Segment_idx__i < Num_segments__i; Segment_idx__i++)
+  {
+    spidev_fill(&Transfers__sa[Segment_idx__i], Channel__i,
+      Segments__p[Segment_idx__i].Data__u8p, Segments__p[Segment_idx__i].Len__i);
+    // Every segment is a register access of its own, so release chip select
+    // after each but the last (where cs_change would keep it asserted).
+    Transfers__sa[Segment_idx__i].cs_change = (Segment_idx__i + 1 < Num_segments__i);
+  }
+  return ioctl(Spidev_fd__ia[Channel__i], SPI_IOC_MESSAGE(Num_segments__i),
+    Transfers__sa);
+}
@@ -0,0 +1,526 @@
+///////////////////////////////////////////////////////////////////////////////
+//
+// command_dispatch.c:
+// In place parsing and perfect hash dispatch of cloud-to-device commands.
+//
+// The slots of a table are a power of two, at least twice the number of
+// commands, so a seed that separates all names is found within a few tries.
+// A slot is picked by the top bits of the hash: the low bits of FNV-1a only
+// depend on the low bits of the seed and the name. Each slot holds the index
+// of its entry plus one; a lookup is one hash and one compare.
+//
+///////////////////////////////////////////////////////////////////////////////
+
+#include "command_dispatch.h"
+#include <limits.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+
+// Nesting accepted inside parameter values.
+#define CD_MAX_DEPTH (16)
+
+// Seeds tried before giving up on a table.
+#define CD_MAX_SEEDS (1u << 16)
+
+// Longest number text command_arg_double converts.
+#define CD_MAX_NUMBER_LEN (32)
+
+struct command_table_tag
+{
+  const command_entry_t * Entries__p;
+  uint32_t Seed__u32;
+  // 32 minus the number of bits of a slot index.
+  int Shift__i;
+  uint16_t * Slots__u16p;
+};
+
+typedef struct
+{
+  const char * Text__cp;
+  size_t Len__z;
+  size_t Pos__z;
+} cd_parser_t;
+
+
+///////////////////////////////////////////////////////////////////////////////
+// FNV-1a, with the seed mixed into the offset basis.
+static uint32_t cd_hash(uint32_t Seed__u32, const char * Name__cp, size_t Len__z)
+{
+  uint32_t Hash__u32 = 2166136261u ^ (Seed__u32 * 16777619u);
+  size_t Idx__z;
+  for (Idx__z = 0; Idx__z < Len__z; Idx__z++)
+  {
+    Hash__u32 ^= (uint8_t)Name__cp[Idx__z];
+    Hash__u32 *= 16777619u;
+  }
+  return Hash__u32;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+static int cd_name_equals(const char * Span__cp, size_t Len__z, const char * Name__cp)
+{
+  return strlen(Name__cp) == Len__z && memcmp(Span__cp, Name__cp, Len__z) == 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Characters of numbers, true, false and null.
+static int cd_is_literal_char(char Char__c)
+{
+  return (Char__c >= '0' && Char__c <= '9') || (Char__c >= 'a' && Char__c <= 'u') ||
+    Char__c == '-' || Char__c == '+' || Char__c == '.' || Char__c == 'E';
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Skips white space.
+// Return: the next character, or 0 at the end of the message.
+static char cd_peek(cd_parser_t * Parser__p)
+{
+  while (Parser__p->Pos__z < Parser__p->Len__z)
+  {
+    char Char__c = Parser__p->Text__cp[Parser__p->Pos__z];
+    if (Char__c != ' ' && Char__c != '\t' && Char__c != '\r' && Char__c != '\n')
+    {
+      return Char__c;
+    }
+    Parser__p->Pos__z++;
+  }
+  return 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+static int cd_expect(cd_parser_t * Parser__p, char Char__c)
+{
+  if (cd_peek(Parser__p) != Char__c)
+  {
+    return 1;
+  }
+  Parser__p->Pos__z++;
+  return 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Param: Start__cpp, Len__zp  Receive the contents, without the quotes and
+//                             with escapes as they are.
+static int cd_parse_string(cd_parser_t * Parser__p, const char ** Start__cpp,
+  size_t * Len__zp)
+{
+  size_t Start__z;
+
+  if (cd_expect(Parser__p, '"'))
+  {
+    return 1;
+  }
+  Start__z = Parser__p->Pos__z;
+  while (Parser__p->Pos__z < Parser__p->Len__z)
+  {
+    char Char__c = Parser__p->Text__cp[Parser__p->Pos__z++];
+    if (Char__c == '"')
+    {
+      *Start__cpp = Parser__p->Text__cp + Start__z;
+      *Len__zp = Parser__p->Pos__z - 1 - Start__z;
+      return 0;
+    }
+    if (Char__c == '\\')
+    {
+      Parser__p->Pos__z++;
+    }
+    else if ((uint8_t)Char__c < 0x20)
+    {
+      return 1;
+    }
+  }
+  return 1;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Param: Start__cpp, Len__zp  Receive the raw text of the value.
+static int cd_parse_value(cd_parser_t * Parser__p, int Depth__i,
+  const char ** Start__cpp, size_t * Len__zp)
+{
+  char Char__c = cd_peek(Parser__p);
+  size_t Start__z = Parser__p->Pos__z;
+  const char * Unused__cp;
+  size_t Unused__z;
+
+  if (Char__c == '"')
+  {
+    if (cd_parse_string(Parser__p, &Unused__cp, &Unused__z))
+    {
+      return 1;
+    }
+  }
+  else if (Char__c == '{' || Char__c == '[')
+  {
+    char Close__c = (Char__c == '{') ? '}' : ']';
+    if (Depth__i >= CD_MAX_DEPTH)
+    {
+      return 1;
+    }
+    Parser__p->Pos__z++;
+    if (cd_peek(Parser__p) == Close__c)
+    {
+      Parser__p->Pos__z++;
+    }
+    else
+    {
+      do
+      {
+        if (Close__c == '}' && (cd_parse_string(Parser__p, &Unused__cp, &Unused__z) || cd_expect(Parser__p, ':')))
+        {
+          return 1;
+        }
+        if (cd_parse_value(Parser__p, Depth__i + 1, &Unused__cp, &Unused__z))
+        {
+          return 1;
+        }
+      } while (cd_expect(Parser__p, ',') == 0);
+      if (cd_expect(Parser__p, Close__c))
+      {
+        return 1;
+      }
+    }
+  }
+  else
+  {
+    // Numbers, true, false and null.
+    while (Parser__p->Pos__z < Parser__p->Len__z &&
+      cd_is_literal_char(Parser__p->Text__cp[Parser__p->Pos__z]))
+    {
+      Parser__p->Pos__z++;
+    }
+    if (Parser__p->Pos__z == Start__z)
+    {
+      return 1;
+    }
+  }
+  *Start__cpp = Parser__p->Text__cp + Start__z;
+  *Len__zp = Parser__p->Pos__z - Start__z;
+  return 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Parses one command object and resolves its name.
+// Return: COMMAND_SUCCESS, or COMMAND_FAILED if the command is malformed or
+//         unknown.
+static COMMAND_RESULT cd_parse_command(const command_table_t * Table__p,
+  cd_parser_t * Parser__p, const command_entry_t ** Entry__pp,
+  command_args_t * Args__p)
+{
+  const char * Name__cp = NULL;
+  size_t Name_len__z = 0;
+
+  Args__p->Count__z = 0;
+  if (cd_expect(Parser__p, '{'))
+  {
+    return COMMAND_FAILED;
+  }
+  if (cd_peek(Parser__p) != '}')
+  {
+    do
+    {
+      const char * Key__cp;
+      size_t Key_len__z;
+      const char * Value__cp;
+      size_t Value_len__z;
+
+      if (cd_parse_string(Parser__p, &Key__cp, &Key_len__z) || cd_expect(Parser__p, ':'))
+      {
+        return COMMAND_FAILED;
+      }
+      if (cd_name_equals(Key__cp, Key_len__z, "Name"))
+      {
+        if (cd_parse_string(Parser__p, &Name__cp, &Name_len__z))
+        {
+          return COMMAND_FAILED;
+        }
+      }
+      else if (cd_name_equals(Key__cp, Key_len__z, "Parameters") && cd_peek(Parser__p) == '{')
+      {
+        Parser__p->Pos__z++;
+        if (cd_peek(Parser__p) != '}')
+        {
+          do
+          {
+            command_param_t * Param__p;
+            if (Args__p->Count__z == COMMAND_MAX_PARAMS)
+            {
+              return COMMAND_FAILED;
+            }
+            Param__p = &Args__p->Params__a[Args__p->Count__z++];
+            if (cd_parse_string(Parser__p, &Param__p->Name__cp, &Param__p->Name_len__z) ||
+              cd_expect(Parser__p, ':') ||
+              cd_parse_value(Parser__p, 1, &Param__p->Value__cp, &Param__p->Value_len__z))
+            {
+              return COMMAND_FAILED;
+            }
+          } while (cd_expect(Parser__p, ',') == 0);
+        }
+        if (cd_expect(Parser__p, '}'))
+        {
+          return COMMAND_FAILED;
+        }
+      }
+      else if (cd_parse_value(Parser__p, 1, &Value__cp, &Value_len__z))
+      {
+        return COMMAND_FAILED;
+      }
+    } while (cd_expect(Parser__p, ',') == 0);
+  }
+  if (cd_expect(Parser__p, '}') || Name__cp == NULL)
+  {
+    return COMMAND_FAILED;
+  }
+  *Entry__pp = command_table_find(Table__p, Name__cp, Name_len__z);
+  return (*Entry__pp == NULL) ? COMMAND_FAILED : COMMAND_SUCCESS;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+static void cd_run(const command_entry_t * Entry__p, const command_args_t * Args__p,
+  void * Context__p, COMMAND_RESULT * Result__ep, size_t * Executed__zp)
+{
+  COMMAND_RESULT Command__e = Entry__p->Handler__fp(Context__p, Args__p);
+  if (Command__e > *Result__ep)
+  {
+    *Result__ep = Command__e;
+  }
+  (*Executed__zp)++;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Goes through the message once, running the commands only with Run__i. A
+// single command runs once the message is known to be valid; the commands
+// of a batch as they are parsed, so a batch is first walked without Run__i.
+static COMMAND_RESULT cd_walk(const command_table_t * Table__p,
+  const char * Message__cp, size_t Len__z, int Run__i, void * Context__p,
+  size_t * Executed__zp)
+{
+  cd_parser_t Parser__s = { Message__cp, Len__z, 0 };
+  COMMAND_RESULT Result__e = COMMAND_SUCCESS;
+  int Batch__i = (cd_peek(&Parser__s) == '[');
+  command_args_t Args__s;
+  const command_entry_t * Entry__p;
+
+  if (Batch__i)
+  {
+    Parser__s.Pos__z++;
+    if (cd_peek(&Parser__s) == ']')
+    {
+      Parser__s.Pos__z++;
+      return (cd_peek(&Parser__s) == 0) ? COMMAND_SUCCESS : COMMAND_FAILED;
+    }
+  }
+  do
+  {
+    if (cd_parse_command(Table__p, &Parser__s, &Entry__p, &Args__s) != COMMAND_SUCCESS)
+    {
+      return COMMAND_FAILED;
+    }
+    if (Run__i && Batch__i)
+    {
+      cd_run(Entry__p, &Args__s, Context__p, &Result__e, Executed__zp);
+    }
+  } while (Batch__i && cd_expect(&Parser__s, ',') == 0);
+
+  if ((Batch__i && cd_expect(&Parser__s, ']')) || cd_peek(&Parser__s) != 0)
+  {
+    return COMMAND_FAILED;
+  }
+  if (Run__i && !Batch__i)
+  {
+    cd_run(Entry__p, &Args__s, Context__p, &Result__e, Executed__zp);
+  }
+  return Result__e;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+command_table_t * command_table_create(const command_entry_t * Entries__p,
+  size_t Count__z)
+{
+  command_table_t * Table__p;
+  uint32_t Slots__u32 = 2;
+  int Shift__i = 31;
+  uint32_t Seed__u32;
+  size_t Idx__z;
+
+  if (Count__z >= UINT16_MAX)
+  {
+    return NULL;
+  }
+  while (Slots__u32 < 2 * Count__z)
+  {
+    Slots__u32 *= 2;
+    Shift__i--;
+  }
+  Table__p = malloc(sizeof(command_table_t));
+  if (Table__p == NULL)
+  {
+    return NULL;
+  }
+  Table__p->Entries__p = Entries__p;
+  Table__p->Shift__i = Shift__i;
+  Table__p->Slots__u16p = malloc(Slots__u32 * sizeof(uint16_t));
+  if (Table__p->Slots__u16p == NULL)
+  {
+    free(Table__p);
+    return NULL;
+  }
+
+  for (Seed__u32 = 0; Seed__u32 < CD_MAX_SEEDS; Seed__u32++)
+  {
+    memset(Table__p->Slots__u16p, 0, Slots__u32 * sizeof(uint16_t));
+    for (Idx__z = 0; Idx__z < Count__z; Idx__z++)
+    {
+      uint32_t Slot__u32 = cd_hash(Seed__u32, Entries__p[Idx__z].Name__cp,
+        strlen(Entries__p[Idx__z].Name__cp)) >> Shift__i;
+      if (Table__p->Slots__u16p[Slot__u32] != 0)
+      {
+        break;
+      }
+      Table__p->Slots__u16p[Slot__u32] = (uint16_t)(Idx__z + 1);
+    }
+    if (Idx__z == Count__z)
+    {
+      Table__p->Seed__u32 = Seed__u32;
+      return Table__p;
+    }
+  }
+
+  // Only repeated names collide under every seed.
+  command_table_destroy(Table__p);
+  return NULL;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+void command_table_destroy(command_table_t * Table__p)
+{
+  if (Table__p != NULL)
+  {
+    free(Table__p->Slots__u16p);
+    free(Table__p);
+  }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+const command_entry_t * command_table_find(const command_table_t * Table__p,
+  const char * Name__cp, size_t Name_len__z)
+{
+  uint16_t Slot__u16 = Table__p->Slots__u16p[
+    cd_hash(Table__p->Seed__u32, Name__cp, Name_len__z) >> Table__p->Shift__i];
+  const command_entry_t * Entry__p;
+
+  if (Slot__u16 == 0)
+  {
+    return NULL;
+  }
+  Entry__p = &Table__p->Entries__p[Slot__u16 - 1];
+  return cd_name_equals(Name__cp, Name_len__z, Entry__p->Name__cp) ? Entry__p : NULL;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+COMMAND_RESULT command_dispatch(const command_table_t * Table__p,
+  const char * Message__cp, size_t Len__z, void * Context__p,
+  size_t * Executed__zp)
+{
+  cd_parser_t Parser__s = { Message__cp, Len__z, 0 };
+  size_t Executed__z = 0;
+  int Batch__i = (cd_peek(&Parser__s) == '[');
+  COMMAND_RESULT Result__e = cd_walk(Table__p, Message__cp, Len__z, !Batch__i, Context__p, &Executed__z);
+
+  if (Batch__i && Result__e == COMMAND_SUCCESS)
+  {
+    Result__e = cd_walk(Table__p, Message__cp, Len__z, 1, Context__p, &Executed__z);
+  }
+  if (Executed__zp != NULL)
+  {
+    *Executed__zp = Executed__z;
+  }
+  return Result__e;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+const command_param_t * command_arg_find(const command_args_t * Args__p,
+  const char * Name__cp)
+{
+  size_t Idx__z;
+  for (Idx__z = 0; Idx__z < Args__p->Count__z; Idx__z++)
+  {
+    const command_param_t * Param__p = &Args__p->Params__a[Idx__z];
+    if (cd_name_equals(Param__p->Name__cp, Param__p->Name_len__z, Name__cp))
+    {
+      return Param__p;
+    }
+  }
+  return NULL;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+int command_arg_int(const command_args_t * Args__p, const char * Name__cp,
+  int * Value__ip)
+{
+  const command_param_t * Param__p = command_arg_find(Args__p, Name__cp);
+  int64_t Value__i64 = 0;
+  size_t Idx__z = 0;
+  int Negative__i;
+
+  if (Param__p == NULL || Param__p->Value_len__z == 0)
+  {
+    return 1;
+  }
+  Negative__i = (Param__p->Value__cp[0] == '-');
+  Idx__z = (size_t)Negative__i;
+  if (Idx__z == Param__p->Value_len__z)
+  {
+    return 1;
+  }
+  for (; Idx__z < Param__p->Value_len__z; Idx__z++)
+  {
+    char Char__c = Param__p->Value__cp[Idx__z];
+    if (Char__c < '0' || Char__c > '9')
+    {
+      return 1;
+    }
+    Value__i64 = Value__i64 * 10 + (Char__c - '0');
+    if (Value__i64 > (int64_t)INT_MAX + 1)
+    {
+      return 1;
+    }
+  }
+  if (Negative__i)
+  {
+    Value__i64 = -Value__i64;
+  }
+  if (Value__i64 > INT_MAX || Value__i64 < INT_MIN)
+  {
+    return 1;
+  }
+  *Value__ip = (int)Value__i64;
+  return 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+int command_arg_double(const command_args_t * Args__p, const char * Name__cp,
+  double * Value__dp)
+{
+  const command_param_t * Param__p = command_arg_find(Args__p, Name__cp);
+  char Number__ca[CD_MAX_NUMBER_LEN + 1];
+  char * End__cp;
+  double Value__d;
+
+  if (Param__p == NULL || Param__p->Value_len__z == 0 ||
+    Param__p->Value_len__z > CD_MAX_NUMBER_LEN ||
+    Param__p->Value__cp[0] == '\0' || strchr("-0123456789", Param__p->Value__cp[0]) == NULL)
+  {
+    return 1;
+  }
+  memcpy(Number__ca, Param__p->Value__cp, Param__p->Value_len__z);
+  Number__ca[Param__p->Value_len__z] = '\0';
+  Value__d = strtod(Number__ca, &End__cp);
+  if (*End__cp != '\0')
+  {
+    return 1;
+  }
+  *Value__dp = Value__d;
+  return 0;
+}
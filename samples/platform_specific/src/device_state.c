@@ -0,0 +1,133 @@
+///////////////////////////////////////////////////////////////////////////////
+//
+// device_state.c:
+// A snapshot of state shared between callbacks and the sampling loop.
+//
+///////////////////////////////////////////////////////////////////////////////
+
+#define _GNU_SOURCE
+#include "device_state.h"
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+
+
+// Spins before a waiting reader or updater gives the core to the thread it
+// waits for, which on a single core Pi may be preempted mid update.
+#define DEVICE_STATE_SPINS (64)
+
+struct device_state_tag
+{
+  // Odd while an update runs.
+  uint32_t Seq__u32;
+  size_t Len__z;
+  // The state, aligned for any struct of the caller.
+  uint64_t Data__u64a[];
+};
+
+
+///////////////////////////////////////////////////////////////////////////////
+static void device_state_wait(uint32_t * Spins__u32p)
+{
+  if (++*Spins__u32p % DEVICE_STATE_SPINS == 0)
+  {
+    (void)sched_yield();
+  }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+device_state_t * device_state_create(const void * Initial__p, size_t Len__z)
+{
+  device_state_t * State__p = (device_state_t *)malloc(sizeof(device_state_t)
+    + (Len__z + sizeof(uint64_t) - 1) / sizeof(uint64_t) * sizeof(uint64_t));
+
+  if (State__p != NULL)
+  {
+    State__p->Seq__u32 = 0;
+    State__p->Len__z = Len__z;
+    memcpy(State__p->Data__u64a, Initial__p, Len__z);
+  }
+  return State__p;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+void device_state_destroy(device_state_t * State__p)
+{
+  free(State__p);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+uint32_t device_state_read(const device_state_t * State__p, void * Copy__p)
+{
+  uint32_t Spins__u32 = 0;
+
+  for (;;)
+  {
+    uint32_t Begin__u32 = __atomic_load_n(&State__p->Seq__u32, __ATOMIC_ACQUIRE);
+
+    if ((Begin__u32 & 1) == 0)
+    {
+      memcpy(Copy__p, State__p->Data__u64a, State__p->Len__z);
+      // The copy is complete before the sequence is checked again.
+      __atomic_thread_fence(__ATOMIC_ACQUIRE);
+      if (__atomic_load_n(&State__p->Seq__u32, __ATOMIC_RELAXED) == Begin__u32)
+      {
+        return Begin__u32 / 2;
+      }
+    }
+    device_state_wait(&Spins__u32);
+  }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+int device_state_try_read(const device_state_t * State__p, void * Copy__p,
+  uint32_t Attempts__u32, uint32_t * Version__u32p)
+{
+  uint32_t Attempt__u32;
+
+  for (Attempt__u32 = 0; Attempt__u32 < Attempts__u32; Attempt__u32++)
+  {
+    uint32_t Begin__u32 = __atomic_load_n(&State__p->Seq__u32, __ATOMIC_ACQUIRE);
+
+    if ((Begin__u32 & 1) == 0)
+    {
+      memcpy(Copy__p, State__p->Data__u64a, State__p->Len__z);
+      __atomic_thread_fence(__ATOMIC_ACQUIRE);
+      if (__atomic_load_n(&State__p->Seq__u32, __ATOMIC_RELAXED) == Begin__u32)
+      {
+        *Version__u32p = Begin__u32 / 2;
+        return 0;
+      }
+    }
+  }
+  return 1;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+int device_state_update(device_state_t * State__p,
+  device_state_update_fn Update__fp, void * Context__p)
+{
+  uint32_t Spins__u32 = 0;
+  uint32_t Seq__u32 = __atomic_load_n(&State__p->Seq__u32, __ATOMIC_RELAXED);
+  int Result__i;
+
+  // Taking the sequence from even to odd holds off the other updaters.
+  while ((Seq__u32 & 1) != 0 ||
+    !__atomic_compare_exchange_n(&State__p->Seq__u32, &Seq__u32, Seq__u32 + 1,
+      0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+  {
+    device_state_wait(&Spins__u32);
+    Seq__u32 = __atomic_load_n(&State__p->Seq__u32, __ATOMIC_RELAXED);
+  }
+  // Readers see the odd sequence before any of the changes.
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  Result__i = Update__fp(State__p->Data__u64a, Context__p);
+  __atomic_store_n(&State__p->Seq__u32, Seq__u32 + 2, __ATOMIC_RELEASE);
+  return Result__i;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+uint32_t device_state_version(const device_state_t * State__p)
+{
+  return __atomic_load_n(&State__p->Seq__u32, __ATOMIC_ACQUIRE) / 2;
+}
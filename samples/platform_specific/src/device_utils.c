@@ -0,0 +1,142 @@
+///////////////////////////////////////////////////////////////////////////////
+//
+// device_utils.c:
+// Text helpers of the samples.
+//
+///////////////////////////////////////////////////////////////////////////////
+
+#include "device_utils.h"
+#include "time_service.h"
+#include <ctype.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+
+///////////////////////////////////////////////////////////////////////////////
+bool GetNumberFromString(const unsigned char* text, size_t size, int* pValue)
+{
+  const unsigned char* pStart = text;
+  for (; pStart < text + size; pStart++)
+  {
+    if (isdigit(*pStart))
+    {
+      break;
+    }
+  }
+
+  const unsigned char* pEnd = pStart + 1;
+  for (; pEnd <= text + size; pEnd++)
+  {
+    if (!isdigit(*pEnd))
+    {
+      break;
+    }
+  }
+
+  if (pStart >= text + size)
+  {
+    return false;
+  }
+
+  char buffer[16] = { 0 };
+  strncpy(buffer, (const char*)pStart, pEnd - pStart);
+
+  *pValue = atoi(buffer);
+  return true;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// The ISO-8601 form cut after the seconds, with a space for the 'T'.
+char* FormatTime_r(const time_t* time, char* buffer, size_t size)
+{
+  char iso[TIME_ISO8601_LEN];
+
+  if (size < FORMAT_TIME_LEN || *time < 0
+    || time_format_iso8601((uint64_t)*time * 1000000, iso, sizeof(iso)) == 0)
+  {
+    if (size > 0)
+    {
+      buffer[0] = '\0';
+    }
+    return buffer;
+  }
+  iso[10] = ' ';
+  memcpy(buffer, iso, FORMAT_TIME_LEN - 1);
+  buffer[FORMAT_TIME_LEN - 1] = '\0';
+  return buffer;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+char* FormatTime(time_t* time)
+{
+  static char buffer[FORMAT_TIME_LEN];
+
+  return FormatTime_r(time, buffer, sizeof(buffer));
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// The argument list is walked twice, once to size the buffer and once to fill
+// it, so the first pass works on a copy.
+void AllocAndVPrintf(unsigned char** buffer, size_t* size, const char* format,
+  va_list argptr)
+{
+  va_list Sizing_args__va;
+  va_copy(Sizing_args__va, argptr);
+  *size = vsnprintf(NULL, 0, format, Sizing_args__va);
+  va_end(Sizing_args__va);
+
+  *buffer = malloc(*size + 1);
+  vsprintf((char*)*buffer, format, argptr);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+char* CopyString(const char* text, size_t length)
+{
+  char* copy = malloc(length + 1);
+  if (copy != NULL)
+  {
+    memcpy(copy, text, length);
+    copy[length] = '\0';
+  }
+  return copy;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+char* ReadTextFile(const char* path)
+{
+  char* result = NULL;
+  FILE* fp = fopen(path, "rb");
+
+  if (fp == NULL)
+  {
+    printf("Failed to open %s\r\n", path);
+  }
+  else
+  {
+    long size;
+    if (fseek(fp, 0, SEEK_END) == 0 && (size = ftell(fp)) >= 0 && fseek(fp, 0, SEEK_SET) == 0 &&
+      (result = malloc((size_t)size + 1)) != NULL)
+    {
+      size_t read = fread(result, 1, (size_t)size, fp);
+      result[read] = '\0';
+    }
+    fclose(fp);
+  }
+  return result;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+int ParseUnsigned(const char* text, unsigned int* value)
+{
+  char* end;
+  unsigned long parsed = strtoul(text, &end, 10);
+  if (*text == '\0' || *end != '\0' || parsed > UINT_MAX)
+  {
+    printf("Invalid number: %s\n", text);
+    return 1;
+  }
+  *value = (unsigned int)parsed;
+  return 0;
+}
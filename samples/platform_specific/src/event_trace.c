@@ -0,0 +1,282 @@
+///////////////////////////////////////////////////////////////////////////////
+//
+// event_trace.c:
+// A ring of pipeline events, written out as Chrome trace event JSON.
+//
+///////////////////////////////////////////////////////////////////////////////
+
+#define _GNU_SOURCE
+#include "event_trace.h"
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+
+#define EVENT_TRACE_MAX_EVENTS (1u << 30)
+#define EVENT_TRACE_THREADS (16)
+
+typedef struct
+{
+  // 2 * index + 1 while the event of that index is written, 2 * index + 2
+  // once it is complete.
+  uint32_t Seq__u32;
+  uint32_t Tid__u32;
+  uint64_t Time_ns__u64;
+  const char * Name__cp;
+  uint64_t Arg__u64;
+  uint32_t Phase__u32;
+} event_trace_slot_t;
+
+typedef struct
+{
+  uint32_t Mask__u32;
+  uint64_t Next__u64;
+  event_trace_slot_t Slots__sa[];
+} event_trace_ring_t;
+
+typedef struct
+{
+  // 0 until Name__cp is set.
+  uint32_t Tid__u32;
+  const char * Name__cp;
+} event_trace_thread_t;
+
+// NULL unless started.
+static event_trace_ring_t * Ring__p = NULL;
+static event_trace_thread_t Threads__sa[EVENT_TRACE_THREADS];
+static uint32_t Thread_count__u32 = 0;
+static __thread uint32_t Tid__u32 = 0;
+
+// Chrome's letters for event_trace_phase_t.
+static const char Phases__ca[] = { 'B', 'E', 'i', 'b', 'e' };
+
+
+///////////////////////////////////////////////////////////////////////////////
+static uint32_t event_trace_tid(void)
+{
+  if (Tid__u32 == 0)
+  {
+    Tid__u32 = (uint32_t)syscall(SYS_gettid);
+  }
+  return Tid__u32;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+static uint64_t event_trace_now_ns(void)
+{
+  struct timespec Now__s;
+
+  (void)clock_gettime(CLOCK_MONOTONIC, &Now__s);
+  return (uint64_t)Now__s.tv_sec * 1000000000ULL + (uint64_t)Now__s.tv_nsec;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+int event_trace_start(uint32_t Events__u32)
+{
+  event_trace_ring_t * New__p;
+  uint32_t Capacity__u32 = 1;
+
+  if (Events__u32 == 0 || Events__u32 > EVENT_TRACE_MAX_EVENTS ||
+    __atomic_load_n(&Ring__p, __ATOMIC_ACQUIRE) != NULL)
+  {
+    return 1;
+  }
+  while (Capacity__u32 < Events__u32)
+  {
+    Capacity__u32 <<= 1;
+  }
+  // Zeroed slots have sequence 0, which matches no index.
+  New__p = (event_trace_ring_t *)calloc(1, sizeof(event_trace_ring_t)
+    + Capacity__u32 * sizeof(event_trace_slot_t));
+  if (New__p == NULL)
+  {
+    return 1;
+  }
+  New__p->Mask__u32 = Capacity__u32 - 1;
+  __atomic_store_n(&Ring__p, New__p, __ATOMIC_RELEASE);
+  return 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+void event_trace_stop(void)
+{
+  free(__atomic_exchange_n(&Ring__p, NULL, __ATOMIC_ACQ_REL));
+}
+
+///////////////////////////////////////////////////////////////////////////////
+void event_trace_record(event_trace_phase_t Phase__e, const char * Name__cp,
+  uint64_t Arg__u64)
+{
+  event_trace_ring_t * Ring__sp = __atomic_load_n(&Ring__p, __ATOMIC_ACQUIRE);
+  event_trace_slot_t * Slot__p;
+  uint64_t Index__u64;
+
+  if (Ring__sp == NULL)
+  {
+    return;
+  }
+  Index__u64 = __atomic_fetch_add(&Ring__sp->Next__u64, 1, __ATOMIC_RELAXED);
+  Slot__p = &Ring__sp->Slots__sa[Index__u64 & Ring__sp->Mask__u32];
+
+  __atomic_store_n(&Slot__p->Seq__u32, (uint32_t)(Index__u64 * 2 + 1), __ATOMIC_RELAXED);
+  // A dump sees the odd sequence before any of the new fields.
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  Slot__p->Tid__u32 = event_trace_tid();
+  Slot__p->Time_ns__u64 = event_trace_now_ns();
+  Slot__p->Name__cp = Name__cp;
+  Slot__p->Arg__u64 = Arg__u64;
+  Slot__p->Phase__u32 = (uint32_t)Phase__e;
+  __atomic_store_n(&Slot__p->Seq__u32, (uint32_t)(Index__u64 * 2 + 2), __ATOMIC_RELEASE);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+void event_trace_name_thread(const char * Name__cp)
+{
+  uint32_t Index__u32 = __atomic_fetch_add(&Thread_count__u32, 1, __ATOMIC_RELAXED);
+
+  if (Index__u32 < EVENT_TRACE_THREADS)
+  {
+    Threads__sa[Index__u32].Name__cp = Name__cp;
+    __atomic_store_n(&Threads__sa[Index__u32].Tid__u32, event_trace_tid(), __ATOMIC_RELEASE);
+  }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Copies the event of Index__u64.
+// Return: 0 on success, 1 if it is being written or was overwritten.
+static int event_trace_read(const event_trace_ring_t * Ring__sp,
+  uint64_t Index__u64, event_trace_slot_t * Copy__p)
+{
+  const event_trace_slot_t * Slot__p = &Ring__sp->Slots__sa[Index__u64 & Ring__sp->Mask__u32];
+  uint32_t Seq__u32 = (uint32_t)(Index__u64 * 2 + 2);
+
+  if (__atomic_load_n(&Slot__p->Seq__u32, __ATOMIC_ACQUIRE) != Seq__u32)
+  {
+    return 1;
+  }
+  memcpy(Copy__p, Slot__p, sizeof(*Copy__p));
+  // The copy is complete before the sequence is checked again.
+  __atomic_thread_fence(__ATOMIC_ACQUIRE);
+  return (__atomic_load_n(&Slot__p->Seq__u32, __ATOMIC_RELAXED) == Seq__u32) ? 0 : 1;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+int event_trace_write_json(const char * Path__cp, uint32_t * Events__u32p)
+{
+  event_trace_ring_t * Ring__sp = __atomic_load_n(&Ring__p, __ATOMIC_ACQUIRE);
+  uint32_t Written__u32 = 0;
+  uint32_t Count__u32;
+  uint32_t Index__u32;
+  uint64_t Next__u64;
+  uint64_t First__u64;
+  uint64_t Index__u64;
+  char * Temp__cp;
+  FILE * File__p;
+  int Pid__i = (int)getpid();
+  int Result__i;
+
+  if (Ring__sp == NULL)
+  {
+    return 1;
+  }
+  Temp__cp = (char *)malloc(strlen(Path__cp) + sizeof(".tmp"));
+  if (Temp__cp == NULL)
+  {
+    return 1;
+  }
+  sprintf(Temp__cp, "%s.tmp", Path__cp);
+  File__p = fopen(Temp__cp, "w");
+  if (File__p == NULL)
+  {
+    free(Temp__cp);
+    return 1;
+  }
+
+  fprintf(File__p, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+  fprintf(File__p, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":0,\"args\":{\"name\":\"%s\"}}",
+    Pid__i, program_invocation_short_name);
+  Count__u32 = __atomic_load_n(&Thread_count__u32, __ATOMIC_RELAXED);
+  for (Index__u32 = 0; Index__u32 < Count__u32 && Index__u32 < EVENT_TRACE_THREADS; Index__u32++)
+  {
+    uint32_t Tid__u32a = __atomic_load_n(&Threads__sa[Index__u32].Tid__u32, __ATOMIC_ACQUIRE);
+    if (Tid__u32a != 0)
+    {
+      fprintf(File__p, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%u,\"args\":{\"name\":\"%s\"}}",
+        Pid__i, Tid__u32a, Threads__sa[Index__u32].Name__cp);
+    }
+  }
+
+  // Events recorded while writing are left for the next dump.
+  Next__u64 = __atomic_load_n(&Ring__sp->Next__u64, __ATOMIC_ACQUIRE);
+  First__u64 = (Next__u64 > (uint64_t)Ring__sp->Mask__u32 + 1) ? Next__u64 - Ring__sp->Mask__u32 - 1 : 0;
+  for (Index__u64 = First__u64; Index__u64 < Next__u64; Index__u64++)
+  {
+    event_trace_slot_t Event__s;
+
+    if (event_trace_read(Ring__sp, Index__u64, &Event__s) != 0 ||
+      Event__s.Phase__u32 >= sizeof(Phases__ca))
+    {
+      continue;
+    }
+    fprintf(File__p, ",\n{\"name\":\"%s\",\"cat\":\"pipeline\",\"ph\":\"%c\",\"ts\":%llu.%03u,\"pid\":%d,\"tid\":%u",
+      Event__s.Name__cp, Phases__ca[Event__s.Phase__u32],
+      (unsigned long long)(Event__s.Time_ns__u64 / 1000), (unsigned int)(Event__s.Time_ns__u64 % 1000),
+      Pid__i, Event__s.Tid__u32);
+    if (Event__s.Phase__u32 == EVENT_TRACE_ASYNC_BEGIN || Event__s.Phase__u32 == EVENT_TRACE_ASYNC_END)
+    {
+      fprintf(File__p, ",\"id\":\"0x%llx\"", (unsigned long long)Event__s.Arg__u64);
+    }
+    else if (Event__s.Arg__u64 != 0)
+    {
+      fprintf(File__p, ",\"args\":{\"value\":%llu}", (unsigned long long)Event__s.Arg__u64);
+    }
+    if (Event__s.Phase__u32 == EVENT_TRACE_INSTANT)
+    {
+      fprintf(File__p, ",\"s\":\"t\"");
+    }
+    fprintf(File__p, "}");
+    Written__u32++;
+  }
+  fprintf(File__p, "\n]}\n");
+
+  Result__i = (ferror(File__p) != 0) ? 1 : 0;
+  if (fclose(File__p) != 0)
+  {
+    Result__i = 1;
+  }
+  if (Result__i == 0 && rename(Temp__cp, Path__cp) != 0)
+  {
+    Result__i = 1;
+  }
+  if (Result__i != 0)
+  {
+    (void)remove(Temp__cp);
+  }
+  free(Temp__cp);
+  if (Result__i == 0 && Events__u32p != NULL)
+  {
+    *Events__u32p = Written__u32;
+  }
+  return Result__i;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+void event_trace_get_stats(event_trace_stats_t * Stats__p)
+{
+  event_trace_ring_t * Ring__sp = __atomic_load_n(&Ring__p, __ATOMIC_ACQUIRE);
+
+  memset(Stats__p, 0, sizeof(*Stats__p));
+  if (Ring__sp != NULL)
+  {
+    Stats__p->Capacity__u32 = Ring__sp->Mask__u32 + 1;
+    Stats__p->Recorded__u64 = __atomic_load_n(&Ring__sp->Next__u64, __ATOMIC_RELAXED);
+    if (Stats__p->Recorded__u64 > Stats__p->Capacity__u32)
+    {
+      Stats__p->Overwritten__u64 = Stats__p->Recorded__u64 - Stats__p->Capacity__u32;
+    }
+  }
+}
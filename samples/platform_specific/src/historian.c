@@ -0,0 +1,968 @@
+///////////////////////////////////////////////////////////////////////////////
+//
+// historian.c:
+// On-device history of the sensor readings in three tiers: every sample,
+// one minute and one hour roll-ups (mean, min and max), each kept in a
+// fixed size ring file so the device holds weeks of data in bounded space.
+//
+///////////////////////////////////////////////////////////////////////////////
+
+#define _POSIX_C_SOURCE 200809L
+#include "historian.h"
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <zlib.h>
+
+
+// Block layout, all integers little endian:
+//   0  uint32  magic, HIST_MAGIC
+//   4  uint32  sequence number; the block lives in slot sequence % capacity
+//   8  uint16  number of points
+//  10  uint8   number of value columns
+//  11  uint8   flags, HIST_FLAG_SEALED once the block is full
+//  12  uint16  payload length
+//  16  uint64  time of the first point
+//  24  uint64  time of the last point
+//  32  uint32  CRC-32 of bytes 0 ~ 31 and the payload
+//  40  payload: uint16 length of each column, time column first, then
+//      the columns themselves
+#define HIST_MAGIC (0x314B4248u) // "HBK1"
+#define HIST_HEADER_LEN (40)
+#define HIST_FLAG_SEALED (0x01)
+
+// A raw tier point has one value per measurement, a roll-up point a mean,
+// min and max.
+#define HIST_MAX_CHANNELS (3 * HISTORIAN_MEASUREMENTS)
+#define HIST_MAX_COLUMNS (1 + HIST_MAX_CHANNELS)
+
+// Worst case growth of a block by one point: a 10 byte time varint and
+// 5 bytes per value.
+#define HIST_POINT_MAX_LEN(Channels) (10 + 5 * (Channels))
+
+// Control byte of a value equal to the previous one.
+#define HIST_XOR_ZERO (0x10)
+
+enum
+{
+    eHistHdr_MAGIC       = 0
+  , eHistHdr_SEQ         = 4
+  , eHistHdr_COUNT       = 8
+  , eHistHdr_CHANNELS    = 10
+  , eHistHdr_FLAGS       = 11
+  , eHistHdr_PAYLOAD_LEN = 12
+  , eHistHdr_FIRST       = 16
+  , eHistHdr_LAST        = 24
+  , eHistHdr_CRC         = 32
+};
+
+static const char * Tier_names__cpa[HISTORIAN_TIER_COUNT] =
+{
+    "raw"
+  , "1min"
+  , "1h"
+};
+static const uint64_t Tier_bucket_us__u64a[HISTORIAN_TIER_COUNT] =
+{
+  0, 60ULL * 1000000, 3600ULL * 1000000
+};
+static const uint32_t Default_capacity__u32a[HISTORIAN_TIER_COUNT] =
+{
+  4096, 512, 64
+};
+
+// What the index keeps of every block header.
+typedef struct
+{
+  int Valid__i;
+  uint32_t Seq__u32;
+  uint16_t Count__u16;
+  uint64_t First_us__u64;
+  uint64_t Last_us__u64;
+} hist_slot_t;
+
+typedef struct
+{
+  uint64_t Time_us__u64;
+  float Values__fa[HIST_MAX_CHANNELS];
+} hist_point_t;
+
+typedef struct
+{
+  int Fd__i;
+  int Channels__i;
+  uint32_t Capacity__u32;
+  hist_slot_t * Slots__p;
+
+  // The block being filled, one buffer of HISTORIAN_BLOCK_LEN per column.
+  uint32_t Seq__u32;
+  uint16_t Count__u16;
+  uint64_t First_us__u64;
+  uint64_t Last_us__u64;
+  int64_t Last_delta__i64;
+  uint32_t Last_bits__u32a[HIST_MAX_CHANNELS];
+  uint8_t * Columns__u8p;
+  size_t Column_len__za[HIST_MAX_COLUMNS];
+
+  // Roll-up of the tier below into the next point of this tier.
+  uint64_t Bucket_us__u64;
+  uint32_t Bucket_count__u32;
+  double Sum__da[HISTORIAN_MEASUREMENTS];
+  float Min__fa[HISTORIAN_MEASUREMENTS];
+  float Max__fa[HISTORIAN_MEASUREMENTS];
+} hist_tier_t;
+
+struct historian_tag
+{
+  int Read_only__i;
+  hist_tier_t Tiers__sa[HISTORIAN_TIER_COUNT];
+  uint8_t Block__u8a[HISTORIAN_BLOCK_LEN];
+};
+
+typedef void (*hist_point_fn)(void * Context__p, const hist_point_t * Point__p);
+
+
+///////////////////////////////////////////////////////////////////////////////
+static void hist_put_le(uint8_t * Data__u8p, uint64_t Value__u64, int Len__i)
+{
+  int Byte_idx__i;
+  for (Byte_idx__i = 0; Byte_idx__i < Len__i; Byte_idx__i++)
+  {
+    Data__u8p[Byte_idx__i] = (uint8_t)(Value__u64 >> (8 * Byte_idx__i));
+  }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+static uint64_t hist_get_le(const uint8_t * Data__u8p, int Len__i)
+{
+  uint64_t Value__u64 = 0;
+  int Byte_idx__i;
+  for (Byte_idx__i = Len__i - 1; Byte_idx__i >= 0; Byte_idx__i--)
+  {
+    Value__u64 = (Value__u64 << 8) | Data__u8p[Byte_idx__i];
+  }
+  return Value__u64;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+static uint8_t * hist_column(hist_tier_t * Tier__p, int Column__i)
+{
+  return Tier__p->Columns__u8p + (size_t)Column__i * HISTORIAN_BLOCK_LEN;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+static void hist_put_varint(hist_tier_t * Tier__p, int Column__i,
+  uint64_t Value__u64)
+{
+  uint8_t * Column__u8p = hist_column(Tier__p, Column__i);
+  size_t * Len__zp = &Tier__p->Column_len__za[Column__i];
+
+  while (Value__u64 >= 0x80)
+  {
+    Column__u8p[(*Len__zp)++] = (uint8_t)(Value__u64 | 0x80);
+    Value__u64 >>= 7;
+  }
+  Column__u8p[(*Len__zp)++] = (uint8_t)Value__u64;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Return: the number of bytes used, or 0 if the varint runs past End__u8p.
+static size_t hist_get_varint(const uint8_t * Data__u8p, const uint8_t * End__u8p,
+  uint64_t * Value__u64p)
+{
+  size_t Len__z = 0;
+  int Shift__i = 0;
+
+  *Value__u64p = 0;
+  while ((Data__u8p + Len__z < End__u8p) && (Shift__i < 64))
+  {
+    uint8_t Byte__u8 = Data__u8p[Len__z++];
+    *Value__u64p |= (uint64_t)(Byte__u8 & 0x7F) << Shift__i;
+    if ((Byte__u8 & 0x80) == 0)
+    {
+      return Len__z;
+    }
+    Shift__i += 7;
+  }
+  return 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// XOR with the previous value of the column. A control byte holds the number
+// of zero bytes above (bits 3~2) and below (bits 1~0) the bytes that differ,
+// which follow it, most significant first.
+static void hist_put_value(hist_tier_t * Tier__p, int Channel__i, float Value__f)
+{
+  uint8_t * Column__u8p = hist_column(Tier__p, 1 + Channel__i);
+  size_t * Len__zp = &Tier__p->Column_len__za[1 + Channel__i];
+  uint32_t Bits__u32;
+  uint32_t Xor__u32;
+  int Leading__i = 0;
+  int Trailing__i = 0;
+  int Byte_idx__i;
+
+  memcpy(&Bits__u32, &Value__f, sizeof(Bits__u32));
+  Xor__u32 = Bits__u32 ^ Tier__p->Last_bits__u32a[Channel__i];
+  Tier__p->Last_bits__u32a[Channel__i] = Bits__u32;
+
+  if (Xor__u32 == 0)
+  {
+    Column__u8p[(*Len__zp)++] = HIST_XOR_ZERO;
+    return;
+  }
+  while ((Xor__u32 >> (24 - 8 * Leading__i)) == 0)
+  {
+    Leading__i++;
+  }
+  while (((Xor__u32 >> (8 * Trailing__i)) & 0xFF) == 0)
+  {
+    Trailing__i++;
+  }
+  Column__u8p[(*Len__zp)++] = (uint8_t)((Leading__i << 2) | Trailing__i);
+  for (Byte_idx__i = 3 - Leading__i; Byte_idx__i >= Trailing__i; Byte_idx__i--)
+  {
+    Column__u8p[(*Len__zp)++] = (uint8_t)(Xor__u32 >> (8 * Byte_idx__i));
+  }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Return: the number of bytes used, or 0 if the value is malformed.
+static size_t hist_get_value(const uint8_t * Data__u8p, const uint8_t * End__u8p,
+  uint32_t * Bits__u32p)
+{
+  uint8_t Control__u8;
+  int Leading__i;
+  int Trailing__i;
+  int Byte_idx__i;
+  size_t Len__z = 1;
+  uint32_t Xor__u32 = 0;
+
+  if (Data__u8p >= End__u8p)
+  {
+    return 0;
+  }
+  Control__u8 = Data__u8p[0];
+  if (Control__u8 == HIST_XOR_ZERO)
+  {
+    return 1;
+  }
+  Leading__i = (Control__u8 >> 2) & 0x03;
+  Trailing__i = Control__u8 & 0x03;
+  if ((Control__u8 > 0x0F) || (Leading__i + Trailing__i > 3)
+    || (Data__u8p + 1 + (4 - Leading__i - Trailing__i) > End__u8p))
+  {
+    return 0;
+  }
+  for (Byte_idx__i = 3 - Leading__i; Byte_idx__i >= Trailing__i; Byte_idx__i--)
+  {
+    Xor__u32 |= (uint32_t)Data__u8p[Len__z++] << (8 * Byte_idx__i);
+  }
+  *Bits__u32p ^= Xor__u32;
+  return Len__z;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+static size_t hist_block_used(const hist_tier_t * Tier__p)
+{
+  size_t Used__z = HIST_HEADER_LEN + 2 * (size_t)(1 + Tier__p->Channels__i);
+  int Column__i;
+  for (Column__i = 0; Column__i <= Tier__p->Channels__i; Column__i++)
+  {
+    Used__z += Tier__p->Column_len__za[Column__i];
+  }
+  return Used__z;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+static void hist_block_reset(hist_tier_t * Tier__p)
+{
+  Tier__p->Count__u16 = 0;
+  Tier__p->First_us__u64 = 0;
+  Tier__p->Last_us__u64 = 0;
+  Tier__p->Last_delta__i64 = 0;
+  memset(Tier__p->Last_bits__u32a, 0, sizeof(Tier__p->Last_bits__u32a));
+  memset(Tier__p->Column_len__za, 0, sizeof(Tier__p->Column_len__za));
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Lays out the block being filled in Block__u8p, zero padded.
+static void hist_block_build(const hist_tier_t * Tier__p, uint8_t Flags__u8,
+  uint8_t * Block__u8p)
+{
+  size_t Offset__z = HIST_HEADER_LEN;
+  int Column__i;
+  uint32_t Crc__u32;
+
+  memset(Block__u8p, 0, HISTORIAN_BLOCK_LEN);
+  for (Column__i = 0; Column__i <= Tier__p->Channels__i; Column__i++)
+  {
+    hist_put_le(&Block__u8p[Offset__z], Tier__p->Column_len__za[Column__i], 2);
+    Offset__z += 2;
+  }
+  for (Column__i = 0; Column__i <= Tier__p->Channels__i; Column__i++)
+  {
+    memcpy(&Block__u8p[Offset__z],
+      Tier__p->Columns__u8p + (size_t)Column__i * HISTORIAN_BLOCK_LEN,
+      Tier__p->Column_len__za[Column__i]);
+    Offset__z += Tier__p->Column_len__za[Column__i];
+  }
+
+  hist_put_le(&Block__u8p[eHistHdr_MAGIC], HIST_MAGIC, 4);
+  hist_put_le(&Block__u8p[eHistHdr_SEQ], Tier__p->Seq__u32, 4);
+  hist_put_le(&Block__u8p[eHistHdr_COUNT], Tier__p->Count__u16, 2);
+  Block__u8p[eHistHdr_CHANNELS] = (uint8_t)Tier__p->Channels__i;
+  Block__u8p[eHistHdr_FLAGS] = Flags__u8;
+  hist_put_le(&Block__u8p[eHistHdr_PAYLOAD_LEN], Offset__z - HIST_HEADER_LEN, 2);
+  hist_put_le(&Block__u8p[eHistHdr_FIRST], Tier__p->First_us__u64, 8);
+  hist_put_le(&Block__u8p[eHistHdr_LAST], Tier__p->Last_us__u64, 8);
+
+  Crc__u32 = crc32(0L, Block__u8p, eHistHdr_CRC);
+  Crc__u32 = crc32(Crc__u32, &Block__u8p[HIST_HEADER_LEN],
+    (uInt)(Offset__z - HIST_HEADER_LEN));
+  hist_put_le(&Block__u8p[eHistHdr_CRC], Crc__u32, 4);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Checks the header of a block read from slot Slot__u32.
+// Return: 0 if it is a block of this tier, otherwise 1.
+static int hist_header_check(const hist_tier_t * Tier__p,
+  const uint8_t * Header__u8p, uint32_t Slot__u32)
+{
+  if ((hist_get_le(&Header__u8p[eHistHdr_MAGIC], 4) != HIST_MAGIC)
+    || (Header__u8p[eHistHdr_CHANNELS] != Tier__p->Channels__i)
+    || ((uint32_t)hist_get_le(&Header__u8p[eHistHdr_SEQ], 4) % Tier__p->Capacity__u32 != Slot__u32)
+    || (hist_get_le(&Header__u8p[eHistHdr_PAYLOAD_LEN], 2) > HISTORIAN_BLOCK_LEN - HIST_HEADER_LEN))
+  {
+    return 1;
+  }
+  return 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+static void hist_index_block(hist_tier_t * Tier__p, const uint8_t * Header__u8p,
+  uint32_t Slot__u32)
+{
+  hist_slot_t * Slot__p = &Tier__p->Slots__p[Slot__u32];
+  Slot__p->Valid__i = 1;
+  Slot__p->Seq__u32 = (uint32_t)hist_get_le(&Header__u8p[eHistHdr_SEQ], 4);
+  Slot__p->Count__u16 = (uint16_t)hist_get_le(&Header__u8p[eHistHdr_COUNT], 2);
+  Slot__p->First_us__u64 = hist_get_le(&Header__u8p[eHistHdr_FIRST], 8);
+  Slot__p->Last_us__u64 = hist_get_le(&Header__u8p[eHistHdr_LAST], 8);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Decodes a block and calls Point__fp for each point.
+// Return: 0 on success, 1 if the block is damaged.
+static int hist_block_decode(const hist_tier_t * Tier__p, const uint8_t * Block__u8p,
+  hist_point_fn Point__fp, void * Context__p)
+{
+  const uint8_t * Column__u8pa[HIST_MAX_COLUMNS];
+  const uint8_t * Column_end__u8pa[HIST_MAX_COLUMNS];
+  uint32_t Bits__u32a[HIST_MAX_CHANNELS];
+  size_t Payload_len__z = hist_get_le(&Block__u8p[eHistHdr_PAYLOAD_LEN], 2);
+  uint16_t Count__u16 = (uint16_t)hist_get_le(&Block__u8p[eHistHdr_COUNT], 2);
+  size_t Offset__z = HIST_HEADER_LEN + 2 * (size_t)(1 + Tier__p->Channels__i);
+  int64_t Delta__i64 = 0;
+  hist_point_t Point__s;
+  uint32_t Crc__u32;
+  uint16_t Point_idx__u16;
+  int Column__i;
+
+  Crc__u32 = crc32(0L, Block__u8p, eHistHdr_CRC);
+  Crc__u32 = crc32(Crc__u32, &Block__u8p[HIST_HEADER_LEN], (uInt)Payload_len__z);
+  if ((Crc__u32 != (uint32_t)hist_get_le(&Block__u8p[eHistHdr_CRC], 4))
+    || (Offset__z > HIST_HEADER_LEN + Payload_len__z))
+  {
+    return 1;
+  }
+
+  for (Column__i = 0; Column__i <= Tier__p->Channels__i; Column__i++)
+  {
+    size_t Len__z = hist_get_le(&Block__u8p[HIST_HEADER_LEN + 2 * Column__i], 2);
+    if (Offset__z + Len__z > HIST_HEADER_LEN + Payload_len__z)
+    {
+      return 1;
+    }
+    Column__u8pa[Column__i] = &Block__u8p[Offset__z];
+    Column_end__u8pa[Column__i] = &Block__u8p[Offset__z + Len__z];
+    Offset__z += Len__z;
+  }
+
+  memset(Bits__u32a, 0, sizeof(Bits__u32a));
+  memset(&Point__s, 0, sizeof(Point__s));
+  Point__s.Time_us__u64 = hist_get_le(&Block__u8p[eHistHdr_FIRST], 8);
+  for (Point_idx__u16 = 0; Point_idx__u16 < Count__u16; Point_idx__u16++)
+  {
+    if (Point_idx__u16 > 0)
+    {
+      uint64_t Varint__u64;
+      size_t Len__z = hist_get_varint(Column__u8pa[0], Column_end__u8pa[0], &Varint__u64);
+      if (Len__z == 0)
+      {
+        return 1;
+      }
+      Column__u8pa[0] += Len__z;
+      if (Point_idx__u16 == 1)
+      {
+        Delta__i64 = (int64_t)Varint__u64;
+      }
+      else
+      {
+        // Zigzag decoding of the change of the delta.
+        Delta__i64 += (int64_t)(Varint__u64 >> 1) ^ -(int64_t)(Varint__u64 & 1);
+      }
+      Point__s.Time_us__u64 += (uint64_t)Delta__i64;
+    }
+
+    for (Column__i = 0; Column__i < Tier__p->Channels__i; Column__i++)
+    {
+      size_t Len__z = hist_get_value(Column__u8pa[1 + Column__i],
+        Column_end__u8pa[1 + Column__i], &Bits__u32a[Column__i]);
+      if (Len__z == 0)
+      {
+        return 1;
+      }
+      Column__u8pa[1 + Column__i] += Len__z;
+      memcpy(&Point__s.Values__fa[Column__i], &Bits__u32a[Column__i], sizeof(float));
+    }
+
+    Point__fp(Context__p, &Point__s);
+  }
+  return 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Return: 0 on success, 1 if the block could not be written.
+static int hist_block_write(historian_t * Historian__p, hist_tier_t * Tier__p,
+  uint8_t Flags__u8)
+{
+  uint32_t Slot__u32 = Tier__p->Seq__u32 % Tier__p->Capacity__u32;
+
+  hist_block_build(Tier__p, Flags__u8, Historian__p->Block__u8a);
+  if ((pwrite(Tier__p->Fd__i, Historian__p->Block__u8a, HISTORIAN_BLOCK_LEN,
+      (off_t)Slot__u32 * HISTORIAN_BLOCK_LEN) != HISTORIAN_BLOCK_LEN)
+    || (fdatasync(Tier__p->Fd__i) != 0))
+  {
+    return 1;
+  }
+  hist_index_block(Tier__p, Historian__p->Block__u8a, Slot__u32);
+  return 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Return: 0 and sets *Time_us__u64p to the time of the newest point of the
+//         tier, or 1 if the tier is empty.
+static int hist_last_time(const hist_tier_t * Tier__p, uint64_t * Time_us__u64p)
+{
+  const hist_slot_t * Slot__p;
+
+  if (Tier__p->Count__u16 > 0)
+  {
+    *Time_us__u64p = Tier__p->Last_us__u64;
+    return 0;
+  }
+  if (Tier__p->Seq__u32 == 0)
+  {
+    return 1;
+  }
+  Slot__p = &Tier__p->Slots__p[(Tier__p->Seq__u32 - 1) % Tier__p->Capacity__u32];
+  if (!Slot__p->Valid__i || (Slot__p->Seq__u32 != Tier__p->Seq__u32 - 1))
+  {
+    return 1;
+  }
+  *Time_us__u64p = Slot__p->Last_us__u64;
+  return 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Return: 0 on success, 1 if a full block could not be written.
+static int hist_append(historian_t * Historian__p, hist_tier_t * Tier__p,
+  const hist_point_t * Point__p)
+{
+  int Result__i = 0;
+  int Channel__i;
+
+  if ((Tier__p->Count__u16 > 0)
+    && ((hist_block_used(Tier__p) + HIST_POINT_MAX_LEN(Tier__p->Channels__i) > HISTORIAN_BLOCK_LEN)
+      || (Tier__p->Count__u16 == UINT16_MAX)))
+  {
+    if (!Historian__p->Read_only__i)
+    {
+      Result__i = hist_block_write(Historian__p, Tier__p, HIST_FLAG_SEALED);
+    }
+    Tier__p->Seq__u32++;
+    hist_block_reset(Tier__p);
+  }
+
+  if (Tier__p->Count__u16 == 0)
+  {
+    Tier__p->First_us__u64 = Point__p->Time_us__u64;
+  }
+  else
+  {
+    int64_t Delta__i64 = (int64_t)(Point__p->Time_us__u64 - Tier__p->Last_us__u64);
+    if (Tier__p->Count__u16 == 1)
+    {
+      hist_put_varint(Tier__p, 0, (uint64_t)Delta__i64);
+    }
+    else
+    {
+      // Zigzag encoding of the change of the delta, usually 0 or close to it.
+      int64_t Change__i64 = Delta__i64 - Tier__p->Last_delta__i64;
+      hist_put_varint(Tier__p, 0, ((uint64_t)Change__i64 << 1) ^ (uint64_t)(Change__i64 >> 63));
+    }
+    Tier__p->Last_delta__i64 = Delta__i64;
+  }
+  for (Channel__i = 0; Channel__i < Tier__p->Channels__i; Channel__i++)
+  {
+    hist_put_value(Tier__p, Channel__i, Point__p->Values__fa[Channel__i]);
+  }
+  Tier__p->Last_us__u64 = Point__p->Time_us__u64;
+  Tier__p->Count__u16++;
+  return Result__i;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Adds one point of the tier below to the roll-up of Tier__e. When the point
+// starts a new minute or hour, the finished one is appended to the tier and
+// rolled up in turn.
+// Return: 0 on success, 1 if a block could not be written.
+static int hist_roll_up(historian_t * Historian__p, int Tier__i,
+  uint64_t Time_us__u64, const float * Mean__fap, const float * Min__fap,
+  const float * Max__fap)
+{
+  hist_tier_t * Tier__p = &Historian__p->Tiers__sa[Tier__i];
+  uint64_t Bucket_us__u64 = Time_us__u64 - Time_us__u64 % Tier_bucket_us__u64a[Tier__i];
+  int Result__i = 0;
+  int Measure__i;
+
+  if ((Tier__p->Bucket_count__u32 > 0) && (Bucket_us__u64 != Tier__p->Bucket_us__u64))
+  {
+    hist_point_t Point__s;
+    float Mean__fa[HISTORIAN_MEASUREMENTS];
+
+    Point__s.Time_us__u64 = Tier__p->Bucket_us__u64;
+    for (Measure__i = 0; Measure__i < HISTORIAN_MEASUREMENTS; Measure__i++)
+    {
+      Mean__fa[Measure__i] = (float)(Tier__p->Sum__da[Measure__i] / Tier__p->Bucket_count__u32);
+      Point__s.Values__fa[3 * Measure__i] = Mean__fa[Measure__i];
+      Point__s.Values__fa[3 * Measure__i + 1] = Tier__p->Min__fa[Measure__i];
+      Point__s.Values__fa[3 * Measure__i + 2] = Tier__p->Max__fa[Measure__i];
+    }
+    Result__i |= hist_append(Historian__p, Tier__p, &Point__s);
+    if (Tier__i + 1 < HISTORIAN_TIER_COUNT)
+    {
+      Result__i |= hist_roll_up(Historian__p, Tier__i + 1, Point__s.Time_us__u64,
+        Mean__fa, Tier__p->Min__fa, Tier__p->Max__fa);
+    }
+    Tier__p->Bucket_count__u32 = 0;
+  }
+
+  if (Tier__p->Bucket_count__u32 == 0)
+  {
+    Tier__p->Bucket_us__u64 = Bucket_us__u64;
+    for (Measure__i = 0; Measure__i < HISTORIAN_MEASUREMENTS; Measure__i++)
+    {
+      Tier__p->Sum__da[Measure__i] = 0;
+      Tier__p->Min__fa[Measure__i] = Min__fap[Measure__i];
+      Tier__p->Max__fa[Measure__i] = Max__fap[Measure__i];
+    }
+  }
+  for (Measure__i = 0; Measure__i < HISTORIAN_MEASUREMENTS; Measure__i++)
+  {
+    Tier__p->Sum__da[Measure__i] += Mean__fap[Measure__i];
+    if (Min__fap[Measure__i] < Tier__p->Min__fa[Measure__i])
+    {
+      Tier__p->Min__fa[Measure__i] = Min__fap[Measure__i];
+    }
+    if (Max__fap[Measure__i] > Tier__p->Max__fa[Measure__i])
+    {
+      Tier__p->Max__fa[Measure__i] = Max__fap[Measure__i];
+    }
+  }
+  Tier__p->Bucket_count__u32++;
+  return Result__i;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+static void hist_to_point(int Tier__i, const hist_point_t * In__p,
+  historian_point_t * Out__p)
+{
+  int Measure__i;
+
+  Out__p->Time_us__u64 = In__p->Time_us__u64;
+  for (Measure__i = 0; Measure__i < HISTORIAN_MEASUREMENTS; Measure__i++)
+  {
+    if (Tier__i == HISTORIAN_TIER_RAW)
+    {
+      Out__p->Mean__fa[Measure__i] = In__p->Values__fa[Measure__i];
+      Out__p->Min__fa[Measure__i] = In__p->Values__fa[Measure__i];
+      Out__p->Max__fa[Measure__i] = In__p->Values__fa[Measure__i];
+    }
+    else
+    {
+      Out__p->Mean__fa[Measure__i] = In__p->Values__fa[3 * Measure__i];
+      Out__p->Min__fa[Measure__i] = In__p->Values__fa[3 * Measure__i + 1];
+      Out__p->Max__fa[Measure__i] = In__p->Values__fa[3 * Measure__i + 2];
+    }
+  }
+}
+
+typedef struct
+{
+  historian_t * Historian__p;
+  int Tier__i;
+  uint64_t From_us__u64;
+  uint64_t To_us__u64;
+  historian_point_fn Point__fp;
+  void * Context__p;
+  size_t Count__z;
+} hist_query_t;
+
+///////////////////////////////////////////////////////////////////////////////
+static void hist_query_point(void * Context__p, const hist_point_t * Point__p)
+{
+  hist_query_t * Query__p = Context__p;
+
+  if ((Point__p->Time_us__u64 >= Query__p->From_us__u64)
+    && (Point__p->Time_us__u64 <= Query__p->To_us__u64))
+  {
+    historian_point_t Out__s;
+    hist_to_point(Query__p->Tier__i, Point__p, &Out__s);
+    Query__p->Point__fp(Query__p->Context__p, &Out__s);
+    Query__p->Count__z++;
+  }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Restores the running block from its last flush.
+static void hist_restore_point(void * Context__p, const hist_point_t * Point__p)
+{
+  hist_query_t * Query__p = Context__p;
+  (void)hist_append(Query__p->Historian__p,
+    &Query__p->Historian__p->Tiers__sa[Query__p->Tier__i], Point__p);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Restores the running roll-up of the tier above from its points.
+static void hist_restore_roll_up(void * Context__p, const historian_point_t * Point__p)
+{
+  hist_query_t * Query__p = Context__p;
+  (void)hist_roll_up(Query__p->Historian__p, Query__p->Tier__i + 1,
+    Point__p->Time_us__u64, Point__p->Mean__fa, Point__p->Min__fa, Point__p->Max__fa);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Opens a tier file, indexes its blocks and reloads the newest block if it
+// was not full yet.
+// Return: 0 on success, 1 otherwise.
+static int hist_tier_open(historian_t * Historian__p, int Tier__i,
+  const char * Dir__cp, uint32_t Capacity__u32)
+{
+  hist_tier_t * Tier__p = &Historian__p->Tiers__sa[Tier__i];
+  char Path__ca[512];
+  struct stat Stat__s;
+  uint8_t Header__u8a[HIST_HEADER_LEN];
+  int Newest_slot__i = -1;
+  uint32_t Slot__u32;
+
+  Tier__p->Fd__i = -1;
+  Tier__p->Channels__i = (Tier__i == HISTORIAN_TIER_RAW) ? HISTORIAN_MEASUREMENTS
+    : HIST_MAX_CHANNELS;
+
+  if (snprintf(Path__ca, sizeof(Path__ca), "%s/%s.hist", Dir__cp,
+    Tier_names__cpa[Tier__i]) >= (int)sizeof(Path__ca))
+  {
+    return 1;
+  }
+  Tier__p->Fd__i = Historian__p->Read_only__i ? open(Path__ca, O_RDONLY)
+    : open(Path__ca, O_RDWR | O_CREAT, 0644);
+  if ((Tier__p->Fd__i < 0) || (fstat(Tier__p->Fd__i, &Stat__s) != 0))
+  {
+    return 1;
+  }
+
+  // The ring is allocated up front (sparse) and keeps its size for good.
+  if (Stat__s.st_size >= HISTORIAN_BLOCK_LEN)
+  {
+    Capacity__u32 = (uint32_t)(Stat__s.st_size / HISTORIAN_BLOCK_LEN);
+  }
+  else if (Historian__p->Read_only__i
+    || (Capacity__u32 == 0)
+    || (ftruncate(Tier__p->Fd__i, (off_t)Capacity__u32 * HISTORIAN_BLOCK_LEN) != 0))
+  {
+    return 1;
+  }
+  Tier__p->Capacity__u32 = Capacity__u32;
+
+  Tier__p->Slots__p = calloc(Capacity__u32, sizeof(hist_slot_t));
+  Tier__p->Columns__u8p = malloc((size_t)(1 + Tier__p->Channels__i) * HISTORIAN_BLOCK_LEN);
+  if ((Tier__p->Slots__p == NULL) || (Tier__p->Columns__u8p == NULL))
+  {
+    return 1;
+  }
+
+  for (Slot__u32 = 0; Slot__u32 < Capacity__u32; Slot__u32++)
+  {
+    if ((pread(Tier__p->Fd__i, Header__u8a, sizeof(Header__u8a),
+        (off_t)Slot__u32 * HISTORIAN_BLOCK_LEN) == (ssize_t)sizeof(Header__u8a))
+      && (hist_header_check(Tier__p, Header__u8a, Slot__u32) == 0))
+    {
+      hist_index_block(Tier__p, Header__u8a, Slot__u32);
+      if ((Newest_slot__i < 0)
+        || (Tier__p->Slots__p[Slot__u32].Seq__u32 > Tier__p->Slots__p[Newest_slot__i].Seq__u32))
+      {
+        Newest_slot__i = (int)Slot__u32;
+      }
+    }
+  }
+
+  hist_block_reset(Tier__p);
+  Tier__p->Seq__u32 = 0;
+  if (Newest_slot__i >= 0)
+  {
+    hist_slot_t * Newest__p = &Tier__p->Slots__p[Newest_slot__i];
+    uint8_t * Block__u8p = Historian__p->Block__u8a;
+
+    Tier__p->Seq__u32 = Newest__p->Seq__u32 + 1;
+    if ((pread(Tier__p->Fd__i, Block__u8p, HISTORIAN_BLOCK_LEN,
+        (off_t)Newest_slot__i * HISTORIAN_BLOCK_LEN) == HISTORIAN_BLOCK_LEN)
+      && ((Block__u8p[eHistHdr_FLAGS] & HIST_FLAG_SEALED) == 0))
+    {
+      // Keep filling the flushed block in place, as if the run never stopped.
+      uint8_t Copy__u8a[HISTORIAN_BLOCK_LEN];
+      hist_query_t Query__s = { Historian__p, Tier__i, 0, UINT64_MAX, NULL, NULL, 0 };
+
+      memcpy(Copy__u8a, Block__u8p, sizeof(Copy__u8a));
+      Tier__p->Seq__u32 = Newest__p->Seq__u32;
+      Newest__p->Valid__i = 0;
+      if (hist_block_decode(Tier__p, Copy__u8a, hist_restore_point, &Query__s) != 0)
+      {
+        hist_block_reset(Tier__p);
+      }
+    }
+  }
+  return 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+historian_t * historian_open(const char * Dir__cp,
+  const uint32_t * Capacity_blocks__u32a, int Read_only__i)
+{
+  historian_t * Historian__p = calloc(1, sizeof(*Historian__p));
+  int Tier__i;
+  int Result__i = 0;
+
+  if (Historian__p == NULL)
+  {
+    return NULL;
+  }
+  Historian__p->Read_only__i = Read_only__i;
+  if (Capacity_blocks__u32a == NULL)
+  {
+    Capacity_blocks__u32a = Default_capacity__u32a;
+  }
+
+  for (Tier__i = 0; Tier__i < HISTORIAN_TIER_COUNT; Tier__i++)
+  {
+    if (Result__i == 0)
+    {
+      Result__i = hist_tier_open(Historian__p, Tier__i, Dir__cp,
+        Capacity_blocks__u32a[Tier__i]);
+    }
+    else
+    {
+      Historian__p->Tiers__sa[Tier__i].Fd__i = -1;
+    }
+  }
+  if (Result__i != 0)
+  {
+    historian_close(Historian__p);
+    return NULL;
+  }
+
+  // Refill the running minute and hour from the points already stored for
+  // them in the tier below.
+  if (!Read_only__i)
+  {
+    for (Tier__i = HISTORIAN_TIER_HOUR; Tier__i > HISTORIAN_TIER_RAW; Tier__i--)
+    {
+      uint64_t Last_us__u64;
+      if (hist_last_time(&Historian__p->Tiers__sa[Tier__i - 1], &Last_us__u64) == 0)
+      {
+        hist_query_t Query__s = { Historian__p, Tier__i - 1, 0, 0, NULL, NULL, 0 };
+        (void)historian_query(Historian__p, Tier__i - 1,
+          Last_us__u64 - Last_us__u64 % Tier_bucket_us__u64a[Tier__i], UINT64_MAX,
+          hist_restore_roll_up, &Query__s);
+      }
+    }
+  }
+  return Historian__p;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+void historian_close(historian_t * Historian__p)
+{
+  int Tier__i;
+
+  if (Historian__p == NULL)
+  {
+    return;
+  }
+  if (!Historian__p->Read_only__i)
+  {
+    (void)historian_flush(Historian__p);
+  }
+  for (Tier__i = 0; Tier__i < HISTORIAN_TIER_COUNT; Tier__i++)
+  {
+    hist_tier_t * Tier__p = &Historian__p->Tiers__sa[Tier__i];
+    if (Tier__p->Fd__i >= 0)
+    {
+      close(Tier__p->Fd__i);
+    }
+    free(Tier__p->Slots__p);
+    free(Tier__p->Columns__u8p);
+  }
+  free(Historian__p);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+int historian_add(historian_t * Historian__p, uint64_t Time_us__u64,
+  const float * Values__fap)
+{
+  hist_tier_t * Raw__p = &Historian__p->Tiers__sa[HISTORIAN_TIER_RAW];
+  hist_point_t Point__s;
+  uint64_t Last_us__u64;
+  int Result__i;
+
+  if (Historian__p->Read_only__i
+    || ((hist_last_time(Raw__p, &Last_us__u64) == 0) && (Time_us__u64 <= Last_us__u64)))
+  {
+    return 1;
+  }
+
+  memset(&Point__s, 0, sizeof(Point__s));
+  Point__s.Time_us__u64 = Time_us__u64;
+  memcpy(Point__s.Values__fa, Values__fap, HISTORIAN_MEASUREMENTS * sizeof(float));
+  Result__i = hist_append(Historian__p, Raw__p, &Point__s);
+  Result__i |= hist_roll_up(Historian__p, HISTORIAN_TIER_MINUTE, Time_us__u64,
+    Values__fap, Values__fap, Values__fap);
+  return Result__i;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+int historian_flush(historian_t * Historian__p)
+{
+  int Result__i = 0;
+  int Tier__i;
+
+  if (Historian__p->Read_only__i)
+  {
+    return 1;
+  }
+  for (Tier__i = 0; Tier__i < HISTORIAN_TIER_COUNT; Tier__i++)
+  {
+    hist_tier_t * Tier__p = &Historian__p->Tiers__sa[Tier__i];
+    if (Tier__p->Count__u16 > 0)
+    {
+      Result__i |= hist_block_write(Historian__p, Tier__p, 0);
+    }
+  }
+  return Result__i;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+size_t historian_query(historian_t * Historian__p, HISTORIAN_TIER Tier__e,
+  uint64_t From_us__u64, uint64_t To_us__u64,
+  historian_point_fn Point__fp, void * Context__p)
+{
+  hist_tier_t * Tier__p = &Historian__p->Tiers__sa[Tier__e];
+  hist_query_t Query__s = { Historian__p, (int)Tier__e, From_us__u64, To_us__u64,
+    Point__fp, Context__p, 0 };
+  // Not the historian's buffer: restoring writes blocks while it queries.
+  uint8_t Block__u8a[HISTORIAN_BLOCK_LEN];
+  uint32_t Oldest__u32 = (Tier__p->Seq__u32 > Tier__p->Capacity__u32)
+    ? Tier__p->Seq__u32 - Tier__p->Capacity__u32 : 0;
+  uint32_t Seq__u32;
+
+  // Stored blocks oldest first, then the block being filled.
+  for (Seq__u32 = Oldest__u32; Seq__u32 < Tier__p->Seq__u32; Seq__u32++)
+  {
+    uint32_t Slot__u32 = Seq__u32 % Tier__p->Capacity__u32;
+    const hist_slot_t * Slot__p = &Tier__p->Slots__p[Slot__u32];
+
+    if (!Slot__p->Valid__i || (Slot__p->Seq__u32 != Seq__u32)
+      || (Slot__p->Last_us__u64 < From_us__u64) || (Slot__p->First_us__u64 > To_us__u64))
+    {
+      continue;
+    }
+    if (pread(Tier__p->Fd__i, Block__u8a, HISTORIAN_BLOCK_LEN,
+      (off_t)Slot__u32 * HISTORIAN_BLOCK_LEN) == HISTORIAN_BLOCK_LEN)
+    {
+      (void)hist_block_decode(Tier__p, Block__u8a, hist_query_point, &Query__s);
+    }
+  }
+
+  if ((Tier__p->Count__u16 > 0) && (Tier__p->Last_us__u64 >= From_us__u64)
+    && (Tier__p->First_us__u64 <= To_us__u64))
+  {
+    hist_block_build(Tier__p, 0, Block__u8a);
+    (void)hist_block_decode(Tier__p, Block__u8a, hist_query_point, &Query__s);
+  }
+  return Query__s.Count__z;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+HISTORIAN_TIER historian_pick_tier(const historian_t * Historian__p,
+  uint64_t From_us__u64, uint64_t To_us__u64, size_t Max_points__z)
+{
+  int Tier__i;
+
+  for (Tier__i = HISTORIAN_TIER_RAW; Tier__i < HISTORIAN_TIER_HOUR; Tier__i++)
+  {
+    const hist_tier_t * Tier__p = &Historian__p->Tiers__sa[Tier__i];
+    size_t Points__z = 0;
+    uint32_t Slot__u32;
+
+    // Whole blocks are counted, so this errs towards the coarser tier.
+    for (Slot__u32 = 0; Slot__u32 < Tier__p->Capacity__u32; Slot__u32++)
+    {
+      const hist_slot_t * Slot__p = &Tier__p->Slots__p[Slot__u32];
+      if (Slot__p->Valid__i && (Slot__p->Seq__u32 < Tier__p->Seq__u32)
+        && (Slot__p->Last_us__u64 >= From_us__u64)
+        && (Slot__p->First_us__u64 <= To_us__u64))
+      {
+        Points__z += Slot__p->Count__u16;
+      }
+    }
+    if ((Tier__p->Count__u16 > 0) && (Tier__p->Last_us__u64 >= From_us__u64)
+      && (Tier__p->First_us__u64 <= To_us__u64))
+    {
+      Points__z += Tier__p->Count__u16;
+    }
+    if (Points__z <= Max_points__z)
+    {
+      return (HISTORIAN_TIER)Tier__i;
+    }
+  }
+  return HISTORIAN_TIER_HOUR;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+int historian_tier_from_string(const char * Name__cp, HISTORIAN_TIER * Tier__ep)
+{
+  int Tier__i;
+
+  for (Tier__i = 0; Tier__i < HISTORIAN_TIER_COUNT; Tier__i++)
+  {
+    if (strcmp(Name__cp, Tier_names__cpa[Tier__i]) == 0)
+    {
+      *Tier__ep = (HISTORIAN_TIER)Tier__i;
+      return 0;
+    }
+  }
+  return 1;
+}
@@ -0,0 +1,128 @@
+///////////////////////////////////////////////////////////////////////////////
+//
+// latency_histogram.c:
+// Fixed size, allocation free histogram of latencies with about 12%
+// resolution, for p50/p99 reporting on the device.
+//
+///////////////////////////////////////////////////////////////////////////////
+
+#define _POSIX_C_SOURCE 200112L
+#include "latency_histogram.h"
+#include <string.h>
+#include <time.h>
+
+
+///////////////////////////////////////////////////////////////////////////////
+// Values below 8 get a bucket each; above that, bucket = (msb - 2) * 8 plus
+// the three bits following the most significant one.
+static int latency_bucket(uint64_t Value__u64)
+{
+  int Msb__i;
+
+  if (Value__u64 < LATENCY_HISTOGRAM_SUB_BUCKETS)
+  {
+    return (int)Value__u64;
+  }
+  Msb__i = 63 - __builtin_clzll(Value__u64);
+  return (Msb__i - 2) * LATENCY_HISTOGRAM_SUB_BUCKETS
+    + (int)((Value__u64 >> (Msb__i - 3)) & (LATENCY_HISTOGRAM_SUB_BUCKETS - 1));
+}
+
+///////////////////////////////////////////////////////////////////////////////
+static uint64_t latency_bucket_middle(int Bucket__i)
+{
+  int Msb__i;
+  uint64_t Low__u64;
+
+  if (Bucket__i < LATENCY_HISTOGRAM_SUB_BUCKETS)
+  {
+    return (uint64_t)Bucket__i;
+  }
+  Msb__i = Bucket__i / LATENCY_HISTOGRAM_SUB_BUCKETS + 2;
+  Low__u64 = ((uint64_t)(LATENCY_HISTOGRAM_SUB_BUCKETS
+    + Bucket__i % LATENCY_HISTOGRAM_SUB_BUCKETS)) << (Msb__i - 3);
+  return Low__u64 + ((((uint64_t)1) << (Msb__i - 3)) >> 1);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+uint64_t latency_clock_us(void)
+{
+  struct timespec Now__s;
+  clock_gettime(CLOCK_MONOTONIC, &Now__s);
+  return (uint64_t)Now__s.tv_sec * 1000000ULL + (uint64_t)Now__s.tv_nsec / 1000;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+void latency_histogram_reset(latency_histogram_t * Histogram__p)
+{
+  memset(Histogram__p, 0, sizeof(latency_histogram_t));
+  Histogram__p->Min__u64 = UINT64_MAX;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+void latency_histogram_record(latency_histogram_t * Histogram__p,
+  uint64_t Value__u64)
+{
+  Histogram__p->Counts__u32a[latency_bucket(Value__u64)]++;
+  Histogram__p->Count__u64++;
+  Histogram__p->Sum__u64 += Value__u64;
+  if (Value__u64 < Histogram__p->Min__u64)
+  {
+    Histogram__p->Min__u64 = Value__u64;
+  }
+  if (Value__u64 > Histogram__p->Max__u64)
+  {
+    Histogram__p->Max__u64 = Value__u64;
+  }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+void latency_histogram_merge(latency_histogram_t * Histogram__p,
+  const latency_histogram_t * Other__p)
+{
+  int Bucket__i;
+
+  for (Bucket__i = 0; Bucket__i < LATENCY_HISTOGRAM_BUCKETS; Bucket__i++)
+  {
+    Histogram__p->Counts__u32a[Bucket__i] += Other__p->Counts__u32a[Bucket__i];
+  }
+  Histogram__p->Count__u64 += Other__p->Count__u64;
+  Histogram__p->Sum__u64 += Other__p->Sum__u64;
+  if (Other__p->Min__u64 < Histogram__p->Min__u64)
+  {
+    Histogram__p->Min__u64 = Other__p->Min__u64;
+  }
+  if (Other__p->Max__u64 > Histogram__p->Max__u64)
+  {
+    Histogram__p->Max__u64 = Other__p->Max__u64;
+  }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+uint64_t latency_histogram_percentile(const latency_histogram_t * Histogram__p,
+  double Percentile__d)
+{
+  uint64_t Rank__u64;
+  uint64_t Seen__u64 = 0;
+  int Bucket__i;
+
+  if (Histogram__p->Count__u64 == 0)
+  {
+    return 0;
+  }
+  Rank__u64 = (uint64_t)(Percentile__d / 100.0 * (double)Histogram__p->Count__u64);
+  if (Rank__u64 >= Histogram__p->Count__u64)
+  {
+    Rank__u64 = Histogram__p->Count__u64 - 1;
+  }
+
+  for (Bucket__i = 0; Bucket__i < LATENCY_HISTOGRAM_BUCKETS; Bucket__i++)
+  {
+    Seen__u64 += Histogram__p->Counts__u32a[Bucket__i];
+    if (Seen__u64 > Rank__u64)
+    {
+      break;
+    }
+  }
+  return latency_bucket_middle(Bucket__i);
+}
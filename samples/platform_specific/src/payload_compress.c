@@ -0,0 +1,152 @@
+///////////////////////////////////////////////////////////////////////////////
+//
+// payload_compress.c:
+// Deflate (RFC 1950 zlib format) compression of outgoing message bodies with
+// a fixed, small working set so it can run next to the IoT client on a Pi.
+//
+///////////////////////////////////////////////////////////////////////////////
+
+#include "payload_compress.h"
+#include <stdlib.h>
+#include <string.h>
+#include <zlib.h>
+
+
+// Telemetry batches are a few KB at most and very repetitive, so a 1 KB
+// window loses little ratio against the default 32 KB one.
+// Working set = (1 << (Window_bits + 2)) + (1 << (Mem_level + 9)) bytes
+// plus the z_stream state.
+#define PAYLOAD_WINDOW_BITS (10)
+#define PAYLOAD_MEM_LEVEL (4)
+#define PAYLOAD_INPUT_CHUNK (512)
+
+struct payload_compressor_tag
+{
+  z_stream Stream__s;
+  size_t Memory__z;
+};
+
+
+///////////////////////////////////////////////////////////////////////////////
+static voidpf payload_alloc(voidpf Opaque__p, uInt Items__u, uInt Size__u)
+{
+  payload_compressor_t * Compressor__p = (payload_compressor_t *)Opaque__p;
+  size_t * Block__zp = malloc(sizeof(size_t) + (size_t)Items__u * Size__u);
+  if (Block__zp == NULL)
+  {
+    return Z_NULL;
+  }
+  *Block__zp = (size_t)Items__u * Size__u;
+  Compressor__p->Memory__z += *Block__zp;
+  return Block__zp + 1;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+static void payload_free(voidpf Opaque__p, voidpf Address__p)
+{
+  payload_compressor_t * Compressor__p = (payload_compressor_t *)Opaque__p;
+  size_t * Block__zp = ((size_t *)Address__p) - 1;
+  Compressor__p->Memory__z -= *Block__zp;
+  free(Block__zp);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+int payload_compression_from_string(const char * Name__cp,
+  PAYLOAD_COMPRESSION * Compression__ep)
+{
+  if (strcmp(Name__cp, "none") == 0)
+  {
+    *Compression__ep = PAYLOAD_COMPRESSION_NONE;
+    return 0;
+  }
+  if (strcmp(Name__cp, "deflate") == 0)
+  {
+    *Compression__ep = PAYLOAD_COMPRESSION_DEFLATE;
+    return 0;
+  }
+  return 1;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+const char * payload_content_encoding(PAYLOAD_COMPRESSION Compression__e)
+{
+  return (Compression__e == PAYLOAD_COMPRESSION_DEFLATE) ? "deflate" : NULL;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+payload_compressor_t * payload_compressor_create(int Level__i)
+{
+  payload_compressor_t * Compressor__p = malloc(sizeof(payload_compressor_t));
+  if (Compressor__p == NULL)
+  {
+    return NULL;
+  }
+  memset(Compressor__p, 0, sizeof(payload_compressor_t));
+  Compressor__p->Memory__z = sizeof(payload_compressor_t);
+  Compressor__p->Stream__s.zalloc = payload_alloc;
+  Compressor__p->Stream__s.zfree = payload_free;
+  Compressor__p->Stream__s.opaque = Compressor__p;
+
+  if (deflateInit2(&Compressor__p->Stream__s, Level__i, Z_DEFLATED,
+    PAYLOAD_WINDOW_BITS, PAYLOAD_MEM_LEVEL, Z_DEFAULT_STRATEGY) != Z_OK)
+  {
+    free(Compressor__p);
+    return NULL;
+  }
+  return Compressor__p;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+void payload_compressor_destroy(payload_compressor_t * Compressor__p)
+{
+  if (Compressor__p != NULL)
+  {
+    (void)deflateEnd(&Compressor__p->Stream__s);
+    free(Compressor__p);
+  }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+size_t payload_compressor_memory(const payload_compressor_t * Compressor__p)
+{
+  return Compressor__p->Memory__z;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+size_t payload_compress(payload_compressor_t * Compressor__p,
+  const uint8_t * In__u8p, size_t In_len__z,
+  uint8_t * Out__u8p, size_t Out_size__z)
+{
+  z_stream * Stream__p = &Compressor__p->Stream__s;
+  size_t Consumed__z = 0;
+  int Status__i = Z_OK;
+
+  if (deflateReset(Stream__p) != Z_OK)
+  {
+    return 0;
+  }
+  Stream__p->next_out = Out__u8p;
+  Stream__p->avail_out = (uInt)Out_size__z;
+
+  while (Status__i == Z_OK)
+  {
+    size_t Chunk__z = In_len__z - Consumed__z;
+    if (Chunk__z > PAYLOAD_INPUT_CHUNK)
+    {
+      Chunk__z = PAYLOAD_INPUT_CHUNK;
+    }
+    Stream__p->next_in = (Bytef *)(In__u8p + Consumed__z);
+    Stream__p->avail_in = (uInt)Chunk__z;
+    Consumed__z += Chunk__z;
+
+    Status__i = deflate(Stream__p,
+      (Consumed__z == In_len__z) ? Z_FINISH : Z_NO_FLUSH);
+    if (Stream__p->avail_out == 0 && Status__i != Z_STREAM_END)
+    {
+      // Out of room: the result would not be smaller than the limit.
+      return 0;
+    }
+  }
+
+  return (Status__i == Z_STREAM_END) ? Stream__p->total_out : 0;
+}
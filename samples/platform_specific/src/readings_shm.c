@@ -0,0 +1,477 @@
+///////////////////////////////////////////////////////////////////////////////
+//
+// readings_shm.c:
+// Live readings for other processes on the same board, in a POSIX shared
+// memory object.
+//
+///////////////////////////////////////////////////////////////////////////////
+
+#define _POSIX_C_SOURCE 200809L
+#include "readings_shm.h"
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+
+static const char Magic__ca[8] = { 'R', 'D', 'N', 'G', 'S', 'H', 'M', '1' };
+
+// Copies a reader gives up after, when the writer died halfway through a
+// record and left its sequence odd.
+#define READINGS_SHM_MAX_RETRIES (10000)
+
+typedef struct
+{
+  char Magic__ca[8];
+  uint16_t Version__u16;
+  uint16_t Header_len__u16;
+  uint16_t Channel_len__u16;
+  uint16_t Record_len__u16;
+  uint32_t Slots__u32;
+  uint32_t Channels__u32;
+  uint32_t Closed__u32;
+  int32_t Writer_pid__i32;
+  uint64_t Head__u64;
+  uint8_t Reserved__u8a[24];
+} readings_shm_header_t;
+
+typedef struct
+{
+  uint32_t Seq__u32;
+  uint32_t Channel__u32;
+  uint64_t Index__u64;
+  uint64_t Time_us__u64;
+  uint64_t Mono_us__u64;
+  float Values__fa[READINGS_SHM_VALUES];
+} readings_shm_slot_t;
+
+// Pointers into a mapping
+typedef struct
+{
+  readings_shm_header_t * Header__p;
+  readings_shm_channel_t * Channels__p;
+  readings_shm_slot_t * Latest__p;
+  readings_shm_slot_t * Ring__p;
+} readings_shm_map_t;
+
+struct readings_shm_writer_tag
+{
+  int Fd__i;
+  void * Base__p;
+  size_t Size__z;
+  char * Name__cp;
+  readings_shm_map_t Map__s;
+  uint32_t Value_counts__u32a[READINGS_SHM_CHANNELS];
+};
+
+struct readings_shm_reader_tag
+{
+  int Fd__i;
+  void * Base__p;
+  size_t Size__z;
+  readings_shm_map_t Map__s;
+};
+
+
+///////////////////////////////////////////////////////////////////////////////
+static size_t readings_shm_size(uint32_t Slots__u32)
+{
+  return sizeof(readings_shm_header_t)
+    + READINGS_SHM_CHANNELS * sizeof(readings_shm_channel_t)
+    + (READINGS_SHM_CHANNELS + (size_t)Slots__u32) * sizeof(readings_shm_slot_t);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+static void readings_shm_map(void * Base__p, readings_shm_map_t * Map__p)
+{
+  Map__p->Header__p = (readings_shm_header_t *)Base__p;
+  Map__p->Channels__p = (readings_shm_channel_t *)(Map__p->Header__p + 1);
+  Map__p->Latest__p = (readings_shm_slot_t *)(Map__p->Channels__p + READINGS_SHM_CHANNELS);
+  Map__p->Ring__p = Map__p->Latest__p + READINGS_SHM_CHANNELS;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// The writer side of the sequence lock.
+static void readings_shm_write(readings_shm_slot_t * Slot__p,
+  uint32_t Channel__u32, uint64_t Index__u64, uint64_t Time_us__u64,
+  uint64_t Mono_us__u64, const float * Values__fp, uint32_t Value_count__u32)
+{
+  uint32_t Seq__u32 = __atomic_load_n(&Slot__p->Seq__u32, __ATOMIC_RELAXED);
+
+  __atomic_store_n(&Slot__p->Seq__u32, Seq__u32 + 1, __ATOMIC_RELAXED);
+  // The odd sequence is seen before any of the new contents.
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  Slot__p->Channel__u32 = Channel__u32;
+  Slot__p->Index__u64 = Index__u64;
+  Slot__p->Time_us__u64 = Time_us__u64;
+  Slot__p->Mono_us__u64 = Mono_us__u64;
+  memset(Slot__p->Values__fa, 0, sizeof(Slot__p->Values__fa));
+  memcpy(Slot__p->Values__fa, Values__fp, Value_count__u32 * sizeof(float));
+  __atomic_store_n(&Slot__p->Seq__u32, Seq__u32 + 2, __ATOMIC_RELEASE);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// The reader side of the sequence lock.
+// Return: 0 if a consistent copy was made, 1 if the slot was never written
+//         or stayed busy.
+static int readings_shm_copy(const readings_shm_slot_t * Slot__p,
+  readings_shm_record_t * Record__p)
+{
+  int Retries__i;
+
+  for (Retries__i = 0; Retries__i < READINGS_SHM_MAX_RETRIES; Retries__i++)
+  {
+    uint32_t Begin__u32 = __atomic_load_n(&Slot__p->Seq__u32, __ATOMIC_ACQUIRE);
+    uint32_t End__u32;
+
+    if (Begin__u32 == 0)
+    {
+      return 1;
+    }
+    if ((Begin__u32 & 1) != 0)
+    {
+      continue;
+    }
+    Record__p->Channel__u32 = Slot__p->Channel__u32;
+    Record__p->Index__u64 = Slot__p->Index__u64;
+    Record__p->Time_us__u64 = Slot__p->Time_us__u64;
+    Record__p->Mono_us__u64 = Slot__p->Mono_us__u64;
+    memcpy(Record__p->Values__fa, Slot__p->Values__fa, sizeof(Record__p->Values__fa));
+    // The copy is complete before the sequence is checked again.
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    End__u32 = __atomic_load_n(&Slot__p->Seq__u32, __ATOMIC_RELAXED);
+    if (Begin__u32 == End__u32)
+    {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Marks the object of an earlier writer closed, so its readers let go.
+static void readings_shm_close_previous(const char * Name__cp)
+{
+  int Fd__i = shm_open(Name__cp, O_RDWR, 0);
+  struct stat Stat__s;
+
+  if (Fd__i < 0)
+  {
+    return;
+  }
+  if (fstat(Fd__i, &Stat__s) == 0 &&
+    (size_t)Stat__s.st_size >= sizeof(readings_shm_header_t))
+  {
+    readings_shm_header_t * Header__p = (readings_shm_header_t *)mmap(NULL,
+      sizeof(readings_shm_header_t), PROT_READ | PROT_WRITE, MAP_SHARED, Fd__i, 0);
+    if (Header__p != MAP_FAILED)
+    {
+      if (memcmp(Header__p->Magic__ca, Magic__ca, sizeof(Magic__ca)) == 0)
+      {
+        __atomic_store_n(&Header__p->Closed__u32, 1, __ATOMIC_RELEASE);
+      }
+      munmap(Header__p, sizeof(readings_shm_header_t));
+    }
+  }
+  close(Fd__i);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+readings_shm_writer_t * readings_shm_create(const char * Name__cp,
+  uint32_t Slots__u32)
+{
+  readings_shm_writer_t * Writer__p;
+  readings_shm_header_t * Header__p;
+  uint32_t Slots_pow2__u32 = 1;
+
+  while (Slots_pow2__u32 < Slots__u32 && Slots_pow2__u32 < 0x80000000u)
+  {
+    Slots_pow2__u32 <<= 1;
+  }
+
+  Writer__p = (readings_shm_writer_t *)calloc(1, sizeof(readings_shm_writer_t));
+  if (Writer__p == NULL)
+  {
+    return NULL;
+  }
+  Writer__p->Name__cp = strdup(Name__cp);
+  Writer__p->Size__z = readings_shm_size(Slots_pow2__u32);
+  Writer__p->Base__p = MAP_FAILED;
+
+  readings_shm_close_previous(Name__cp);
+  (void)shm_unlink(Name__cp);
+  Writer__p->Fd__i = shm_open(Name__cp, O_RDWR | O_CREAT | O_EXCL, 0644);
+  // Readable by the other users whatever the umask.
+  if (Writer__p->Name__cp == NULL || Writer__p->Fd__i < 0 ||
+    fchmod(Writer__p->Fd__i, 0644) != 0 ||
+    ftruncate(Writer__p->Fd__i, (off_t)Writer__p->Size__z) != 0 ||
+    (Writer__p->Base__p = mmap(NULL, Writer__p->Size__z, PROT_READ | PROT_WRITE,
+      MAP_SHARED, Writer__p->Fd__i, 0)) == MAP_FAILED)
+  {
+    if (Writer__p->Fd__i >= 0)
+    {
+      close(Writer__p->Fd__i);
+      (void)shm_unlink(Name__cp);
+    }
+    free(Writer__p->Name__cp);
+    free(Writer__p);
+    return NULL;
+  }
+
+  // The new object is zero filled, so only the header needs setting. The
+  // magic goes last: a reader opening the object checks it first.
+  readings_shm_map(Writer__p->Base__p, &Writer__p->Map__s);
+  Header__p = Writer__p->Map__s.Header__p;
+  Header__p->Version__u16 = READINGS_SHM_VERSION;
+  Header__p->Header_len__u16 = (uint16_t)sizeof(readings_shm_header_t);
+  Header__p->Channel_len__u16 = (uint16_t)sizeof(readings_shm_channel_t);
+  Header__p->Record_len__u16 = (uint16_t)sizeof(readings_shm_slot_t);
+  Header__p->Slots__u32 = Slots_pow2__u32;
+  Header__p->Writer_pid__i32 = (int32_t)getpid();
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  memcpy(Header__p->Magic__ca, Magic__ca, sizeof(Magic__ca));
+  return Writer__p;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+int readings_shm_add_channel(readings_shm_writer_t * Writer__p,
+  const char * Name__cp, size_t Value_count__z,
+  const char * const * Value_names__cpp)
+{
+  readings_shm_header_t * Header__p = Writer__p->Map__s.Header__p;
+  uint32_t Channel__u32 = Header__p->Channels__u32;
+  readings_shm_channel_t * Channel__p;
+  size_t Index__z;
+
+  if (Channel__u32 == READINGS_SHM_CHANNELS)
+  {
+    return -1;
+  }
+  if (Value_count__z > READINGS_SHM_VALUES)
+  {
+    Value_count__z = READINGS_SHM_VALUES;
+  }
+
+  Channel__p = &Writer__p->Map__s.Channels__p[Channel__u32];
+  strncpy(Channel__p->Name__ca, Name__cp, READINGS_SHM_NAME_LEN - 1);
+  Channel__p->Value_count__u32 = (uint32_t)Value_count__z;
+  for (Index__z = 0; Index__z < Value_count__z; Index__z++)
+  {
+    strncpy(Channel__p->Value_names__caa[Index__z], Value_names__cpp[Index__z],
+      READINGS_SHM_NAME_LEN - 1);
+  }
+  Writer__p->Value_counts__u32a[Channel__u32] = (uint32_t)Value_count__z;
+  // Readers only look at descriptors below the count.
+  __atomic_store_n(&Header__p->Channels__u32, Channel__u32 + 1, __ATOMIC_RELEASE);
+  return (int)Channel__u32;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+void readings_shm_publish(readings_shm_writer_t * Writer__p, int Channel__i,
+  uint64_t Time_us__u64, uint64_t Mono_us__u64, const float * Values__fp)
+{
+  readings_shm_header_t * Header__p = Writer__p->Map__s.Header__p;
+  uint32_t Value_count__u32;
+  uint64_t Index__u64;
+
+  if (Channel__i < 0 || (uint32_t)Channel__i >= Header__p->Channels__u32)
+  {
+    return;
+  }
+  Value_count__u32 = Writer__p->Value_counts__u32a[Channel__i];
+  Index__u64 = __atomic_fetch_add(&Header__p->Head__u64, 1, __ATOMIC_ACQ_REL);
+  readings_shm_write(&Writer__p->Map__s.Ring__p[Index__u64 & (Header__p->Slots__u32 - 1)],
+    (uint32_t)Channel__i, Index__u64, Time_us__u64, Mono_us__u64, Values__fp,
+    Value_count__u32);
+  readings_shm_write(&Writer__p->Map__s.Latest__p[Channel__i],
+    (uint32_t)Channel__i, Index__u64, Time_us__u64, Mono_us__u64, Values__fp,
+    Value_count__u32);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+void readings_shm_destroy(readings_shm_writer_t * Writer__p)
+{
+  struct stat Stat__s;
+
+  if (Writer__p != NULL)
+  {
+    __atomic_store_n(&Writer__p->Map__s.Header__p->Closed__u32, 1, __ATOMIC_RELEASE);
+    munmap(Writer__p->Base__p, Writer__p->Size__z);
+    // The name may already belong to the object of a newer writer.
+    if (fstat(Writer__p->Fd__i, &Stat__s) == 0 && Stat__s.st_nlink != 0)
+    {
+      (void)shm_unlink(Writer__p->Name__cp);
+    }
+    close(Writer__p->Fd__i);
+    free(Writer__p->Name__cp);
+    free(Writer__p);
+  }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+readings_shm_reader_t * readings_shm_open(const char * Name__cp)
+{
+  readings_shm_reader_t * Reader__p;
+  const readings_shm_header_t * Header__p;
+  struct stat Stat__s;
+
+  Reader__p = (readings_shm_reader_t *)calloc(1, sizeof(readings_shm_reader_t));
+  if (Reader__p == NULL)
+  {
+    return NULL;
+  }
+  Reader__p->Fd__i = shm_open(Name__cp, O_RDONLY, 0);
+  if (Reader__p->Fd__i < 0 || fstat(Reader__p->Fd__i, &Stat__s) != 0 ||
+    (size_t)Stat__s.st_size < readings_shm_size(1))
+  {
+    if (Reader__p->Fd__i >= 0)
+    {
+      close(Reader__p->Fd__i);
+    }
+    free(Reader__p);
+    return NULL;
+  }
+  Reader__p->Size__z = (size_t)Stat__s.st_size;
+  Reader__p->Base__p = mmap(NULL, Reader__p->Size__z, PROT_READ, MAP_SHARED,
+    Reader__p->Fd__i, 0);
+  if (Reader__p->Base__p == MAP_FAILED)
+  {
+    close(Reader__p->Fd__i);
+    free(Reader__p);
+    return NULL;
+  }
+
+  readings_shm_map(Reader__p->Base__p, &Reader__p->Map__s);
+  Header__p = Reader__p->Map__s.Header__p;
+  if (memcmp(Header__p->Magic__ca, Magic__ca, sizeof(Magic__ca)) != 0)
+  {
+    readings_shm_close(Reader__p);
+    return NULL;
+  }
+  __atomic_thread_fence(__ATOMIC_ACQUIRE);
+  if (Header__p->Version__u16 != READINGS_SHM_VERSION ||
+    Header__p->Header_len__u16 != sizeof(readings_shm_header_t) ||
+    Header__p->Channel_len__u16 != sizeof(readings_shm_channel_t) ||
+    Header__p->Record_len__u16 != sizeof(readings_shm_slot_t) ||
+    Header__p->Slots__u32 == 0 ||
+    (Header__p->Slots__u32 & (Header__p->Slots__u32 - 1)) != 0 ||
+    readings_shm_size(Header__p->Slots__u32) != Reader__p->Size__z)
+  {
+    readings_shm_close(Reader__p);
+    return NULL;
+  }
+  return Reader__p;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+void readings_shm_close(readings_shm_reader_t * Reader__p)
+{
+  if (Reader__p != NULL)
+  {
+    munmap(Reader__p->Base__p, Reader__p->Size__z);
+    close(Reader__p->Fd__i);
+    free(Reader__p);
+  }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+int readings_shm_stale(const readings_shm_reader_t * Reader__p)
+{
+  struct stat Stat__s;
+
+  // A replaced object has lost its name, and so its last link.
+  return __atomic_load_n(&Reader__p->Map__s.Header__p->Closed__u32, __ATOMIC_ACQUIRE) != 0 ||
+    fstat(Reader__p->Fd__i, &Stat__s) != 0 || Stat__s.st_nlink == 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+size_t readings_shm_channel_count(const readings_shm_reader_t * Reader__p)
+{
+  uint32_t Channels__u32 = __atomic_load_n(&Reader__p->Map__s.Header__p->Channels__u32,
+    __ATOMIC_ACQUIRE);
+  return (Channels__u32 < READINGS_SHM_CHANNELS) ? Channels__u32 : READINGS_SHM_CHANNELS;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+int readings_shm_channel(const readings_shm_reader_t * Reader__p,
+  int Channel__i, readings_shm_channel_t * Channel__p)
+{
+  int Value__i;
+
+  if (Channel__i < 0 || (size_t)Channel__i >= readings_shm_channel_count(Reader__p))
+  {
+    return 1;
+  }
+  *Channel__p = Reader__p->Map__s.Channels__p[Channel__i];
+  // Terminated even if the writer misbehaved.
+  Channel__p->Name__ca[READINGS_SHM_NAME_LEN - 1] = '\0';
+  if (Channel__p->Value_count__u32 > READINGS_SHM_VALUES)
+  {
+    Channel__p->Value_count__u32 = READINGS_SHM_VALUES;
+  }
+  for (Value__i = 0; Value__i < READINGS_SHM_VALUES; Value__i++)
+  {
+    Channel__p->Value_names__caa[Value__i][READINGS_SHM_NAME_LEN - 1] = '\0';
+  }
+  return 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+int readings_shm_latest(const readings_shm_reader_t * Reader__p,
+  int Channel__i, readings_shm_record_t * Record__p)
+{
+  if (Channel__i < 0 || Channel__i >= READINGS_SHM_CHANNELS)
+  {
+    return 1;
+  }
+  return readings_shm_copy(&Reader__p->Map__s.Latest__p[Channel__i], Record__p);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+size_t readings_shm_read(const readings_shm_reader_t * Reader__p,
+  uint64_t * Next__u64p, readings_shm_record_t * Records__p, size_t Max__z,
+  uint64_t * Lost__u64p)
+{
+  const readings_shm_header_t * Header__p = Reader__p->Map__s.Header__p;
+  uint64_t Slots__u64 = Header__p->Slots__u32;
+  uint64_t Lost__u64 = 0;
+  size_t Count__z = 0;
+
+  while (Count__z < Max__z)
+  {
+    uint64_t Head__u64 = __atomic_load_n(&Header__p->Head__u64, __ATOMIC_ACQUIRE);
+    readings_shm_record_t * Record__p = &Records__p[Count__z];
+
+    if (*Next__u64p > Head__u64)
+    {
+      *Next__u64p = Head__u64;
+    }
+    if (Head__u64 > Slots__u64 && *Next__u64p < Head__u64 - Slots__u64)
+    {
+      Lost__u64 += Head__u64 - Slots__u64 - *Next__u64p;
+      *Next__u64p = Head__u64 - Slots__u64;
+    }
+    if (*Next__u64p == Head__u64 ||
+      readings_shm_copy(&Reader__p->Map__s.Ring__p[*Next__u64p & (Slots__u64 - 1)],
+        Record__p) != 0 ||
+      Record__p->Index__u64 < *Next__u64p)
+    {
+      // Nothing newer, or the record is claimed but not written yet.
+      break;
+    }
+    if (Record__p->Index__u64 > *Next__u64p)
+    {
+      // Overwritten while this reader looked; go again from the oldest.
+      continue;
+    }
+    (*Next__u64p)++;
+    Count__z++;
+  }
+  if (Lost__u64p != NULL)
+  {
+    *Lost__u64p = Lost__u64;
+  }
+  return Count__z;
+}
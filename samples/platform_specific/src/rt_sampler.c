@@ -0,0 +1,253 @@
+///////////////////////////////////////////////////////////////////////////////
+//
+// rt_sampler.c:
+// Periodic sampling thread for consistent sample times on a loaded Pi.
+//
+///////////////////////////////////////////////////////////////////////////////
+
+#define _GNU_SOURCE
+#include "rt_sampler.h"
+#include "event_trace.h"
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+
+
+// With memory locked the whole stack is resident, so keep it well below
+// the 8 MB default.
+#define RT_SAMPLER_STACK_LEN (256 * 1024)
+
+struct rt_sampler_tag
+{
+  rt_sampler_config_t Config__s;
+  rt_sampler_read_fn Read__fp;
+  void * Context__p;
+  pthread_t Thread__s;
+  int Stop__i;
+
+  // Head is only written by the sampling thread, Tail only by the consumer.
+  rt_sampler_sample_t Ring__sa[RT_SAMPLER_RING_LEN];
+  uint32_t Head__u32;
+  uint32_t Tail__u32;
+
+  // Priority inheritance, so a consumer copying the statistics is boosted
+  // instead of holding up the sampling thread.
+  pthread_mutex_t Stats_lock__s;
+  rt_sampler_stats_t Stats__s;
+};
+
+
+///////////////////////////////////////////////////////////////////////////////
+static uint64_t rt_sampler_timespec_us(const struct timespec * Time__p)
+{
+  return (uint64_t)Time__p->tv_sec * 1000000ULL + (uint64_t)Time__p->tv_nsec / 1000;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+static void rt_sampler_timespec_add_us(struct timespec * Time__p, uint64_t Us__u64)
+{
+  uint64_t Ns__u64 = (uint64_t)Time__p->tv_nsec + (Us__u64 % 1000000) * 1000;
+  Time__p->tv_sec += (time_t)(Us__u64 / 1000000 + Ns__u64 / 1000000000);
+  Time__p->tv_nsec = (long)(Ns__u64 % 1000000000);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Return: 0 if the sample was queued, 1 if the ring was full.
+static int rt_sampler_push(rt_sampler_t * Sampler__p,
+  const rt_sampler_sample_t * Sample__p)
+{
+  uint32_t Head__u32 = Sampler__p->Head__u32;
+  uint32_t Tail__u32 = __atomic_load_n(&Sampler__p->Tail__u32, __ATOMIC_ACQUIRE);
+
+  if (Head__u32 - Tail__u32 == RT_SAMPLER_RING_LEN)
+  {
+    return 1;
+  }
+  Sampler__p->Ring__sa[Head__u32 & (RT_SAMPLER_RING_LEN - 1)] = *Sample__p;
+  __atomic_store_n(&Sampler__p->Head__u32, Head__u32 + 1, __ATOMIC_RELEASE);
+  return 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+static void * rt_sampler_thread(void * Arg__p)
+{
+  rt_sampler_t * Sampler__p = (rt_sampler_t *)Arg__p;
+  uint64_t Period_us__u64 = Sampler__p->Config__s.Period_us__u32;
+  struct timespec Deadline__s;
+
+  event_trace_name_thread("rt_sampler");
+  clock_gettime(CLOCK_MONOTONIC, &Deadline__s);
+  while (!__atomic_load_n(&Sampler__p->Stop__i, __ATOMIC_ACQUIRE))
+  {
+    rt_sampler_sample_t Sample__s;
+    uint64_t Deadline_us__u64, Done_us__u64, Missed__u64 = 0;
+    int Dropped__i;
+
+    rt_sampler_timespec_add_us(&Deadline__s, Period_us__u64);
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &Deadline__s, NULL) == EINTR)
+    {
+    }
+    if (__atomic_load_n(&Sampler__p->Stop__i, __ATOMIC_ACQUIRE))
+    {
+      break;
+    }
+
+    memset(&Sample__s, 0, sizeof(Sample__s));
+    Sample__s.Time_us__u64 = latency_clock_us();
+    Deadline_us__u64 = rt_sampler_timespec_us(&Deadline__s);
+    Sample__s.Latency_us__u64 = (Sample__s.Time_us__u64 > Deadline_us__u64)
+      ? Sample__s.Time_us__u64 - Deadline_us__u64 : 0;
+    Sampler__p->Read__fp(Sampler__p->Context__p, &Sample__s);
+    Dropped__i = rt_sampler_push(Sampler__p, &Sample__s);
+
+    // Skip the deadlines already passed rather than sampling in a burst to
+    // catch up, so samples stay on the period grid.
+    Done_us__u64 = latency_clock_us();
+    if (Done_us__u64 >= Deadline_us__u64 + Period_us__u64)
+    {
+      Missed__u64 = (Done_us__u64 - Deadline_us__u64) / Period_us__u64;
+      rt_sampler_timespec_add_us(&Deadline__s, Missed__u64 * Period_us__u64);
+    }
+
+    pthread_mutex_lock(&Sampler__p->Stats_lock__s);
+    latency_histogram_record(&Sampler__p->Stats__s.Wakeup_latency_us__s,
+      Sample__s.Latency_us__u64);
+    Sampler__p->Stats__s.Samples__u64++;
+    Sampler__p->Stats__s.Missed__u64 += Missed__u64;
+    Sampler__p->Stats__s.Dropped__u64 += (uint64_t)Dropped__i;
+    pthread_mutex_unlock(&Sampler__p->Stats_lock__s);
+  }
+  return NULL;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Return: 0 on success, otherwise an error number.
+static int rt_sampler_attr(const rt_sampler_config_t * Config__p,
+  pthread_attr_t * Attr__p)
+{
+  int Result__i = pthread_attr_setstacksize(Attr__p, RT_SAMPLER_STACK_LEN);
+
+  if (Result__i == 0 && Config__p->Cpu__i >= 0)
+  {
+    cpu_set_t Cpus__s;
+    CPU_ZERO(&Cpus__s);
+    CPU_SET(Config__p->Cpu__i, &Cpus__s);
+    Result__i = pthread_attr_setaffinity_np(Attr__p, sizeof(Cpus__s), &Cpus__s);
+  }
+  if (Result__i == 0 && Config__p->Priority__i > 0)
+  {
+    struct sched_param Param__s;
+    memset(&Param__s, 0, sizeof(Param__s));
+    Param__s.sched_priority = Config__p->Priority__i;
+    Result__i = pthread_attr_setinheritsched(Attr__p, PTHREAD_EXPLICIT_SCHED);
+    if (Result__i == 0)
+    {
+      Result__i = pthread_attr_setschedpolicy(Attr__p, SCHED_FIFO);
+    }
+    if (Result__i == 0)
+    {
+      Result__i = pthread_attr_setschedparam(Attr__p, &Param__s);
+    }
+  }
+  return Result__i;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+rt_sampler_t * rt_sampler_start(const rt_sampler_config_t * Config__p,
+  rt_sampler_read_fn Read__fp, void * Context__p)
+{
+  rt_sampler_t * Sampler__p;
+  pthread_mutexattr_t Lock_attr__s;
+  pthread_attr_t Attr__s;
+  int Result__i;
+
+  if (Config__p->Period_us__u32 == 0 || Read__fp == NULL)
+  {
+    errno = EINVAL;
+    return NULL;
+  }
+  // Before the thread exists, so its stack is locked as it is mapped.
+  if (Config__p->Lock_memory__i && mlockall(MCL_CURRENT | MCL_FUTURE) != 0)
+  {
+    return NULL;
+  }
+
+  Sampler__p = (rt_sampler_t *)calloc(1, sizeof(rt_sampler_t));
+  if (Sampler__p == NULL)
+  {
+    errno = ENOMEM;
+    return NULL;
+  }
+  Sampler__p->Config__s = *Config__p;
+  Sampler__p->Read__fp = Read__fp;
+  Sampler__p->Context__p = Context__p;
+  latency_histogram_reset(&Sampler__p->Stats__s.Wakeup_latency_us__s);
+
+  pthread_mutexattr_init(&Lock_attr__s);
+  (void)pthread_mutexattr_setprotocol(&Lock_attr__s, PTHREAD_PRIO_INHERIT);
+  Result__i = pthread_mutex_init(&Sampler__p->Stats_lock__s, &Lock_attr__s);
+  pthread_mutexattr_destroy(&Lock_attr__s);
+  if (Result__i != 0)
+  {
+    free(Sampler__p);
+    errno = Result__i;
+    return NULL;
+  }
+
+  pthread_attr_init(&Attr__s);
+  Result__i = rt_sampler_attr(Config__p, &Attr__s);
+  if (Result__i == 0)
+  {
+    Result__i = pthread_create(&Sampler__p->Thread__s, &Attr__s,
+      rt_sampler_thread, Sampler__p);
+  }
+  pthread_attr_destroy(&Attr__s);
+  if (Result__i != 0)
+  {
+    pthread_mutex_destroy(&Sampler__p->Stats_lock__s);
+    free(Sampler__p);
+    errno = Result__i;
+    return NULL;
+  }
+  return Sampler__p;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+void rt_sampler_stop(rt_sampler_t * Sampler__p)
+{
+  if (Sampler__p != NULL)
+  {
+    __atomic_store_n(&Sampler__p->Stop__i, 1, __ATOMIC_RELEASE);
+    pthread_join(Sampler__p->Thread__s, NULL);
+    pthread_mutex_destroy(&Sampler__p->Stats_lock__s);
+    free(Sampler__p);
+  }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+int rt_sampler_pop(rt_sampler_t * Sampler__p, rt_sampler_sample_t * Sample__p)
+{
+  uint32_t Tail__u32 = Sampler__p->Tail__u32;
+  uint32_t Head__u32 = __atomic_load_n(&Sampler__p->Head__u32, __ATOMIC_ACQUIRE);
+
+  if (Head__u32 == Tail__u32)
+  {
+    return 0;
+  }
+  *Sample__p = Sampler__p->Ring__sa[Tail__u32 & (RT_SAMPLER_RING_LEN - 1)];
+  __atomic_store_n(&Sampler__p->Tail__u32, Tail__u32 + 1, __ATOMIC_RELEASE);
+  return 1;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+void rt_sampler_get_stats(rt_sampler_t * Sampler__p,
+  rt_sampler_stats_t * Stats__p)
+{
+  pthread_mutex_lock(&Sampler__p->Stats_lock__s);
+  *Stats__p = Sampler__p->Stats__s;
+  pthread_mutex_unlock(&Sampler__p->Stats_lock__s);
+}
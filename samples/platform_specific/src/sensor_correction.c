@@ -0,0 +1,146 @@
+///////////////////////////////////////////////////////////////////////////////
+//
+// sensor_correction.c:
+// Calibration corrections in fixed point.
+//
+///////////////////////////////////////////////////////////////////////////////
+
+#include "sensor_correction.h"
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+
+///////////////////////////////////////////////////////////////////////////////
+static int32_t sensor_correction_saturate(int64_t Value__i64)
+{
+  return (Value__i64 > INT32_MAX) ? INT32_MAX
+    : (Value__i64 < INT32_MIN) ? INT32_MIN : (int32_t)Value__i64;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Parses a number and scales it to fixed point.
+// Return: 0 on success, 1 if there is no number or it does not fit.
+static int sensor_correction_number(const char ** Text__cpp, double Scale__d,
+  int32_t * Value__i32p)
+{
+  char * End__cp;
+  double Value__d = strtod(*Text__cpp, &End__cp);
+
+  if (End__cp == *Text__cpp || !isfinite(Value__d))
+  {
+    return 1;
+  }
+  Value__d = floor(Value__d * Scale__d + 0.5);
+  if (Value__d > INT32_MAX || Value__d < INT32_MIN)
+  {
+    return 1;
+  }
+  *Value__i32p = (int32_t)Value__d;
+  *Text__cpp = End__cp;
+  return 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+int sensor_correction_parse(const char * Spec__cp, int32_t Scale__i32,
+  sensor_correction_t * Correction__p)
+{
+  sensor_correction_t Parsed__s;
+  const char * Text__cp = Spec__cp;
+  uint32_t Index__u32;
+  int32_t Gain__i32;
+
+  memset(&Parsed__s, 0, sizeof(Parsed__s));
+  if (*Text__cp == '\0')
+  {
+    *Correction__p = Parsed__s;
+    return 0;
+  }
+
+  if (strchr(Spec__cp, ':') == NULL)
+  {
+    // OFFSET or GAIN,OFFSET: a single point at 0.
+    Parsed__s.Num_points__u32 = 1;
+    Parsed__s.Slope_q16__i32a[0] = 1 << 16;
+    if (sensor_correction_number(&Text__cp, 65536.0, &Gain__i32) == 0 &&
+      *Text__cp == ',')
+    {
+      Text__cp++;
+      Parsed__s.Slope_q16__i32a[0] = Gain__i32;
+    }
+    else
+    {
+      Text__cp = Spec__cp;
+    }
+    if (Parsed__s.Slope_q16__i32a[0] <= 0 ||
+      sensor_correction_number(&Text__cp, (double)Scale__i32, &Parsed__s.Out__i32a[0]) != 0)
+    {
+      return 1;
+    }
+    if (*Text__cp != '\0')
+    {
+      return 1;
+    }
+    *Correction__p = Parsed__s;
+    return 0;
+  }
+
+  for (;;)
+  {
+    Index__u32 = Parsed__s.Num_points__u32;
+    if (Index__u32 == SENSOR_CORRECTION_MAX_POINTS ||
+      sensor_correction_number(&Text__cp, (double)Scale__i32, &Parsed__s.In__i32a[Index__u32]) != 0 ||
+      *Text__cp++ != ':' ||
+      sensor_correction_number(&Text__cp, (double)Scale__i32, &Parsed__s.Out__i32a[Index__u32]) != 0 ||
+      (Index__u32 > 0 && Parsed__s.In__i32a[Index__u32] <= Parsed__s.In__i32a[Index__u32 - 1]))
+    {
+      return 1;
+    }
+    Parsed__s.Num_points__u32++;
+    if (*Text__cp == '\0')
+    {
+      break;
+    }
+    if (*Text__cp++ != ',')
+    {
+      return 1;
+    }
+  }
+
+  // Each point carries the slope to the next one; the last one keeps the
+  // slope of the segment before it, and a single point is an offset.
+  Parsed__s.Slope_q16__i32a[0] = 1 << 16;
+  for (Index__u32 = 0; Index__u32 + 1 < Parsed__s.Num_points__u32; Index__u32++)
+  {
+    int64_t Rise__i64 = (int64_t)Parsed__s.Out__i32a[Index__u32 + 1] - Parsed__s.Out__i32a[Index__u32];
+    int64_t Run__i64 = (int64_t)Parsed__s.In__i32a[Index__u32 + 1] - Parsed__s.In__i32a[Index__u32];
+    Parsed__s.Slope_q16__i32a[Index__u32] = sensor_correction_saturate(Rise__i64 * 65536 / Run__i64);
+    Parsed__s.Slope_q16__i32a[Index__u32 + 1] = Parsed__s.Slope_q16__i32a[Index__u32];
+  }
+  *Correction__p = Parsed__s;
+  return 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+int32_t sensor_correction_apply(const sensor_correction_t * Correction__p,
+  int32_t Value__i32)
+{
+  uint32_t Index__u32 = 0;
+  int64_t Delta__i64;
+
+  if (Correction__p->Num_points__u32 == 0)
+  {
+    return Value__i32;
+  }
+  // Tables are short; a linear scan beats a binary search here.
+  while (Index__u32 + 1 < Correction__p->Num_points__u32 &&
+    Value__i32 >= Correction__p->In__i32a[Index__u32 + 1])
+  {
+    Index__u32++;
+  }
+  Delta__i64 = ((int64_t)Value__i32 - Correction__p->In__i32a[Index__u32])
+    * Correction__p->Slope_q16__i32a[Index__u32];
+  // Rounded to nearest; the shift of a negative value rounds down.
+  return sensor_correction_saturate((int64_t)Correction__p->Out__i32a[Index__u32]
+    + ((Delta__i64 + (1 << 15)) >> 16));
+}
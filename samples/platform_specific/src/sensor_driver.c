@@ -0,0 +1,527 @@
+///////////////////////////////////////////////////////////////////////////////
+//
+// sensor_driver.c:
+// Sensor driver registry, the built-in drivers and the channel scheduler.
+//
+///////////////////////////////////////////////////////////////////////////////
+
+#define _POSIX_C_SOURCE 200809L
+#include "sensor_driver.h"
+#include "bme280.h"
+#include "event_trace.h"
+#include "latency_histogram.h"
+#include <fcntl.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+
+// Thermal zones cpu-thermal can read; the Pi has one.
+#define SENSOR_THERMAL_ZONES (4)
+
+struct sensor_channel_tag
+{
+  const sensor_driver_t * Driver__p;
+  int Bus__i;
+  uint64_t Period_us__u64;
+  // Next and last sample, and while converting when it can be read.
+  uint64_t Due_us__u64;
+  uint64_t Last_due_us__u64;
+  uint64_t Ready_us__u64;
+  int Converting__i;
+  sensor_channel_stats_t Stats__s;
+};
+
+struct sensor_scheduler_tag
+{
+  struct sensor_channel_tag * Channels__sp;
+  size_t Count__z;
+  // Set by the first poll, which makes every channel due.
+  int Started__i;
+};
+
+
+///////////////////////////////////////////////////////////////////////////////
+// bme280: one sensor per process, as the bme280 driver keeps its chip select
+// and calibration globally. It runs in normal mode, so there is no
+// conversion to start.
+static const char * const Bme280_value_names__cpa[] =
+{
+  "Temperature", "Pressure", "Humidity"
+};
+
+static int sensor_bme280_init(int Bus__i)
+{
+  return (bme280_init(Bus__i) == 1) ? 0 : 1;
+}
+
+static int sensor_bme280_read_raw(int Bus__i, uint8_t * Frame__u8p)
+{
+  (void)Bus__i;
+  return (bme280_read_frame(Frame__u8p) == 1) ? 0 : 1;
+}
+
+static void sensor_bme280_decode(const uint8_t * Frame__u8p, float * Values__fp)
+{
+  bme280_compensate_frame(Frame__u8p, &Values__fp[0], &Values__fp[1],
+    &Values__fp[2]);
+}
+
+const sensor_driver_t sensor_driver_bme280 =
+{
+  "bme280", 3, Bme280_value_names__cpa, BME280_FRAME_LEN, 0,
+  sensor_bme280_init, NULL, sensor_bme280_read_raw, sensor_bme280_decode
+};
+
+///////////////////////////////////////////////////////////////////////////////
+// cpu-thermal: the file of the zone stays open and is read again from the
+// start for every sample. The raw sample is the millidegrees as a little
+// endian int32.
+static const char * const Cpu_thermal_value_names__cpa[] =
+{
+  "CpuTemperature"
+};
+static int Thermal_fd__ia[SENSOR_THERMAL_ZONES] = { -1, -1, -1, -1 };
+
+static int sensor_cpu_thermal_init(int Bus__i)
+{
+  char Path__ca[64];
+
+  if (Bus__i < 0 || Bus__i >= SENSOR_THERMAL_ZONES)
+  {
+    return 1;
+  }
+  if (Thermal_fd__ia[Bus__i] < 0)
+  {
+    (void)snprintf(Path__ca, sizeof(Path__ca),
+      "/sys/class/thermal/thermal_zone%d/temp", Bus__i);
+    Thermal_fd__ia[Bus__i] = open(Path__ca, O_RDONLY | O_CLOEXEC);
+  }
+  return (Thermal_fd__ia[Bus__i] >= 0) ? 0 : 1;
+}
+
+static int sensor_cpu_thermal_read_raw(int Bus__i, uint8_t * Frame__u8p)
+{
+  char Text__ca[16];
+  ssize_t Len__z;
+  char * End__cp;
+  long Millidegrees__l;
+  uint32_t Raw__u32;
+
+  if (Bus__i < 0 || Bus__i >= SENSOR_THERMAL_ZONES || Thermal_fd__ia[Bus__i] < 0)
+  {
+    return 1;
+  }
+  Len__z = pread(Thermal_fd__ia[Bus__i], Text__ca, sizeof(Text__ca) - 1, 0);
+  if (Len__z <= 0)
+  {
+    return 1;
+  }
+  Text__ca[Len__z] = '\0';
+  Millidegrees__l = strtol(Text__ca, &End__cp, 10);
+  if (End__cp == Text__ca)
+  {
+    return 1;
+  }
+  Raw__u32 = (uint32_t)(int32_t)Millidegrees__l;
+  Frame__u8p[0] = (uint8_t)Raw__u32;
+  Frame__u8p[1] = (uint8_t)(Raw__u32 >> 8);
+  Frame__u8p[2] = (uint8_t)(Raw__u32 >> 16);
+  Frame__u8p[3] = (uint8_t)(Raw__u32 >> 24);
+  return 0;
+}
+
+static void sensor_cpu_thermal_decode(const uint8_t * Frame__u8p,
+  float * Values__fp)
+{
+  uint32_t Raw__u32 = (uint32_t)Frame__u8p[0] | ((uint32_t)Frame__u8p[1] << 8)
+    | ((uint32_t)Frame__u8p[2] << 16) | ((uint32_t)Frame__u8p[3] << 24);
+  Values__fp[0] = (float)(int32_t)Raw__u32 / 1000.0f;
+}
+
+const sensor_driver_t sensor_driver_cpu_thermal =
+{
+  "cpu-thermal", 1, Cpu_thermal_value_names__cpa, 4, 0,
+  sensor_cpu_thermal_init, NULL, sensor_cpu_thermal_read_raw,
+  sensor_cpu_thermal_decode
+};
+
+
+static const sensor_driver_t * Registry__pa[SENSOR_REGISTRY_LEN] =
+{
+  &sensor_driver_bme280, &sensor_driver_cpu_thermal
+};
+static size_t Registry_count__z = 2;
+
+///////////////////////////////////////////////////////////////////////////////
+int sensor_registry_add(const sensor_driver_t * Driver__p)
+{
+  if (Driver__p == NULL || Driver__p->Name__cp == NULL ||
+    Driver__p->Value_count__z == 0 ||
+    Driver__p->Value_count__z > SENSOR_MAX_VALUES ||
+    Driver__p->Frame_len__z > SENSOR_MAX_FRAME_LEN ||
+    Driver__p->Read_raw__fp == NULL || Driver__p->Decode__fp == NULL ||
+    sensor_registry_find(Driver__p->Name__cp) != NULL ||
+    Registry_count__z == SENSOR_REGISTRY_LEN)
+  {
+    return 1;
+  }
+  Registry__pa[Registry_count__z++] = Driver__p;
+  return 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+const sensor_driver_t * sensor_registry_find(const char * Name__cp)
+{
+  size_t Index__z;
+
+  for (Index__z = 0; Index__z < Registry_count__z; Index__z++)
+  {
+    if (strcmp(Registry__pa[Index__z]->Name__cp, Name__cp) == 0)
+    {
+      return Registry__pa[Index__z];
+    }
+  }
+  return NULL;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+const sensor_driver_t * sensor_registry_get(size_t Index__z)
+{
+  return (Index__z < Registry_count__z) ? Registry__pa[Index__z] : NULL;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+sensor_scheduler_t * sensor_scheduler_create(void)
+{
+  return (sensor_scheduler_t *)calloc(1, sizeof(sensor_scheduler_t));
+}
+
+///////////////////////////////////////////////////////////////////////////////
+void sensor_scheduler_destroy(sensor_scheduler_t * Scheduler__p)
+{
+  if (Scheduler__p != NULL)
+  {
+    free(Scheduler__p->Channels__sp);
+    free(Scheduler__p);
+  }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+int sensor_scheduler_add(sensor_scheduler_t * Scheduler__p,
+  const sensor_driver_t * Driver__p, int Bus__i, uint32_t Period_us__u32)
+{
+  struct sensor_channel_tag * Channels__sp;
+  struct sensor_channel_tag * Channel__p;
+
+  if (Period_us__u32 == 0)
+  {
+    return -1;
+  }
+  Channels__sp = (struct sensor_channel_tag *)realloc(Scheduler__p->Channels__sp,
+    (Scheduler__p->Count__z + 1) * sizeof(struct sensor_channel_tag));
+  if (Channels__sp == NULL)
+  {
+    return -1;
+  }
+  Scheduler__p->Channels__sp = Channels__sp;
+
+  Channel__p = &Channels__sp[Scheduler__p->Count__z];
+  memset(Channel__p, 0, sizeof(*Channel__p));
+  Channel__p->Driver__p = Driver__p;
+  Channel__p->Bus__i = Bus__i;
+  Channel__p->Period_us__u64 = Period_us__u32;
+  // A channel added after the first poll is due at the next one.
+  Channel__p->Due_us__u64 = Scheduler__p->Started__i ? latency_clock_us() : 0;
+  return (int)Scheduler__p->Count__z++;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+void sensor_scheduler_set_period(sensor_scheduler_t * Scheduler__p,
+  int Channel__i, uint32_t Period_us__u32)
+{
+  if (Channel__i >= 0 && (size_t)Channel__i < Scheduler__p->Count__z &&
+    Period_us__u32 > 0)
+  {
+    struct sensor_channel_tag * Channel__p = &Scheduler__p->Channels__sp[Channel__i];
+    // The next sample moves to one new period after the last one.
+    if (Period_us__u32 != Channel__p->Period_us__u64 &&
+      Channel__p->Stats__s.Samples__u64 > 0 && !Channel__p->Converting__i)
+    {
+      Channel__p->Due_us__u64 = Channel__p->Last_due_us__u64 + Period_us__u32;
+    }
+    Channel__p->Period_us__u64 = Period_us__u32;
+  }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+void sensor_scheduler_set_due(sensor_scheduler_t * Scheduler__p,
+  int Channel__i, uint64_t Due_us__u64)
+{
+  if (Channel__i >= 0 && (size_t)Channel__i < Scheduler__p->Count__z)
+  {
+    struct sensor_channel_tag * Channel__p = &Scheduler__p->Channels__sp[Channel__i];
+    Channel__p->Due_us__u64 = Due_us__u64;
+    if (Channel__p->Converting__i && Channel__p->Ready_us__u64 < Due_us__u64)
+    {
+      Channel__p->Ready_us__u64 = Due_us__u64;
+    }
+  }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// The time of the next step of a channel: starting its conversion ahead of
+// the sample, or reading it.
+static uint64_t sensor_channel_next_us(const struct sensor_channel_tag * Channel__p)
+{
+  uint32_t Conversion_us__u32 = Channel__p->Driver__p->Conversion_us__u32;
+
+  if (Channel__p->Converting__i)
+  {
+    return Channel__p->Ready_us__u64;
+  }
+  if (Channel__p->Driver__p->Start__fp != NULL &&
+    Channel__p->Due_us__u64 > Conversion_us__u32)
+  {
+    return Channel__p->Due_us__u64 - Conversion_us__u32;
+  }
+  return Channel__p->Due_us__u64;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+uint64_t sensor_scheduler_next_us(const sensor_scheduler_t * Scheduler__p)
+{
+  uint64_t Next_us__u64 = UINT64_MAX;
+  size_t Index__z;
+
+  for (Index__z = 0; Index__z < Scheduler__p->Count__z; Index__z++)
+  {
+    uint64_t Channel_us__u64 = sensor_channel_next_us(&Scheduler__p->Channels__sp[Index__z]);
+    if (Channel_us__u64 < Next_us__u64)
+    {
+      Next_us__u64 = Channel_us__u64;
+    }
+  }
+  return Next_us__u64;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Reads and decodes the sample of a channel and moves it to its next period.
+static void sensor_channel_sample(struct sensor_channel_tag * Channel__p,
+  int Channel__i, uint64_t Now_us__u64, sensor_sample_fn Sample__fp,
+  void * Context__p)
+{
+  const sensor_driver_t * Driver__p = Channel__p->Driver__p;
+  sensor_sample_t Sample__s;
+  uint64_t Next_us__u64;
+
+  memset(&Sample__s, 0, sizeof(Sample__s));
+  Sample__s.Channel__i = Channel__i;
+  Sample__s.Due_us__u64 = Channel__p->Due_us__u64;
+  Sample__s.Time_us__u64 = latency_clock_us();
+  event_trace_record(EVENT_TRACE_BEGIN, "read_raw", (uint64_t)Channel__i);
+  Sample__s.Result__i = Driver__p->Read_raw__fp(Channel__p->Bus__i,
+    Sample__s.Frame__u8a);
+  event_trace_record(EVENT_TRACE_END, "read_raw", 0);
+  if (Sample__s.Result__i == 0)
+  {
+    event_trace_record(EVENT_TRACE_BEGIN, "decode", 0);
+    Driver__p->Decode__fp(Sample__s.Frame__u8a, Sample__s.Values__fa);
+    event_trace_record(EVENT_TRACE_END, "decode", 0);
+  }
+  else
+  {
+    Channel__p->Stats__s.Failed__u64++;
+  }
+  Channel__p->Stats__s.Samples__u64++;
+  Channel__p->Converting__i = 0;
+  Channel__p->Last_due_us__u64 = Channel__p->Due_us__u64;
+
+  // Skip the periods already passed rather than sampling in a burst to
+  // catch up, as the rt_sampler does.
+  Next_us__u64 = Channel__p->Due_us__u64 + Channel__p->Period_us__u64;
+  if (Next_us__u64 <= Now_us__u64)
+  {
+    uint64_t Missed__u64 = (Now_us__u64 - Channel__p->Due_us__u64) / Channel__p->Period_us__u64;
+    Channel__p->Stats__s.Missed__u64 += Missed__u64;
+    Next_us__u64 = Channel__p->Due_us__u64 + (Missed__u64 + 1) * Channel__p->Period_us__u64;
+  }
+  Channel__p->Due_us__u64 = Next_us__u64;
+
+  Sample__fp(Context__p, &Sample__s);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+size_t sensor_scheduler_poll(sensor_scheduler_t * Scheduler__p,
+  uint64_t Now_us__u64, sensor_sample_fn Sample__fp, void * Context__p)
+{
+  size_t Samples__z = 0;
+
+  if (!Scheduler__p->Started__i)
+  {
+    size_t Index__z;
+    for (Index__z = 0; Index__z < Scheduler__p->Count__z; Index__z++)
+    {
+      struct sensor_channel_tag * Channel__p = &Scheduler__p->Channels__sp[Index__z];
+      if (Channel__p->Due_us__u64 == 0)
+      {
+        Channel__p->Due_us__u64 = Now_us__u64;
+        if (Channel__p->Driver__p->Start__fp != NULL)
+        {
+          Channel__p->Due_us__u64 += Channel__p->Driver__p->Conversion_us__u32;
+        }
+      }
+    }
+    Scheduler__p->Started__i = 1;
+  }
+
+  // One step at a time, always of the channel that is due first. Every step
+  // moves its channel past Now_us__u64 or from starting to reading, so this
+  // ends.
+  for (;;)
+  {
+    struct sensor_channel_tag * Channel__p = NULL;
+    uint64_t Next_us__u64 = UINT64_MAX;
+    size_t Index__z;
+    int Channel__i = 0;
+
+    for (Index__z = 0; Index__z < Scheduler__p->Count__z; Index__z++)
+    {
+      uint64_t Channel_us__u64 = sensor_channel_next_us(&Scheduler__p->Channels__sp[Index__z]);
+      if (Channel_us__u64 < Next_us__u64)
+      {
+        Next_us__u64 = Channel_us__u64;
+        Channel__p = &Scheduler__p->Channels__sp[Index__z];
+        Channel__i = (int)Index__z;
+      }
+    }
+    if (Channel__p == NULL || Next_us__u64 > Now_us__u64)
+    {
+      break;
+    }
+
+    if (!Channel__p->Converting__i && Channel__p->Driver__p->Start__fp != NULL)
+    {
+      if (Channel__p->Driver__p->Start__fp(Channel__p->Bus__i) != 0)
+      {
+        // Read anyway; the driver reports the failure with no data.
+        Channel__p->Ready_us__u64 = Now_us__u64;
+      }
+      else
+      {
+        Channel__p->Ready_us__u64 = Now_us__u64 + Channel__p->Driver__p->Conversion_us__u32;
+        if (Channel__p->Ready_us__u64 < Channel__p->Due_us__u64)
+        {
+          Channel__p->Ready_us__u64 = Channel__p->Due_us__u64;
+        }
+      }
+      Channel__p->Converting__i = 1;
+      if (Channel__p->Ready_us__u64 > Now_us__u64)
+      {
+        continue;
+      }
+    }
+    sensor_channel_sample(Channel__p, Channel__i, Now_us__u64, Sample__fp,
+      Context__p);
+    Samples__z++;
+  }
+  return Samples__z;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+const sensor_driver_t * sensor_scheduler_driver(
+  const sensor_scheduler_t * Scheduler__p, int Channel__i)
+{
+  if (Channel__i < 0 || (size_t)Channel__i >= Scheduler__p->Count__z)
+  {
+    return NULL;
+  }
+  return Scheduler__p->Channels__sp[Channel__i].Driver__p;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+size_t sensor_scheduler_count(const sensor_scheduler_t * Scheduler__p)
+{
+  return Scheduler__p->Count__z;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+void sensor_scheduler_get_stats(const sensor_scheduler_t * Scheduler__p,
+  int Channel__i, sensor_channel_stats_t * Stats__p)
+{
+  if (Channel__i >= 0 && (size_t)Channel__i < Scheduler__p->Count__z)
+  {
+    *Stats__p = Scheduler__p->Channels__sp[Channel__i].Stats__s;
+  }
+  else
+  {
+    memset(Stats__p, 0, sizeof(*Stats__p));
+  }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Appends to a JSON text being built; strings are only taken if they need no
+// escaping.
+// Return: 0 on success, 1 if the text does not fit or has such a string.
+static int sensor_json_append(char * Buffer__cp, size_t Buffer_size__z,
+  size_t * Len__zp, const char * Format__cp, const char * String__cp,
+  double Number__d)
+{
+  int Written__i;
+
+  if (String__cp != NULL)
+  {
+    const char * Char__cp;
+    for (Char__cp = String__cp; *Char__cp != '\0'; Char__cp++)
+    {
+      if (*Char__cp == '"' || *Char__cp == '\\' || (unsigned char)*Char__cp < 0x20)
+      {
+        return 1;
+      }
+    }
+    Written__i = snprintf(Buffer__cp + *Len__zp, Buffer_size__z - *Len__zp,
+      Format__cp, String__cp, Number__d);
+  }
+  else
+  {
+    Written__i = snprintf(Buffer__cp + *Len__zp, Buffer_size__z - *Len__zp,
+      Format__cp, Number__d);
+  }
+  if (Written__i < 0 || (size_t)Written__i >= Buffer_size__z - *Len__zp)
+  {
+    return 1;
+  }
+  *Len__zp += (size_t)Written__i;
+  return 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+size_t sensor_sample_format_json(const sensor_driver_t * Driver__p,
+  const sensor_sample_t * Sample__p, const char * Device_id__cp,
+  const char * Sample_time__cp, char * Buffer__cp, size_t Buffer_size__z)
+{
+  size_t Len__z = 0;
+  size_t Index__z;
+  int Failed__i;
+
+  if (Sample__p->Result__i != 0 || Buffer_size__z == 0)
+  {
+    return 0;
+  }
+  Failed__i = sensor_json_append(Buffer__cp, Buffer_size__z, &Len__z,
+    "{\"DeviceId\":\"%s\"", Device_id__cp, 0.0);
+  Failed__i = Failed__i || sensor_json_append(Buffer__cp, Buffer_size__z,
+    &Len__z, ",\"Sensor\":\"%s\"", Driver__p->Name__cp, 0.0);
+  for (Index__z = 0; Index__z < Driver__p->Value_count__z && !Failed__i; Index__z++)
+  {
+    double Value__d = Sample__p->Values__fa[Index__z];
+    Failed__i = sensor_json_append(Buffer__cp, Buffer_size__z, &Len__z,
+      isfinite(Value__d) ? ",\"%s\":%.6g" : ",\"%s\":null",
+      Driver__p->Value_names__cpp[Index__z], Value__d);
+  }
+  Failed__i = Failed__i || sensor_json_append(Buffer__cp, Buffer_size__z,
+    &Len__z, ",\"SampleTime\":\"%s\"}", Sample_time__cp, 0.0);
+  return Failed__i ? 0 : Len__z;
+}
@@ -0,0 +1,377 @@
+///////////////////////////////////////////////////////////////////////////////
+//
+// sensor_trace.c:
+// Append-only binary traces of raw BME280 frames, and their replay through
+// the bme280 SPI hook so the driver and compensation run unchanged.
+//
+///////////////////////////////////////////////////////////////////////////////
+
+#define _POSIX_C_SOURCE 200809L
+#include "sensor_trace.h"
+#include "bme280.h"
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+
+static const char Trace_magic__ca[8] = { 'B', 'M', 'E', 'T', 'R', 'A', 'C', 'E' };
+
+// Header field offsets, see the layout in sensor_trace.h.
+enum
+{
+    eTraceHdr_MAGIC      = 0
+  , eTraceHdr_VERSION    = 8
+  , eTraceHdr_HEADER_LEN = 10
+  , eTraceHdr_RECORD_LEN = 12
+  , eTraceHdr_CALIB_LEN  = 14
+  , eTraceHdr_CALIB      = 16
+  , eTraceHdr_CREATED    = 48
+};
+
+// Register addresses the replay answers, see the device register enum in
+// bme280.c, and where the calibration registers sit in the calibration bytes.
+enum
+{
+    eTraceReg_DIG_T1   = 0x88
+  , eTraceReg_DIG_H1   = 0xA1
+  , eTraceReg_DIG_H2   = 0xE1
+  , eTraceReg_CHIPID   = 0xD0
+  , eTraceReg_PRESDATA = 0xF7
+
+  , eTraceCalib_T_P_LEN = 24
+  , eTraceCalib_H2_LEN  = 7
+};
+
+struct sensor_trace_writer_tag
+{
+  int Fd__i;
+};
+
+struct sensor_trace_reader_tag
+{
+  const uint8_t * Map__u8p;
+  size_t Map_len__z;
+  size_t Count__z;
+};
+
+static const sensor_trace_reader_t * Replay_reader__p = NULL;
+static size_t Replay_position__z = 0;
+static uint8_t Replay_registers__u8a[256];
+
+
+///////////////////////////////////////////////////////////////////////////////
+static void trace_put_u16(uint8_t * Data__u8p, uint16_t Value__u16)
+{
+  Data__u8p[0] = (uint8_t)Value__u16;
+  Data__u8p[1] = (uint8_t)(Value__u16 >> 8);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+static uint16_t trace_get_u16(const uint8_t * Data__u8p)
+{
+  return (uint16_t)(Data__u8p[0] | ((uint16_t)Data__u8p[1] << 8));
+}
+
+///////////////////////////////////////////////////////////////////////////////
+static void trace_put_u64(uint8_t * Data__u8p, uint64_t Value__u64)
+{
+  int Byte_idx__i;
+  for (Byte_idx__i = 0; Byte_idx__i < 8; Byte_idx__i++)
+  {
+    Data__u8p[Byte_idx__i] = (uint8_t)(Value__u64 >> (8 * Byte_idx__i));
+  }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+static uint64_t trace_get_u64(const uint8_t * Data__u8p)
+{
+  uint64_t Value__u64 = 0;
+  int Byte_idx__i;
+  for (Byte_idx__i = 7; Byte_idx__i >= 0; Byte_idx__i--)
+  {
+    Value__u64 = (Value__u64 << 8) | Data__u8p[Byte_idx__i];
+  }
+  return Value__u64;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Return: 0 if the header is one this code can read, otherwise 1.
+static int trace_check_header(const uint8_t * Header__u8p)
+{
+  if ((memcmp(&Header__u8p[eTraceHdr_MAGIC], Trace_magic__ca,
+      sizeof(Trace_magic__ca)) != 0)
+    || (trace_get_u16(&Header__u8p[eTraceHdr_VERSION]) != SENSOR_TRACE_VERSION)
+    || (trace_get_u16(&Header__u8p[eTraceHdr_HEADER_LEN]) != SENSOR_TRACE_HEADER_LEN)
+    || (trace_get_u16(&Header__u8p[eTraceHdr_RECORD_LEN]) != SENSOR_TRACE_RECORD_LEN)
+    || (trace_get_u16(&Header__u8p[eTraceHdr_CALIB_LEN]) != BME280_CALIB_LEN))
+  {
+    return 1;
+  }
+  return 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+uint64_t sensor_trace_now_us(void)
+{
+  struct timespec Now__s;
+  clock_gettime(CLOCK_REALTIME, &Now__s);
+  return (uint64_t)Now__s.tv_sec * 1000000ULL + (uint64_t)Now__s.tv_nsec / 1000;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+sensor_trace_writer_t * sensor_trace_writer_open(const char * Path__cp,
+  const uint8_t * Calib__u8p)
+{
+  uint8_t Header__u8a[SENSOR_TRACE_HEADER_LEN];
+  struct stat Stat__s;
+  sensor_trace_writer_t * Writer__p;
+
+  int Fd__i = open(Path__cp, O_RDWR | O_CREAT | O_APPEND, 0644);
+  if (Fd__i < 0)
+  {
+    return NULL;
+  }
+
+  if (fstat(Fd__i, &Stat__s) != 0)
+  {
+    close(Fd__i);
+    return NULL;
+  }
+
+  if (Stat__s.st_size < SENSOR_TRACE_HEADER_LEN)
+  {
+    // New file, or one that died before its header was complete.
+    memset(Header__u8a, 0, sizeof(Header__u8a));
+    memcpy(&Header__u8a[eTraceHdr_MAGIC], Trace_magic__ca, sizeof(Trace_magic__ca));
+    trace_put_u16(&Header__u8a[eTraceHdr_VERSION], SENSOR_TRACE_VERSION);
+    trace_put_u16(&Header__u8a[eTraceHdr_HEADER_LEN], SENSOR_TRACE_HEADER_LEN);
+    trace_put_u16(&Header__u8a[eTraceHdr_RECORD_LEN], SENSOR_TRACE_RECORD_LEN);
+    trace_put_u16(&Header__u8a[eTraceHdr_CALIB_LEN], BME280_CALIB_LEN);
+    memcpy(&Header__u8a[eTraceHdr_CALIB], Calib__u8p, BME280_CALIB_LEN);
+    trace_put_u64(&Header__u8a[eTraceHdr_CREATED], sensor_trace_now_us());
+
+    if ((ftruncate(Fd__i, 0) != 0)
+      || (write(Fd__i, Header__u8a, sizeof(Header__u8a)) != (ssize_t)sizeof(Header__u8a)))
+    {
+      close(Fd__i);
+      return NULL;
+    }
+  }
+  else
+  {
+    off_t Records_len__o;
+
+    if ((pread(Fd__i, Header__u8a, sizeof(Header__u8a), 0) != (ssize_t)sizeof(Header__u8a))
+      || (trace_check_header(Header__u8a) != 0)
+      || (memcmp(&Header__u8a[eTraceHdr_CALIB], Calib__u8p, BME280_CALIB_LEN) != 0))
+    {
+      close(Fd__i);
+      return NULL;
+    }
+
+    // Drop a record torn by a crash, so the next one lands on a boundary.
+    Records_len__o = Stat__s.st_size - SENSOR_TRACE_HEADER_LEN;
+    if ((Records_len__o % SENSOR_TRACE_RECORD_LEN) != 0)
+    {
+      if (ftruncate(Fd__i, Stat__s.st_size - Records_len__o % SENSOR_TRACE_RECORD_LEN) != 0)
+      {
+        close(Fd__i);
+        return NULL;
+      }
+    }
+  }
+
+  Writer__p = malloc(sizeof(*Writer__p));
+  if (Writer__p == NULL)
+  {
+    close(Fd__i);
+    return NULL;
+  }
+  Writer__p->Fd__i = Fd__i;
+  return Writer__p;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+int sensor_trace_writer_append(sensor_trace_writer_t * Writer__p,
+  uint64_t Time_us__u64, const uint8_t * Frame__u8p)
+{
+  uint8_t Record__u8a[SENSOR_TRACE_RECORD_LEN];
+
+  trace_put_u64(&Record__u8a[0], Time_us__u64);
+  memcpy(&Record__u8a[8], Frame__u8p, BME280_FRAME_LEN);
+
+  if (write(Writer__p->Fd__i, Record__u8a, sizeof(Record__u8a)) != (ssize_t)sizeof(Record__u8a))
+  {
+    return 1;
+  }
+  return 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+void sensor_trace_writer_close(sensor_trace_writer_t * Writer__p)
+{
+  if (Writer__p != NULL)
+  {
+    close(Writer__p->Fd__i);
+    free(Writer__p);
+  }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+sensor_trace_reader_t * sensor_trace_reader_open(const char * Path__cp)
+{
+  struct stat Stat__s;
+  sensor_trace_reader_t * Reader__p;
+  void * Map__p;
+
+  int Fd__i = open(Path__cp, O_RDONLY);
+  if (Fd__i < 0)
+  {
+    return NULL;
+  }
+  if ((fstat(Fd__i, &Stat__s) != 0) || (Stat__s.st_size < SENSOR_TRACE_HEADER_LEN))
+  {
+    close(Fd__i);
+    return NULL;
+  }
+
+  Map__p = mmap(NULL, (size_t)Stat__s.st_size, PROT_READ, MAP_SHARED, Fd__i, 0);
+  // The mapping stays valid without the descriptor.
+  close(Fd__i);
+  if (Map__p == MAP_FAILED)
+  {
+    return NULL;
+  }
+
+  if (trace_check_header(Map__p) != 0)
+  {
+    munmap(Map__p, (size_t)Stat__s.st_size);
+    return NULL;
+  }
+
+  Reader__p = malloc(sizeof(*Reader__p));
+  if (Reader__p == NULL)
+  {
+    munmap(Map__p, (size_t)Stat__s.st_size);
+    return NULL;
+  }
+  Reader__p->Map__u8p = Map__p;
+  Reader__p->Map_len__z = (size_t)Stat__s.st_size;
+  // A torn record at the end is ignored.
+  Reader__p->Count__z = (Reader__p->Map_len__z - SENSOR_TRACE_HEADER_LEN)
+    / SENSOR_TRACE_RECORD_LEN;
+  return Reader__p;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+void sensor_trace_reader_close(sensor_trace_reader_t * Reader__p)
+{
+  if (Reader__p != NULL)
+  {
+    if (Replay_reader__p == Reader__p)
+    {
+      Replay_reader__p = NULL;
+    }
+    munmap((void *)Reader__p->Map__u8p, Reader__p->Map_len__z);
+    free(Reader__p);
+  }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+size_t sensor_trace_reader_count(const sensor_trace_reader_t * Reader__p)
+{
+  return Reader__p->Count__z;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+const uint8_t * sensor_trace_reader_calibration(
+  const sensor_trace_reader_t * Reader__p)
+{
+  return &Reader__p->Map__u8p[eTraceHdr_CALIB];
+}
+
+///////////////////////////////////////////////////////////////////////////////
+int sensor_trace_reader_record(const sensor_trace_reader_t * Reader__p,
+  size_t Index__z, uint64_t * Time_us__u64p, const uint8_t ** Frame__u8pp)
+{
+  const uint8_t * Record__u8p;
+
+  if (Index__z >= Reader__p->Count__z)
+  {
+    return 1;
+  }
+  Record__u8p = Reader__p->Map__u8p + SENSOR_TRACE_HEADER_LEN
+    + Index__z * SENSOR_TRACE_RECORD_LEN;
+  if (Time_us__u64p != NULL)
+  {
+    *Time_us__u64p = trace_get_u64(Record__u8p);
+  }
+  if (Frame__u8pp != NULL)
+  {
+    *Frame__u8pp = Record__u8p + 8;
+  }
+  return 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Answers the driver like bme280_sim does, with the status register always
+// showing a finished conversion and each burst read taking the next record.
+static int replay_spi_xfer(int Channel__i, unsigned char * Data__u8p, int Len__i)
+{
+  (void)Channel__i;
+  if ((Len__i > 0) && ((Data__u8p[0] & 0x80) != 0))
+  {
+    uint8_t Register__u8 = Data__u8p[0];
+    int Idx__i;
+
+    if (Register__u8 <= eTraceReg_PRESDATA + BME280_FRAME_LEN - 1
+      && Register__u8 + Len__i - 1 > eTraceReg_PRESDATA)
+    {
+      const uint8_t * Frame__u8p;
+      if ((Replay_reader__p == NULL)
+        || (sensor_trace_reader_record(Replay_reader__p, Replay_position__z,
+          NULL, &Frame__u8p) != 0))
+      {
+        // End of the trace: only the command byte went through.
+        return 1;
+      }
+      memcpy(&Replay_registers__u8a[eTraceReg_PRESDATA], Frame__u8p,
+        BME280_FRAME_LEN);
+      Replay_position__z++;
+    }
+    for (Idx__i = 1; Idx__i < Len__i; Idx__i++)
+    {
+      Data__u8p[Idx__i] = Replay_registers__u8a[(uint8_t)(Register__u8 + Idx__i - 1)];
+    }
+  }
+  // Register writes (the control setting) are accepted and ignored.
+  return Len__i;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+void sensor_trace_replay_install(const sensor_trace_reader_t * Reader__p)
+{
+  const uint8_t * Calib__u8p = sensor_trace_reader_calibration(Reader__p);
+
+  memset(Replay_registers__u8a, 0, sizeof(Replay_registers__u8a));
+  Replay_registers__u8a[eTraceReg_CHIPID] = 0x60;
+  memcpy(&Replay_registers__u8a[eTraceReg_DIG_T1], Calib__u8p,
+    eTraceCalib_T_P_LEN);
+  Replay_registers__u8a[eTraceReg_DIG_H1] = Calib__u8p[eTraceCalib_T_P_LEN];
+  memcpy(&Replay_registers__u8a[eTraceReg_DIG_H2],
+    &Calib__u8p[eTraceCalib_T_P_LEN + 1], eTraceCalib_H2_LEN);
+
+  Replay_reader__p = Reader__p;
+  Replay_position__z = 0;
+  bme280_set_spi_xfer(replay_spi_xfer);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+size_t sensor_trace_replay_position(void)
+{
+  return Replay_position__z;
+}
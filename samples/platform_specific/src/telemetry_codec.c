@@ -0,0 +1,220 @@
+///////////////////////////////////////////////////////////////////////////////
+//
+// telemetry_codec.c:
+// Compact binary (CBOR, RFC 7049) encoding of telemetry samples, used as an
+// alternative to the JSON produced by the serializer's SERIALIZE macro.
+//
+///////////////////////////////////////////////////////////////////////////////
+
+#include "telemetry_codec.h"
+#include <string.h>
+
+
+// CBOR major types, already shifted into the top three bits.
+enum
+{
+    eCborMajor_UINT  = 0x00
+  , eCborMajor_TEXT  = 0x60
+  , eCborMajor_ARRAY = 0x80
+  , eCborMajor_MAP   = 0xA0
+  , eCborMajor_FLOAT = 0xE0
+};
+
+static const char * Field_names__cpa[eTelemetryField_COUNT] =
+{
+    "Schema"
+  , "DeviceId"
+  , "Temperature"
+  , "Humidity"
+  , "SampleTime"
+};
+
+typedef struct
+{
+  uint8_t * Data__u8p;
+  size_t Size__z;
+  size_t Used__z;
+  int Overflow__i;
+} cbor_writer_t;
+
+
+///////////////////////////////////////////////////////////////////////////////
+static void cbor_put(cbor_writer_t * Writer__p, const uint8_t * Data__u8p,
+  size_t Num_bytes__z)
+{
+  if (Writer__p->Overflow__i || (Writer__p->Size__z - Writer__p->Used__z) < Num_bytes__z)
+  {
+    Writer__p->Overflow__i = 1;
+    return;
+  }
+  memcpy(Writer__p->Data__u8p + Writer__p->Used__z, Data__u8p, Num_bytes__z);
+  Writer__p->Used__z += Num_bytes__z;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Writes a major type with its argument using the shortest form.
+static void cbor_put_head(cbor_writer_t * Writer__p, uint8_t Major__u8,
+  uint64_t Value__u64)
+{
+  uint8_t Head__u8a[9];
+  size_t Len__z;
+  uint32_t Value__u32 = (uint32_t)Value__u64;
+
+  if (Value__u64 > 0xFFFFFFFFULL)
+  {
+    int Byte_idx__i;
+    Head__u8a[0] = Major__u8 | 27;
+    for (Byte_idx__i = 0; Byte_idx__i < 8; Byte_idx__i++)
+    {
+      Head__u8a[1 + Byte_idx__i] = (uint8_t)(Value__u64 >> (56 - 8 * Byte_idx__i));
+    }
+    Len__z = 9;
+  }
+  else if (Value__u32 < 24)
+  {
+    Head__u8a[0] = Major__u8 | (uint8_t)Value__u32;
+    Len__z = 1;
+  }
+  else if (Value__u32 <= 0xFF)
+  {
+    Head__u8a[0] = Major__u8 | 24;
+    Head__u8a[1] = (uint8_t)Value__u32;
+    Len__z = 2;
+  }
+  else if (Value__u32 <= 0xFFFF)
+  {
+    Head__u8a[0] = Major__u8 | 25;
+    Head__u8a[1] = (uint8_t)(Value__u32 >> 8);
+    Head__u8a[2] = (uint8_t)Value__u32;
+    Len__z = 3;
+  }
+  else
+  {
+    Head__u8a[0] = Major__u8 | 26;
+    Head__u8a[1] = (uint8_t)(Value__u32 >> 24);
+    Head__u8a[2] = (uint8_t)(Value__u32 >> 16);
+    Head__u8a[3] = (uint8_t)(Value__u32 >> 8);
+    Head__u8a[4] = (uint8_t)Value__u32;
+    Len__z = 5;
+  }
+  cbor_put(Writer__p, Head__u8a, Len__z);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+static void cbor_put_text(cbor_writer_t * Writer__p, const char * Text__cp)
+{
+  size_t Len__z = strlen(Text__cp);
+  cbor_put_head(Writer__p, eCborMajor_TEXT, (uint32_t)Len__z);
+  cbor_put(Writer__p, (const uint8_t *)Text__cp, Len__z);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Sensor readings start life as floats, so they nearly always fit in a
+// single precision value without loss; fall back to double otherwise.
+static void cbor_put_double(cbor_writer_t * Writer__p, double Value__d)
+{
+  uint8_t Buffer__u8a[9];
+  float Single__f = (float)Value__d;
+
+  if ((double)Single__f == Value__d)
+  {
+    uint32_t Bits__u32;
+    memcpy(&Bits__u32, &Single__f, sizeof(Bits__u32));
+    Buffer__u8a[0] = eCborMajor_FLOAT | 26;
+    Buffer__u8a[1] = (uint8_t)(Bits__u32 >> 24);
+    Buffer__u8a[2] = (uint8_t)(Bits__u32 >> 16);
+    Buffer__u8a[3] = (uint8_t)(Bits__u32 >> 8);
+    Buffer__u8a[4] = (uint8_t)Bits__u32;
+    cbor_put(Writer__p, Buffer__u8a, 5);
+  }
+  else
+  {
+    uint64_t Bits__u64;
+    int Byte_idx__i;
+    memcpy(&Bits__u64, &Value__d, sizeof(Bits__u64));
+    Buffer__u8a[0] = eCborMajor_FLOAT | 27;
+    for (Byte_idx__i = 0; Byte_idx__i < 8; Byte_idx__i++)
+    {
+      Buffer__u8a[1 + Byte_idx__i] = (uint8_t)(Bits__u64 >> (56 - 8 * Byte_idx__i));
+    }
+    cbor_put(Writer__p, Buffer__u8a, 9);
+  }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+const char * telemetry_field_name(int Field_id__i)
+{
+  if ((Field_id__i < 0) || (Field_id__i >= eTelemetryField_COUNT))
+  {
+    return NULL;
+  }
+  return Field_names__cpa[Field_id__i];
+}
+
+///////////////////////////////////////////////////////////////////////////////
+const char * telemetry_content_type(TELEMETRY_ENCODING Encoding__e)
+{
+  return (Encoding__e == TELEMETRY_ENCODING_CBOR) ? "application/cbor"
+    : "application/json";
+}
+
+///////////////////////////////////////////////////////////////////////////////
+int telemetry_encoding_from_string(const char * Name__cp,
+  TELEMETRY_ENCODING * Encoding__ep)
+{
+  if (strcmp(Name__cp, "json") == 0)
+  {
+    *Encoding__ep = TELEMETRY_ENCODING_JSON;
+    return 0;
+  }
+  if (strcmp(Name__cp, "cbor") == 0)
+  {
+    *Encoding__ep = TELEMETRY_ENCODING_CBOR;
+    return 0;
+  }
+  return 1;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+size_t telemetry_encode_cbor(const telemetry_sample_t * Sample__p,
+  const char * Device_id__cp, uint8_t * Buffer__u8p, size_t Buffer_size__z)
+{
+  cbor_writer_t Writer__s = { Buffer__u8p, Buffer_size__z, 0, 0 };
+
+  cbor_put_head(&Writer__s, eCborMajor_MAP, 3 + ((Device_id__cp != NULL) ? 1 : 0)
+    + ((Sample__p->Time_ms != 0) ? 1 : 0));
+
+  cbor_put_head(&Writer__s, eCborMajor_UINT, eTelemetryField_SCHEMA);
+  cbor_put_head(&Writer__s, eCborMajor_UINT, TELEMETRY_SCHEMA_VERSION);
+
+  if (Device_id__cp != NULL)
+  {
+    cbor_put_head(&Writer__s, eCborMajor_UINT, eTelemetryField_DEVICE_ID);
+    cbor_put_text(&Writer__s, Device_id__cp);
+  }
+
+  cbor_put_head(&Writer__s, eCborMajor_UINT, eTelemetryField_TEMPERATURE);
+  cbor_put_double(&Writer__s, Sample__p->Temperature);
+
+  cbor_put_head(&Writer__s, eCborMajor_UINT, eTelemetryField_HUMIDITY);
+  cbor_put_double(&Writer__s, Sample__p->Humidity);
+
+  if (Sample__p->Time_ms != 0)
+  {
+    cbor_put_head(&Writer__s, eCborMajor_UINT, eTelemetryField_TIME);
+    cbor_put_head(&Writer__s, eCborMajor_UINT, Sample__p->Time_ms);
+  }
+
+  return Writer__s.Overflow__i ? 0 : Writer__s.Used__z;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+size_t telemetry_encode_cbor_array_head(size_t Num_samples__z,
+  uint8_t * Buffer__u8p, size_t Buffer_size__z)
+{
+  cbor_writer_t Writer__s = { Buffer__u8p, Buffer_size__z, 0, 0 };
+
+  cbor_put_head(&Writer__s, eCborMajor_ARRAY, (uint32_t)Num_samples__z);
+
+  return Writer__s.Overflow__i ? 0 : Writer__s.Used__z;
+}
@@ -0,0 +1,112 @@
+///////////////////////////////////////////////////////////////////////////////
+//
+// time_service.c:
+// Source timestamps for samples, clock step detection and ISO-8601
+// formatting.
+//
+///////////////////////////////////////////////////////////////////////////////
+
+#define _POSIX_C_SOURCE 200112L
+#include "time_service.h"
+#include <string.h>
+#include <time.h>
+
+
+///////////////////////////////////////////////////////////////////////////////
+static uint64_t time_service_clock_us(clockid_t Clock__e)
+{
+  struct timespec Now__s;
+  clock_gettime(Clock__e, &Now__s);
+  return (uint64_t)Now__s.tv_sec * 1000000ULL + (uint64_t)Now__s.tv_nsec / 1000;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Writes Value__u32 as exactly Digits__i decimal digits.
+static char * time_put_digits(char * Out__cp, uint32_t Value__u32, int Digits__i)
+{
+  int Idx__i;
+  for (Idx__i = Digits__i - 1; Idx__i >= 0; Idx__i--)
+  {
+    Out__cp[Idx__i] = (char)('0' + Value__u32 % 10);
+    Value__u32 /= 10;
+  }
+  return Out__cp + Digits__i;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+void time_service_init(time_service_t * Service__p)
+{
+  memset(Service__p, 0, sizeof(time_service_t));
+}
+
+///////////////////////////////////////////////////////////////////////////////
+int time_service_stamp(time_service_t * Service__p, time_stamp_t * Stamp__p)
+{
+  int64_t Offset_us__i64;
+  int Stepped__i = 0;
+
+  Stamp__p->Mono_us__u64 = time_service_clock_us(CLOCK_MONOTONIC);
+  Stamp__p->Utc_us__u64 = time_service_clock_us(CLOCK_REALTIME);
+  Offset_us__i64 = (int64_t)(Stamp__p->Utc_us__u64 - Stamp__p->Mono_us__u64);
+
+  if (Service__p->Last_mono_us__u64 != 0)
+  {
+    int64_t Change_us__i64 = Offset_us__i64 - Service__p->Offset_us__i64;
+    uint64_t Allowed_us__u64 = TIME_SERVICE_STEP_US
+      + (Stamp__p->Mono_us__u64 - Service__p->Last_mono_us__u64) / 1000;
+    uint64_t Magnitude_us__u64 = (Change_us__i64 < 0)
+      ? (uint64_t)-Change_us__i64 : (uint64_t)Change_us__i64;
+
+    if (Magnitude_us__u64 > Allowed_us__u64)
+    {
+      Service__p->Steps__u32++;
+      Service__p->Last_step_us__i64 = Change_us__i64;
+      Stepped__i = 1;
+    }
+  }
+  Service__p->Offset_us__i64 = Offset_us__i64;
+  Service__p->Last_mono_us__u64 = Stamp__p->Mono_us__u64;
+  return Stepped__i;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Days to civil date as in H. Hinnant's chrono algorithms, for days since
+// 1970-01-01 that are not negative.
+size_t time_format_iso8601(uint64_t Utc_us__u64, char * Buffer__cp,
+  size_t Size__z)
+{
+  uint64_t Seconds__u64 = Utc_us__u64 / 1000000;
+  uint64_t Days__u64 = Seconds__u64 / 86400;
+  uint32_t Second_of_day__u32 = (uint32_t)(Seconds__u64 % 86400);
+  uint64_t Z__u64 = Days__u64 + 719468;
+  uint64_t Era__u64 = Z__u64 / 146097;
+  uint32_t Doe__u32 = (uint32_t)(Z__u64 - Era__u64 * 146097);
+  uint32_t Yoe__u32 = (Doe__u32 - Doe__u32 / 1460 + Doe__u32 / 36524 - Doe__u32 / 146096) / 365;
+  uint32_t Doy__u32 = Doe__u32 - (365 * Yoe__u32 + Yoe__u32 / 4 - Yoe__u32 / 100);
+  uint32_t Mp__u32 = (5 * Doy__u32 + 2) / 153;
+  uint32_t Day__u32 = Doy__u32 - (153 * Mp__u32 + 2) / 5 + 1;
+  uint32_t Month__u32 = (Mp__u32 < 10) ? Mp__u32 + 3 : Mp__u32 - 9;
+  uint64_t Year__u64 = Yoe__u32 + Era__u64 * 400 + ((Month__u32 <= 2) ? 1 : 0);
+  char * Out__cp = Buffer__cp;
+
+  if (Size__z < TIME_ISO8601_LEN || Year__u64 > 9999)
+  {
+    return 0;
+  }
+  Out__cp = time_put_digits(Out__cp, (uint32_t)Year__u64, 4);
+  *Out__cp++ = '-';
+  Out__cp = time_put_digits(Out__cp, Month__u32, 2);
+  *Out__cp++ = '-';
+  Out__cp = time_put_digits(Out__cp, Day__u32, 2);
+  *Out__cp++ = 'T';
+  Out__cp = time_put_digits(Out__cp, Second_of_day__u32 / 3600, 2);
+  *Out__cp++ = ':';
+  Out__cp = time_put_digits(Out__cp, Second_of_day__u32 / 60 % 60, 2);
+  *Out__cp++ = ':';
+  Out__cp = time_put_digits(Out__cp, Second_of_day__u32 % 60, 2);
+  *Out__cp++ = '.';
+  Out__cp = time_put_digits(Out__cp, (uint32_t)(Utc_us__u64 / 1000 % 1000), 3);
+  *Out__cp++ = 'Z';
+  *Out__cp = '\0';
+  return (size_t)(Out__cp - Buffer__cp);
+}
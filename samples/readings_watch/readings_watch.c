@@ -0,0 +1,240 @@
+// Copyright (c) Microsoft. All rights reserved.
+// Licensed under the MIT license. See LICENSE file in the project root for full license information.
+
+/* Prints the readings remote_monitoring publishes in shared memory (--shm NAME): the
+   latest reading of every sensor, or with --follow every reading as it is taken. It
+   maps the object read-only and never touches the sensors, so any number of copies
+   can run next to remote_monitoring; it is also an example of the reader side of
+   readings_shm.h for control loops that need the latest reading without going
+   through the SPI bus. */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <getopt.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "readings_shm.h"
+
+#define RECORDS_PER_READ 64
+
+typedef struct READINGS_WATCH_OPTIONS_TAG
+{
+	const char* name;
+	int follow;
+	unsigned int pollMs;
+} READINGS_WATCH_OPTIONS;
+
+static READINGS_WATCH_OPTIONS g_options =
+{
+	NULL,
+	0,
+	10
+};
+
+static void sleepMs(unsigned int ms)
+{
+	struct timespec delay;
+	delay.tv_sec = ms / 1000;
+	delay.tv_nsec = (long)(ms % 1000) * 1000000L;
+	(void)nanosleep(&delay, NULL);
+}
+
+/* time,sensor,Name=value,... */
+static void printRecord(const readings_shm_channel_t* channels, const readings_shm_record_t* record)
+{
+	const readings_shm_channel_t* channel = &channels[record->Channel__u32 % READINGS_SHM_CHANNELS];
+	time_t seconds = (time_t)(record->Time_us__u64 / 1000000);
+	struct tm utc;
+	char text[32];
+	uint32_t i;
+
+	if (gmtime_r(&seconds, &utc) == NULL || strftime(text, sizeof(text), "%Y-%m-%dT%H:%M:%S", &utc) == 0)
+	{
+		text[0] = '\0';
+	}
+	printf("%s.%03uZ,%s", text, (unsigned int)(record->Time_us__u64 / 1000 % 1000), channel->Name__ca);
+	for (i = 0; i < channel->Value_count__u32; i++)
+	{
+		printf(",%s=%.2f", channel->Value_names__caa[i], record->Values__fa[i]);
+	}
+	printf("\n");
+}
+
+/* Copies the channel descriptors the writer has added so far */
+static size_t readChannels(const readings_shm_reader_t* reader, readings_shm_channel_t* channels)
+{
+	size_t count = readings_shm_channel_count(reader);
+	size_t i;
+
+	memset(channels, 0, READINGS_SHM_CHANNELS * sizeof(readings_shm_channel_t));
+	for (i = 0; i < count; i++)
+	{
+		(void)readings_shm_channel(reader, (int)i, &channels[i]);
+	}
+	return count;
+}
+
+static int printLatest(const readings_shm_reader_t* reader)
+{
+	readings_shm_channel_t channels[READINGS_SHM_CHANNELS];
+	size_t count = readChannels(reader, channels);
+	size_t i;
+
+	for (i = 0; i < count; i++)
+	{
+		readings_shm_record_t record;
+		if (readings_shm_latest(reader, (int)i, &record) == 0)
+		{
+			printRecord(channels, &record);
+		}
+		else
+		{
+			printf("-,%s,no reading yet\n", channels[i].Name__ca);
+		}
+	}
+	return 0;
+}
+
+/* Prints readings from now on until interrupted; follows remote_monitoring across restarts */
+static void follow(readings_shm_reader_t* reader)
+{
+	readings_shm_channel_t channels[READINGS_SHM_CHANNELS];
+	readings_shm_record_t records[RECORDS_PER_READ];
+	uint64_t next = 0;
+	size_t channelCount = 0;
+	size_t i;
+
+	for (i = 0; i < readings_shm_channel_count(reader); i++)
+	{
+		if (readings_shm_latest(reader, (int)i, &records[0]) == 0 && records[0].Index__u64 + 1 > next)
+		{
+			next = records[0].Index__u64 + 1;
+		}
+	}
+
+	for (;;)
+	{
+		uint64_t lost;
+		size_t count;
+
+		if (readings_shm_stale(reader))
+		{
+			readings_shm_close(reader);
+			printf("# %s was closed, waiting for it to be created again\n", g_options.name);
+			(void)fflush(stdout);
+			while ((reader = readings_shm_open(g_options.name)) == NULL)
+			{
+				sleepMs(1000);
+			}
+			next = 0;
+			channelCount = 0;
+		}
+
+		/* Channels are only ever added */
+		if (readings_shm_channel_count(reader) != channelCount)
+		{
+			channelCount = readChannels(reader, channels);
+		}
+		count = readings_shm_read(reader, &next, records, RECORDS_PER_READ, &lost);
+		if (lost > 0)
+		{
+			printf("# %llu readings lost, this reader fell behind\n", (unsigned long long)lost);
+		}
+		for (i = 0; i < count; i++)
+		{
+			printRecord(channels, &records[i]);
+		}
+		if (count < RECORDS_PER_READ)
+		{
+			(void)fflush(stdout);
+			sleepMs(g_options.pollMs);
+		}
+	}
+}
+
+static void readings_watch_usage(const char* program)
+{
+	printf("Usage: %s --shm NAME [options]\n", program);
+	printf("  --shm NAME             shared memory object given to remote_monitoring --shm\n");
+	printf("  --follow               print every reading as it is taken, until interrupted\n");
+	printf("  --poll-ms MS           how often --follow looks for new readings (default 10)\n");
+}
+
+static int readings_watch_parse_options(int argc, char** argv)
+{
+	static const struct option longOptions[] =
+	{
+		{ "shm", required_argument, NULL, 's' },
+		{ "follow", no_argument, NULL, 'f' },
+		{ "poll-ms", required_argument, NULL, 'p' },
+		{ "help", no_argument, NULL, 'h' },
+		{ NULL, 0, NULL, 0 }
+	};
+	int result = 0;
+	int opt;
+
+	while (result == 0 && (opt = getopt_long(argc, argv, "h", longOptions, NULL)) != -1)
+	{
+		char* end;
+		unsigned long pollMs;
+		switch (opt)
+		{
+		case 's':
+			g_options.name = optarg;
+			break;
+		case 'f':
+			g_options.follow = 1;
+			break;
+		case 'p':
+			pollMs = strtoul(optarg, &end, 10);
+			if (*optarg == '\0' || *end != '\0' || pollMs == 0 || pollMs > UINT_MAX)
+			{
+				printf("Invalid number: %s\n", optarg);
+				result = 1;
+			}
+			g_options.pollMs = (unsigned int)pollMs;
+			break;
+		default:
+			result = 1;
+			break;
+		}
+	}
+
+	if (result == 0 && g_options.name == NULL)
+	{
+		result = 1;
+	}
+	if (result != 0)
+	{
+		readings_watch_usage(argv[0]);
+	}
+	return result;
+}
+
+int main(int argc, char** argv)
+{
+	int result = readings_watch_parse_options(argc, argv);
+	if (result == 0)
+	{
+		readings_shm_reader_t* reader = readings_shm_open(g_options.name);
+		if (reader == NULL)
+		{
+			printf("Failed to open %s; is remote_monitoring running with --shm %s?\n", g_options.name, g_options.name);
+			result = 1;
+		}
+		else if (g_options.follow)
+		{
+			follow(reader);
+		}
+		else
+		{
+			result = printLatest(reader);
+			readings_shm_close(reader);
+		}
+	}
+	return result;
+}
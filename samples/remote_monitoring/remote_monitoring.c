@@ -3,6 +3,15 @@
 
 #define _XOPEN_SOURCE
 #include "iothubtransportmqtt.h"
+#ifdef USE_AMQP
+#include "iothubtransportamqp.h"
+#endif
+#ifdef USE_WEBSOCKETS
+#include "iothubtransportmqtt_websockets.h"
+#ifdef USE_AMQP
+#include "iothubtransportamqp_websockets.h"
+#endif
+#endif
 #include "schemalib.h"
 #include "iothub_client.h"
 #include "serializer_devicetwin.h"
@@ -11,9 +20,14 @@
 #include "azure_c_shared_utility/platform.h"
 
 #include <ctype.h>
+#include <errno.h>
+#include <getopt.h>
+#include <limits.h>
+#include <math.h>
 #include <sys/types.h>
 #include <unistd.h>
 #include <pthread.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -22,152 +36,381 @@
 #include <wiringPi.h>
 #include <wiringPiSPI.h>
 #include "bme280.h"
+#include "bme280_sim.h"
+#include "bme280_spidev.h"
+#include "sensor_trace.h"
+#include "historian.h"
+#include "device_utils.h"
 #include "locking.h"
+#include "telemetry_codec.h"
+#include "payload_compress.h"
+#include "alert_rules.h"
+#include "latency_histogram.h"
+#include "rt_sampler.h"
+#include "sensor_driver.h"
+#include "readings_shm.h"
+#include "device_state.h"
+#include "event_trace.h"
+#include "anomaly_detector.h"
+#include "time_service.h"
+#include "reported_state.h"
+#include "telemetry_outbox.h"
+#include "thermostat_model.h"
 
 static const char* deviceId = "[Device Id]";
 static const char* connectionString = "HostName=[IoTHub Name].azure-devices.net;DeviceId=[Device Id];SharedAccessKey=[Device Key]";
 
-static char* lastUpdateBegin;
-static char* lastRebootBegin;
+/* What the twin, direct method and firmware update callbacks change, on threads of their own,
+   and the sampling loop reads; always copied out of and into g_deviceState */
+typedef struct DEVICE_STATE_TAG
+{
+	/* The desired TelemetryInterval last received, in seconds */
+	unsigned int telemetryIntervalS;
+	int firmwareUpdating;
+	char lastUpdateBegin[FORMAT_TIME_LEN];
+	char lastRebootBegin[FORMAT_TIME_LEN];
+} DEVICE_STATE;
 
-static IOTHUB_CLIENT_HANDLE g_iotHubClientHandle = NULL;
+static device_state_t* g_deviceState = NULL;
 
-static const int Spi_channel = 0;
 static const int Spi_clock = 1000000L;
 
 static const int Grn_led_pin = 7;
 
 static int Lock_fd;
 
-/*json of supported methods*/
-static char* supportedMethod = "{ \"LightBlink\": \"light blink\", \"ChangeLightStatus--LightStatusValue-int\""
-": \"Change light status, on and off\", \"InitiateFirmwareUpdate--FwPackageURI-string\": "
-"\"Updates device Firmware. Use parameter FwPackageURI to specifiy the URI of the firmware file\"}";
+static const int Compression_level = 6;
+
+/* How often the main loop looks for samples of the real-time sampler */
+static const unsigned int Sampler_poll_ms = 10;
+
+/* How long to wait for outstanding confirmations once the sample limit is reached */
+static const unsigned int Confirmation_timeout_ms = 10000;
+
+#define MAX_ALERT_RULES 8
+#define MAX_SENSOR_CHANNELS 8
+
+/* How often a --sensor channel is sampled unless it says otherwise */
+static const unsigned int Sensor_period_ms = 10000;
 
-// Define the Model
-BEGIN_NAMESPACE(Contoso);
+/* Readings kept in the history of the --shm object unless --shm-slots says otherwise */
+static const unsigned int Shm_slots = 1024;
 
-/* Reported properties */
-DECLARE_STRUCT(SystemProperties,
-ascii_char_ptr, FirmwareVersion
-);
+/* Readings kept between the uploads of --duty-cycle unless --duty-buffer says otherwise */
+static const unsigned int Duty_buffer_readings = 1024;
+
+/* Messages each lane of the outbox holds unless --outbox-cap says otherwise */
+static const unsigned int Outbox_lane_capacity = 1000;
+
+/* How long an upload of --duty-cycle waits for the devices to connect before it gives up
+   until the next cycle */
+static const unsigned int Duty_connect_timeout_ms = 60000;
+
+/* How long an upload of --duty-cycle stays connected at least, for the desired properties
+   of the twin to arrive */
+static const unsigned int Duty_twin_sync_ms = 3000;
+
+/* Where --trace writes the events on SIGUSR2 and the DumpTrace direct method unless
+   --trace-file says otherwise */
+static const char* const Trace_file = "/tmp/remote_monitoring.trace.json";
+
+/* Time constant of the baseline --burst compares readings with: a step lasting this long is
+   mostly learned */
+static const unsigned int Burst_baseline_s = 60;
+
+/* Quantities of the thermostat sensor --burst watches, with the smallest standard deviation it
+   assumes for each, about the noise of the BME280, so that a reading steadier than that does
+   not make a change of a few counts an anomaly */
+#define BURST_QUANTITIES 3
+static const char* const burstQuantityNames[BURST_QUANTITIES] = { "Temperature", "Pressure", "Humidity" };
+static const double Burst_min_stddev[BURST_QUANTITIES] = { 0.05, 5.0, 0.25 };
+
+/* Transports of the IoT Hub client for --transport. The WebSocket variants tunnel through
+   port 443 where 8883 and 5671 are blocked; only AMQP can carry several device identities
+   over one connection. A low footprint build leaves out all but MQTT. */
+typedef struct TRANSPORT_NAME_TAG
+{
+	const char* name;
+	IOTHUB_CLIENT_TRANSPORT_PROVIDER protocol;
+	int shareable;
+} TRANSPORT_NAME;
 
-DECLARE_MODEL(ConfigProperties,
-WITH_REPORTED_PROPERTY(uint8_t, TelemetryInterval)
-);
+static const TRANSPORT_NAME transportNames[] =
+{
+	{ "mqtt", MQTT_Protocol, 0 },
+#ifdef USE_WEBSOCKETS
+	{ "mqtt-ws", MQTT_WebSocket_Protocol, 0 },
+#endif
+#ifdef USE_AMQP
+	{ "amqp", AMQP_Protocol, 1 },
+#ifdef USE_WEBSOCKETS
+	{ "amqp-ws", AMQP_Protocol_over_WebSocketsTls, 1 }
+#endif
+#endif
+};
+
+/* A sensor sampled besides the one behind the Thermostat model, from --sensor */
+typedef struct SENSOR_CHANNEL_OPTION_TAG
+{
+	const sensor_driver_t* driver;
+	int bus;
+	unsigned int periodMs;
+} SENSOR_CHANNEL_OPTION;
 
-/* Part of DeviceInfo */
-DECLARE_STRUCT(DeviceProperties,
-ascii_char_ptr, DeviceID,
-_Bool, HubEnabledState
-);
+/* Settings that can be changed from the command line */
+typedef struct REMOTE_MONITORING_OPTIONS_TAG
+{
+	TELEMETRY_ENCODING encoding;
+	unsigned int batchSize;
+	PAYLOAD_COMPRESSION compression;
+	unsigned int compressThreshold;
+	unsigned int bulkWindow;
+	unsigned int outboxCapacity;
+	alert_rule_t alertRules[MAX_ALERT_RULES];
+	size_t alertRuleCount;
+	const char* gatewayFile;
+	const TRANSPORT_NAME* transport;
+	const char* connectionString;
+	const char* trustedCertsFile;
+	int simulate;
+	int intervalSet;
+	unsigned int intervalMs;
+	unsigned int sampleLimit;
+	const char* recordFile;
+	const char* replayFile;
+	int replayMaxSpeed;
+	const char* historyDir;
+	unsigned int historyFlushS;
+	int spidev;
+	int rt;
+	int rtCpu;
+	unsigned int rtPriority;
+	unsigned int twinWindowMs;
+	const char* twinCacheDir;
+	IOTHUB_CLIENT_RETRY_POLICY retryPolicy;
+	unsigned int retryTimeoutS;
+	SENSOR_CHANNEL_OPTION sensors[MAX_SENSOR_CHANNELS];
+	size_t sensorCount;
+	const char* shmName;
+	unsigned int shmSlots;
+	int calibrationSet;
+	bme280_correction_t calibration;
+	unsigned int dutyCycleMin;
+	unsigned int dutyBufferReadings;
+	unsigned int traceEvents;
+	const char* traceFile;
+	double burstZ;
+	unsigned int burstMs;
+	unsigned int burstPreS;
+	unsigned int burstPostS;
+} REMOTE_MONITORING_OPTIONS;
+
+static REMOTE_MONITORING_OPTIONS g_options =
+{
+	TELEMETRY_ENCODING_JSON,
+	1,
+	PAYLOAD_COMPRESSION_NONE,
+	256,
+	4,
+	.historyFlushS = 600,
+	.rtCpu = -1,
+	.rtPriority = 50,
+	.twinWindowMs = 2000,
+	.retryPolicy = IOTHUB_CLIENT_RETRY_EXPONENTIAL_BACKOFF_WITH_JITTER,
+	.shmSlots = Shm_slots,
+	.outboxCapacity = Outbox_lane_capacity,
+	.dutyBufferReadings = Duty_buffer_readings,
+	.traceFile = Trace_file,
+	.burstMs = 100,
+	.burstPreS = 10,
+	.burstPostS = 30
+};
+
+/* Names of the reconnection policies of the IoT Hub client for --retry-policy */
+typedef struct RETRY_POLICY_NAME_TAG
+{
+	const char* name;
+	IOTHUB_CLIENT_RETRY_POLICY policy;
+} RETRY_POLICY_NAME;
 
-DECLARE_DEVICETWIN_MODEL(Thermostat,
-/* Telemetry (temperature, external temperature and humidity) */
-WITH_DATA(double, Temperature),
-WITH_DATA(double, Humidity),
-WITH_DATA(ascii_char_ptr, DeviceId),
+static const RETRY_POLICY_NAME retryPolicyNames[] =
+{
+	{ "none", IOTHUB_CLIENT_RETRY_NONE },
+	{ "immediate", IOTHUB_CLIENT_RETRY_IMMEDIATE },
+	{ "interval", IOTHUB_CLIENT_RETRY_INTERVAL },
+	{ "linear", IOTHUB_CLIENT_RETRY_LINEAR_BACKOFF },
+	{ "exponential", IOTHUB_CLIENT_RETRY_EXPONENTIAL_BACKOFF },
+	{ "exponential-jitter", IOTHUB_CLIENT_RETRY_EXPONENTIAL_BACKOFF_WITH_JITTER },
+	{ "random", IOTHUB_CLIENT_RETRY_RANDOM }
+};
+
+/* Encoded samples waiting to be sent together in one message */
+typedef struct TELEMETRY_BATCH_TAG
+{
+	unsigned char* buffer;
+	size_t size;
+	size_t capacity;
+	size_t count;
+	uint64_t firstSampleUs;
+} TELEMETRY_BATCH;
+
+/* A device identity hosted by this process: a single one normally, one per line
+   of the devices file in gateway mode */
+typedef struct MONITORED_DEVICE_TAG
+{
+	char* connectionString;
+	char* deviceId;
+	int simulated;
+	IOTHUB_CLIENT_HANDLE client;
+	Thermostat* thermostat;
+	TELEMETRY_BATCH batch;
+	alert_rule_t alertRules[MAX_ALERT_RULES];
+	char sampleTime[TIME_ISO8601_LEN];
+	reported_state_t* reported;
+	/* Set by the connection status callback of client */
+	int authenticated;
+	int deviceInfoSent;
+} MONITORED_DEVICE;
+
+static MONITORED_DEVICE* g_devices = NULL;
+static size_t g_deviceCount = 0;
+
+/* In gateway mode all device clients share this connection */
+static TRANSPORT_HANDLE g_transport = NULL;
+
+static payload_compressor_t* g_compressor = NULL;
+static sensor_trace_writer_t* g_traceWriter = NULL;
+static sensor_trace_reader_t* g_traceReader = NULL;
+static historian_t* g_historian = NULL;
+static rt_sampler_t* g_sampler = NULL;
+/* Samples the sensor behind the Thermostat model, unless the --rt sampler does, and the
+   channels of --sensor, each at its own period */
+static sensor_scheduler_t* g_scheduler = NULL;
+static int g_thermostatChannel = -1;
+/* The sensor behind the Thermostat model and its bus, from --thermostat-sensor; for the
+   BME280 the bus is the chip select */
+static const sensor_driver_t* g_thermostatSensor = &sensor_driver_bme280;
+static int g_thermostatBus = 0;
+/* Where the driver of the thermostat sensor puts each reading, -1 if it has none */
+static int g_temperatureValue = -1;
+static int g_pressureValue = -1;
+static int g_humidityValue = -1;
+/* Only used by the main thread; the --rt sampling thread has its own */
+static time_service_t g_timeService;
+static time_service_t g_rtTimeService;
+/* Every reading of every sensor for local processes, from --shm; the thermostat sensor has
+   channel g_thermostatShmChannel, the channels of the scheduler those in g_shmChannels */
+static readings_shm_writer_t* g_readingsShm = NULL;
+static int g_thermostatShmChannel = -1;
+static int g_shmChannels[MAX_SENSOR_CHANNELS];
+static char* g_trustedCerts = NULL;
+/* Messages created so far and the bytes of their bodies */
+static uint64_t g_messageCount = 0;
+static uint64_t g_messageBytes = 0;
+/* Patches of reported properties sent and not yet confirmed by deviceTwinCallback */
+static unsigned int g_reportedInFlight = 0;
+/* Set by SIGUSR2 for the main loop to write the events of --trace */
+static volatile sig_atomic_t g_traceDumpRequested = 0;
 
-/* DeviceInfo */
-WITH_DATA(ascii_char_ptr, ObjectType),
-WITH_DATA(_Bool, IsSimulatedDevice),
-WITH_DATA(ascii_char_ptr, Version),
-WITH_DATA(DeviceProperties, DeviceProperties),
+/*json of supported methods*/
+static char* supportedMethod = "{ \"LightBlink\": \"light blink\", \"ChangeLightStatus--LightStatusValue-int\""
+": \"Change light status, on and off\", \"InitiateFirmwareUpdate--FwPackageURI-string\": "
+"\"Updates device Firmware. Use parameter FwPackageURI to specifiy the URI of the firmware file\", "
+"\"DumpTrace\": \"Write the pipeline events recorded with --trace to the trace file on the device\"}";
 
-/* Device twin properties */
-WITH_REPORTED_PROPERTY(ConfigProperties, Config),
-WITH_REPORTED_PROPERTY(SystemProperties, System),
+static int setTelemetryInterval(void* state, void* context)
+{
+	((DEVICE_STATE*)state)->telemetryIntervalS = *(const unsigned int*)context;
+	return 0;
+}
 
-WITH_DESIRED_PROPERTY(uint8_t, TelemetryInterval, onDesiredTelemetryInterval),
+/* Only one firmware update runs at a time */
+static int beginFirmwareUpdate(void* state, void* context)
+{
+	DEVICE_STATE* deviceState = (DEVICE_STATE*)state;
+	(void)context;
+	if (deviceState->firmwareUpdating)
+	{
+		return 1;
+	}
+	deviceState->firmwareUpdating = 1;
+	deviceState->lastUpdateBegin[0] = '\0';
+	deviceState->lastRebootBegin[0] = '\0';
+	return 0;
+}
 
-/* Direct methods implemented by the device */
-WITH_METHOD(LightBlink),
-WITH_METHOD(ChangeLightStatus, int, LightStatusValue),
-WITH_METHOD(InitiateFirmwareUpdate, ascii_char_ptr, FwPackageURI),
+static int endFirmwareUpdate(void* state, void* context)
+{
+	(void)context;
+	((DEVICE_STATE*)state)->firmwareUpdating = 0;
+	return 0;
+}
 
-/* Register direct methods with solution portal */
-WITH_REPORTED_PROPERTY(ascii_char_ptr_no_quotes, SupportedMethods)
-);
+static int setLastUpdateBegin(void* state, void* context)
+{
+	DEVICE_STATE* deviceState = (DEVICE_STATE*)state;
+	(void)snprintf(deviceState->lastUpdateBegin, sizeof(deviceState->lastUpdateBegin), "%s", (const char*)context);
+	return 0;
+}
 
-END_NAMESPACE(Contoso);
+static int setLastRebootBegin(void* state, void* context)
+{
+	DEVICE_STATE* deviceState = (DEVICE_STATE*)state;
+	(void)snprintf(deviceState->lastRebootBegin, sizeof(deviceState->lastRebootBegin), "%s", (const char*)context);
+	return 0;
+}
 
+/* Runs on the callback thread of the IoT Hub client. In gateway mode every device is sampled
+   at the interval last received by any of them. */
 void onDesiredTelemetryInterval(void* argument)
 {
 	/* By convention 'argument' is of the type of the MODEL */
 	Thermostat* thermostat = argument;
+	unsigned int telemetryIntervalS = thermostat->TelemetryInterval;
+	event_trace_record(EVENT_TRACE_INSTANT, "desired_telemetry_interval", telemetryIntervalS);
 	printf("Received a new desired_TelemetryInterval = %d\r\n", thermostat->TelemetryInterval);
+	(void)device_state_update(g_deviceState, setTelemetryInterval, &telemetryIntervalS);
+}
+
+/* The LED only exists on the real board, not with the simulated sensor or a replayed trace */
+static void setGreenLed(int value)
+{
+	if (!g_options.simulate && g_options.replayFile == NULL)
+	{
+		pinMode(Grn_led_pin, OUTPUT);
+		digitalWrite(Grn_led_pin, value);
+	}
 }
 
 /*change light status on Raspberry Pi to received value*/
 METHODRETURN_HANDLE ChangeLightStatus(Thermostat* thermostat, int lightstatus)
 {
+	event_trace_record(EVENT_TRACE_INSTANT, "method_change_light_status", (uint64_t)lightstatus);
 	printf("Raspberry Pi light status change\n");
-	pinMode(Grn_led_pin, OUTPUT);
 	printf("LED value\n %d", lightstatus);
-	digitalWrite(Grn_led_pin, lightstatus);
+	setGreenLed(lightstatus);
 	return MethodReturn_Create(201, "\"light status changed\"");
 }
 
 void WriteConfig()
 {
 	FILE* fp;
+	DEVICE_STATE state;
 
+	(void)device_state_read(g_deviceState, &state);
 	if (NULL == (fp = fopen("//home//pi//lastupdate", "w")))
 	{
 		printf("Failed to open lastupdate file to write\r\n");
 	}
 	else
 	{
-		printf("last update begin value: %s\r\n", lastUpdateBegin);
-		printf("last reboot begin value: %s\r\n", lastRebootBegin);
-		fprintf(fp, "%s\r\n%s", lastUpdateBegin, lastRebootBegin);
+		printf("last update begin value: %s\r\n", state.lastUpdateBegin);
+		printf("last reboot begin value: %s\r\n", state.lastRebootBegin);
+		fprintf(fp, "%s\r\n%s", state.lastUpdateBegin, state.lastRebootBegin);
 		fclose(fp);
 	}
 }
 
-bool GetNumberFromString(const unsigned char* text, size_t size, int* pValue)
-{
-	const unsigned char* pStart = text;
-	for (; pStart < text + size; pStart++)
-	{
-		if (isdigit(*pStart))
-		{
-			break;
-		}
-	}
-
-	const unsigned char* pEnd = pStart + 1;
-	for (; pEnd <= text + size; pEnd++)
-	{
-		if (!isdigit(*pEnd))
-		{
-			break;
-		}
-	}
-
-	if (pStart >= text + size)
-	{
-		return false;
-	}
-
-	unsigned char buffer[16] = { 0 };
-	strncpy(buffer, pStart, pEnd - pStart);
-
-	*pValue = atoi(buffer);
-	return true;
-}
-
-char* FormatTime(time_t* time)
-{
-	static char buffer[128];
-
-	struct tm* p = gmtime(time);
-
-	strftime(buffer, 26, "%Y-%m-%d %H:%M:%S", p);
-
-	return buffer;
-}
-
 //download file in Git hub repo via wget as example
 bool DownloadFile(ascii_char_ptr url)
 {
@@ -177,15 +420,34 @@ bool DownloadFile(ascii_char_ptr url)
 	return system(str) == 0;
 }
 
-void AllocAndVPrintf(unsigned char** buffer, size_t* size, const char* format, va_list argptr)
+/* Runs on the callback thread of the IoT Hub client while the sampling threads compensate
+   frames; in gateway mode the twin of any device hosted corrects the one sensor */
+void onDesiredCalibration(void* argument)
 {
-	*size = vsnprintf(NULL, 0, format, argptr);
+	Thermostat* thermostat = argument;
+	const char* spec = (thermostat->Calibration != NULL) ? thermostat->Calibration : "";
+	bme280_correction_t correction;
 
-	*buffer = malloc(*size + 1);
-	vsprintf((char*)*buffer, format, argptr);
+	event_trace_record(EVENT_TRACE_INSTANT, "desired_calibration", 0);
+	if (g_thermostatSensor != &sensor_driver_bme280)
+	{
+		printf("Ignoring the desired Calibration, which only applies to the bme280 sensor\r\n");
+	}
+	else if (bme280_correction_parse(spec, &correction) != 0)
+	{
+		printf("Ignoring the invalid desired Calibration \"%s\", expected for example Temperature=-1.5;Humidity=20:22.5,80:78\r\n", spec);
+	}
+	else if (bme280_set_correction(&correction) != 0)
+	{
+		printf("Failed to set the calibration\r\n");
+	}
+	else
+	{
+		printf("Received a new desired_Calibration = \"%s\"\r\n", spec);
+	}
 }
 
-void UpdateReportedProperties(const char* format, ...)
+void UpdateReportedProperties(reported_state_t* reported, const char* format, ...)
 {
 	unsigned char* report;
 	size_t len;
@@ -195,13 +457,14 @@ void UpdateReportedProperties(const char* format, ...)
 	AllocAndVPrintf(&report, &len, format, args);
 	va_end(args);
 
-	if (IoTHubClient_SendReportedState(g_iotHubClientHandle, report, len, NULL, NULL) != IOTHUB_CLIENT_OK)
+	/* Merged with the other updates of the window and sent from the sampling loop */
+	if (reported == NULL || reported_state_update(reported, (const char*)report, len) != 0)
 	{
-		(void)printf("Failed to update reported properties: %.*s\r\n", len, report);
+		(void)printf("Failed to update reported properties: %.*s\r\n", (int)len, report);
 	}
 	else
 	{
-		(void)printf("Succeeded in updating reported properties: %.*s\r\n", len, report);
+		(void)printf("Queued reported properties: %.*s\r\n", (int)len, report);
 	}
 
 	free(report);
@@ -219,113 +482,220 @@ void ApplyFirmware()
 	system("sudo nohup sh ./firmwarereboot.sh > /tmp/reboot.txt &");
 }
 
+/* What FirmwareUpdateThread is started with */
+typedef struct FIRMWARE_UPDATE_TAG
+{
+	char* url;
+	/* Reported properties of the device that received InitiateFirmwareUpdate */
+	reported_state_t* reported;
+} FIRMWARE_UPDATE;
+
 void* FirmwareUpdateThread(void* arg)
 {
 	time_t begin, end, stepBegin, stepEnd;
-	printf("Firmware thread start, download url: %s\r\n", (char*)arg);
-	ascii_char_ptr url = arg;
+	char beginText[FORMAT_TIME_LEN], endText[FORMAT_TIME_LEN];
+	FIRMWARE_UPDATE* update = arg;
+	reported_state_t* reported = update->reported;
+	ascii_char_ptr url = update->url;
+	printf("Firmware thread start, download url: %s\r\n", url);
 
 	// Clear all reportes
-	UpdateReportedProperties("{ 'Method' : { 'UpdateFirmware': null } }");
+	UpdateReportedProperties(reported, "{ \"Method\" : { \"UpdateFirmware\": null } }");
 	time(&begin);
-	char * beginUpdate = FormatTime(&begin);
-	lastUpdateBegin = malloc(strlen(beginUpdate) + 1);
-	strcpy(lastUpdateBegin, beginUpdate);
-	UpdateReportedProperties(
-		"{ 'Method' : { 'UpdateFirmware': { 'Duration-s': 0, 'LastUpdate': '%s', 'Status': 'Running' } } }",
+	char * beginUpdate = FormatTime_r(&begin, beginText, sizeof(beginText));
+	(void)device_state_update(g_deviceState, setLastUpdateBegin, beginUpdate);
+	UpdateReportedProperties(reported,
+		"{ \"Method\" : { \"UpdateFirmware\": { \"Duration-s\": 0, \"LastUpdate\": \"%s\", \"Status\": \"Running\" } } }",
 		beginUpdate);
 
 	time(&stepBegin);
-	UpdateReportedProperties(
-		"{ 'Method' : { 'UpdateFirmware': { 'Download' : { 'Duration-s': 0, 'LastUpdate': '%s', 'Status': 'Running' } } } }",
-		FormatTime(&stepBegin));
+	UpdateReportedProperties(reported,
+		"{ \"Method\" : { \"UpdateFirmware\": { \"Download\" : { \"Duration-s\": 0, \"LastUpdate\": \"%s\", \"Status\": \"Running\" } } } }",
+		FormatTime_r(&stepBegin, beginText, sizeof(beginText)));
 
 	time(&stepEnd);
 	//downloadfile
 	if (!DownloadFile(url))
 	{
-		UpdateReportedProperties(
-			"{ 'Method' : { 'UpdateFirmware': { 'Download' : { 'Duration-s': %u, 'LastUpdate': '%s', 'Status': 'Failed' } } } }",
+		UpdateReportedProperties(reported,
+			"{ \"Method\" : { \"UpdateFirmware\": { \"Download\" : { \"Duration-s\": %u, \"LastUpdate\": \"%s\", \"Status\": \"Failed\" } } } }",
 			stepEnd - stepBegin,
-			FormatTime(&stepEnd));
+			FormatTime_r(&stepEnd, endText, sizeof(endText)));
 
 		time(&end);
-		UpdateReportedProperties(
-			"{ 'Method' : { 'UpdateFirmware': { 'Duration-s': %u, 'LastUpdate': '%s', 'Status': 'Failed' } } }",
+		UpdateReportedProperties(reported,
+			"{ \"Method\" : { \"UpdateFirmware\": { \"Duration-s\": %u, \"LastUpdate\": \"%s\", \"Status\": \"Failed\" } } }",
 			end - begin,
-			FormatTime(&end));
+			FormatTime_r(&end, endText, sizeof(endText)));
+		(void)device_state_update(g_deviceState, endFirmwareUpdate, NULL);
+		free(url);
+		free(update);
 		return NULL;
 	}
 
 	time(&stepEnd);
 
-	UpdateReportedProperties(
-		"{ 'Method' : { 'UpdateFirmware': { 'Download' : { 'Duration-s': %u, 'LastUpdate': '%s', 'Status': 'Complete' } } } }",
+	UpdateReportedProperties(reported,
+		"{ \"Method\" : { \"UpdateFirmware\": { \"Download\" : { \"Duration-s\": %u, \"LastUpdate\": \"%s\", \"Status\": \"Complete\" } } } }",
 		stepEnd - stepBegin,
-		FormatTime(&stepEnd));
+		FormatTime_r(&stepEnd, endText, sizeof(endText)));
 
 	time(&stepBegin);
-	UpdateReportedProperties(
-		"{ 'Method' : { 'UpdateFirmware': { 'Applied' : { 'Duration-s': 0, 'LastUpdate': '%s', 'Status': 'Running' } } } }",
-		FormatTime(&stepBegin));
+	UpdateReportedProperties(reported,
+		"{ \"Method\" : { \"UpdateFirmware\": { \"Applied\" : { \"Duration-s\": 0, \"LastUpdate\": \"%s\", \"Status\": \"Running\" } } } }",
+		FormatTime_r(&stepBegin, beginText, sizeof(beginText)));
 
-	printf("unlock file before apply new firmware\r\n");
-	close_lockfile(Lock_fd);
+	if (Lock_fd >= 0)
+	{
+		printf("unlock file before apply new firmware\r\n");
+		close_lockfile(Lock_fd);
+	}
 
 	ApplyFirmware();
 
 	time(&stepEnd);
-	UpdateReportedProperties(
-		"{ 'Method' : { 'UpdateFirmware': { 'Applied' : { 'Duration-s': %u, 'LastUpdate': '%s', 'Status': 'Complete' } } } }",
+	UpdateReportedProperties(reported,
+		"{ \"Method\" : { \"UpdateFirmware\": { \"Applied\" : { \"Duration-s\": %u, \"LastUpdate\": \"%s\", \"Status\": \"Complete\" } } } }",
 		stepEnd - stepBegin,
-		FormatTime(&stepEnd));
+		FormatTime_r(&stepEnd, endText, sizeof(endText)));
 
 	time(&stepBegin);
-	char * rebootBegin = FormatTime(&stepBegin);
-	UpdateReportedProperties(
-		"{ 'Method' : { 'UpdateFirmware': { 'Reboot' : { 'Duration-s': 0, 'LastUpdate': '%s', 'Status': 'Running' } } } }",
+	char * rebootBegin = FormatTime_r(&stepBegin, beginText, sizeof(beginText));
+	UpdateReportedProperties(reported,
+		"{ \"Method\" : { \"UpdateFirmware\": { \"Reboot\" : { \"Duration-s\": 0, \"LastUpdate\": \"%s\", \"Status\": \"Running\" } } } }",
 		rebootBegin);
 
-	lastRebootBegin = malloc(strlen(rebootBegin) + 1);
-	strcpy(lastRebootBegin, rebootBegin);
+	(void)device_state_update(g_deviceState, setLastRebootBegin, rebootBegin);
 	WriteConfig();
-	free(arg);
+	(void)reported_state_flush(reported, 1);
+	free(url);
+	free(update);
 	exit(0);
 }
 
+/* The device whose model instance is thermostat, or NULL */
+static MONITORED_DEVICE* findDevice(const Thermostat* thermostat)
+{
+	size_t i;
+
+	for (i = 0; i < g_deviceCount; i++)
+	{
+		if (g_devices[i].thermostat == thermostat)
+		{
+			return &g_devices[i];
+		}
+	}
+	return NULL;
+}
+
+/* The firmware update applies to the whole Pi, and reports its progress in the twin of
+   the device that received the method */
 METHODRETURN_HANDLE InitiateFirmwareUpdate(Thermostat* thermostat, ascii_char_ptr FwPackageURI)
 {
-	(void)(thermostat);
+	MONITORED_DEVICE* device = findDevice(thermostat);
+	FIRMWARE_UPDATE* update;
+
+	event_trace_record(EVENT_TRACE_INSTANT, "method_initiate_firmware_update", 0);
+	if (device == NULL || device->reported == NULL)
+	{
+		printf("Firmware update request ignored, the device has no reported properties\r\n");
+		return MethodReturn_Create(500, "\"Device not found\"");
+	}
+	if (device_state_update(g_deviceState, beginFirmwareUpdate, NULL) != 0)
+	{
+		printf("Firmware update request ignored, an update is already running\r\n");
+		return MethodReturn_Create(409, "\"Firmware update already running\"");
+	}
 
-	METHODRETURN_HANDLE result = MethodReturn_Create(201, "\"Initiating Firmware Update\"");
 	printf("Recieved firmware update request. Use package at: %s\r\n", FwPackageURI);
+	update = malloc(sizeof(FIRMWARE_UPDATE));
+	if (update == NULL || (update->url = CopyString(FwPackageURI, strlen(FwPackageURI))) == NULL)
+	{
+		free(update);
+		(void)device_state_update(g_deviceState, endFirmwareUpdate, NULL);
+		return MethodReturn_Create(500, "\"Out of memory\"");
+	}
+	update->reported = device->reported;
+	printf("receive and strcpy url: %s\r\n", update->url);
+
 	pthread_t tid;
-	ascii_char_ptr url = malloc(strlen(FwPackageURI) + 1);
-	strcpy(url, FwPackageURI);
-	printf("receive and strcpy url: %s\r\n", url);
-	pthread_create(&tid, NULL, &FirmwareUpdateThread, url);
-	return result;
+	if (pthread_create(&tid, NULL, &FirmwareUpdateThread, update) != 0)
+	{
+		free(update->url);
+		free(update);
+		(void)device_state_update(g_deviceState, endFirmwareUpdate, NULL);
+		return MethodReturn_Create(500, "\"Failed to start the firmware update\"");
+	}
+	(void)pthread_detach(tid);
+	return MethodReturn_Create(201, "\"Initiating Firmware Update\"");
 }
 
 METHODRETURN_HANDLE LightBlink(Thermostat* thermostat)
 {
 	int blinkCount = 2;
+	event_trace_record(EVENT_TRACE_BEGIN, "method_light_blink", 0);
 	printf("Raspberry Pi light blink\n");
 	while (blinkCount--)
 	{
-		pinMode(Grn_led_pin, OUTPUT);
 		printf("light on\n");
-		digitalWrite(Grn_led_pin, 1);
+		setGreenLed(1);
 		ThreadAPI_Sleep(1000);
 		printf("light off\n");
-		digitalWrite(Grn_led_pin, 0);
+		setGreenLed(0);
 		ThreadAPI_Sleep(1000);
 	}
+	event_trace_record(EVENT_TRACE_END, "method_light_blink", 0);
 	return MethodReturn_Create(201, "\"light blink success\"");
 }
 
-/* Send data to IoT Hub */
-static void sendMessage(IOTHUB_CLIENT_HANDLE iotHubClientHandle, const unsigned char* buffer, size_t size)
+/* Writes the events of --trace, from the direct method or the main loop on SIGUSR2.
+   Return: 0 on success, 1 if tracing is off or the file cannot be written */
+static int writeTrace(uint32_t* events)
+{
+	event_trace_stats_t stats;
+	int result = event_trace_write_json(g_options.traceFile, events);
+
+	event_trace_get_stats(&stats);
+	if (result != 0)
+	{
+		printf("Failed to write the trace to %s\r\n", g_options.traceFile);
+	}
+	else
+	{
+		printf("Wrote %u events to %s, %llu recorded, %llu overwritten\r\n", *events, g_options.traceFile,
+			(unsigned long long)stats.Recorded__u64, (unsigned long long)stats.Overwritten__u64);
+	}
+	return result;
+}
+
+/* Runs on the callback thread of the IoT Hub client, so its own events are in the file */
+METHODRETURN_HANDLE DumpTrace(Thermostat* thermostat)
+{
+	METHODRETURN_HANDLE result;
+	uint32_t events;
+	char response[PATH_MAX + 64];
+
+	(void)thermostat;
+	if (g_options.traceEvents == 0)
+	{
+		result = MethodReturn_Create(400, "\"tracing is off, start with --trace N\"");
+	}
+	else if (writeTrace(&events) != 0)
+	{
+		result = MethodReturn_Create(500, "\"failed to write the trace\"");
+	}
+	else
+	{
+		/* The path comes from the command line; quotes in it would break the JSON */
+		(void)snprintf(response, sizeof(response), "{\"file\":\"%s\",\"events\":%u}",
+			(strpbrk(g_options.traceFile, "\"\\") == NULL) ? g_options.traceFile : "", events);
+		result = MethodReturn_Create(200, response);
+	}
+	return result;
+}
+
+/* Create a message for IoT Hub, taking ownership of the buffer */
+static IOTHUB_MESSAGE_HANDLE createMessage(const unsigned char* buffer, size_t size, TELEMETRY_ENCODING encoding, const char* contentEncoding)
 {
 	IOTHUB_MESSAGE_HANDLE messageHandle = IoTHubMessage_CreateFromByteArray(buffer, size);
 	if (messageHandle == NULL)
@@ -334,215 +704,2742 @@ static void sendMessage(IOTHUB_CLIENT_HANDLE iotHubClientHandle, const unsigned
 	}
 	else
 	{
-		if (IoTHubClient_SendEventAsync(iotHubClientHandle, messageHandle, NULL, NULL) != IOTHUB_CLIENT_OK)
+		/* System properties, which message routing can read without decoding the body */
+		if (IoTHubMessage_SetContentTypeSystemProperty(messageHandle, telemetry_content_type(encoding)) != IOTHUB_MESSAGE_OK)
 		{
-			printf("failed to hand over the message to IoTHubClient");
+			printf("failed to set the content type\r\n");
 		}
-		else
+		if (contentEncoding != NULL && IoTHubMessage_SetContentEncodingSystemProperty(messageHandle, contentEncoding) != IOTHUB_MESSAGE_OK)
 		{
-			printf("IoTHubClient accepted the message for delivery\r\n");
+			printf("failed to set the content encoding\r\n");
 		}
-
-		IoTHubMessage_Destroy(messageHandle);
+		g_messageCount++;
+		g_messageBytes += size;
 	}
 	free((void*)buffer);
+	return messageHandle;
 }
 
-/* Callback after sending reported properties */
-void deviceTwinCallback(int status_code, void* userContextCallback)
+/* Queue data for IoT Hub in the given lane of the outbox */
+static void sendMessage(OUTBOX_LANE lane, IOTHUB_CLIENT_HANDLE iotHubClientHandle, const unsigned char* buffer, size_t size, TELEMETRY_ENCODING encoding, const char* contentEncoding, uint64_t sampleTimeUs)
 {
-	(void)(userContextCallback);
-	printf("IoTHub: reported properties delivered with status_code = %u\n", status_code);
+	IOTHUB_MESSAGE_HANDLE messageHandle = createMessage(buffer, size, encoding, contentEncoding);
+	if (messageHandle != NULL)
+	{
+		(void)outbox_push(lane, iotHubClientHandle, messageHandle, sampleTimeUs);
+	}
 }
 
-void remote_monitoring_run(void)
+/* Serialize the telemetry fields of the model with the selected encoding */
+static int serializeTelemetry(Thermostat* thermostat, uint64_t wallTimeUs, unsigned char** buffer, size_t* bufferSize)
 {
-	if (platform_init() != 0)
-	{
-		printf("Failed to initialize the platform.\n");
-	}
-	else
+	int result;
+
+	if (g_options.encoding == TELEMETRY_ENCODING_CBOR)
 	{
-		if (SERIALIZER_REGISTER_NAMESPACE(Contoso) == NULL)
+		/* IoT Hub stamps every message with the sending device, so the DeviceId is left out of the body */
+		telemetry_sample_t sample;
+		sample.Temperature = thermostat->Temperature;
+		sample.Humidity = thermostat->Humidity;
+		sample.Time_ms = wallTimeUs / 1000;
+
+		*buffer = malloc(TELEMETRY_CBOR_MAX_SAMPLE_SIZE);
+		if (*buffer == NULL)
 		{
-			printf("Unable to SERIALIZER_REGISTER_NAMESPACE\n");
+			result = 1;
 		}
 		else
 		{
-			IOTHUB_CLIENT_HANDLE iotHubClientHandle = IoTHubClient_CreateFromConnectionString(connectionString, MQTT_Protocol);
-			g_iotHubClientHandle = iotHubClientHandle;
-			if (iotHubClientHandle == NULL)
+			*bufferSize = telemetry_encode_cbor(&sample, NULL, *buffer, TELEMETRY_CBOR_MAX_SAMPLE_SIZE);
+			if (*bufferSize == 0)
 			{
-				printf("Failure in IoTHubClient_CreateFromConnectionString\n");
+				free(*buffer);
+				result = 1;
 			}
 			else
 			{
-#ifdef MBED_BUILD_TIMESTAMP
-				// For mbed add the certificate information
-				if (IoTHubClient_SetOption(iotHubClientHandle, "TrustedCerts", certificates) != IOTHUB_CLIENT_OK)
-				{
-					printf("Failed to set option \"TrustedCerts\"\n");
-				}
-#endif // MBED_BUILD_TIMESTAMP
-				Thermostat* thermostat = IoTHubDeviceTwin_CreateThermostat(iotHubClientHandle);
-				if (thermostat == NULL)
-				{
-					printf("Failure in IoTHubDeviceTwin_CreateThermostat\n");
-				}
-				else
-				{
-					/* Set values for reported properties */
-					thermostat->Config.TelemetryInterval = 3;
-					thermostat->System.FirmwareVersion = "1.0";
-					/* Specify the signatures of the supported direct methods */
-					thermostat->SupportedMethods = supportedMethod;
-
-					/* Send reported properties to IoT Hub */
-					if (IoTHubDeviceTwin_SendReportedStateThermostat(thermostat, deviceTwinCallback, NULL) != IOTHUB_CLIENT_OK)
-					{
-						printf("Failed sending serialized reported state\n");
-					}
-					else
-					{
-						printf("Send DeviceInfo object to IoT Hub at startup\n");
-
-						thermostat->ObjectType = "DeviceInfo";
-						thermostat->IsSimulatedDevice = 0;
-						thermostat->Version = "1.0";
-						thermostat->DeviceProperties.HubEnabledState = 1;
-						thermostat->DeviceProperties.DeviceID = (char*)deviceId;
-
-						unsigned char* buffer;
-						size_t bufferSize;
+				result = 0;
+			}
+		}
+	}
+	else
+	{
+		result = (SERIALIZE(buffer, bufferSize, thermostat->DeviceId, thermostat->Temperature, thermostat->Humidity, thermostat->SampleTime) == CODEFIRST_OK) ? 0 : 1;
+	}
 
-						if (SERIALIZE(&buffer, &bufferSize, thermostat->ObjectType, thermostat->Version, thermostat->IsSimulatedDevice, thermostat->DeviceProperties) != CODEFIRST_OK)
-						{
-							(void)printf("Failed serializing DeviceInfo\n");
-						}
-						else
-						{
-							sendMessage(iotHubClientHandle, buffer, bufferSize);
-						}
+	return result;
+}
 
-						/* Send telemetry */
-						thermostat->Temperature = 50;
-						thermostat->Humidity = 50;
-						thermostat->TelemetryInterval = 3;
-						thermostat->DeviceId = (char*)deviceId;
+/* Append one encoded sample, read at the monotonic time sampleTimeUs, to the batch,
+   separating JSON objects with commas */
+static int batchAppend(TELEMETRY_BATCH* batch, const unsigned char* data, size_t size, uint64_t sampleTimeUs)
+{
+	int result;
+	size_t needed = batch->size + size + 1;
 
-						while (1)
-						{
-							unsigned char* buffer;
-							size_t bufferSize;
-							float tempC = -300.0;
-							float pressurePa = -300;
-							float humidityPct = -300;
-
-							int sensorResult = bme280_read_sensors(&tempC, &pressurePa, &humidityPct);
-
-							if (sensorResult == 1)
-							{
-								thermostat->Temperature = tempC;
-								thermostat->Humidity = humidityPct;
-								printf("Read Sensor Data: Humidity = %.1f%% Temperature = %.1f*C \n",
-									humidityPct, tempC);
-							}
-							else
-							{
-								thermostat->Temperature = 50;
-								thermostat->Humidity = 50;
-							}
-
-							(void)printf("Sending sensor value Temperature = %f, Humidity = %f\n", thermostat->Temperature, thermostat->Humidity);
-
-							if (SERIALIZE(&buffer, &bufferSize, thermostat->DeviceId, thermostat->Temperature, thermostat->Humidity) != CODEFIRST_OK)
-							{
-								(void)printf("Failed sending sensor value\r\n");
-							}
-							else
-							{
-								sendMessage(iotHubClientHandle, buffer, bufferSize);
-							}
-
-							ThreadAPI_Sleep(thermostat->TelemetryInterval * 1000);
-						}
+	if (needed > batch->capacity)
+	{
+		unsigned char* grown = realloc(batch->buffer, needed * 2);
+		if (grown != NULL)
+		{
+			batch->buffer = grown;
+			batch->capacity = needed * 2;
+		}
+	}
 
-						IoTHubDeviceTwin_DestroyThermostat(thermostat);
-					}
-				}
-				IoTHubClient_Destroy(iotHubClientHandle);
-			}
-			serializer_deinit();
+	if (needed > batch->capacity)
+	{
+		result = 1;
+	}
+	else
+	{
+		if (g_options.encoding == TELEMETRY_ENCODING_JSON && batch->count > 0)
+		{
+			batch->buffer[batch->size++] = ',';
+		}
+		memcpy(batch->buffer + batch->size, data, size);
+		batch->size += size;
+		if (batch->count++ == 0)
+		{
+			batch->firstSampleUs = sampleTimeUs;
 		}
+		result = 0;
 	}
-	platform_deinit();
+
+	return result;
 }
 
-int remote_monitoring_init(void)
+/* Build the message body for the batch: a single sample goes out as is, several
+   samples as a JSON array or a CBOR array */
+static int batchFinish(TELEMETRY_BATCH* batch, unsigned char** body, size_t* bodySize)
 {
 	int result;
 
-	Lock_fd = open_lockfile(LOCKFILE);
+	*body = malloc(batch->size + TELEMETRY_CBOR_MAX_ARRAY_HEAD_SIZE + 1);
+	if (*body == NULL)
+	{
+		result = 1;
+	}
+	else if (batch->count == 1)
+	{
+		memcpy(*body, batch->buffer, batch->size);
+		*bodySize = batch->size;
+		result = 0;
+	}
+	else if (g_options.encoding == TELEMETRY_ENCODING_CBOR)
+	{
+		size_t headSize = telemetry_encode_cbor_array_head(batch->count, *body, TELEMETRY_CBOR_MAX_ARRAY_HEAD_SIZE);
+		memcpy(*body + headSize, batch->buffer, batch->size);
+		*bodySize = headSize + batch->size;
+		result = 0;
+	}
+	else
+	{
+		(*body)[0] = '[';
+		memcpy(*body + 1, batch->buffer, batch->size);
+		(*body)[batch->size + 1] = ']';
+		*bodySize = batch->size + 2;
+		result = 0;
+	}
 
-	if (setuid(getuid()) < 0)
+	batch->size = 0;
+	batch->count = 0;
+	return result;
+}
+
+/* Send the batched samples of a device, compressed if that is enabled and worth it */
+static void sendTelemetryBatch(MONITORED_DEVICE* device)
+{
+	unsigned char* body;
+	size_t bodySize;
+	uint64_t sampleTimeUs = device->batch.firstSampleUs;
+
+	event_trace_record(EVENT_TRACE_BEGIN, "send_batch", device->batch.count);
+	if (batchFinish(&device->batch, &body, &bodySize) != 0)
 	{
-		perror("Dropping privileges failed. (did you use sudo?)n");
-		result = EXIT_FAILURE;
+		(void)printf("Failed to build the telemetry batch\r\n");
 	}
 	else
 	{
-		result = wiringPiSetup();
-		if (result != 0)
+		const char* contentEncoding = NULL;
+
+		if (g_compressor != NULL && bodySize >= g_options.compressThreshold)
 		{
-			perror("Wiring Pi setup failed.");
+			/* Only keep the compressed body if it is smaller than the original */
+			unsigned char* compressed = malloc(bodySize);
+			size_t compressedSize = (compressed == NULL) ? 0 : payload_compress(g_compressor, body, bodySize, compressed, bodySize - 1);
+			if (compressedSize == 0)
+			{
+				free(compressed);
+			}
+			else
+			{
+				(void)printf("Compressed telemetry from %u to %u bytes\r\n", (unsigned int)bodySize, (unsigned int)compressedSize);
+				free(body);
+				body = compressed;
+				bodySize = compressedSize;
+				contentEncoding = payload_content_encoding(g_options.compression);
+			}
 		}
-		else
+
+		sendMessage(OUTBOX_LANE_BULK, device->client, body, bodySize, g_options.encoding, contentEncoding, sampleTimeUs);
+	}
+	event_trace_record(EVENT_TRACE_END, "send_batch", 0);
+}
+
+/* Evaluate the alert rules of a device on a new sample and queue an alert for every rule that fires */
+static void sendAlerts(MONITORED_DEVICE* device, uint64_t sampleTimeUs)
+{
+	size_t i;
+	Thermostat* thermostat = device->thermostat;
+	telemetry_sample_t sample;
+	sample.Temperature = thermostat->Temperature;
+	sample.Humidity = thermostat->Humidity;
+	sample.Time_ms = 0;
+
+	for (i = 0; i < g_options.alertRuleCount; i++)
+	{
+		double value;
+		alert_rule_t* rule = &device->alertRules[i];
+		if (alert_rule_evaluate(rule, &sample, sampleTimeUs, &value))
 		{
-			result = wiringPiSPISetup(Spi_channel, Spi_clock);
-			if (result < 0)
+			unsigned char* buffer;
+			size_t bufferSize;
+			const char* format = "{\"DeviceId\":\"%s\",\"Alert\":\"%s\",\"Value\":%.2f,\"Temperature\":%.2f,\"Humidity\":%.2f}";
+
+			bufferSize = snprintf(NULL, 0, format, thermostat->DeviceId, rule->Spec__ca, value, sample.Temperature, sample.Humidity);
+			buffer = malloc(bufferSize + 1);
+			if (buffer == NULL)
 			{
-				printf("Can't setup SPI, error %i calling wiringPiSPISetup(%i, %i)  %sn",
-					result, Spi_channel, Spi_clock, strerror(result));
+				(void)printf("Failed to allocate the alert\r\n");
 			}
 			else
 			{
-				int sensorResult = bme280_init(Spi_channel);
-				if (sensorResult != 1)
-				{
-					printf("It appears that no BMP280 module on Chip Enable %i is attached. Aborting.\n", Spi_channel);
-					result = 1;
-				}
-				else
+				(void)sprintf((char*)buffer, format, thermostat->DeviceId, rule->Spec__ca, value, sample.Temperature, sample.Humidity);
+				IOTHUB_MESSAGE_HANDLE messageHandle = createMessage(buffer, bufferSize, TELEMETRY_ENCODING_JSON, NULL);
+				if (messageHandle != NULL)
 				{
-					// Read the Temp & Pressure module.
-					float tempC = -300.0;
-					float pressurePa = -300;
-					float humidityPct = -300;
-					sensorResult = bme280_read_sensors(&tempC, &pressurePa, &humidityPct);
-					if (sensorResult == 1)
-					{
-						printf("Temperature = %.1f *C  Pressure = %.1f Pa  Humidity = %1f %%\n",
-							tempC, pressurePa, humidityPct);
-						result = 0;
-					}
-					else
+					MAP_HANDLE propMap = IoTHubMessage_Properties(messageHandle);
+					if (Map_AddOrUpdate(propMap, "messageType", "alert") != MAP_OK ||
+						Map_AddOrUpdate(propMap, "priority", "high") != MAP_OK)
 					{
-						printf("Unable to read BME280 on pin %i. Aborting.\n", Spi_channel);
-						result = 1;
+						printf("failed to set the alert properties\r\n");
 					}
+					(void)printf("%s: alert %s fired with value %.2f\r\n", device->deviceId, rule->Spec__ca, value);
+					(void)outbox_push(OUTBOX_LANE_ALERT, device->client, messageHandle, sampleTimeUs);
 				}
 			}
 		}
 	}
+}
+
+/* Callback after sending reported properties */
+void deviceTwinCallback(int status_code, void* userContextCallback)
+{
+	MONITORED_DEVICE* device = userContextCallback;
+	event_trace_record(EVENT_TRACE_INSTANT, "reported_confirmed", (uint64_t)status_code);
+	printf("IoTHub: reported properties delivered with status_code = %u\n", status_code);
+	(void)__atomic_sub_fetch(&g_reportedInFlight, 1, __ATOMIC_RELAXED);
+	/* The hub may lack any of what was sent, so send all of it again in the next window */
+	if (status_code >= 300 && device != NULL && device->reported != NULL)
+	{
+		reported_state_invalidate(device->reported);
+	}
+}
+
+/* Sends a patch of reported properties merged by the reported state of a device */
+static int sendReportedState(void* context, const char* patch, size_t size)
+{
+	MONITORED_DEVICE* device = context;
+	int result;
+
+	if (IoTHubClient_SendReportedState(device->client, (const unsigned char*)patch, size, deviceTwinCallback, device) != IOTHUB_CLIENT_OK)
+	{
+		(void)printf("%s: failed to send reported properties: %.*s\r\n", device->deviceId, (int)size, patch);
+		result = 1;
+	}
+	else
+	{
+		(void)printf("%s: sent reported properties: %.*s\r\n", device->deviceId, (int)size, patch);
+		(void)__atomic_add_fetch(&g_reportedInFlight, 1, __ATOMIC_RELAXED);
+		result = 0;
+	}
 	return result;
 }
 
-int main(void)
+/* The twin cache file of a device, DIR/<device id>.twin.json */
+static reported_state_t* createReportedState(MONITORED_DEVICE* device)
 {
-	int result = remote_monitoring_init();
-	if (result == 0)
+	reported_state_t* result;
+	char* cachePath = NULL;
+
+	if (g_options.twinCacheDir != NULL)
 	{
-		remote_monitoring_run();
+		size_t size = strlen(g_options.twinCacheDir) + strlen(device->deviceId) + sizeof("/.twin.json");
+		cachePath = malloc(size);
+		if (cachePath != NULL)
+		{
+			(void)snprintf(cachePath, size, "%s/%s.twin.json", g_options.twinCacheDir, device->deviceId);
+		}
+	}
+	result = reported_state_create(g_options.twinWindowMs, cachePath, sendReportedState, device);
+	free(cachePath);
+	return result;
+}
+
+/* Returns a copy of the value of "key=value" in a connection string, or NULL */
+static char* connectionStringValue(const char* connectionString, const char* key)
+{
+	size_t keyLength = strlen(key);
+	const char* field = connectionString;
+
+	while (field != NULL && *field != '\0')
+	{
+		if (strncmp(field, key, keyLength) == 0 && field[keyLength] == '=')
+		{
+			const char* value = field + keyLength + 1;
+			return CopyString(value, strcspn(value, ";"));
+		}
+		field = strchr(field, ';');
+		if (field != NULL)
+		{
+			field++;
+		}
+	}
+	return NULL;
+}
+
+/* deviceIdText is NULL to take the DeviceId from the connection string */
+static int addDevice(const char* deviceConnectionString, size_t length, const char* deviceIdText, int simulated)
+{
+	int result;
+	MONITORED_DEVICE* grown = realloc(g_devices, (g_deviceCount + 1) * sizeof(MONITORED_DEVICE));
+
+	if (grown == NULL)
+	{
+		result = 1;
+	}
+	else
+	{
+		MONITORED_DEVICE* device = &grown[g_deviceCount];
+		g_devices = grown;
+		memset(device, 0, sizeof(MONITORED_DEVICE));
+		device->connectionString = CopyString(deviceConnectionString, length);
+		if (deviceIdText != NULL)
+		{
+			device->deviceId = CopyString(deviceIdText, strlen(deviceIdText));
+		}
+		else if (device->connectionString != NULL)
+		{
+			device->deviceId = connectionStringValue(device->connectionString, "DeviceId");
+		}
+		device->simulated = simulated;
+		/* Every device keeps its own alert state */
+		memcpy(device->alertRules, g_options.alertRules, sizeof(device->alertRules));
+		if (device->deviceId == NULL)
+		{
+			printf("No DeviceId in connection string %.*s\r\n", (int)length, deviceConnectionString);
+			free(device->connectionString);
+			result = 1;
+		}
+		else
+		{
+			g_deviceCount++;
+			result = 0;
+		}
+	}
+	return result;
+}
+
+/* The devices file has one connection string per line, optionally preceded by
+   "sim " for a device reporting simulated readings instead of the attached BME280.
+   Empty lines and lines starting with # are ignored. */
+static int loadDevices(void)
+{
+	int result = 0;
+
+	if (g_options.gatewayFile == NULL)
+	{
+		if (g_options.connectionString != NULL)
+		{
+			result = addDevice(g_options.connectionString, strlen(g_options.connectionString), NULL, 0);
+		}
+		else
+		{
+			result = addDevice(connectionString, strlen(connectionString), deviceId, 0);
+		}
+	}
+	else
+	{
+		FILE* fp = fopen(g_options.gatewayFile, "r");
+		if (fp == NULL)
+		{
+			printf("Failed to open the devices file %s\r\n", g_options.gatewayFile);
+			result = 1;
+		}
+		else
+		{
+			char line[1024];
+			while (result == 0 && fgets(line, sizeof(line), fp) != NULL)
+			{
+				const char* text = line;
+				int simulated = 0;
+				if (strncmp(text, "sim ", 4) == 0)
+				{
+					simulated = 1;
+					text += 4;
+				}
+				if (text[0] != '#' && strcspn(text, "\r\n") > 0)
+				{
+					result = addDevice(text, strcspn(text, "\r\n"), NULL, simulated);
+				}
+			}
+			fclose(fp);
+			if (result == 0 && g_deviceCount == 0)
+			{
+				printf("No devices in %s\r\n", g_options.gatewayFile);
+				result = 1;
+			}
+		}
+	}
+	return result;
+}
+
+static void freeDevices(void)
+{
+	size_t i;
+	for (i = 0; i < g_deviceCount; i++)
+	{
+		free(g_devices[i].connectionString);
+		free(g_devices[i].deviceId);
+		free(g_devices[i].batch.buffer);
+	}
+	free(g_devices);
+	g_devices = NULL;
+	g_deviceCount = 0;
+}
+
+/* A device of its own connects with the selected transport. In gateway mode every device
+   registers with one shared AMQP transport: the SDK cannot multiplex identities over MQTT. */
+static IOTHUB_CLIENT_HANDLE createClient(MONITORED_DEVICE* device)
+{
+	IOTHUB_CLIENT_HANDLE result = NULL;
+
+	if (g_options.gatewayFile == NULL)
+	{
+		result = IoTHubClient_CreateFromConnectionString(device->connectionString, g_options.transport->protocol);
+	}
+	else
+	{
+		char* hostName = connectionStringValue(device->connectionString, "HostName");
+		char* deviceKey = connectionStringValue(device->connectionString, "SharedAccessKey");
+		char* hubSuffix = (hostName == NULL) ? NULL : strchr(hostName, '.');
+
+		if (deviceKey == NULL || hubSuffix == NULL)
+		{
+			printf("%s: the connection string needs a HostName and a SharedAccessKey\r\n", device->deviceId);
+		}
+		else
+		{
+			*hubSuffix++ = '\0';
+			if (g_transport == NULL)
+			{
+				g_transport = IoTHubTransport_Create(g_options.transport->protocol, hostName, hubSuffix);
+				if (g_transport == NULL)
+				{
+					printf("Failure in IoTHubTransport_Create\r\n");
+				}
+			}
+			if (g_transport != NULL)
+			{
+				IOTHUB_CLIENT_CONFIG config;
+				memset(&config, 0, sizeof(config));
+				config.protocol = g_options.transport->protocol;
+				config.deviceId = device->deviceId;
+				config.deviceKey = deviceKey;
+				config.iotHubName = hostName;
+				config.iotHubSuffix = hubSuffix;
+				result = IoTHubClient_CreateWithTransport(g_transport, &config);
+			}
+		}
+		free(hostName);
+		free(deviceKey);
+	}
+	return result;
+}
+
+/* Queued telemetry and reported properties of a disconnected device wait in the outbox and
+   the reported state until the client is authenticated again */
+static void connectionStatusCallback(IOTHUB_CLIENT_CONNECTION_STATUS result, IOTHUB_CLIENT_CONNECTION_STATUS_REASON reason, void* userContextCallback)
+{
+	MONITORED_DEVICE* device = userContextCallback;
+	(void)printf("%s: connection %s, %s\r\n", device->deviceId,
+		ENUM_TO_STRING(IOTHUB_CLIENT_CONNECTION_STATUS, result), ENUM_TO_STRING(IOTHUB_CLIENT_CONNECTION_STATUS_REASON, reason));
+	outbox_set_connected(device->client, result == IOTHUB_CLIENT_CONNECTION_AUTHENTICATED);
+	__atomic_store_n(&device->authenticated, result == IOTHUB_CLIENT_CONNECTION_AUTHENTICATED, __ATOMIC_RELEASE);
+}
+
+/* Closes the connection of a device but keeps its reported properties, pending ones included.
+   Return: the messages of the device that were still queued and are dropped */
+static size_t disconnectDevice(MONITORED_DEVICE* device)
+{
+	size_t dropped = 0;
+
+	if (device->thermostat != NULL)
+	{
+		IoTHubDeviceTwin_DestroyThermostat(device->thermostat);
+		device->thermostat = NULL;
+	}
+	if (device->client != NULL)
+	{
+		IoTHubClient_Destroy(device->client);
+		dropped = outbox_forget_client(device->client);
+		device->client = NULL;
+	}
+	return dropped;
+}
+
+static void stopDevice(MONITORED_DEVICE* device)
+{
+	if (device->reported != NULL)
+	{
+		reported_state_stats_t stats;
+		if (device->client != NULL)
+		{
+			(void)reported_state_flush(device->reported, 1);
+		}
+		reported_state_get_stats(device->reported, &stats);
+		(void)printf("%s: %llu reported property updates sent in %llu patches, %llu unchanged fields left out\r\n",
+			device->deviceId, (unsigned long long)stats.updates, (unsigned long long)stats.sends,
+			(unsigned long long)stats.fieldsSkipped);
+		reported_state_destroy(device->reported);
+		device->reported = NULL;
+	}
+	(void)disconnectDevice(device);
+}
+
+/* Connect a device, send its reported properties and, the first time, DeviceInfo. The
+   reported properties of an earlier connection are kept. */
+static int startDevice(MONITORED_DEVICE* device)
+{
+	int result = 1;
+
+	printf("%s: connecting over %s\n", device->deviceId, g_options.transport->name);
+	device->authenticated = 0;
+	device->client = createClient(device);
+	if (device->client == NULL)
+	{
+		printf("%s: failure creating the IoTHubClient\n", device->deviceId);
+	}
+	else
+	{
+#ifdef MBED_BUILD_TIMESTAMP
+		// For mbed add the certificate information
+		if (IoTHubClient_SetOption(device->client, "TrustedCerts", certificates) != IOTHUB_CLIENT_OK)
+		{
+			printf("Failed to set option \"TrustedCerts\"\n");
+		}
+#endif // MBED_BUILD_TIMESTAMP
+		if (g_trustedCerts != NULL && IoTHubClient_SetOption(device->client, "TrustedCerts", g_trustedCerts) != IOTHUB_CLIENT_OK)
+		{
+			printf("Failed to set option \"TrustedCerts\"\n");
+		}
+		if (IoTHubClient_SetConnectionStatusCallback(device->client, connectionStatusCallback, device) != IOTHUB_CLIENT_OK)
+		{
+			printf("Failed to set the connection status callback\n");
+		}
+		if (IoTHubClient_SetRetryPolicy(device->client, g_options.retryPolicy, g_options.retryTimeoutS) != IOTHUB_CLIENT_OK)
+		{
+			printf("Failed to set the retry policy\n");
+		}
+		Thermostat* thermostat = IoTHubDeviceTwin_CreateThermostat(device->client);
+		device->thermostat = thermostat;
+		if (device->reported == NULL)
+		{
+			device->reported = createReportedState(device);
+		}
+		if (thermostat == NULL)
+		{
+			printf("Failure in IoTHubDeviceTwin_CreateThermostat\n");
+		}
+		else if (device->reported == NULL)
+		{
+			printf("Failed to create the reported state\n");
+		}
+		else
+		{
+			/* Set values for reported properties */
+			thermostat->Config.TelemetryInterval = 3;
+			thermostat->System.FirmwareVersion = "1.0";
+			/* Specify the signatures of the supported direct methods */
+			thermostat->SupportedMethods = supportedMethod;
+
+			/* Send the reported properties the twin does not have yet, after a restart usually none */
+			unsigned char* reportedBuffer;
+			size_t reportedSize;
+			int reportedResult = 1;
+			if (SERIALIZE_REPORTED_PROPERTIES_FROM_POINTERS(&reportedBuffer, &reportedSize, thermostat) == CODEFIRST_OK)
+			{
+				reportedResult = reported_state_update(device->reported, (const char*)reportedBuffer, reportedSize) != 0 ||
+					reported_state_flush(device->reported, 1) != 0;
+				free(reportedBuffer);
+			}
+			if (reportedResult != 0)
+			{
+				printf("Failed sending serialized reported state\n");
+			}
+			else if (device->deviceInfoSent)
+			{
+				result = 0;
+			}
+			else
+			{
+				printf("Send DeviceInfo object of %s to IoT Hub at startup\n", device->deviceId);
+
+				thermostat->ObjectType = "DeviceInfo";
+				thermostat->IsSimulatedDevice = device->simulated;
+				thermostat->Version = "1.0";
+				thermostat->DeviceProperties.HubEnabledState = 1;
+				thermostat->DeviceProperties.DeviceID = device->deviceId;
+
+				unsigned char* buffer;
+				size_t bufferSize;
+
+				if (SERIALIZE(&buffer, &bufferSize, thermostat->ObjectType, thermostat->Version, thermostat->IsSimulatedDevice, thermostat->DeviceProperties) != CODEFIRST_OK)
+				{
+					(void)printf("Failed serializing DeviceInfo\n");
+				}
+				else
+				{
+					sendMessage(OUTBOX_LANE_BULK, device->client, buffer, bufferSize, TELEMETRY_ENCODING_JSON, NULL, latency_clock_us());
+					device->deviceInfoSent = 1;
+				}
+				result = 0;
+			}
+			thermostat->Temperature = 50;
+			thermostat->Humidity = 50;
+			thermostat->TelemetryInterval = 3;
+			thermostat->DeviceId = device->deviceId;
+		}
+	}
+	return result;
+}
+
+/* Queue the alerts and telemetry for one sample of a device */
+/* sampleTimeUs is the monotonic time of the sample, for latencies; wallTimeUs stamps the telemetry */
+static void sampleDevice(MONITORED_DEVICE* device, int valid, float tempC, float humidityPct, uint64_t sampleTimeUs, uint64_t wallTimeUs)
+{
+	Thermostat* thermostat = device->thermostat;
+	unsigned char* buffer;
+	size_t bufferSize;
+	int result;
+
+	if (valid)
+	{
+		thermostat->Temperature = tempC;
+		thermostat->Humidity = humidityPct;
+
+		/* Alerts go out ahead of the batch and of any queued telemetry */
+		sendAlerts(device, sampleTimeUs);
+		outbox_drain();
+	}
+	else
+	{
+		thermostat->Temperature = 50;
+		thermostat->Humidity = 50;
+	}
+
+	(void)time_format_iso8601(wallTimeUs, device->sampleTime, sizeof(device->sampleTime));
+	thermostat->SampleTime = device->sampleTime;
+
+	(void)printf("Sending sensor value of %s Temperature = %f, Humidity = %f\n", device->deviceId, thermostat->Temperature, thermostat->Humidity);
+
+	event_trace_record(EVENT_TRACE_BEGIN, "serialize", 0);
+	result = serializeTelemetry(thermostat, wallTimeUs, &buffer, &bufferSize);
+	event_trace_record(EVENT_TRACE_END, "serialize", 0);
+	if (result != 0)
+	{
+		(void)printf("Failed sending sensor value\r\n");
+	}
+	else
+	{
+		if (batchAppend(&device->batch, buffer, bufferSize, sampleTimeUs) != 0)
+		{
+			(void)printf("Failed to batch sensor value\r\n");
+		}
+		free(buffer);
+
+		if (device->batch.count >= g_options.batchSize)
+		{
+			sendTelemetryBatch(device);
+		}
+	}
+}
+
+/* Wall clock time of a sample read at the monotonic time sampleTimeUs */
+static uint64_t wallClockUs(time_service_t* timeService, uint64_t sampleTimeUs)
+{
+	time_stamp_t stamp;
+
+	if (time_service_stamp(timeService, &stamp))
+	{
+		printf("The wall clock was stepped by %.3f s, %u steps so far\n",
+			(double)timeService->Last_step_us__i64 / 1e6, (unsigned int)timeService->Steps__u32);
+	}
+	return (stamp.Mono_us__u64 > sampleTimeUs) ? stamp.Utc_us__u64 - (stamp.Mono_us__u64 - sampleTimeUs) : stamp.Utc_us__u64;
+}
+
+/* A reading of the thermostat sensor, from the sensor scheduler or the real-time sampler.
+   sampleTimeUs is the monotonic time of the read, for latencies; wallTimeUs stamps the telemetry */
+typedef struct THERMOSTAT_READING_TAG
+{
+	int valid;
+	float tempC;
+	float pressurePa;
+	float humidityPct;
+	uint64_t sampleTimeUs;
+	uint64_t wallTimeUs;
+} THERMOSTAT_READING;
+
+/* Where an upload of --duty-cycle is */
+typedef enum DUTY_STATE_TAG
+{
+	DUTY_STATE_OFFLINE,
+	DUTY_STATE_CONNECTING,
+	DUTY_STATE_UPLOADING
+} DUTY_STATE;
+
+/* A reading taken between uploads: of the thermostat sensor if channel is g_thermostatChannel,
+   otherwise a sample of that --sensor channel read at wallTimeUs */
+typedef struct DUTY_READING_TAG
+{
+	int channel;
+	uint64_t wallTimeUs;
+	union
+	{
+		THERMOSTAT_READING thermostat;
+		sensor_sample_t sensor;
+	} u;
+} DUTY_READING;
+
+/* With --duty-cycle the devices are only connected for an upload once per cycle, and the
+   readings wait in a ring buffer in between. Only used by the main thread. */
+typedef struct DUTY_CYCLE_TAG
+{
+	DUTY_STATE state;
+	DUTY_READING* readings;
+	size_t capacity;
+	size_t first;
+	size_t count;
+	/* Readings at the front of the buffer handed to the devices in this upload; they stay
+	   until it ends, in case their messages do not arrive */
+	size_t handed;
+	uint64_t dropped;
+	uint64_t nextUs;
+	/* The current or last upload */
+	unsigned int cycle;
+	uint64_t beginUs;
+	uint64_t connectedUs;
+	uint64_t syncedUs;
+	size_t uploaded;
+	uint64_t messageCount;
+	uint64_t messageBytes;
+	uint64_t reportedBytes;
+	/* All uploads */
+	unsigned int failed;
+	uint64_t radioOnUs;
+	uint64_t bytes;
+	latency_histogram_t connectTime;
+} DUTY_CYCLE;
+
+static DUTY_CYCLE g_duty;
+
+/* Whether a burst of --burst is being sent */
+typedef enum BURST_STATE_TAG
+{
+	BURST_STATE_ARMED,
+	BURST_STATE_CAPTURING
+} BURST_STATE;
+
+/* A reading of the pre-trigger ring of --burst */
+typedef struct BURST_READING_TAG
+{
+	THERMOSTAT_READING reading;
+	int sent;
+} BURST_READING;
+
+/* With --burst the thermostat sensor is read every burstMs, but only a reading per telemetry
+   interval is sent while the readings behave. The readings of the last burstPreS seconds wait
+   in a ring buffer. When a reading is an anomaly, the sensor switches to its fast profile and
+   the readings of the ring not sent yet go out, followed by every reading until burstPostS
+   seconds after the last anomaly. Only used by the main thread. */
+typedef struct BURST_CAPTURE_TAG
+{
+	BURST_STATE state;
+	anomaly_detector_t detectors[BURST_QUANTITIES];
+	BURST_READING* readings;
+	size_t capacity;
+	size_t first;
+	size_t count;
+	/* When the next reading is due to be sent while armed */
+	uint64_t nextSendUs;
+	uint64_t endUs;
+	unsigned int bursts;
+	uint64_t taken;
+	uint64_t sent;
+	uint64_t sentInBursts;
+} BURST_CAPTURE;
+
+static BURST_CAPTURE g_burst;
+
+static float readingValue(const float* values, int index)
+{
+	return (index >= 0) ? values[index] : -300.0f;
+}
+
+/* Fills a reading from a read of the thermostat sensor. The wall time is when the read
+   started, or the frame was recorded when replaying a trace. */
+static void makeReading(time_service_t* timeService, int readResult, const float* values,
+	uint64_t sampleTimeUs, THERMOSTAT_READING* reading)
+{
+	reading->valid = (readResult == 0);
+	reading->sampleTimeUs = sampleTimeUs;
+	reading->wallTimeUs = wallClockUs(timeService, sampleTimeUs);
+	reading->tempC = -300.0f;
+	reading->pressurePa = -300.0f;
+	reading->humidityPct = -300.0f;
+
+	if (reading->valid)
+	{
+		if (g_traceReader != NULL)
+		{
+			(void)sensor_trace_reader_record(g_traceReader, sensor_trace_replay_position() - 1, &reading->wallTimeUs, NULL);
+		}
+		reading->tempC = readingValue(values, g_temperatureValue);
+		reading->pressurePa = readingValue(values, g_pressureValue);
+		reading->humidityPct = readingValue(values, g_humidityValue);
+		if (g_readingsShm != NULL)
+		{
+			readings_shm_publish(g_readingsShm, g_thermostatShmChannel, reading->wallTimeUs, sampleTimeUs, values);
+		}
+	}
+}
+
+/* Appends the raw frame of a valid reading to the trace being recorded. On the main thread
+   only: it writes to a file, and a failed append closes the writer. */
+static void recordFrame(const THERMOSTAT_READING* reading, const uint8_t* frame)
+{
+	if (reading->valid && g_traceWriter != NULL && sensor_trace_writer_append(g_traceWriter, reading->wallTimeUs, frame) != 0)
+	{
+		printf("Failed to append to the sensor trace, recording stopped\n");
+		sensor_trace_writer_close(g_traceWriter);
+		g_traceWriter = NULL;
+	}
+}
+
+/* Calls into the SPI backend (system calls on the real sensor) and bus time per sample */
+static void printBusStats(unsigned int sampleCount)
+{
+	bme280_bus_stats_t stats;
+	bme280_get_bus_stats(&stats);
+	if (sampleCount > 0)
+	{
+		(void)printf("Sensor bus: %.2f calls, %.2f transfers, %.1f us per sample\r\n",
+			(double)stats.Calls__u64 / sampleCount, (double)stats.Transfers__u64 / sampleCount,
+			(double)stats.Time_ns__u64 / 1000.0 / sampleCount);
+	}
+}
+
+/* Runs on the thread of the real-time sampler */
+static void sampleSensor(void* context, rt_sampler_sample_t* sample)
+{
+	uint8_t frame[SENSOR_MAX_FRAME_LEN];
+	float values[SENSOR_MAX_VALUES];
+	THERMOSTAT_READING reading;
+	int result;
+
+	(void)context;
+	event_trace_record(EVENT_TRACE_BEGIN, "read_raw", 0);
+	result = g_thermostatSensor->Read_raw__fp(g_thermostatBus, frame);
+	event_trace_record(EVENT_TRACE_END, "read_raw", 0);
+	if (result == 0)
+	{
+		event_trace_record(EVENT_TRACE_BEGIN, "decode", 0);
+		g_thermostatSensor->Decode__fp(frame, values);
+		event_trace_record(EVENT_TRACE_END, "decode", 0);
+	}
+	makeReading(&g_rtTimeService, result, values, sample->Time_us__u64, &reading);
+	sample->Result__i = reading.valid;
+	memcpy(sample->Frame__u8a, frame, g_thermostatSensor->Frame_len__z);
+	sample->Values__fa[0] = reading.tempC;
+	sample->Values__fa[1] = reading.pressurePa;
+	sample->Values__fa[2] = reading.humidityPct;
+	sample->Wall_time_us__u64 = reading.wallTimeUs;
+}
+
+/* What one poll of the sensor scheduler brought */
+typedef struct SENSOR_POLL_TAG
+{
+	MONITORED_DEVICE* device;
+	int hasReading;
+	THERMOSTAT_READING reading;
+} SENSOR_POLL;
+
+/* Sends a sample of a --sensor channel from the device the sensors are attached to, as a
+   message of its own on the bulk lane */
+static void publishSensorSample(MONITORED_DEVICE* device, const sensor_sample_t* sample, uint64_t wallTimeUs)
+{
+	const sensor_driver_t* driver = sensor_scheduler_driver(g_scheduler, sample->Channel__i);
+	char sampleTime[TIME_ISO8601_LEN];
+	char message[256];
+	size_t size;
+
+	if (sample->Result__i != 0)
+	{
+		printf("Failed to read the %s sensor\n", driver->Name__cp);
+	}
+	else
+	{
+		(void)time_format_iso8601(wallTimeUs, sampleTime, sizeof(sampleTime));
+		size = sensor_sample_format_json(driver, sample, device->deviceId, sampleTime, message, sizeof(message));
+		if (size == 0)
+		{
+			printf("Failed to format a sample of the %s sensor\n", driver->Name__cp);
+		}
+		else
+		{
+			(void)printf("Sending %s\n", message);
+			sendMessage(OUTBOX_LANE_BULK, device->client, (const unsigned char*)message, size, TELEMETRY_ENCODING_JSON, NULL, sample->Time_us__u64);
+		}
+	}
+}
+
+/* Readings are only sent while an upload of --duty-cycle is in progress */
+static int dutyCycleOffline(void)
+{
+	return g_options.dutyCycleMin > 0 && g_duty.state != DUTY_STATE_UPLOADING;
+}
+
+/* Returns the slot for a reading to keep until the next upload, or until the end of this one
+   if the reading is handed to the devices right away; a full buffer gives up its oldest reading */
+static DUTY_READING* dutyCycleKeep(int handed)
+{
+	if (g_duty.count == g_duty.capacity)
+	{
+		g_duty.first = (g_duty.first + 1) % g_duty.capacity;
+		g_duty.count--;
+		g_duty.dropped++;
+		if (g_duty.handed > 0)
+		{
+			g_duty.handed--;
+		}
+	}
+	if (handed)
+	{
+		g_duty.handed++;
+	}
+	return &g_duty.readings[(g_duty.first + g_duty.count++) % g_duty.capacity];
+}
+
+static uint64_t dutyReadingTimeUs(const DUTY_READING* kept)
+{
+	return (kept->channel == g_thermostatChannel) ? kept->u.thermostat.sampleTimeUs : kept->u.sensor.Time_us__u64;
+}
+
+/* The thermostat sensor feeds the Thermostat model of every device; the other channels are
+   published as they are, or kept until the next upload */
+static void onSensorSample(void* context, const sensor_sample_t* sample)
+{
+	SENSOR_POLL* poll = (SENSOR_POLL*)context;
+
+	if (sample->Channel__i == g_thermostatChannel)
+	{
+		makeReading(&g_timeService, sample->Result__i, sample->Values__fa, sample->Time_us__u64, &poll->reading);
+		recordFrame(&poll->reading, sample->Frame__u8a);
+		poll->hasReading = 1;
+	}
+	else
+	{
+		uint64_t wallTimeUs = wallClockUs(&g_timeService, sample->Time_us__u64);
+		if (g_readingsShm != NULL && sample->Result__i == 0)
+		{
+			readings_shm_publish(g_readingsShm, g_shmChannels[sample->Channel__i], wallTimeUs, sample->Time_us__u64, sample->Values__fa);
+		}
+		if (sample->Result__i == 0 && g_options.dutyCycleMin > 0)
+		{
+			DUTY_READING* kept = dutyCycleKeep(!dutyCycleOffline());
+			kept->channel = sample->Channel__i;
+			kept->wallTimeUs = wallTimeUs;
+			kept->u.sensor = *sample;
+		}
+		if (sample->Result__i != 0 || !dutyCycleOffline())
+		{
+			publishSensorSample(poll->device, sample, wallTimeUs);
+		}
+	}
+}
+
+/* Samples, failed reads and missed periods of the --sensor channels */
+static void printSensorStats(void)
+{
+	size_t i;
+
+	for (i = 0; i < sensor_scheduler_count(g_scheduler); i++)
+	{
+		if ((int)i != g_thermostatChannel)
+		{
+			sensor_channel_stats_t stats;
+			sensor_scheduler_get_stats(g_scheduler, (int)i, &stats);
+			(void)printf("Sensor %s: %llu samples, %llu failed, %llu periods missed\r\n",
+				sensor_scheduler_driver(g_scheduler, (int)i)->Name__cp, (unsigned long long)stats.Samples__u64,
+				(unsigned long long)stats.Failed__u64, (unsigned long long)stats.Missed__u64);
+		}
+	}
+}
+
+/* How late the sampler woke up for its deadlines */
+static void printSamplerStats(void)
+{
+	if (g_sampler != NULL)
+	{
+		rt_sampler_stats_t stats;
+		rt_sampler_get_stats(g_sampler, &stats);
+		(void)printf("Sampler wake-up latency: p50 %llu us, p99 %llu us, max %llu us; %llu samples, %llu periods missed, %llu samples dropped\r\n",
+			(unsigned long long)latency_histogram_percentile(&stats.Wakeup_latency_us__s, 50.0),
+			(unsigned long long)latency_histogram_percentile(&stats.Wakeup_latency_us__s, 99.0),
+			(unsigned long long)(stats.Samples__u64 > 0 ? stats.Wakeup_latency_us__s.Max__u64 : 0),
+			(unsigned long long)stats.Samples__u64, (unsigned long long)stats.Missed__u64, (unsigned long long)stats.Dropped__u64);
+	}
+}
+
+static int replayFinished(void)
+{
+	return g_traceReader != NULL && sensor_trace_replay_position() >= sensor_trace_reader_count(g_traceReader);
+}
+
+/* Time between the telemetry samples sent */
+static unsigned int telemetryIntervalMs(void)
+{
+	DEVICE_STATE state;
+	(void)device_state_read(g_deviceState, &state);
+	return g_options.intervalSet ? g_options.intervalMs : state.telemetryIntervalS * 1000;
+}
+
+/* Time until the next sample. A replayed trace keeps the spacing it was recorded with,
+   measured from the start of the run so that slow sends do not add up, or runs at
+   maximum speed. --burst reads the sensor more often than telemetry is sent. */
+static unsigned int nextSampleDelayMs(uint64_t startUs)
+{
+	unsigned int result;
+
+	if (g_traceReader != NULL)
+	{
+		uint64_t firstUs, nextUs;
+		result = 0;
+		if (!g_options.replayMaxSpeed &&
+			sensor_trace_reader_record(g_traceReader, 0, &firstUs, NULL) == 0 &&
+			sensor_trace_reader_record(g_traceReader, sensor_trace_replay_position(), &nextUs, NULL) == 0 &&
+			nextUs > firstUs)
+		{
+			uint64_t elapsedUs = latency_clock_us() - startUs;
+			if (nextUs - firstUs > elapsedUs)
+			{
+				result = (unsigned int)((nextUs - firstUs - elapsedUs) / 1000);
+			}
+		}
+	}
+	else if (g_options.burstZ > 0)
+	{
+		result = g_options.burstMs;
+	}
+	else
+	{
+		result = telemetryIntervalMs();
+	}
+	return result;
+}
+
+/* Sleeps until the next sample, but hands queued telemetry over as soon as a connection returns */
+static void sleepDraining(unsigned int delayMs)
+{
+	uint64_t wakeUs = latency_clock_us() + delayMs * 1000ULL;
+	uint64_t nowUs;
+
+	while ((nowUs = latency_clock_us()) < wakeUs)
+	{
+		if (outbox_wait((unsigned int)((wakeUs - nowUs + 999) / 1000)))
+		{
+			outbox_drain();
+		}
+	}
+}
+
+/* A replayed trace and flat out sampling set the time of every sample of the thermostat
+   sensor themselves rather than keeping to a period */
+static uint32_t thermostatPeriodUs(unsigned int delayMs)
+{
+	return (g_traceReader != NULL || delayMs == 0 || delayMs >= UINT32_MAX / 1000) ? UINT32_MAX : delayMs * 1000;
+}
+
+/* Without --rt the thermostat sensor is a channel of the sensor scheduler like the others;
+   its first sample is taken right away */
+static int startThermostatChannel(void)
+{
+	g_thermostatChannel = sensor_scheduler_add(g_scheduler, g_thermostatSensor, g_thermostatBus,
+		thermostatPeriodUs(nextSampleDelayMs(latency_clock_us())));
+	if (g_thermostatChannel < 0)
+	{
+		printf("Failed to schedule the %s sensor\n", g_thermostatSensor->Name__cp);
+	}
+	return g_thermostatChannel >= 0;
+}
+
+/* After each sample of the thermostat sensor: follows changes of the TelemetryInterval twin
+   property, or moves the next sample to when the replayed trace or flat out sampling want it */
+static void scheduleThermostat(uint64_t startUs)
+{
+	unsigned int delayMs = nextSampleDelayMs(startUs);
+	uint32_t periodUs = thermostatPeriodUs(delayMs);
+
+	sensor_scheduler_set_period(g_scheduler, g_thermostatChannel, periodUs);
+	if (periodUs == UINT32_MAX)
+	{
+		sensor_scheduler_set_due(g_scheduler, g_thermostatChannel, latency_clock_us() + delayMs * 1000ULL);
+	}
+}
+
+/* Sleeps until the sensor scheduler has a step due, at most for the poll interval of the
+   real-time sampler */
+static void waitForSensors(void)
+{
+	uint64_t nextUs = sensor_scheduler_next_us(g_scheduler);
+	uint64_t nowUs = latency_clock_us();
+	uint64_t delayMs;
+	/* An upload of --duty-cycle is stepped from the sampling loop */
+	int uploading = g_options.dutyCycleMin > 0 && g_duty.state != DUTY_STATE_OFFLINE;
+
+	if (g_options.dutyCycleMin > 0 && g_duty.state == DUTY_STATE_OFFLINE && g_duty.nextUs < nextUs)
+	{
+		nextUs = g_duty.nextUs;
+	}
+	delayMs = (nextUs > nowUs) ? (nextUs - nowUs + 999) / 1000 : 0;
+	if ((g_sampler != NULL || uploading) && delayMs > Sampler_poll_ms)
+	{
+		delayMs = Sampler_poll_ms;
+	}
+	if (delayMs > 0)
+	{
+		sleepDraining((delayMs > UINT_MAX) ? UINT_MAX : (unsigned int)delayMs);
+	}
+}
+
+/* In real-time mode the sensor is read on a thread of its own, pinned and at SCHED_FIFO
+   priority, at the interval in force when sampling starts */
+static int startSampler(void)
+{
+	rt_sampler_config_t config;
+	unsigned int delayMs = nextSampleDelayMs(0);
+	/* Longer intervals than the period can hold, about 71 minutes, are sampled at that */
+	config.Period_us__u32 = (delayMs >= UINT32_MAX / 1000) ? UINT32_MAX : delayMs * 1000;
+	config.Cpu__i = g_options.rtCpu;
+	config.Priority__i = (int)g_options.rtPriority;
+	config.Lock_memory__i = 1;
+
+	if (g_thermostatSensor->Frame_len__z > RT_SAMPLER_FRAME_LEN)
+	{
+		printf("The %s sensor reads more bytes than the real-time sampler keeps\n", g_thermostatSensor->Name__cp);
+		return 0;
+	}
+	g_sampler = rt_sampler_start(&config, sampleSensor, NULL);
+	if (g_sampler == NULL)
+	{
+		printf("Failed to start the real-time sampler: %s\n", strerror(errno));
+	}
+	return g_sampler != NULL;
+}
+
+/* Queues the telemetry of a reading of the thermostat sensor for every connected device;
+   simulated devices report their own readings for the time of it */
+static void sampleDevices(const THERMOSTAT_READING* reading, uint64_t startUs)
+{
+	size_t i;
+
+	for (i = 0; i < g_deviceCount; i++)
+	{
+		MONITORED_DEVICE* device = &g_devices[i];
+		if (device->client == NULL)
+		{
+			continue;
+		}
+
+		if (device->simulated)
+		{
+			double simTempC, simPressurePa, simHumidityPct;
+			bme280_sim_readings((uint32_t)i, (double)(reading->sampleTimeUs - startUs) / 1e6, &simTempC, &simPressurePa, &simHumidityPct);
+			sampleDevice(device, 1, (float)simTempC, (float)simHumidityPct, reading->sampleTimeUs, reading->wallTimeUs);
+		}
+		else
+		{
+			sampleDevice(device, reading->valid, reading->tempC, reading->humidityPct, reading->sampleTimeUs, reading->wallTimeUs);
+		}
+	}
+}
+
+/* Keeps a reading of the thermostat sensor in the history and sends it, or keeps it until
+   the next upload of --duty-cycle */
+static void sendReading(const THERMOSTAT_READING* reading, uint64_t startUs, uint64_t* historyFlushUs)
+{
+	if (reading->valid)
+	{
+		printf("Read Sensor Data: Humidity = %.1f%% Temperature = %.1f*C \n",
+			reading->humidityPct, reading->tempC);
+
+		if (g_historian != NULL)
+		{
+			float values[HISTORIAN_MEASUREMENTS] = { reading->tempC, reading->humidityPct, reading->pressurePa };
+			if (historian_add(g_historian, reading->wallTimeUs, values) != 0)
+			{
+				printf("Sample not added to the history\n");
+			}
+			/* Partly filled blocks are rewritten on every flush, so not too often */
+			if (g_options.historyFlushS > 0 && reading->sampleTimeUs - *historyFlushUs >= g_options.historyFlushS * 1000000ULL)
+			{
+				(void)historian_flush(g_historian);
+				*historyFlushUs = reading->sampleTimeUs;
+			}
+		}
+	}
+
+	if (g_options.dutyCycleMin > 0)
+	{
+		DUTY_READING* kept = dutyCycleKeep(!dutyCycleOffline());
+		kept->channel = g_thermostatChannel;
+		kept->wallTimeUs = reading->wallTimeUs;
+		kept->u.thermostat = *reading;
+	}
+	if (!dutyCycleOffline())
+	{
+		sampleDevices(reading, startUs);
+		g_duty.uploaded++;
+	}
+}
+
+/* Scores a reading against the baseline of each quantity.
+   Return: the index of the quantity furthest from its baseline if that is an anomaly, otherwise -1 */
+static int burstDetect(const THERMOSTAT_READING* reading, double* value, double* zScore)
+{
+	double values[BURST_QUANTITIES] = { reading->tempC, reading->pressurePa, reading->humidityPct };
+	int result = -1;
+	int i;
+
+	*value = 0;
+	*zScore = 0;
+	for (i = 0; i < BURST_QUANTITIES; i++)
+	{
+		double z;
+		/* -300 is a quantity the sensor does not have */
+		if (values[i] != -300.0f && anomaly_detector_update(&g_burst.detectors[i], values[i], &z) &&
+			fabs(z) > fabs(*zScore))
+		{
+			*value = values[i];
+			*zScore = z;
+			result = i;
+		}
+	}
+	return result;
+}
+
+/* Sends a reading of a burst */
+static void burstSend(const THERMOSTAT_READING* reading, uint64_t startUs, uint64_t* historyFlushUs)
+{
+	sendReading(reading, startUs, historyFlushUs);
+	g_burst.sent++;
+	g_burst.sentInBursts++;
+}
+
+/* Decides what to do with a reading of the thermostat sensor under --burst.
+   Return: the readings sent, this one and those of the ring */
+static unsigned int burstStep(const THERMOSTAT_READING* reading, uint64_t startUs, uint64_t* historyFlushUs)
+{
+	unsigned int sent = 0;
+	double value;
+	double zScore;
+	int quantity = reading->valid ? burstDetect(reading, &value, &zScore) : -1;
+
+	g_burst.taken++;
+	if (quantity >= 0)
+	{
+		event_trace_record(EVENT_TRACE_INSTANT, "anomaly", (uint64_t)quantity);
+		if (g_burst.state == BURST_STATE_ARMED)
+		{
+			g_burst.bursts++;
+			printf("Anomaly: %s %.2f is %.1f standard deviations off its baseline, sending every reading for %u s\n",
+				burstQuantityNames[quantity], value, zScore, g_options.burstPostS);
+			if (g_thermostatSensor == &sensor_driver_bme280 && bme280_set_profile(BME280_PROFILE_FAST) != 0)
+			{
+				printf("Failed to switch the sensor to its fast profile\n");
+			}
+			g_burst.state = BURST_STATE_CAPTURING;
+			/* What led up to the anomaly, oldest first, as far as not sent already */
+			while (g_burst.count > 0)
+			{
+				const BURST_READING* kept = &g_burst.readings[g_burst.first];
+				g_burst.first = (g_burst.first + 1) % g_burst.capacity;
+				g_burst.count--;
+				if (!kept->sent)
+				{
+					burstSend(&kept->reading, startUs, historyFlushUs);
+					sent++;
+				}
+			}
+		}
+		/* Every anomaly keeps the burst going */
+		g_burst.endUs = reading->sampleTimeUs + g_options.burstPostS * 1000000ULL;
+	}
+
+	if (g_burst.state == BURST_STATE_CAPTURING)
+	{
+		burstSend(reading, startUs, historyFlushUs);
+		sent++;
+		if (reading->sampleTimeUs >= g_burst.endUs)
+		{
+			if (g_thermostatSensor == &sensor_driver_bme280 && bme280_set_profile(BME280_PROFILE_DEFAULT) != 0)
+			{
+				printf("Failed to switch the sensor back to its default profile\n");
+			}
+			g_burst.state = BURST_STATE_ARMED;
+			g_burst.nextSendUs = reading->sampleTimeUs + telemetryIntervalMs() * 1000ULL;
+			printf("Burst %u ended, back to a reading every %u ms\n", g_burst.bursts, telemetryIntervalMs());
+		}
+	}
+	else
+	{
+		if (g_burst.count == g_burst.capacity)
+		{
+			g_burst.first = (g_burst.first + 1) % g_burst.capacity;
+			g_burst.count--;
+		}
+		BURST_READING* kept = &g_burst.readings[(g_burst.first + g_burst.count++) % g_burst.capacity];
+		kept->reading = *reading;
+		kept->sent = 0;
+
+		/* Half a period early rather than a whole one late */
+		if (reading->sampleTimeUs + g_options.burstMs * 500ULL >= g_burst.nextSendUs)
+		{
+			sendReading(reading, startUs, historyFlushUs);
+			kept->sent = 1;
+			g_burst.nextSendUs = reading->sampleTimeUs + telemetryIntervalMs() * 1000ULL;
+			g_burst.sent++;
+			sent++;
+		}
+	}
+	return sent;
+}
+
+static void printBurstStats(void)
+{
+	(void)printf("Burst capture: %u bursts, %llu readings taken, %llu sent, %llu of them in bursts%s\r\n",
+		g_burst.bursts, (unsigned long long)g_burst.taken, (unsigned long long)g_burst.sent,
+		(unsigned long long)g_burst.sentInBursts, (g_burst.state == BURST_STATE_CAPTURING) ? ", capturing" : "");
+}
+
+static uint64_t reportedBytesSent(void)
+{
+	uint64_t bytes = 0;
+	size_t i;
+
+	for (i = 0; i < g_deviceCount; i++)
+	{
+		if (g_devices[i].reported != NULL)
+		{
+			reported_state_stats_t stats;
+			reported_state_get_stats(g_devices[i].reported, &stats);
+			bytes += stats.bytesSent;
+		}
+	}
+	return bytes;
+}
+
+/* Closes every connection and prints what the upload cost. The readings handed to the devices
+   leave the buffer, except those from the sample time of the oldest message that did not arrive
+   on, which are sent again with the next cycle; sending some twice is better than losing them.
+   Unless the upload started, all readings stay. */
+static void dutyCycleEnd(uint64_t nowUs)
+{
+	int uploaded = (g_duty.state == DUTY_STATE_UPLOADING);
+	size_t unconfirmed = outbox_pending();
+	uint64_t messageBytes = g_messageBytes - g_duty.messageBytes;
+	uint64_t reportedBytes = reportedBytesSent() - g_duty.reportedBytes;
+	uint64_t radioOnUs;
+	uint64_t lostSinceUs;
+	size_t i;
+
+	for (i = 0; i < g_deviceCount; i++)
+	{
+		/* A DeviceInfo that never left goes out with the next upload */
+		if (disconnectDevice(&g_devices[i]) > 0 && !uploaded)
+		{
+			g_devices[i].deviceInfoSent = 0;
+		}
+	}
+	if (g_transport != NULL)
+	{
+		IoTHubTransport_Destroy(g_transport);
+		g_transport = NULL;
+	}
+	radioOnUs = latency_clock_us() - g_duty.beginUs;
+	g_duty.radioOnUs += radioOnUs;
+	g_duty.state = DUTY_STATE_OFFLINE;
+
+	/* Destroying the clients has failed the confirmations of the messages still in flight */
+	lostSinceUs = outbox_take_lost();
+	while (g_duty.handed > 0 && dutyReadingTimeUs(&g_duty.readings[g_duty.first]) < lostSinceUs)
+	{
+		g_duty.first = (g_duty.first + 1) % g_duty.capacity;
+		g_duty.count--;
+		g_duty.handed--;
+	}
+
+	if (uploaded)
+	{
+		g_duty.bytes += messageBytes + reportedBytes;
+		(void)printf("Duty cycle %u: connected in %.1f s, uploaded %u readings in %u messages, %llu bytes of telemetry and %llu of reported properties, %u unconfirmed, radio on %.1f s\r\n",
+			g_duty.cycle, (double)(g_duty.connectedUs - g_duty.beginUs) / 1e6, (unsigned int)g_duty.uploaded,
+			(unsigned int)(g_messageCount - g_duty.messageCount), (unsigned long long)messageBytes,
+			(unsigned long long)reportedBytes, (unsigned int)unconfirmed, (double)radioOnUs / 1e6);
+		if (g_duty.handed > 0)
+		{
+			(void)printf("Duty cycle %u: %u readings uploaded without confirmation are sent again with the next cycle\r\n",
+				g_duty.cycle, (unsigned int)g_duty.handed);
+		}
+	}
+	else
+	{
+		g_duty.failed++;
+		(void)printf("Duty cycle %u: not connected after %.1f s, %u readings wait for the next cycle, radio on %.1f s\r\n",
+			g_duty.cycle, (double)(nowUs - g_duty.beginUs) / 1e6, (unsigned int)g_duty.count, (double)radioOnUs / 1e6);
+	}
+	g_duty.handed = 0;
+}
+
+/* Opens the connections of every device for an upload. The readings stay in the buffer
+   until all devices are authenticated. */
+static void dutyCycleBegin(uint64_t nowUs)
+{
+	size_t i;
+	size_t started = 0;
+
+	g_duty.state = DUTY_STATE_CONNECTING;
+	g_duty.cycle++;
+	g_duty.beginUs = nowUs;
+	g_duty.nextUs = nowUs + g_options.dutyCycleMin * 60000000ULL;
+	g_duty.uploaded = 0;
+	g_duty.messageCount = g_messageCount;
+	g_duty.messageBytes = g_messageBytes;
+	g_duty.reportedBytes = reportedBytesSent();
+	/* Only what this upload loses counts for its readings */
+	(void)outbox_take_lost();
+	printf("Duty cycle %u: connecting to upload %u readings\n", g_duty.cycle, (unsigned int)g_duty.count);
+	for (i = 0; i < g_deviceCount; i++)
+	{
+		if (startDevice(&g_devices[i]) == 0)
+		{
+			started++;
+		}
+		else
+		{
+			(void)disconnectDevice(&g_devices[i]);
+		}
+	}
+	if (started == 0)
+	{
+		printf("Duty cycle %u: no device could be started\n", g_duty.cycle);
+		dutyCycleEnd(nowUs);
+	}
+}
+
+/* Hands the readings kept since the last upload to the connected devices, oldest first; they
+   stay in the buffer until the upload ends */
+static void dutyCycleUpload(MONITORED_DEVICE* sensorDevice, uint64_t startUs)
+{
+	while (g_duty.handed < g_duty.count)
+	{
+		DUTY_READING* kept = &g_duty.readings[(g_duty.first + g_duty.handed) % g_duty.capacity];
+		if (kept->channel == g_thermostatChannel)
+		{
+			sampleDevices(&kept->u.thermostat, startUs);
+		}
+		else if (sensorDevice->client != NULL)
+		{
+			publishSensorSample(sensorDevice, &kept->u.sensor, kept->wallTimeUs);
+		}
+		g_duty.handed++;
+		g_duty.uploaded++;
+		outbox_drain();
+	}
+}
+
+/* Takes an upload of --duty-cycle one step further; called from the sampling loop, which keeps
+   sampling meanwhile */
+static void dutyCycleStep(MONITORED_DEVICE* sensorDevice, uint64_t startUs)
+{
+	uint64_t nowUs = latency_clock_us();
+	size_t i;
+
+	if (g_duty.state == DUTY_STATE_OFFLINE)
+	{
+		if (nowUs >= g_duty.nextUs)
+		{
+			dutyCycleBegin(nowUs);
+		}
+	}
+	else if (g_duty.state == DUTY_STATE_CONNECTING)
+	{
+		size_t connected = 0;
+		size_t started = 0;
+		for (i = 0; i < g_deviceCount; i++)
+		{
+			if (g_devices[i].client != NULL)
+			{
+				started++;
+				connected += __atomic_load_n(&g_devices[i].authenticated, __ATOMIC_ACQUIRE) ? 1 : 0;
+			}
+		}
+		if (connected < started && nowUs - g_duty.beginUs >= Duty_connect_timeout_ms * 1000ULL)
+		{
+			/* Upload through the devices that made it, if any */
+			for (i = 0; connected > 0 && i < g_deviceCount; i++)
+			{
+				if (g_devices[i].client != NULL && !__atomic_load_n(&g_devices[i].authenticated, __ATOMIC_ACQUIRE))
+				{
+					printf("%s: not connected after %u s, left out of this upload\n", g_devices[i].deviceId, Duty_connect_timeout_ms / 1000);
+					(void)disconnectDevice(&g_devices[i]);
+				}
+			}
+			started = connected;
+		}
+		if (started == 0)
+		{
+			dutyCycleEnd(nowUs);
+		}
+		else if (connected == started)
+		{
+			g_duty.state = DUTY_STATE_UPLOADING;
+			g_duty.connectedUs = nowUs;
+			g_duty.syncedUs = nowUs + Duty_twin_sync_ms * 1000ULL;
+			latency_histogram_record(&g_duty.connectTime, nowUs - g_duty.beginUs);
+			dutyCycleUpload(sensorDevice, startUs);
+		}
+	}
+	else
+	{
+		DEVICE_STATE state;
+		int sending = 0;
+
+		outbox_drain();
+		for (i = 0; i < g_deviceCount; i++)
+		{
+			if (g_devices[i].client != NULL && g_devices[i].reported != NULL)
+			{
+				(void)reported_state_flush(g_devices[i].reported, 0);
+			}
+		}
+		(void)device_state_read(g_deviceState, &state);
+		/* A firmware update reports its progress until the Pi reboots */
+		if (state.firmwareUpdating)
+		{
+			return;
+		}
+		if (nowUs >= g_duty.syncedUs && outbox_pending() == 0 && __atomic_load_n(&g_reportedInFlight, __ATOMIC_RELAXED) == 0)
+		{
+			/* Nothing is left for the next cycle in a partly filled batch or the reported state */
+			for (i = 0; i < g_deviceCount; i++)
+			{
+				MONITORED_DEVICE* device = &g_devices[i];
+				if (device->client != NULL && device->batch.count > 0)
+				{
+					sendTelemetryBatch(device);
+					sending = 1;
+				}
+				if (device->client != NULL && device->reported != NULL)
+				{
+					(void)reported_state_flush(device->reported, 1);
+				}
+			}
+			outbox_drain();
+			sending = sending || __atomic_load_n(&g_reportedInFlight, __ATOMIC_RELAXED) > 0;
+			if (!sending)
+			{
+				dutyCycleEnd(nowUs);
+			}
+		}
+		else if (nowUs - g_duty.connectedUs >= (Duty_twin_sync_ms + Confirmation_timeout_ms) * 1000ULL)
+		{
+			dutyCycleEnd(nowUs);
+		}
+	}
+}
+
+/* Radio time, failed cycles and bytes of all uploads of --duty-cycle */
+static void printDutyCycleStats(uint64_t startUs)
+{
+	uint64_t runUs = latency_clock_us() - startUs;
+
+	(void)printf("Duty cycling: %u uploads, %u failed, radio on %.1f s of %.1f s (%.1f%%), time to connect p50 %.1f s max %.1f s, %llu bytes sent, %llu readings dropped from a full buffer, %u not uploaded yet\r\n",
+		g_duty.cycle, g_duty.failed, (double)g_duty.radioOnUs / 1e6, (double)runUs / 1e6,
+		(runUs > 0) ? 100.0 * (double)g_duty.radioOnUs / (double)runUs : 0.0,
+		(double)latency_histogram_percentile(&g_duty.connectTime, 50) / 1e6,
+		(double)g_duty.connectTime.Max__u64 / 1e6, (unsigned long long)g_duty.bytes,
+		(unsigned long long)g_duty.dropped, (unsigned int)g_duty.count);
+}
+
+void remote_monitoring_run(void)
+{
+	if (platform_init() != 0)
+	{
+		printf("Failed to initialize the platform.\n");
+	}
+	else if (g_options.compression != PAYLOAD_COMPRESSION_NONE &&
+		(g_compressor = payload_compressor_create(Compression_level)) == NULL)
+	{
+		printf("Failed to create the payload compressor.\n");
+	}
+	else
+	{
+		if (SERIALIZER_REGISTER_NAMESPACE(Contoso) == NULL)
+		{
+			printf("Unable to SERIALIZER_REGISTER_NAMESPACE\n");
+		}
+		else if (loadDevices() != 0)
+		{
+			printf("Failed to load the devices\n");
+		}
+		else if (g_options.trustedCertsFile != NULL && (g_trustedCerts = ReadTextFile(g_options.trustedCertsFile)) == NULL)
+		{
+			printf("Failed to read the trusted certificates\n");
+			freeDevices();
+		}
+		else
+		{
+			size_t i;
+			MONITORED_DEVICE* primary = NULL;
+
+			(void)outbox_init(g_options.bulkWindow, g_options.outboxCapacity);
+			if (g_options.dutyCycleMin > 0)
+			{
+				/* The first upload connects right away, for the desired properties */
+				dutyCycleBegin(latency_clock_us());
+			}
+			else
+			{
+				for (i = 0; i < g_deviceCount; i++)
+				{
+					if (startDevice(&g_devices[i]) != 0)
+					{
+						stopDevice(&g_devices[i]);
+					}
+				}
+			}
+			for (i = 0; i < g_deviceCount && primary == NULL; i++)
+			{
+				if (g_devices[i].client != NULL)
+				{
+					primary = &g_devices[i];
+				}
+			}
+
+			if (primary == NULL)
+			{
+				printf("No device could be started\n");
+			}
+			else
+			{
+				outbox_drain();
+
+				/* Send telemetry; all devices are sampled at the desired telemetry interval,
+				   the channels of --sensor at their own periods */
+				uint64_t startUs = latency_clock_us();
+				uint64_t historyFlushUs = startUs;
+				unsigned int sampleCount = 0;
+				/* Less than sampleCount with --burst */
+				unsigned int sentCount = 0;
+				unsigned int statsCount = 0;
+				SENSOR_POLL poll;
+				poll.device = primary;
+				bme280_reset_bus_stats();
+				int sampling = g_options.rt ? startSampler() : startThermostatChannel();
+				while (sampling && (g_options.sampleLimit == 0 || sampleCount < g_options.sampleLimit) && !replayFinished())
+				{
+					THERMOSTAT_READING* reading = &poll.reading;
+
+					poll.hasReading = 0;
+					if (g_sampler != NULL)
+					{
+						rt_sampler_sample_t sample;
+						if (rt_sampler_pop(g_sampler, &sample))
+						{
+							reading->valid = sample.Result__i;
+							reading->tempC = sample.Values__fa[0];
+							reading->pressurePa = sample.Values__fa[1];
+							reading->humidityPct = sample.Values__fa[2];
+							reading->wallTimeUs = sample.Wall_time_us__u64;
+							reading->sampleTimeUs = sample.Time_us__u64;
+							recordFrame(reading, sample.Frame__u8a);
+							poll.hasReading = 1;
+						}
+					}
+					(void)sensor_scheduler_poll(g_scheduler, latency_clock_us(), onSensorSample, &poll);
+					if (g_options.dutyCycleMin > 0)
+					{
+						dutyCycleStep(primary, startUs);
+					}
+					if (g_traceDumpRequested)
+					{
+						uint32_t events;
+						g_traceDumpRequested = 0;
+						(void)writeTrace(&events);
+					}
+					if (!poll.hasReading)
+					{
+						outbox_drain();
+						waitForSensors();
+						continue;
+					}
+
+					event_trace_record(EVENT_TRACE_BEGIN, "reading", sampleCount);
+					if (g_options.burstZ > 0)
+					{
+						sentCount += burstStep(reading, startUs, &historyFlushUs);
+					}
+					else
+					{
+						sendReading(reading, startUs, &historyFlushUs);
+						sentCount++;
+					}
+					outbox_drain();
+					for (i = 0; i < g_deviceCount; i++)
+					{
+						if (g_devices[i].client != NULL && g_devices[i].reported != NULL && outbox_is_connected(g_devices[i].client))
+						{
+							(void)reported_state_flush(g_devices[i].reported, 0);
+						}
+					}
+					event_trace_record(EVENT_TRACE_END, "reading", 0);
+
+					sampleCount++;
+					if (sentCount >= statsCount + 20)
+					{
+						statsCount = sentCount;
+						outbox_print_stats();
+						if (g_options.dutyCycleMin > 0)
+						{
+							printDutyCycleStats(startUs);
+						}
+						if (g_options.burstZ > 0)
+						{
+							printBurstStats();
+						}
+						printBusStats(sampleCount);
+						printSamplerStats();
+						printSensorStats();
+					}
+
+					if (g_sampler == NULL)
+					{
+						scheduleThermostat(startUs);
+					}
+				}
+				if (g_sampler != NULL)
+				{
+					printSamplerStats();
+					rt_sampler_stop(g_sampler);
+					g_sampler = NULL;
+				}
+
+				/* Only reached with a sample limit or at the end of a replayed trace:
+				   upload what was read since the last upload of --duty-cycle, or send what
+				   is batched and wait for the confirmations */
+				if (g_options.dutyCycleMin > 0)
+				{
+					if (g_duty.state == DUTY_STATE_OFFLINE && g_duty.count > 0)
+					{
+						dutyCycleBegin(latency_clock_us());
+					}
+					while (g_duty.state != DUTY_STATE_OFFLINE)
+					{
+						dutyCycleStep(primary, startUs);
+						ThreadAPI_Sleep(10);
+					}
+				}
+				for (i = 0; i < g_deviceCount; i++)
+				{
+					if (g_devices[i].client != NULL && g_devices[i].batch.count > 0)
+					{
+						sendTelemetryBatch(&g_devices[i]);
+					}
+				}
+				uint64_t deadlineUs = latency_clock_us() + Confirmation_timeout_ms * 1000ULL;
+				while (outbox_pending() > 0 && latency_clock_us() < deadlineUs)
+				{
+					outbox_drain();
+					ThreadAPI_Sleep(10);
+				}
+				(void)printf("Sent %u samples per device in %.3f s, %u messages unconfirmed\r\n",
+					sentCount, (double)(latency_clock_us() - startUs) / 1e6, (unsigned int)outbox_pending());
+				outbox_print_stats();
+				printBusStats(sampleCount);
+				printSensorStats();
+				if (g_options.dutyCycleMin > 0)
+				{
+					printDutyCycleStats(startUs);
+				}
+				if (g_options.burstZ > 0)
+				{
+					printBurstStats();
+				}
+			}
+
+			for (i = 0; i < g_deviceCount; i++)
+			{
+				stopDevice(&g_devices[i]);
+			}
+			if (g_transport != NULL)
+			{
+				IoTHubTransport_Destroy(g_transport);
+				g_transport = NULL;
+			}
+			outbox_deinit();
+			freeDevices();
+			free(g_trustedCerts);
+		}
+		serializer_deinit();
+		payload_compressor_destroy(g_compressor);
+	}
+	platform_deinit();
+}
+
+/* The simulated BME280 needs neither the lock file, root nor the SPI bus */
+static int remote_monitoring_init_simulated(void)
+{
+	int result;
+
+	Lock_fd = -1;
+	bme280_sim_install();
+	if (g_thermostatSensor->Init__fp(g_thermostatBus) != 0)
+	{
+		printf("Failed to initialize the simulated BME280\n");
+		result = 1;
+	}
+	else
+	{
+		printf("Using the simulated BME280 instead of the sensor\n");
+		result = 0;
+	}
+	return result;
+}
+
+/* Neither does a replayed trace: the driver reads the recorded calibration and frames */
+static int remote_monitoring_init_replay(void)
+{
+	int result;
+
+	Lock_fd = -1;
+	g_traceReader = sensor_trace_reader_open(g_options.replayFile);
+	if (g_traceReader == NULL)
+	{
+		printf("Failed to open the sensor trace %s\n", g_options.replayFile);
+		result = 1;
+	}
+	else
+	{
+		sensor_trace_replay_install(g_traceReader);
+		if (g_thermostatSensor->Init__fp(g_thermostatBus) != 0)
+		{
+			printf("Failed to initialize the BME280 from the sensor trace\n");
+			result = 1;
+		}
+		else
+		{
+			printf("Replaying %u sensor frames from %s\n", (unsigned int)sensor_trace_reader_count(g_traceReader), g_options.replayFile);
+			result = 0;
+		}
+	}
+	return result;
+}
+
+/* The SPI backend of the sensor: wiringPi, or spidev with the reads of a sample chained into one ioctl */
+static int openSpi(void)
+{
+	int result;
+
+	if (g_options.spidev)
+	{
+		result = bme280_spidev_open(g_thermostatBus, Spi_clock);
+		if (result != 0)
+		{
+			printf("Can't open /dev/spidev0.%i at %i Hz (is SPI enabled?)\n", g_thermostatBus, Spi_clock);
+		}
+	}
+	else
+	{
+		result = wiringPiSPISetup(g_thermostatBus, Spi_clock);
+		if (result < 0)
+		{
+			printf("Can't setup SPI, error %i calling wiringPiSPISetup(%i, %i)  %sn",
+				result, g_thermostatBus, Spi_clock, strerror(result));
+		}
+		else
+		{
+			result = 0;
+		}
+	}
+	return result;
+}
+
+/* Reads and prints one sample of the thermostat sensor, to show that it answers */
+static int readFirstSample(void)
+{
+	uint8_t frame[SENSOR_MAX_FRAME_LEN];
+	float values[SENSOR_MAX_VALUES];
+	int result = 0;
+	size_t i;
+
+	if (g_thermostatSensor->Start__fp != NULL)
+	{
+		result = g_thermostatSensor->Start__fp(g_thermostatBus);
+		ThreadAPI_Sleep((g_thermostatSensor->Conversion_us__u32 + 999) / 1000);
+	}
+	if (result == 0)
+	{
+		result = g_thermostatSensor->Read_raw__fp(g_thermostatBus, frame);
+	}
+	if (result == 0)
+	{
+		g_thermostatSensor->Decode__fp(frame, values);
+		for (i = 0; i < g_thermostatSensor->Value_count__z; i++)
+		{
+			printf("%s%s = %.1f", (i > 0) ? "  " : "", g_thermostatSensor->Value_names__cpp[i], values[i]);
+		}
+		printf("\n");
+	}
+	return result;
+}
+
+static int remote_monitoring_init_sensor(void)
+{
+	int result;
+
+	Lock_fd = open_lockfile(LOCKFILE);
+
+	if (setuid(getuid()) < 0)
+	{
+		perror("Dropping privileges failed. (did you use sudo?)n");
+		result = EXIT_FAILURE;
+	}
+	else
+	{
+		result = wiringPiSetup();
+		if (result != 0)
+		{
+			perror("Wiring Pi setup failed.");
+		}
+		else
+		{
+			/* Only the BME280 is on the SPI bus */
+			result = (g_thermostatSensor == &sensor_driver_bme280) ? openSpi() : 0;
+			if (result != 0)
+			{
+				printf("Aborting.\n");
+			}
+			else if (g_thermostatSensor->Init__fp != NULL && g_thermostatSensor->Init__fp(g_thermostatBus) != 0)
+			{
+				printf("It appears that no %s sensor on bus %i is attached. Aborting.\n", g_thermostatSensor->Name__cp, g_thermostatBus);
+				result = 1;
+			}
+			else if (readFirstSample() != 0)
+			{
+				printf("Unable to read the %s sensor on bus %i. Aborting.\n", g_thermostatSensor->Name__cp, g_thermostatBus);
+				result = 1;
+			}
+		}
+	}
+	return result;
+}
+
+static int sensorValueIndex(const sensor_driver_t* driver, const char* name)
+{
+	size_t i;
+	for (i = 0; i < driver->Value_count__z; i++)
+	{
+		if (strcmp(driver->Value_names__cpp[i], name) == 0)
+		{
+			return (int)i;
+		}
+	}
+	return -1;
+}
+
+/* Finds the readings of the Thermostat model among the values of its sensor and initializes the
+   sensors of --sensor */
+static int initSensorChannels(void)
+{
+	int result = 0;
+	size_t i;
+
+	g_temperatureValue = sensorValueIndex(g_thermostatSensor, "Temperature");
+	g_pressureValue = sensorValueIndex(g_thermostatSensor, "Pressure");
+	g_humidityValue = sensorValueIndex(g_thermostatSensor, "Humidity");
+	g_scheduler = sensor_scheduler_create();
+	if (g_scheduler == NULL)
+	{
+		printf("Failed to create the sensor scheduler\n");
+		result = 1;
+	}
+
+	for (i = 0; result == 0 && i < g_options.sensorCount; i++)
+	{
+		const SENSOR_CHANNEL_OPTION* channel = &g_options.sensors[i];
+		if (channel->driver->Init__fp != NULL && channel->driver->Init__fp(channel->bus) != 0)
+		{
+			printf("Failed to initialize the %s sensor on bus %d\n", channel->driver->Name__cp, channel->bus);
+			result = 1;
+		}
+		else if (sensor_scheduler_add(g_scheduler, channel->driver, channel->bus, channel->periodMs * 1000) < 0)
+		{
+			printf("Failed to schedule the %s sensor\n", channel->driver->Name__cp);
+			result = 1;
+		}
+		else
+		{
+			printf("Sampling the %s sensor on bus %d every %u ms\n", channel->driver->Name__cp, channel->bus, channel->periodMs);
+		}
+	}
+	return result;
+}
+
+/* Creates the --shm object with a channel for the thermostat sensor and one for each sensor of
+   --sensor, in that order */
+static int initReadingsShm(void)
+{
+	size_t i;
+
+	g_readingsShm = readings_shm_create(g_options.shmName, g_options.shmSlots);
+	if (g_readingsShm == NULL)
+	{
+		printf("Failed to create the shared memory object %s: %s\n", g_options.shmName, strerror(errno));
+		return 1;
+	}
+	g_thermostatShmChannel = readings_shm_add_channel(g_readingsShm, g_thermostatSensor->Name__cp,
+		g_thermostatSensor->Value_count__z, g_thermostatSensor->Value_names__cpp);
+	for (i = 0; i < sensor_scheduler_count(g_scheduler); i++)
+	{
+		const sensor_driver_t* driver = sensor_scheduler_driver(g_scheduler, (int)i);
+		g_shmChannels[i] = readings_shm_add_channel(g_readingsShm, driver->Name__cp, driver->Value_count__z, driver->Value_names__cpp);
+	}
+	printf("Publishing the readings in shared memory as %s\n", g_options.shmName);
+	return 0;
+}
+
+static void onTraceSignal(int signal)
+{
+	(void)signal;
+	g_traceDumpRequested = 1;
+}
+
+int remote_monitoring_init(void)
+{
+	int result;
+	/* The TelemetryInterval the Thermostat model starts with */
+	DEVICE_STATE initialState = { .telemetryIntervalS = 3 };
+
+	time_service_init(&g_timeService);
+	time_service_init(&g_rtTimeService);
+	g_deviceState = device_state_create(&initialState, sizeof(initialState));
+	if (g_deviceState == NULL)
+	{
+		printf("Failed to create the device state\n");
+		result = 1;
+	}
+	else if (g_options.replayFile != NULL)
+	{
+		result = remote_monitoring_init_replay();
+	}
+	else if (g_options.simulate)
+	{
+		result = remote_monitoring_init_simulated();
+	}
+	else
+	{
+		result = remote_monitoring_init_sensor();
+	}
+
+	if (result == 0)
+	{
+		result = initSensorChannels();
+	}
+
+	if (result == 0 && g_options.calibrationSet && bme280_set_correction(&g_options.calibration) != 0)
+	{
+		printf("Failed to set the calibration\n");
+		result = 1;
+	}
+
+	if (result == 0 && g_options.shmName != NULL)
+	{
+		result = initReadingsShm();
+	}
+
+	if (result == 0 && g_options.dutyCycleMin > 0)
+	{
+		g_duty.capacity = g_options.dutyBufferReadings;
+		g_duty.readings = calloc(g_duty.capacity, sizeof(DUTY_READING));
+		if (g_duty.readings == NULL)
+		{
+			printf("Failed to allocate the buffer of %u readings for --duty-cycle\n", g_options.dutyBufferReadings);
+			result = 1;
+		}
+		latency_histogram_reset(&g_duty.connectTime);
+	}
+
+	if (result == 0 && g_options.burstZ > 0)
+	{
+		/* The baseline covers about Burst_baseline_s of readings and is learned over as long */
+		double alpha = (double)g_options.burstMs / (Burst_baseline_s * 1000.0);
+		size_t i;
+
+		if (alpha > 1.0)
+		{
+			alpha = 1.0;
+		}
+		for (i = 0; i < BURST_QUANTITIES; i++)
+		{
+			(void)anomaly_detector_init(&g_burst.detectors[i], alpha, g_options.burstZ, (uint32_t)(1.0 / alpha), Burst_min_stddev[i]);
+		}
+		g_burst.capacity = (size_t)g_options.burstPreS * 1000 / g_options.burstMs + 1;
+		g_burst.readings = calloc(g_burst.capacity, sizeof(BURST_READING));
+		if (g_burst.readings == NULL)
+		{
+			printf("Failed to allocate the buffer of %u readings for --burst\n", (unsigned int)g_burst.capacity);
+			result = 1;
+		}
+	}
+
+	if (result == 0 && g_options.traceEvents > 0)
+	{
+		struct sigaction action;
+
+		event_trace_name_thread("main");
+		memset(&action, 0, sizeof(action));
+		action.sa_handler = onTraceSignal;
+		(void)sigemptyset(&action.sa_mask);
+		if (event_trace_start(g_options.traceEvents) != 0)
+		{
+			printf("Failed to allocate the ring of %u events for --trace\n", g_options.traceEvents);
+			result = 1;
+		}
+		else if (sigaction(SIGUSR2, &action, NULL) != 0)
+		{
+			printf("Failed to install the SIGUSR2 handler of --trace\n");
+			result = 1;
+		}
+	}
+
+	if (result == 0 && g_options.recordFile != NULL)
+	{
+		uint8_t calibration[BME280_CALIB_LEN];
+		bme280_get_calibration(calibration);
+		g_traceWriter = sensor_trace_writer_open(g_options.recordFile, calibration);
+		if (g_traceWriter == NULL)
+		{
+			printf("Failed to open %s for recording, or it holds a trace of another sensor\n", g_options.recordFile);
+			result = 1;
+		}
+	}
+
+	if (result == 0 && g_options.historyDir != NULL)
+	{
+		g_historian = historian_open(g_options.historyDir, NULL, 0);
+		if (g_historian == NULL)
+		{
+			printf("Failed to open the history in %s\n", g_options.historyDir);
+			result = 1;
+		}
+	}
+	return result;
+}
+
+static void remote_monitoring_deinit(void)
+{
+	bme280_spidev_close();
+	historian_close(g_historian);
+	g_historian = NULL;
+	sensor_trace_writer_close(g_traceWriter);
+	g_traceWriter = NULL;
+	sensor_trace_reader_close(g_traceReader);
+	g_traceReader = NULL;
+	sensor_scheduler_destroy(g_scheduler);
+	g_scheduler = NULL;
+	readings_shm_destroy(g_readingsShm);
+	g_readingsShm = NULL;
+	device_state_destroy(g_deviceState);
+	g_deviceState = NULL;
+	free(g_duty.readings);
+	g_duty.readings = NULL;
+	free(g_burst.readings);
+	g_burst.readings = NULL;
+	event_trace_stop();
+}
+
+static const TRANSPORT_NAME* findTransport(const char* name)
+{
+	size_t i;
+	for (i = 0; i < sizeof(transportNames) / sizeof(transportNames[0]); i++)
+	{
+		if (strcmp(name, transportNames[i].name) == 0)
+		{
+			return &transportNames[i];
+		}
+	}
+	return NULL;
+}
+
+static void remote_monitoring_usage(const char* program)
+{
+	const sensor_driver_t* driver;
+	size_t i;
+
+	printf("Usage: %s [options]\n", program);
+	printf("  --encoding json|cbor         encoding of telemetry messages (default json)\n");
+	printf("  --batch N                    send N samples per message (default 1)\n");
+	printf("  --compress none|deflate      compression of telemetry messages (default none)\n");
+	printf("  --compress-threshold BYTES   only compress messages of at least BYTES (default 256)\n");
+	printf("  --alert SPEC                 send an alert when a rule such as Temperature>30, Humidity<20\n");
+	printf("                               or Temperature~0.5 (change per second) is breached; repeatable\n");
+	printf("  --bulk-window N              telemetry messages in flight before the rest waits (default 4)\n");
+	printf("  --outbox-cap N               messages waiting per lane; beyond that the oldest are dropped\n");
+	printf("                               (default %u)\n", Outbox_lane_capacity);
+	printf("  --transport NAME             mqtt, mqtt-ws, amqp or amqp-ws, as far as built in (default mqtt,\n");
+	printf("                               amqp with --gateway)\n");
+	printf("  --gateway FILE               host every device listed in FILE over one shared AMQP connection\n");
+	printf("  --connection-string STRING   device connection string to use instead of the built-in one\n");
+	printf("  --trusted-certs FILE         PEM certificates to trust, e.g. of a local broker stand-in\n");
+	printf("  --thermostat-sensor NAME[@BUS]\n");
+	printf("                               sensor behind the Thermostat telemetry, which must read Temperature\n");
+	printf("                               and Humidity (default bme280@0, on chip select 0)\n");
+	printf("  --simulate                   read a simulated BME280 instead of the sensor on the SPI bus\n");
+	printf("  --interval-ms MS             time between samples, overriding the TelemetryInterval twin property\n");
+	printf("  --samples N                  stop after N samples and print the latency statistics\n");
+	printf("  --sensor NAME[@BUS][:MS]     also sample the sensor NAME on BUS (default 0) every MS milliseconds\n");
+	printf("                               (default %u) and send its readings in messages of their own;\n", Sensor_period_ms);
+	printf("                               repeatable. Sensors:");
+	for (i = 0; (driver = sensor_registry_get(i)) != NULL; i++)
+	{
+		if (driver != g_thermostatSensor)
+		{
+			printf(" %s", driver->Name__cp);
+		}
+	}
+	printf("\n");
+	printf("  --calibration SPEC           correct the BME280 readings, e.g. Temperature=-1.5;Humidity=20:22.5,80:78\n");
+	printf("                               (OFFSET, GAIN,OFFSET or IN:OUT,... per quantity); the Calibration\n");
+	printf("                               twin property replaces it\n");
+	printf("  --shm NAME                   publish every reading of every sensor in the shared memory object NAME\n");
+	printf("                               (e.g. /readings) for other processes; see readings_watch\n");
+	printf("  --shm-slots N                readings kept in the history of the --shm object (default %u)\n", Shm_slots);
+	printf("  --record FILE                append the raw sensor frames to the trace FILE\n");
+	printf("  --replay FILE                read the sensor frames of the trace FILE instead of the sensor\n");
+	printf("  --replay-speed realtime|max  replay with the recorded timing or as fast as possible (default realtime)\n");
+	printf("  --spi wiringpi|spidev        SPI backend of the sensor; spidev chains the reads of a sample into one ioctl (default wiringpi)\n");
+	printf("  --rt                         read the sensor on a thread of its own, at SCHED_FIFO priority with memory locked,\n");
+	printf("                               at the interval in force at start; needs root\n");
+	printf("  --rt-cpu N                   pin the --rt sampling thread to core N\n");
+	printf("  --rt-priority P              SCHED_FIFO priority of the --rt sampling thread, 0 for none (default 50)\n");
+	printf("  --retry-policy POLICY        reconnection policy: none, immediate, interval, linear, exponential,\n");
+	printf("                               exponential-jitter or random (default exponential-jitter)\n");
+	printf("  --retry-timeout-s S          give up reconnecting after S seconds, 0 for never (default 0)\n");
+	printf("  --twin-window-ms MS          merge reported property updates for MS before sending them (default 2000)\n");
+	printf("  --twin-cache DIR             remember the reported properties sent, in DIR/<device id>.twin.json,\n");
+	printf("                               so that a restart only sends what changed\n");
+	printf("  --history DIR                keep the readings on the device, in tier files in DIR\n");
+	printf("  --history-flush-s S          write partly filled history blocks every S seconds, 0 for only on exit (default 600)\n");
+	printf("  --duty-cycle MIN             only connect every MIN minutes, to upload the readings taken since and sync\n");
+	printf("                               the twin, and disconnect again; for sites on battery or solar power\n");
+	printf("  --duty-buffer N              readings kept between uploads of --duty-cycle; beyond that the oldest\n");
+	printf("                               are dropped (default %u)\n", Duty_buffer_readings);
+	printf("  --trace N                    record the last N pipeline events (sensor reads, serialization, hand-off\n");
+	printf("                               and confirmation of messages, twin and method callbacks) and write them\n");
+	printf("                               as a Chrome trace on SIGUSR2 or the DumpTrace direct method\n");
+	printf("  --trace-file FILE            where to write the trace (default %s)\n", Trace_file);
+	printf("  --burst Z                    read the sensor every --burst-ms but send a reading per telemetry interval,\n");
+	printf("                               until a reading is more than Z standard deviations off its baseline; then\n");
+	printf("                               send the readings around it at the full rate, with the sensor in its fast profile\n");
+	printf("  --burst-ms MS                time between readings of --burst (default 100)\n");
+	printf("  --burst-pre-s S              seconds of readings before an anomaly sent with it (default 10)\n");
+	printf("  --burst-post-s S             seconds of readings after the last anomaly sent (default 30)\n");
+}
+
+/* NAME[@BUS][:MS] of --sensor */
+static int parseSensorChannel(const char* spec, SENSOR_CHANNEL_OPTION* channel)
+{
+	char name[32];
+	size_t nameLength = strcspn(spec, "@:");
+	const char* rest = spec + nameLength;
+	char* end;
+	int result = 0;
+
+	channel->bus = 0;
+	channel->periodMs = Sensor_period_ms;
+	if (nameLength == 0 || nameLength >= sizeof(name))
+	{
+		printf("Invalid sensor: %s\n", spec);
+		return 1;
+	}
+	(void)memcpy(name, spec, nameLength);
+	name[nameLength] = '\0';
+	channel->driver = sensor_registry_find(name);
+	if (channel->driver == NULL)
+	{
+		printf("Unknown sensor: %s\n", name);
+		result = 1;
+	}
+
+	if (result == 0 && *rest == '@')
+	{
+		unsigned long bus = strtoul(rest + 1, &end, 10);
+		channel->bus = (int)bus;
+		result = (!isdigit((unsigned char)rest[1]) || bus > INT_MAX) ? 1 : 0;
+		rest = end;
+	}
+	if (result == 0 && *rest == ':')
+	{
+		unsigned long periodMs = strtoul(rest + 1, &end, 10);
+		channel->periodMs = (unsigned int)periodMs;
+		result = (!isdigit((unsigned char)rest[1]) || periodMs == 0 || periodMs > UINT32_MAX / 1000) ? 1 : 0;
+		rest = end;
+	}
+	if (result == 0 && *rest != '\0')
+	{
+		result = 1;
+	}
+	if (result != 0 && channel->driver != NULL)
+	{
+		printf("Invalid sensor: %s, expected NAME[@BUS][:MS]\n", spec);
+	}
+	return result;
+}
+
+static int remote_monitoring_parse_options(int argc, char** argv)
+{
+	static const struct option longOptions[] =
+	{
+		{ "encoding", required_argument, NULL, 'e' },
+		{ "batch", required_argument, NULL, 'b' },
+		{ "compress", required_argument, NULL, 'c' },
+		{ "compress-threshold", required_argument, NULL, 't' },
+		{ "alert", required_argument, NULL, 'a' },
+		{ "bulk-window", required_argument, NULL, 'w' },
+		{ "outbox-cap", required_argument, NULL, 'q' },
+		{ "gateway", required_argument, NULL, 'g' },
+		{ "connection-string", required_argument, NULL, 's' },
+		{ "trusted-certs", required_argument, NULL, 'T' },
+		{ "simulate", no_argument, NULL, 'S' },
+		{ "interval-ms", required_argument, NULL, 'i' },
+		{ "samples", required_argument, NULL, 'n' },
+		{ "record", required_argument, NULL, 'r' },
+		{ "replay", required_argument, NULL, 'R' },
+		{ "replay-speed", required_argument, NULL, 'p' },
+		{ "history", required_argument, NULL, 'H' },
+		{ "spi", required_argument, NULL, 'P' },
+		{ "history-flush-s", required_argument, NULL, 'F' },
+		{ "rt", no_argument, NULL, 'x' },
+		{ "twin-window-ms", required_argument, NULL, 'W' },
+		{ "retry-policy", required_argument, NULL, 'Y' },
+		{ "transport", required_argument, NULL, 'N' },
+		{ "retry-timeout-s", required_argument, NULL, 'O' },
+		{ "twin-cache", required_argument, NULL, 'K' },
+		{ "rt-cpu", required_argument, NULL, 'C' },
+		{ "rt-priority", required_argument, NULL, 'y' },
+		{ "sensor", required_argument, NULL, 'u' },
+		{ "thermostat-sensor", required_argument, NULL, 'k' },
+		{ "shm", required_argument, NULL, 'm' },
+		{ "shm-slots", required_argument, NULL, 'M' },
+		{ "calibration", required_argument, NULL, 'L' },
+		{ "duty-cycle", required_argument, NULL, 'D' },
+		{ "duty-buffer", required_argument, NULL, 'B' },
+		{ "trace", required_argument, NULL, 'E' },
+		{ "trace-file", required_argument, NULL, 'f' },
+		{ "burst", required_argument, NULL, 'z' },
+		{ "burst-ms", required_argument, NULL, 'Z' },
+		{ "burst-pre-s", required_argument, NULL, 'j' },
+		{ "burst-post-s", required_argument, NULL, 'J' },
+		{ "help", no_argument, NULL, 'h' },
+		{ NULL, 0, NULL, 0 }
+	};
+	int result = 0;
+	int opt;
+	size_t i;
+
+	while (result == 0 && (opt = getopt_long(argc, argv, "h", longOptions, NULL)) != -1)
+	{
+		switch (opt)
+		{
+		case 'e':
+			if (telemetry_encoding_from_string(optarg, &g_options.encoding) != 0)
+			{
+				printf("Unknown telemetry encoding: %s\n", optarg);
+				result = 1;
+			}
+			break;
+		case 'b':
+			result = ParseUnsigned(optarg, &g_options.batchSize);
+			if (result == 0 && g_options.batchSize == 0)
+			{
+				printf("The batch size must be at least 1\n");
+				result = 1;
+			}
+			break;
+		case 'c':
+			if (payload_compression_from_string(optarg, &g_options.compression) != 0)
+			{
+				printf("Unknown compression: %s\n", optarg);
+				result = 1;
+			}
+			break;
+		case 't':
+			result = ParseUnsigned(optarg, &g_options.compressThreshold);
+			break;
+		case 'a':
+			if (g_options.alertRuleCount == MAX_ALERT_RULES)
+			{
+				printf("At most %d alert rules are supported\n", MAX_ALERT_RULES);
+				result = 1;
+			}
+			else if (alert_rule_parse(optarg, &g_options.alertRules[g_options.alertRuleCount]) != 0)
+			{
+				printf("Invalid alert rule: %s\n", optarg);
+				result = 1;
+			}
+			else
+			{
+				g_options.alertRuleCount++;
+			}
+			break;
+		case 'w':
+			result = ParseUnsigned(optarg, &g_options.bulkWindow);
+			break;
+		case 'q':
+			result = ParseUnsigned(optarg, &g_options.outboxCapacity);
+			if (result == 0 && g_options.outboxCapacity == 0)
+			{
+				printf("The outbox must hold at least 1 message per lane\n");
+				result = 1;
+			}
+			break;
+		case 'g':
+			g_options.gatewayFile = optarg;
+			break;
+		case 's':
+			g_options.connectionString = optarg;
+			break;
+		case 'T':
+			g_options.trustedCertsFile = optarg;
+			break;
+		case 'S':
+			g_options.simulate = 1;
+			break;
+		case 'i':
+			result = ParseUnsigned(optarg, &g_options.intervalMs);
+			g_options.intervalSet = 1;
+			break;
+		case 'n':
+			result = ParseUnsigned(optarg, &g_options.sampleLimit);
+			break;
+		case 'r':
+			g_options.recordFile = optarg;
+			break;
+		case 'R':
+			g_options.replayFile = optarg;
+			break;
+		case 'p':
+			if (strcmp(optarg, "max") == 0)
+			{
+				g_options.replayMaxSpeed = 1;
+			}
+			else if (strcmp(optarg, "realtime") == 0)
+			{
+				g_options.replayMaxSpeed = 0;
+			}
+			else
+			{
+				printf("Unknown replay speed: %s\n", optarg);
+				result = 1;
+			}
+			break;
+		case 'H':
+			g_options.historyDir = optarg;
+			break;
+		case 'P':
+			if (strcmp(optarg, "spidev") == 0)
+			{
+				g_options.spidev = 1;
+			}
+			else if (strcmp(optarg, "wiringpi") == 0)
+			{
+				g_options.spidev = 0;
+			}
+			else
+			{
+				printf("Unknown SPI backend: %s\n", optarg);
+				result = 1;
+			}
+			break;
+		case 'F':
+			result = ParseUnsigned(optarg, &g_options.historyFlushS);
+			break;
+		case 'x':
+			g_options.rt = 1;
+			break;
+		case 'W':
+			result = ParseUnsigned(optarg, &g_options.twinWindowMs);
+			break;
+		case 'K':
+			g_options.twinCacheDir = optarg;
+			break;
+		case 'Y':
+		{
+			size_t policy;
+			for (policy = 0; policy < sizeof(retryPolicyNames) / sizeof(retryPolicyNames[0]); policy++)
+			{
+				if (strcmp(optarg, retryPolicyNames[policy].name) == 0)
+				{
+					g_options.retryPolicy = retryPolicyNames[policy].policy;
+					break;
+				}
+			}
+			if (policy == sizeof(retryPolicyNames) / sizeof(retryPolicyNames[0]))
+			{
+				printf("Unknown retry policy: %s\n", optarg);
+				result = 1;
+			}
+			break;
+		}
+		case 'O':
+			result = ParseUnsigned(optarg, &g_options.retryTimeoutS);
+			break;
+		case 'N':
+			g_options.transport = findTransport(optarg);
+			if (g_options.transport == NULL)
+			{
+				printf("Unknown transport: %s\n", optarg);
+				result = 1;
+			}
+			break;
+		case 'C':
+		{
+			unsigned int cpu;
+			result = ParseUnsigned(optarg, &cpu);
+			if (result == 0 && cpu > INT_MAX)
+			{
+				printf("Invalid core: %s\n", optarg);
+				result = 1;
+			}
+			g_options.rtCpu = (int)cpu;
+			break;
+		}
+		case 'y':
+			result = ParseUnsigned(optarg, &g_options.rtPriority);
+			if (result == 0 && g_options.rtPriority > 99)
+			{
+				printf("The priority must be between 0 and 99\n");
+				result = 1;
+			}
+			break;
+		case 'u':
+			if (g_options.sensorCount == MAX_SENSOR_CHANNELS)
+			{
+				printf("At most %d sensors are supported\n", MAX_SENSOR_CHANNELS);
+				result = 1;
+			}
+			else
+			{
+				result = parseSensorChannel(optarg, &g_options.sensors[g_options.sensorCount]);
+				if (result == 0)
+				{
+					g_options.sensorCount++;
+				}
+			}
+			break;
+		case 'm':
+			if (optarg[0] != '/' || optarg[1] == '\0' || strchr(optarg + 1, '/') != NULL)
+			{
+				printf("Invalid shared memory object name: %s, expected /NAME\n", optarg);
+				result = 1;
+			}
+			g_options.shmName = optarg;
+			break;
+		case 'M':
+			result = ParseUnsigned(optarg, &g_options.shmSlots);
+			if (result == 0 && (g_options.shmSlots == 0 || g_options.shmSlots > 0x80000000u))
+			{
+				printf("The history must hold between 1 and 2147483648 readings\n");
+				result = 1;
+			}
+			break;
+		case 'L':
+			result = bme280_correction_parse(optarg, &g_options.calibration);
+			if (result != 0)
+			{
+				printf("Invalid calibration: %s\n", optarg);
+			}
+			g_options.calibrationSet = 1;
+			break;
+		case 'D':
+			result = ParseUnsigned(optarg, &g_options.dutyCycleMin);
+			if (result == 0 && (g_options.dutyCycleMin == 0 || g_options.dutyCycleMin > 1440))
+			{
+				printf("The duty cycle must be between 1 and 1440 minutes\n");
+				result = 1;
+			}
+			break;
+		case 'B':
+			result = ParseUnsigned(optarg, &g_options.dutyBufferReadings);
+			if (result == 0 && g_options.dutyBufferReadings == 0)
+			{
+				printf("The duty cycle buffer must hold at least 1 reading\n");
+				result = 1;
+			}
+			break;
+		case 'E':
+			result = ParseUnsigned(optarg, &g_options.traceEvents);
+			if (result == 0 && (g_options.traceEvents == 0 || g_options.traceEvents > (1u << 30)))
+			{
+				printf("The trace must keep between 1 and 1073741824 events\n");
+				result = 1;
+			}
+			break;
+		case 'f':
+			g_options.traceFile = optarg;
+			break;
+		case 'z':
+		{
+			char* end;
+			g_options.burstZ = strtod(optarg, &end);
+			if (*optarg == '\0' || *end != '\0' || !(g_options.burstZ > 0) || g_options.burstZ > 1000)
+			{
+				printf("The threshold of --burst must be a number of standard deviations, such as 4\n");
+				result = 1;
+			}
+			break;
+		}
+		case 'Z':
+			result = ParseUnsigned(optarg, &g_options.burstMs);
+			if (result == 0 && (g_options.burstMs < 10 || g_options.burstMs > 60000))
+			{
+				printf("--burst-ms must be between 10 and 60000\n");
+				result = 1;
+			}
+			break;
+		case 'j':
+			result = ParseUnsigned(optarg, &g_options.burstPreS);
+			if (result == 0 && g_options.burstPreS > 3600)
+			{
+				printf("--burst-pre-s must be at most 3600\n");
+				result = 1;
+			}
+			break;
+		case 'J':
+			result = ParseUnsigned(optarg, &g_options.burstPostS);
+			break;
+		case 'k':
+			if (strchr(optarg, ':') != NULL)
+			{
+				printf("The Thermostat telemetry keeps to the TelemetryInterval, expected NAME[@BUS]\n");
+				result = 1;
+			}
+			else
+			{
+				SENSOR_CHANNEL_OPTION thermostat;
+				result = parseSensorChannel(optarg, &thermostat);
+				if (result == 0)
+				{
+					g_thermostatSensor = thermostat.driver;
+					g_thermostatBus = thermostat.bus;
+				}
+			}
+			break;
+		default:
+			result = 1;
+			break;
+		}
+	}
+
+	if (result == 0 && g_options.transport == NULL)
+	{
+		g_options.transport = findTransport((g_options.gatewayFile == NULL) ? "mqtt" : "amqp");
+	}
+	if (result == 0 && g_options.transport == NULL)
+	{
+		printf("--gateway needs AMQP, which this build leaves out\n");
+		result = 1;
+	}
+	if (result == 0 && g_options.gatewayFile != NULL && !g_options.transport->shareable)
+	{
+		printf("--gateway shares one connection between devices, which needs --transport amqp or amqp-ws\n");
+		result = 1;
+	}
+	if (result == 0 && (sensorValueIndex(g_thermostatSensor, "Temperature") < 0 || sensorValueIndex(g_thermostatSensor, "Humidity") < 0))
+	{
+		printf("The %s sensor reads no Temperature or Humidity for the Thermostat telemetry\n", g_thermostatSensor->Name__cp);
+		result = 1;
+	}
+	for (i = 0; result == 0 && i < g_options.sensorCount; i++)
+	{
+		if (g_options.sensors[i].driver == g_thermostatSensor)
+		{
+			printf("The %s sensor is already sampled for the Thermostat telemetry\n", g_thermostatSensor->Name__cp);
+			result = 1;
+		}
+	}
+	if (result == 0 && g_thermostatSensor != &sensor_driver_bme280 &&
+		(g_options.simulate || g_options.replayFile != NULL || g_options.recordFile != NULL || g_options.calibrationSet || g_options.spidev))
+	{
+		printf("--simulate, --replay, --record, --calibration and --spi only apply to the bme280 sensor\n");
+		result = 1;
+	}
+	if (result == 0 && g_options.rt && g_thermostatSensor->Start__fp != NULL)
+	{
+		printf("--rt reads the latest conversion of a free-running sensor; the %s sensor needs each one started\n",
+			g_thermostatSensor->Name__cp);
+		result = 1;
+	}
+	if (result == 0 && g_options.rt && g_options.replayFile != NULL)
+	{
+		printf("--rt samples the sensor; a replayed trace keeps its recorded timing\n");
+		result = 1;
+	}
+	if (result == 0 && g_options.rt && g_options.burstZ > 0)
+	{
+		printf("--burst reads the sensor at its own rate, which --rt keeps fixed\n");
+		result = 1;
+	}
+	if (result != 0)
+	{
+		remote_monitoring_usage(argv[0]);
+	}
+	return result;
+}
+
+int main(int argc, char** argv)
+{
+	int result = remote_monitoring_parse_options(argc, argv);
+	if (result == 0)
+	{
+		result = remote_monitoring_init();
+		if (result == 0)
+		{
+			remote_monitoring_run();
+		}
+		remote_monitoring_deinit();
 	}
 	return result;
 }
\ No newline at end of file
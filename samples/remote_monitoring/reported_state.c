@@ -0,0 +1,449 @@
+// Copyright (c) Microsoft. All rights reserved.
+// Licensed under the MIT license. See LICENSE file in the project root for full license information.
+
+#define _POSIX_C_SOURCE 200809L
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "parson.h"
+#include "reported_state.h"
+#include "latency_histogram.h"
+
+/* A pending patch; patches are chained oldest first */
+typedef struct REPORTED_PATCH_TAG
+{
+	JSON_Value* value;
+	struct REPORTED_PATCH_TAG* next;
+} REPORTED_PATCH;
+
+struct reported_state_tag
+{
+	uint64_t windowUs;
+	char* cachePath;
+	reported_state_send_fn send;
+	void* context;
+
+	pthread_mutex_t lock;
+	/* What the hub is known to have; a cleared member stays in it as null */
+	JSON_Value* sent;
+	/* A new patch is only started when merging would lose a clearing null */
+	REPORTED_PATCH* pending;
+	uint64_t firstPendingUs;
+	reported_state_stats_t stats;
+};
+
+static int isObject(const JSON_Value* value)
+{
+	return value != NULL && json_value_get_type(value) == JSONObject;
+}
+
+static void freeValue(JSON_Value* value)
+{
+	if (value != NULL)
+	{
+		json_value_free(value);
+	}
+}
+
+static void freePatches(REPORTED_PATCH* patch)
+{
+	while (patch != NULL)
+	{
+		REPORTED_PATCH* next = patch->next;
+		json_value_free(patch->value);
+		free(patch);
+		patch = next;
+	}
+}
+
+/* Whether merging patch into target would put an object where target clears with null */
+static int wouldLoseClear(const JSON_Object* target, const JSON_Object* patch)
+{
+	size_t i;
+
+	for (i = 0; i < json_object_get_count(patch); i++)
+	{
+		const char* name = json_object_get_name(patch, i);
+		JSON_Value* member = json_object_get_value(patch, name);
+		JSON_Value* old = json_object_get_value(target, name);
+
+		if (isObject(member) && old != NULL &&
+			(json_value_get_type(old) == JSONNull || (isObject(old) && wouldLoseClear(json_object(old), json_object(member)))))
+		{
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/* Merges the members of patch into target, nulls included; returns 1 if out of memory */
+static int merge(JSON_Object* target, const JSON_Object* patch)
+{
+	size_t i;
+
+	for (i = 0; i < json_object_get_count(patch); i++)
+	{
+		const char* name = json_object_get_name(patch, i);
+		JSON_Value* member = json_object_get_value(patch, name);
+		JSON_Value* old = json_object_get_value(target, name);
+
+		if (isObject(member))
+		{
+			if (!isObject(old))
+			{
+				old = json_value_init_object();
+				if (old == NULL || json_object_set_value(target, name, old) != JSONSuccess)
+				{
+					freeValue(old);
+					return 1;
+				}
+			}
+			if (merge(json_object(old), json_object(member)) != 0)
+			{
+				return 1;
+			}
+		}
+		else
+		{
+			JSON_Value* copy = json_value_deep_copy(member);
+			if (copy == NULL || json_object_set_value(target, name, copy) != JSONSuccess)
+			{
+				freeValue(copy);
+				return 1;
+			}
+		}
+	}
+	return 0;
+}
+
+static uint64_t countLeaves(const JSON_Object* object)
+{
+	uint64_t leaves = 0;
+	size_t i;
+
+	for (i = 0; i < json_object_get_count(object); i++)
+	{
+		JSON_Value* member = json_object_get_value(object, json_object_get_name(object, i));
+		leaves += isObject(member) ? countLeaves(json_object(member)) : 1;
+	}
+	return leaves;
+}
+
+/* The members of patch that sent (NULL if unknown) does not already have, as a new
+   object, or NULL if out of memory */
+static JSON_Value* diff(const JSON_Object* patch, const JSON_Object* sent, reported_state_stats_t* stats)
+{
+	JSON_Value* result = json_value_init_object();
+	size_t i;
+
+	for (i = 0; result != NULL && i < json_object_get_count(patch); i++)
+	{
+		const char* name = json_object_get_name(patch, i);
+		JSON_Value* member = json_object_get_value(patch, name);
+		JSON_Value* old = (sent != NULL) ? json_object_get_value(sent, name) : NULL;
+		JSON_Value* change;
+
+		if (!isObject(member))
+		{
+			if (old != NULL && !isObject(old) && json_value_equals(member, old))
+			{
+				stats->fieldsSkipped++;
+				continue;
+			}
+			change = json_value_deep_copy(member);
+			stats->fieldsSent++;
+		}
+		else if (isObject(old))
+		{
+			change = diff(json_object(member), json_object(old), stats);
+			if (change != NULL && json_object_get_count(json_object(change)) == 0 && json_object_get_count(json_object(member)) > 0)
+			{
+				/* Nothing changed below */
+				json_value_free(change);
+				continue;
+			}
+		}
+		else
+		{
+			change = json_value_deep_copy(member);
+			stats->fieldsSent += countLeaves(json_object(member));
+		}
+
+		if (change == NULL || json_object_set_value(json_object(result), name, change) != JSONSuccess)
+		{
+			freeValue(change);
+			json_value_free(result);
+			result = NULL;
+		}
+	}
+	return result;
+}
+
+/* Replaces the cache file, through a temporary file so that a power cut leaves either the
+   old or the new state */
+static void saveSent(const reported_state_t* state)
+{
+	char* text = json_serialize_to_string(state->sent);
+	size_t pathLength = strlen(state->cachePath);
+	char* tempPath = malloc(pathLength + sizeof(".tmp"));
+
+	if (text != NULL && tempPath != NULL)
+	{
+		FILE* fp;
+		memcpy(tempPath, state->cachePath, pathLength);
+		memcpy(tempPath + pathLength, ".tmp", sizeof(".tmp"));
+		fp = fopen(tempPath, "w");
+		if (fp != NULL)
+		{
+			int written = fputs(text, fp) >= 0 && fputc('\n', fp) != EOF;
+			if (fclose(fp) == 0 && written)
+			{
+				(void)rename(tempPath, state->cachePath);
+			}
+		}
+	}
+	free(tempPath);
+	if (text != NULL)
+	{
+		json_free_serialized_string(text);
+	}
+}
+
+static void loadSent(reported_state_t* state)
+{
+	JSON_Value* value = json_parse_file(state->cachePath);
+
+	if (isObject(value))
+	{
+		json_value_free(state->sent);
+		state->sent = value;
+	}
+	else
+	{
+		freeValue(value);
+	}
+}
+
+reported_state_t* reported_state_create(uint32_t windowMs, const char* cachePath, reported_state_send_fn send, void* context)
+{
+	reported_state_t* state = calloc(1, sizeof(reported_state_t));
+
+	if (state == NULL)
+	{
+		return NULL;
+	}
+	state->windowUs = (uint64_t)windowMs * 1000;
+	state->send = send;
+	state->context = context;
+	state->sent = json_value_init_object();
+	if (state->sent == NULL ||
+		(cachePath != NULL && (state->cachePath = strdup(cachePath)) == NULL) ||
+		pthread_mutex_init(&state->lock, NULL) != 0)
+	{
+		freeValue(state->sent);
+		free(state->cachePath);
+		free(state);
+		return NULL;
+	}
+	if (state->cachePath != NULL)
+	{
+		loadSent(state);
+	}
+	return state;
+}
+
+void reported_state_destroy(reported_state_t* state)
+{
+	if (state != NULL)
+	{
+		json_value_free(state->sent);
+		freePatches(state->pending);
+		(void)pthread_mutex_destroy(&state->lock);
+		free(state->cachePath);
+		free(state);
+	}
+}
+
+int reported_state_update(reported_state_t* state, const char* patch, size_t size)
+{
+	/* parson needs the text zero terminated */
+	char* text = malloc(size + 1);
+	JSON_Value* value = NULL;
+	REPORTED_PATCH* entry = malloc(sizeof(REPORTED_PATCH));
+	int result = 1;
+
+	if (text != NULL)
+	{
+		memcpy(text, patch, size);
+		text[size] = '\0';
+		value = json_parse_string(text);
+		free(text);
+	}
+	if (entry != NULL && isObject(value))
+	{
+		REPORTED_PATCH* last;
+
+		entry->value = value;
+		entry->next = NULL;
+		(void)pthread_mutex_lock(&state->lock);
+		last = state->pending;
+		while (last != NULL && last->next != NULL)
+		{
+			last = last->next;
+		}
+		if (last == NULL)
+		{
+			state->firstPendingUs = latency_clock_us();
+			state->pending = entry;
+			entry = NULL;
+			value = NULL;
+			result = 0;
+		}
+		else if (wouldLoseClear(json_object(last->value), json_object(value)))
+		{
+			last->next = entry;
+			entry = NULL;
+			value = NULL;
+			result = 0;
+		}
+		else
+		{
+			result = merge(json_object(last->value), json_object(value));
+		}
+		state->stats.updates++;
+		(void)pthread_mutex_unlock(&state->lock);
+	}
+	freeValue(value);
+	free(entry);
+	return result;
+}
+
+int reported_state_flush(reported_state_t* state, int force)
+{
+	REPORTED_PATCH* pending;
+	int result = 0;
+	int changed = 0;
+
+	(void)pthread_mutex_lock(&state->lock);
+	pending = state->pending;
+	if (pending != NULL && !force && latency_clock_us() - state->firstPendingUs < state->windowUs)
+	{
+		pending = NULL;
+	}
+	if (pending != NULL)
+	{
+		state->pending = NULL;
+	}
+	(void)pthread_mutex_unlock(&state->lock);
+
+	/* The send runs unlocked: the IoT Hub client may call back into
+	   reported_state_invalidate while holding its own lock */
+	while (pending != NULL && result == 0)
+	{
+		JSON_Value* changes;
+		char* text = NULL;
+		size_t members = 0;
+		size_t size = 0;
+
+		(void)pthread_mutex_lock(&state->lock);
+		changes = diff(json_object(pending->value), json_object(state->sent), &state->stats);
+		(void)pthread_mutex_unlock(&state->lock);
+
+		if (changes == NULL)
+		{
+			result = 1;
+		}
+		else if ((members = json_object_get_count(json_object(changes))) > 0)
+		{
+			text = json_serialize_to_string(changes);
+			if (text == NULL)
+			{
+				result = 1;
+			}
+			else
+			{
+				size = strlen(text);
+				result = state->send(state->context, text, size);
+			}
+		}
+
+		(void)pthread_mutex_lock(&state->lock);
+		if (result == 0)
+		{
+			REPORTED_PATCH* next = pending->next;
+			if (members > 0)
+			{
+				state->stats.sends++;
+				state->stats.bytesSent += size;
+				changed = 1;
+			}
+			(void)merge(json_object(state->sent), json_object(pending->value));
+			pending->next = NULL;
+			freePatches(pending);
+			pending = next;
+		}
+		else
+		{
+			/* Retry after another window, ahead of what arrived meanwhile */
+			REPORTED_PATCH* last = pending;
+			while (last->next != NULL)
+			{
+				last = last->next;
+			}
+			last->next = state->pending;
+			state->pending = pending;
+			state->firstPendingUs = latency_clock_us();
+		}
+		(void)pthread_mutex_unlock(&state->lock);
+
+		if (text != NULL)
+		{
+			json_free_serialized_string(text);
+		}
+		freeValue(changes);
+	}
+
+	if (changed && state->cachePath != NULL)
+	{
+		(void)pthread_mutex_lock(&state->lock);
+		saveSent(state);
+		(void)pthread_mutex_unlock(&state->lock);
+	}
+	return result;
+}
+
+void reported_state_invalidate(reported_state_t* state)
+{
+	JSON_Value* empty = json_value_init_object();
+	REPORTED_PATCH* entry = malloc(sizeof(REPORTED_PATCH));
+
+	if (empty != NULL && entry != NULL)
+	{
+		(void)pthread_mutex_lock(&state->lock);
+		if (json_object_get_count(json_object(state->sent)) > 0)
+		{
+			if (state->pending == NULL)
+			{
+				state->firstPendingUs = latency_clock_us();
+			}
+			entry->value = state->sent;
+			entry->next = state->pending;
+			state->pending = entry;
+			state->sent = empty;
+			entry = NULL;
+			empty = NULL;
+		}
+		(void)pthread_mutex_unlock(&state->lock);
+	}
+	freeValue(empty);
+	free(entry);
+}
+
+void reported_state_get_stats(reported_state_t* state, reported_state_stats_t* stats)
+{
+	(void)pthread_mutex_lock(&state->lock);
+	*stats = state->stats;
+	(void)pthread_mutex_unlock(&state->lock);
+}
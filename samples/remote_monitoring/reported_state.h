@@ -0,0 +1,68 @@
+// Copyright (c) Microsoft. All rights reserved.
+// Licensed under the MIT license. See LICENSE file in the project root for full license information.
+
+#ifndef REPORTED_STATE_H
+#define REPORTED_STATE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+    /* Coalescing cache of device twin reported properties. Patches are merged as they
+       arrive (JSON merge patch: objects merge, null removes) and sent together at most
+       once per window, leaving out every field whose value the hub already has from an
+       earlier send. The sent state can be kept in a file, so a restart does not resend
+       what the twin already holds.
+
+       Merging keeps the meaning of a sequence of patches: a patch that sets an object
+       which an earlier pending patch set to null (to clear it) is sent after it, not
+       merged into it, so the old members are still removed. */
+    typedef struct reported_state_tag reported_state_t;
+
+    /* Sends one patch, for example with IoTHubClient_SendReportedState. Called without
+       any lock of the cache held; returns 0 if the patch was accepted for sending */
+    typedef int (*reported_state_send_fn)(void* context, const char* patch, size_t size);
+
+    typedef struct REPORTED_STATE_STATS_TAG
+    {
+        uint64_t updates;
+        uint64_t sends;
+        uint64_t bytesSent;
+        /* Leaf values sent, and left out because the hub already had them */
+        uint64_t fieldsSent;
+        uint64_t fieldsSkipped;
+    } reported_state_stats_t;
+
+    /* Patches are collected for windowMs from the first pending one before
+       reported_state_flush sends them. cachePath is the file keeping the sent state
+       across runs, or NULL; a missing or unreadable file starts empty. Returns NULL
+       if out of memory. */
+    reported_state_t* reported_state_create(uint32_t windowMs, const char* cachePath, reported_state_send_fn send, void* context);
+
+    /* Frees the cache without sending what is pending */
+    void reported_state_destroy(reported_state_t* state);
+
+    /* Merges a patch, a JSON object size bytes long, into the pending state. Returns 0
+       on success, 1 if the patch is not a valid object. Thread safe. */
+    int reported_state_update(reported_state_t* state, const char* patch, size_t size);
+
+    /* Sends the pending state once the window has passed, or right away with force, as
+       one patch per clearing step (usually one). Call it often, for example from the
+       sampling loop. Returns 0 on success or if nothing was due, 1 if a send failed;
+       what was not sent stays pending. Thread safe. */
+    int reported_state_flush(reported_state_t* state, int force);
+
+    /* Forgets what the hub is known to have and queues all of it again, for when a send
+       was reported as failed. Thread safe, also from the callbacks of the IoT Hub client. */
+    void reported_state_invalidate(reported_state_t* state);
+
+    void reported_state_get_stats(reported_state_t* state, reported_state_stats_t* stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* REPORTED_STATE_H */
@@ -0,0 +1,512 @@
+// Copyright (c) Microsoft. All rights reserved.
+// Licensed under the MIT license. See LICENSE file in the project root for full license information.
+
+#define _POSIX_C_SOURCE 200112L
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "telemetry_outbox.h"
+#include "latency_histogram.h"
+#include "event_trace.h"
+
+typedef struct OUTBOX_ENTRY_TAG
+{
+	IOTHUB_CLIENT_HANDLE client;
+	IOTHUB_MESSAGE_HANDLE message;
+	OUTBOX_LANE lane;
+	uint64_t sampleTimeUs;
+	struct OUTBOX_ENTRY_TAG* next;
+} OUTBOX_ENTRY;
+
+typedef struct OUTBOX_QUEUE_TAG
+{
+	OUTBOX_ENTRY* head;
+	OUTBOX_ENTRY* tail;
+	size_t count;
+} OUTBOX_QUEUE;
+
+/* A client that reported its connection state */
+typedef struct OUTBOX_CLIENT_TAG
+{
+	IOTHUB_CLIENT_HANDLE client;
+	int connected;
+	uint64_t disconnectedUs;
+} OUTBOX_CLIENT;
+
+static const char* laneNames[OUTBOX_LANE_COUNT] = { "alert", "bulk" };
+
+/* Guards everything below; the confirmation callback runs on the client's thread */
+static pthread_mutex_t g_outboxLock = PTHREAD_MUTEX_INITIALIZER;
+static OUTBOX_QUEUE g_lanes[OUTBOX_LANE_COUNT];
+static size_t g_bulkWindow;
+static size_t g_laneCapacity;
+/* Messages dropped from full lanes, per lane */
+static unsigned long long g_dropped[OUTBOX_LANE_COUNT];
+/* Sample time of the oldest message dropped or not confirmed since outbox_take_lost */
+static uint64_t g_lostSinceUs = UINT64_MAX;
+static size_t g_bulkInFlight;
+static size_t g_alertInFlight;
+static latency_histogram_t g_handOffLatency[OUTBOX_LANE_COUNT];
+static latency_histogram_t g_confirmLatency[OUTBOX_LANE_COUNT];
+static OUTBOX_CLIENT* g_clients;
+static size_t g_clientCount;
+static size_t g_disconnectedCount;
+static latency_histogram_t g_reconnectTime;
+/* Signalled when a client reconnects, to end outbox_wait early */
+static pthread_cond_t g_reconnected;
+static unsigned int g_reconnectGeneration;
+
+static OUTBOX_CLIENT* outboxFindClient(IOTHUB_CLIENT_HANDLE client)
+{
+	size_t i;
+	for (i = 0; i < g_clientCount; i++)
+	{
+		if (g_clients[i].client == client)
+		{
+			return &g_clients[i];
+		}
+	}
+	return NULL;
+}
+
+static int outboxClientConnected(IOTHUB_CLIENT_HANDLE client)
+{
+	OUTBOX_CLIENT* state = (g_disconnectedCount == 0) ? NULL : outboxFindClient(client);
+	return state == NULL || state->connected;
+}
+
+static OUTBOX_ENTRY* outboxPop(OUTBOX_QUEUE* queue)
+{
+	OUTBOX_ENTRY* entry = queue->head;
+	if (entry != NULL)
+	{
+		queue->head = entry->next;
+		if (queue->head == NULL)
+		{
+			queue->tail = NULL;
+		}
+		queue->count--;
+	}
+	return entry;
+}
+
+/* Takes the oldest entry of a connected client, leaving those of disconnected ones queued */
+static OUTBOX_ENTRY* outboxPopConnected(OUTBOX_QUEUE* queue)
+{
+	OUTBOX_ENTRY* previous = NULL;
+	OUTBOX_ENTRY* entry = queue->head;
+
+	if (g_disconnectedCount == 0)
+	{
+		return outboxPop(queue);
+	}
+	while (entry != NULL && !outboxClientConnected(entry->client))
+	{
+		previous = entry;
+		entry = entry->next;
+	}
+	if (entry != NULL)
+	{
+		if (previous == NULL)
+		{
+			queue->head = entry->next;
+		}
+		else
+		{
+			previous->next = entry->next;
+		}
+		if (queue->tail == entry)
+		{
+			queue->tail = previous;
+		}
+		queue->count--;
+	}
+	return entry;
+}
+
+/* Called with g_outboxLock held for a message that will not reach IoT Hub */
+static void outboxLost(const OUTBOX_ENTRY* entry)
+{
+	if (entry->sampleTimeUs < g_lostSinceUs)
+	{
+		g_lostSinceUs = entry->sampleTimeUs;
+	}
+}
+
+static void outboxConfirmationCallback(IOTHUB_CLIENT_CONFIRMATION_RESULT result, void* userContextCallback)
+{
+	OUTBOX_ENTRY* entry = (OUTBOX_ENTRY*)userContextCallback;
+	uint64_t latencyUs = latency_clock_us() - entry->sampleTimeUs;
+
+	event_trace_record(EVENT_TRACE_ASYNC_END, "in_flight", (uint64_t)(uintptr_t)entry);
+	(void)pthread_mutex_lock(&g_outboxLock);
+	if (entry->lane == OUTBOX_LANE_BULK)
+	{
+		g_bulkInFlight--;
+	}
+	else
+	{
+		g_alertInFlight--;
+	}
+	if (result == IOTHUB_CLIENT_CONFIRMATION_OK)
+	{
+		latency_histogram_record(&g_confirmLatency[entry->lane], latencyUs);
+	}
+	else
+	{
+		outboxLost(entry);
+	}
+	(void)pthread_mutex_unlock(&g_outboxLock);
+
+	if (entry->lane == OUTBOX_LANE_ALERT)
+	{
+		(void)printf("Alert confirmed %llu ms after the sample, result %s\r\n",
+			(unsigned long long)(latencyUs / 1000), ENUM_TO_STRING(IOTHUB_CLIENT_CONFIRMATION_RESULT, result));
+	}
+	free(entry);
+}
+
+int outbox_init(size_t bulkWindow, size_t laneCapacity)
+{
+	int i;
+	pthread_condattr_t condAttr;
+
+	g_bulkWindow = (bulkWindow == 0) ? 1 : bulkWindow;
+	g_laneCapacity = (laneCapacity == 0) ? 1 : laneCapacity;
+	g_bulkInFlight = 0;
+	g_alertInFlight = 0;
+	g_lostSinceUs = UINT64_MAX;
+	for (i = 0; i < OUTBOX_LANE_COUNT; i++)
+	{
+		g_lanes[i].head = NULL;
+		g_lanes[i].tail = NULL;
+		g_lanes[i].count = 0;
+		g_dropped[i] = 0;
+		latency_histogram_reset(&g_handOffLatency[i]);
+		latency_histogram_reset(&g_confirmLatency[i]);
+	}
+	g_clients = NULL;
+	g_clientCount = 0;
+	g_disconnectedCount = 0;
+	latency_histogram_reset(&g_reconnectTime);
+
+	/* Timed waits against the monotonic clock, like latency_clock_us */
+	(void)pthread_condattr_init(&condAttr);
+	(void)pthread_condattr_setclock(&condAttr, CLOCK_MONOTONIC);
+	i = pthread_cond_init(&g_reconnected, &condAttr);
+	(void)pthread_condattr_destroy(&condAttr);
+	return (i == 0) ? 0 : 1;
+}
+
+void outbox_deinit(void)
+{
+	int i;
+
+	(void)pthread_mutex_lock(&g_outboxLock);
+	for (i = 0; i < OUTBOX_LANE_COUNT; i++)
+	{
+		OUTBOX_ENTRY* entry;
+		while ((entry = outboxPop(&g_lanes[i])) != NULL)
+		{
+			IoTHubMessage_Destroy(entry->message);
+			free(entry);
+		}
+	}
+	free(g_clients);
+	g_clients = NULL;
+	g_clientCount = 0;
+	g_disconnectedCount = 0;
+	(void)pthread_mutex_unlock(&g_outboxLock);
+	(void)pthread_cond_destroy(&g_reconnected);
+}
+
+int outbox_push(OUTBOX_LANE lane, IOTHUB_CLIENT_HANDLE iotHubClientHandle, IOTHUB_MESSAGE_HANDLE message, uint64_t sampleTimeUs)
+{
+	int result;
+	OUTBOX_ENTRY* entry = malloc(sizeof(OUTBOX_ENTRY));
+
+	if (entry == NULL)
+	{
+		printf("failed to queue the message\r\n");
+		IoTHubMessage_Destroy(message);
+		result = 1;
+	}
+	else
+	{
+		OUTBOX_ENTRY* dropped = NULL;
+
+		entry->client = iotHubClientHandle;
+		entry->message = message;
+		entry->lane = lane;
+		entry->sampleTimeUs = sampleTimeUs;
+		entry->next = NULL;
+
+		event_trace_record(EVENT_TRACE_ASYNC_BEGIN, "queued", (uint64_t)(uintptr_t)entry);
+		(void)pthread_mutex_lock(&g_outboxLock);
+		if (g_lanes[lane].count >= g_laneCapacity)
+		{
+			/* A long disconnection would otherwise use up the memory of the device */
+			dropped = outboxPop(&g_lanes[lane]);
+			outboxLost(dropped);
+			g_dropped[lane]++;
+		}
+		if (g_lanes[lane].tail == NULL)
+		{
+			g_lanes[lane].head = entry;
+		}
+		else
+		{
+			g_lanes[lane].tail->next = entry;
+		}
+		g_lanes[lane].tail = entry;
+		g_lanes[lane].count++;
+		(void)pthread_mutex_unlock(&g_outboxLock);
+
+		if (dropped != NULL)
+		{
+			event_trace_record(EVENT_TRACE_ASYNC_END, "queued", (uint64_t)(uintptr_t)dropped);
+			IoTHubMessage_Destroy(dropped->message);
+			free(dropped);
+		}
+		result = 0;
+	}
+	return result;
+}
+
+void outbox_drain(void)
+{
+	while (1)
+	{
+		OUTBOX_ENTRY* entry;
+
+		/* The lock is not held while calling into the client: the client may hold its
+		   own lock while running outboxConfirmationCallback */
+		(void)pthread_mutex_lock(&g_outboxLock);
+		entry = outboxPopConnected(&g_lanes[OUTBOX_LANE_ALERT]);
+		if (entry != NULL)
+		{
+			g_alertInFlight++;
+		}
+		else if (g_bulkInFlight < g_bulkWindow)
+		{
+			entry = outboxPopConnected(&g_lanes[OUTBOX_LANE_BULK]);
+			if (entry != NULL)
+			{
+				g_bulkInFlight++;
+			}
+		}
+		(void)pthread_mutex_unlock(&g_outboxLock);
+
+		if (entry == NULL)
+		{
+			break;
+		}
+
+		IOTHUB_MESSAGE_HANDLE message = entry->message;
+		OUTBOX_LANE lane = entry->lane;
+		uint64_t handOffUs = latency_clock_us() - entry->sampleTimeUs;
+		IOTHUB_CLIENT_RESULT sendResult;
+		/* The confirmation may arrive before SendEventAsync returns */
+		event_trace_record(EVENT_TRACE_ASYNC_END, "queued", (uint64_t)(uintptr_t)entry);
+		event_trace_record(EVENT_TRACE_ASYNC_BEGIN, "in_flight", (uint64_t)(uintptr_t)entry);
+		event_trace_record(EVENT_TRACE_BEGIN, "send_event_async", (uint64_t)lane);
+		sendResult = IoTHubClient_SendEventAsync(entry->client, message, outboxConfirmationCallback, entry);
+		event_trace_record(EVENT_TRACE_END, "send_event_async", 0);
+		if (sendResult != IOTHUB_CLIENT_OK)
+		{
+			event_trace_record(EVENT_TRACE_ASYNC_END, "in_flight", (uint64_t)(uintptr_t)entry);
+			printf("failed to hand over the %s message to IoTHubClient\r\n", laneNames[lane]);
+			(void)pthread_mutex_lock(&g_outboxLock);
+			if (lane == OUTBOX_LANE_BULK)
+			{
+				g_bulkInFlight--;
+			}
+			else
+			{
+				g_alertInFlight--;
+			}
+			(void)pthread_mutex_unlock(&g_outboxLock);
+			free(entry);
+		}
+		else
+		{
+			printf("IoTHubClient accepted the %s message for delivery\r\n", laneNames[lane]);
+			(void)pthread_mutex_lock(&g_outboxLock);
+			latency_histogram_record(&g_handOffLatency[lane], handOffUs);
+			(void)pthread_mutex_unlock(&g_outboxLock);
+		}
+		IoTHubMessage_Destroy(message);
+	}
+}
+
+void outbox_set_connected(IOTHUB_CLIENT_HANDLE iotHubClientHandle, int connected)
+{
+	OUTBOX_CLIENT* state;
+
+	(void)pthread_mutex_lock(&g_outboxLock);
+	state = outboxFindClient(iotHubClientHandle);
+	if (state == NULL)
+	{
+		OUTBOX_CLIENT* clients = realloc(g_clients, (g_clientCount + 1) * sizeof(OUTBOX_CLIENT));
+		if (clients != NULL)
+		{
+			g_clients = clients;
+			state = &g_clients[g_clientCount++];
+			state->client = iotHubClientHandle;
+			state->connected = 1;
+			state->disconnectedUs = 0;
+		}
+	}
+	if (state != NULL && state->connected != (connected != 0))
+	{
+		state->connected = (connected != 0);
+		if (state->connected)
+		{
+			g_disconnectedCount--;
+			latency_histogram_record(&g_reconnectTime, latency_clock_us() - state->disconnectedUs);
+			g_reconnectGeneration++;
+			(void)pthread_cond_broadcast(&g_reconnected);
+		}
+		else
+		{
+			g_disconnectedCount++;
+			state->disconnectedUs = latency_clock_us();
+		}
+	}
+	(void)pthread_mutex_unlock(&g_outboxLock);
+}
+
+int outbox_is_connected(IOTHUB_CLIENT_HANDLE iotHubClientHandle)
+{
+	int connected;
+
+	(void)pthread_mutex_lock(&g_outboxLock);
+	connected = outboxClientConnected(iotHubClientHandle);
+	(void)pthread_mutex_unlock(&g_outboxLock);
+	return connected;
+}
+
+size_t outbox_forget_client(IOTHUB_CLIENT_HANDLE iotHubClientHandle)
+{
+	OUTBOX_CLIENT* state;
+	size_t dropped = 0;
+	int i;
+
+	(void)pthread_mutex_lock(&g_outboxLock);
+	for (i = 0; i < OUTBOX_LANE_COUNT; i++)
+	{
+		OUTBOX_ENTRY** link = &g_lanes[i].head;
+		OUTBOX_ENTRY* previous = NULL;
+		while (*link != NULL)
+		{
+			OUTBOX_ENTRY* entry = *link;
+			if (entry->client == iotHubClientHandle)
+			{
+				*link = entry->next;
+				g_lanes[i].count--;
+				outboxLost(entry);
+				event_trace_record(EVENT_TRACE_ASYNC_END, "queued", (uint64_t)(uintptr_t)entry);
+				IoTHubMessage_Destroy(entry->message);
+				free(entry);
+				dropped++;
+			}
+			else
+			{
+				previous = entry;
+				link = &entry->next;
+			}
+		}
+		g_lanes[i].tail = previous;
+	}
+	state = outboxFindClient(iotHubClientHandle);
+	if (state != NULL)
+	{
+		if (!state->connected)
+		{
+			g_disconnectedCount--;
+		}
+		*state = g_clients[--g_clientCount];
+	}
+	(void)pthread_mutex_unlock(&g_outboxLock);
+	return dropped;
+}
+
+int outbox_wait(unsigned int timeoutMs)
+{
+	struct timespec deadline;
+	unsigned int generation;
+	int result = 0;
+
+	(void)clock_gettime(CLOCK_MONOTONIC, &deadline);
+	deadline.tv_sec += timeoutMs / 1000;
+	deadline.tv_nsec += (long)(timeoutMs % 1000) * 1000000L;
+	if (deadline.tv_nsec >= 1000000000L)
+	{
+		deadline.tv_sec++;
+		deadline.tv_nsec -= 1000000000L;
+	}
+
+	(void)pthread_mutex_lock(&g_outboxLock);
+	generation = g_reconnectGeneration;
+	while (generation == g_reconnectGeneration)
+	{
+		if (pthread_cond_timedwait(&g_reconnected, &g_outboxLock, &deadline) != 0)
+		{
+			break;
+		}
+	}
+	result = (generation != g_reconnectGeneration);
+	(void)pthread_mutex_unlock(&g_outboxLock);
+	return result;
+}
+
+uint64_t outbox_take_lost(void)
+{
+	uint64_t lostSinceUs;
+
+	(void)pthread_mutex_lock(&g_outboxLock);
+	lostSinceUs = g_lostSinceUs;
+	g_lostSinceUs = UINT64_MAX;
+	(void)pthread_mutex_unlock(&g_outboxLock);
+	return lostSinceUs;
+}
+
+size_t outbox_pending(void)
+{
+	size_t pending;
+
+	(void)pthread_mutex_lock(&g_outboxLock);
+	pending = g_lanes[OUTBOX_LANE_ALERT].count + g_lanes[OUTBOX_LANE_BULK].count + g_alertInFlight + g_bulkInFlight;
+	(void)pthread_mutex_unlock(&g_outboxLock);
+	return pending;
+}
+
+void outbox_print_stats(void)
+{
+	int i;
+
+	(void)pthread_mutex_lock(&g_outboxLock);
+	for (i = 0; i < OUTBOX_LANE_COUNT; i++)
+	{
+		(void)printf("%s lane: %u queued, sample-to-send p50 %llu us p99 %llu us, sample-to-confirmation p50 %.1f ms p99 %.1f ms (%llu confirmed)\r\n",
+			laneNames[i], (unsigned int)g_lanes[i].count,
+			(unsigned long long)latency_histogram_percentile(&g_handOffLatency[i], 50),
+			(unsigned long long)latency_histogram_percentile(&g_handOffLatency[i], 99),
+			(double)latency_histogram_percentile(&g_confirmLatency[i], 50) / 1000.0,
+			(double)latency_histogram_percentile(&g_confirmLatency[i], 99) / 1000.0,
+			(unsigned long long)g_confirmLatency[i].Count__u64);
+	}
+	if (g_reconnectTime.Count__u64 > 0 || g_disconnectedCount > 0 || g_dropped[OUTBOX_LANE_ALERT] > 0 || g_dropped[OUTBOX_LANE_BULK] > 0)
+	{
+		(void)printf("connection: %u of %u clients disconnected, %llu reconnects, time to reconnect p50 %.1f s max %.1f s, "
+			"%llu alerts and %llu telemetry messages dropped from full lanes\r\n",
+			(unsigned int)g_disconnectedCount, (unsigned int)g_clientCount,
+			(unsigned long long)g_reconnectTime.Count__u64,
+			(double)latency_histogram_percentile(&g_reconnectTime, 50) / 1e6,
+			(double)g_reconnectTime.Max__u64 / 1e6,
+			g_dropped[OUTBOX_LANE_ALERT], g_dropped[OUTBOX_LANE_BULK]);
+	}
+	(void)pthread_mutex_unlock(&g_outboxLock);
+}
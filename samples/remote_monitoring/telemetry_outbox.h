@@ -0,0 +1,72 @@
+// Copyright (c) Microsoft. All rights reserved.
+// Licensed under the MIT license. See LICENSE file in the project root for full license information.
+
+#ifndef TELEMETRY_OUTBOX_H
+#define TELEMETRY_OUTBOX_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "iothub_client.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+    /* Messages wait in their lane until they are handed to the IoT Hub client. The
+       alert lane is always drained first and is not limited by the in-flight window,
+       so an alert never waits behind queued routine telemetry. */
+    typedef enum OUTBOX_LANE_TAG
+    {
+        OUTBOX_LANE_ALERT,
+        OUTBOX_LANE_BULK,
+        OUTBOX_LANE_COUNT
+    } OUTBOX_LANE;
+
+    /* bulkWindow is the number of bulk messages that may be handed to the client
+       and not yet confirmed; everything beyond that stays in the outbox. Each lane
+       holds at most laneCapacity waiting messages; pushing to a full lane drops its
+       oldest message, which the statistics count. */
+    int outbox_init(size_t bulkWindow, size_t laneCapacity);
+    void outbox_deinit(void);
+
+    /* Takes ownership of the message, which will be sent by iotHubClientHandle.
+       sampleTimeUs is the latency_clock_us() time at which the (oldest) sample in
+       the message was acquired. */
+    int outbox_push(OUTBOX_LANE lane, IOTHUB_CLIENT_HANDLE iotHubClientHandle, IOTHUB_MESSAGE_HANDLE message, uint64_t sampleTimeUs);
+
+    /* Hands queued messages over to their clients, alerts first. In gateway mode the
+       clients share one connection, so the bulk window applies to all of them. */
+    void outbox_drain(void);
+
+    /* Connection state of a client, from its connection status callback. Messages of a
+       disconnected client stay queued instead of being handed to a dead connection;
+       clients never reported are taken as connected. */
+    void outbox_set_connected(IOTHUB_CLIENT_HANDLE iotHubClientHandle, int connected);
+    int outbox_is_connected(IOTHUB_CLIENT_HANDLE iotHubClientHandle);
+
+    /* Drops the state and the queued messages of a client that is being destroyed, and
+       returns how many messages were dropped */
+    size_t outbox_forget_client(IOTHUB_CLIENT_HANDLE iotHubClientHandle);
+
+    /* Sleeps for up to timeoutMs, returning 1 early when a client reconnects so that
+       the caller can drain right away, 0 otherwise */
+    int outbox_wait(unsigned int timeoutMs);
+
+    /* Number of messages queued or handed over and not yet confirmed */
+    size_t outbox_pending(void);
+
+    /* The sampleTimeUs of the oldest message that was dropped, or confirmed with an
+       error, since the last call, or UINT64_MAX if none; for a caller that keeps its
+       readings until they are known to have arrived */
+    uint64_t outbox_take_lost(void);
+
+    /* Prints sample-to-send and sample-to-confirmation latency per lane, and the time
+       clients took to reconnect */
+    void outbox_print_stats(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* TELEMETRY_OUTBOX_H */
@@ -0,0 +1,66 @@
+// Copyright (c) Microsoft. All rights reserved.
+// Licensed under the MIT license. See LICENSE file in the project root for full license information.
+
+/* The Contoso Thermostat model of the remote_monitoring sample. It is shared with
+   fleet_sim, so both report the same telemetry and twin to the backend. Every
+   file including it defines onDesiredTelemetryInterval, onDesiredCalibration and
+   the direct methods. */
+
+#ifndef THERMOSTAT_MODEL_H
+#define THERMOSTAT_MODEL_H
+
+#include "serializer_devicetwin.h"
+
+BEGIN_NAMESPACE(Contoso);
+
+/* Reported properties */
+DECLARE_STRUCT(SystemProperties,
+ascii_char_ptr, FirmwareVersion
+);
+
+DECLARE_MODEL(ConfigProperties,
+WITH_REPORTED_PROPERTY(uint8_t, TelemetryInterval)
+);
+
+/* Part of DeviceInfo */
+DECLARE_STRUCT(DeviceProperties,
+ascii_char_ptr, DeviceID,
+_Bool, HubEnabledState
+);
+
+DECLARE_DEVICETWIN_MODEL(Thermostat,
+/* Telemetry (temperature, external temperature and humidity) */
+WITH_DATA(double, Temperature),
+WITH_DATA(double, Humidity),
+WITH_DATA(ascii_char_ptr, DeviceId),
+/* ISO-8601 UTC time the sample was taken, as batched or queued telemetry is sent later */
+WITH_DATA(ascii_char_ptr, SampleTime),
+
+/* DeviceInfo */
+WITH_DATA(ascii_char_ptr, ObjectType),
+WITH_DATA(_Bool, IsSimulatedDevice),
+WITH_DATA(ascii_char_ptr, Version),
+WITH_DATA(DeviceProperties, DeviceProperties),
+
+/* Device twin properties */
+WITH_REPORTED_PROPERTY(ConfigProperties, Config),
+WITH_REPORTED_PROPERTY(SystemProperties, System),
+
+WITH_DESIRED_PROPERTY(uint8_t, TelemetryInterval, onDesiredTelemetryInterval),
+/* Corrections of the sensor, see bme280_correction_parse */
+WITH_DESIRED_PROPERTY(ascii_char_ptr, Calibration, onDesiredCalibration),
+
+/* Direct methods implemented by the device */
+WITH_METHOD(LightBlink),
+WITH_METHOD(ChangeLightStatus, int, LightStatusValue),
+WITH_METHOD(InitiateFirmwareUpdate, ascii_char_ptr, FwPackageURI),
+/* Writes the events recorded with --trace to a file on the device */
+WITH_METHOD(DumpTrace),
+
+/* Register direct methods with solution portal */
+WITH_REPORTED_PROPERTY(ascii_char_ptr_no_quotes, SupportedMethods)
+);
+
+END_NAMESPACE(Contoso);
+
+#endif /* THERMOSTAT_MODEL_H */
@@ -3,10 +3,14 @@
 
 #include "simplesample_amqp.h"
 
-int main(void)
+int main(int argc, char** argv)
 {
-    simplesample_amqp_run();
+    int result = simplesample_amqp_parse_options(argc, argv);
+    if (result == 0)
+    {
+        simplesample_amqp_run();
+    }
 
-    return 0;
+    return result;
 }
 
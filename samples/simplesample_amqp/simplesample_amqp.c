@@ -5,6 +5,9 @@
 
 #include <stdio.h>
 #include <stdint.h>
+#include <string.h>
+#include <getopt.h>
+#include <pthread.h>
 
 #ifdef ARDUINO
 #include "AzureIoTHub.h"
@@ -15,6 +18,7 @@
 #include "azure_c_shared_utility/platform.h"
 #include "iothub_client.h"
 #include "iothubtransportamqp.h"
+#include "iothubtransportamqp_websockets.h"
 #include "iothub_client_ll.h"
 #endif
 
@@ -22,10 +26,51 @@
 #include "certs.h"
 #endif // MBED_BUILD_TIMESTAMP
 
+#include "device_utils.h"
+#include "latency_histogram.h"
+#include "command_dispatch.h"
+#include "simplesample_amqp.h"
+
 /*String containing Hostname, Device Id & Device Key in the format:             */
 /*  "HostName=<host_name>;DeviceId=<device_id>;SharedAccessKey=<device_key>"    */
 static const char* connectionString = "[device connection string]";
 
+/* How long to wait for outstanding confirmations after the last message */
+static const unsigned int Confirmation_timeout_ms = 10000;
+
+/* Settings that can be changed from the command line */
+typedef struct SIMPLESAMPLE_AMQP_OPTIONS_TAG
+{
+    const char* connectionString;
+    const char* trustedCertsFile;
+    IOTHUB_CLIENT_TRANSPORT_PROVIDER protocol;
+    unsigned int messageCount;
+    unsigned int intervalMs;
+    bool trace;
+} SIMPLESAMPLE_AMQP_OPTIONS;
+
+static SIMPLESAMPLE_AMQP_OPTIONS g_options =
+{
+    NULL,
+    NULL,
+    AMQP_Protocol,
+    0,
+    1000,
+    true
+};
+
+typedef struct SEND_CONTEXT_TAG
+{
+    unsigned int messageTrackingId;
+    uint64_t createTimeUs;
+} SEND_CONTEXT;
+
+/* Confirmation statistics, updated on the client's thread */
+static pthread_mutex_t g_statsLock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned int g_confirmed;
+static unsigned int g_failed;
+static latency_histogram_t g_confirmLatency;
+
 // Define the Model
 BEGIN_NAMESPACE(WeatherStation);
 
@@ -63,39 +108,102 @@ EXECUTE_COMMAND_RESULT SetAirResistance(ContosoAnemometer* device, int Position)
 
 void sendCallback(IOTHUB_CLIENT_CONFIRMATION_RESULT result, void* userContextCallback)
 {
-    unsigned int messageTrackingId = (unsigned int)(uintptr_t)userContextCallback;
+    SEND_CONTEXT* context = (SEND_CONTEXT*)userContextCallback;
+    uint64_t latencyUs = latency_clock_us() - context->createTimeUs;
 
-    (void)printf("Message Id: %u Received.\r\n", messageTrackingId);
+    (void)printf("Message Id: %u Received.\r\n", context->messageTrackingId);
 
     (void)printf("Result Call Back Called! Result is: %s \r\n", ENUM_TO_STRING(IOTHUB_CLIENT_CONFIRMATION_RESULT, result));
+
+    (void)pthread_mutex_lock(&g_statsLock);
+    if (result == IOTHUB_CLIENT_CONFIRMATION_OK)
+    {
+        g_confirmed++;
+        latency_histogram_record(&g_confirmLatency, latencyUs);
+    }
+    else
+    {
+        g_failed++;
+    }
+    (void)pthread_mutex_unlock(&g_statsLock);
+    free(context);
 }
 
 
-static void sendMessage(IOTHUB_CLIENT_HANDLE iotHubClientHandle, const unsigned char* buffer, size_t size)
+static void sendMessage(IOTHUB_CLIENT_HANDLE iotHubClientHandle, const unsigned char* buffer, size_t size, uint64_t createTimeUs)
 {
     static unsigned int messageTrackingId;
     IOTHUB_MESSAGE_HANDLE messageHandle = IoTHubMessage_CreateFromByteArray(buffer, size);
-    if (messageHandle == NULL)
+    SEND_CONTEXT* context = malloc(sizeof(SEND_CONTEXT));
+    if (messageHandle == NULL || context == NULL)
     {
         printf("unable to create a new IoTHubMessage\r\n");
+        free(context);
     }
     else
     {
-        if (IoTHubClient_SendEventAsync(iotHubClientHandle, messageHandle, sendCallback, (void*)(uintptr_t)messageTrackingId) != IOTHUB_CLIENT_OK)
+        context->messageTrackingId = messageTrackingId;
+        context->createTimeUs = createTimeUs;
+        if (IoTHubClient_SendEventAsync(iotHubClientHandle, messageHandle, sendCallback, context) != IOTHUB_CLIENT_OK)
         {
             printf("failed to hand over the message to IoTHubClient");
+            free(context);
         }
         else
         {
             printf("IoTHubClient accepted the message for delivery\r\n");
         }
 
+    }
+    if (messageHandle != NULL)
+    {
         IoTHubMessage_Destroy(messageHandle);
     }
     free((void*)buffer);
     messageTrackingId++;
 }
 
+static COMMAND_RESULT toCommandResult(EXECUTE_COMMAND_RESULT result)
+{
+    return (result == EXECUTE_COMMAND_SUCCESS) ? COMMAND_SUCCESS :
+        (result == EXECUTE_COMMAND_FAILED) ? COMMAND_FAILED :
+        COMMAND_ERROR;
+}
+
+static COMMAND_RESULT dispatchTurnFanOn(void* context, const command_args_t* args)
+{
+    (void)args;
+    return toCommandResult(TurnFanOn((ContosoAnemometer*)context));
+}
+
+static COMMAND_RESULT dispatchTurnFanOff(void* context, const command_args_t* args)
+{
+    (void)args;
+    return toCommandResult(TurnFanOff((ContosoAnemometer*)context));
+}
+
+static COMMAND_RESULT dispatchSetAirResistance(void* context, const command_args_t* args)
+{
+    int position;
+    if (command_arg_int(args, "Position", &position) != 0)
+    {
+        (void)printf("SetAirResistance needs an integer Position\r\n");
+        return COMMAND_FAILED;
+    }
+    return toCommandResult(SetAirResistance((ContosoAnemometer*)context, position));
+}
+
+/* The actions of the model, resolved without going through the serializer's schema */
+static const command_entry_t commandEntries[] =
+{
+    { "TurnFanOn", dispatchTurnFanOn },
+    { "TurnFanOff", dispatchTurnFanOff },
+    { "SetAirResistance", dispatchSetAirResistance }
+};
+
+static command_table_t* g_commands;
+
+/* Commands are parsed where the client keeps the message; a message may hold an array of them */
 static IOTHUBMESSAGE_DISPOSITION_RESULT IoTHubMessage(IOTHUB_MESSAGE_HANDLE message, void* userContextCallback)
 {
     IOTHUBMESSAGE_DISPOSITION_RESULT result;
@@ -108,26 +216,65 @@ static IOTHUBMESSAGE_DISPOSITION_RESULT IoTHubMessage(IOTHUB_MESSAGE_HANDLE mess
     }
     else
     {
-        /*buffer is not zero terminated*/
-        char* temp = malloc(size + 1);
-        if (temp == NULL)
-        {
-            printf("failed to malloc\r\n");
-            result = IOTHUBMESSAGE_ABANDONED;
-        }
-        else
+        COMMAND_RESULT commandResult = command_dispatch(g_commands, (const char*)buffer, size, userContextCallback, NULL);
+        result =
+            (commandResult == COMMAND_ERROR) ? IOTHUBMESSAGE_ABANDONED :
+            (commandResult == COMMAND_SUCCESS) ? IOTHUBMESSAGE_ACCEPTED :
+            IOTHUBMESSAGE_REJECTED;
+    }
+    return result;
+}
+
+static void sendWindSpeed(IOTHUB_CLIENT_HANDLE iotHubClientHandle, ContosoAnemometer* myWeather, int avgWindSpeed)
+{
+    unsigned char* destination;
+    size_t destinationSize;
+    uint64_t createTimeUs = latency_clock_us();
+
+    myWeather->WindSpeed = avgWindSpeed + (rand() % 4 + 2);
+
+    if (SERIALIZE(&destination, &destinationSize, myWeather->DeviceId, myWeather->WindSpeed) != CODEFIRST_OK)
+    {
+        (void)printf("Failed to serialize\r\n");
+    }
+    else
+    {
+        sendMessage(iotHubClientHandle, destination, destinationSize, createTimeUs);
+    }
+}
+
+/* Sends messageCount messages, waits for their confirmations and prints the statistics */
+static void sendMessageSeries(IOTHUB_CLIENT_HANDLE iotHubClientHandle, ContosoAnemometer* myWeather, int avgWindSpeed)
+{
+    unsigned int i;
+    unsigned int done;
+    uint64_t startUs = latency_clock_us();
+    uint64_t deadlineUs;
+
+    for (i = 0; i < g_options.messageCount; i++)
+    {
+        sendWindSpeed(iotHubClientHandle, myWeather, avgWindSpeed);
+        if (g_options.intervalMs > 0)
         {
-            (void)memcpy(temp, buffer, size);
-            temp[size] = '\0';
-            EXECUTE_COMMAND_RESULT executeCommandResult = EXECUTE_COMMAND(userContextCallback, temp);
-            result =
-                (executeCommandResult == EXECUTE_COMMAND_ERROR) ? IOTHUBMESSAGE_ABANDONED :
-                (executeCommandResult == EXECUTE_COMMAND_SUCCESS) ? IOTHUBMESSAGE_ACCEPTED :
-                IOTHUBMESSAGE_REJECTED;
-            free(temp);
+            ThreadAPI_Sleep(g_options.intervalMs);
         }
     }
-    return result;
+
+    deadlineUs = latency_clock_us() + Confirmation_timeout_ms * 1000ULL;
+    do
+    {
+        ThreadAPI_Sleep(10);
+        (void)pthread_mutex_lock(&g_statsLock);
+        done = g_confirmed + g_failed;
+        (void)pthread_mutex_unlock(&g_statsLock);
+    } while (done < g_options.messageCount && latency_clock_us() < deadlineUs);
+
+    (void)pthread_mutex_lock(&g_statsLock);
+    (void)printf("Sent %u messages in %.3f s, %u confirmed, %u failed, sample-to-confirmation p50 %.1f ms p99 %.1f ms\r\n",
+        g_options.messageCount, (double)(latency_clock_us() - startUs) / 1e6, g_confirmed, g_failed,
+        (double)latency_histogram_percentile(&g_confirmLatency, 50) / 1000.0,
+        (double)latency_histogram_percentile(&g_confirmLatency, 99) / 1000.0);
+    (void)pthread_mutex_unlock(&g_statsLock);
 }
 
 void simplesample_amqp_run(void)
@@ -142,15 +289,24 @@ void simplesample_amqp_run(void)
         {
             (void)printf("Failed on serializer_init\r\n");
         }
+        else if ((g_commands = command_table_create(commandEntries, sizeof(commandEntries) / sizeof(commandEntries[0]))) == NULL)
+        {
+            (void)printf("Failed to create the command table\r\n");
+            serializer_deinit();
+        }
         else
         {
             /* Setup IoTHub client configuration */
-            IOTHUB_CLIENT_HANDLE iotHubClientHandle = IoTHubClient_CreateFromConnectionString(connectionString, AMQP_Protocol);
+            IOTHUB_CLIENT_HANDLE iotHubClientHandle = IoTHubClient_CreateFromConnectionString(
+                (g_options.connectionString != NULL) ? g_options.connectionString : connectionString, g_options.protocol);
             srand((unsigned int)time(NULL));
             int avgWindSpeed = 10;
+            char* trustedCerts = NULL;
+
+            latency_histogram_reset(&g_confirmLatency);
 
             // Turn on Log 
-            bool trace = true;
+            bool trace = g_options.trace;
             (void)IoTHubClient_SetOption(iotHubClientHandle, "logtrace", &trace);
 
             if (iotHubClientHandle == NULL)
@@ -166,6 +322,12 @@ void simplesample_amqp_run(void)
                     (void)printf("failure to set option \"TrustedCerts\"\r\n");
                 }
 #endif // MBED_BUILD_TIMESTAMP
+                if (g_options.trustedCertsFile != NULL &&
+                    ((trustedCerts = ReadTextFile(g_options.trustedCertsFile)) == NULL ||
+                    IoTHubClient_SetOption(iotHubClientHandle, "TrustedCerts", trustedCerts) != IOTHUB_CLIENT_OK))
+                {
+                    (void)printf("failure to set option \"TrustedCerts\"\r\n");
+                }
 
                 ContosoAnemometer* myWeather = CREATE_MODEL_INSTANCE(WeatherStation, ContosoAnemometer);
                 if (myWeather == NULL)
@@ -174,9 +336,6 @@ void simplesample_amqp_run(void)
                 }
                 else
                 {
-                    unsigned char* destination;
-                    size_t destinationSize;
-
                     if (IoTHubClient_SetMessageCallback(iotHubClientHandle, IoTHubMessage, myWeather) != IOTHUB_CLIENT_OK)
                     {
                         printf("unable to IoTHubClient_SetMessageCallback\r\n");
@@ -184,27 +343,103 @@ void simplesample_amqp_run(void)
                     else
                     {
                         myWeather->DeviceId = "myFirstDevice";
-                        myWeather->WindSpeed = avgWindSpeed + (rand() % 4 + 2);
 
-                        if (SERIALIZE(&destination, &destinationSize, myWeather->DeviceId, myWeather->WindSpeed) != CODEFIRST_OK)
+                        if (g_options.messageCount > 0)
                         {
-                            (void)printf("Failed to serialize\r\n");
+                            sendMessageSeries(iotHubClientHandle, myWeather, avgWindSpeed);
                         }
                         else
                         {
-                            sendMessage(iotHubClientHandle, destination, destinationSize);
-                        }
+                            sendWindSpeed(iotHubClientHandle, myWeather, avgWindSpeed);
 
-                        /* wait for commands */
-                        (void)getchar();
+                            /* wait for commands */
+                            (void)getchar();
+                        }
                     }
                     DESTROY_MODEL_INSTANCE(myWeather);
                 }
                 IoTHubClient_Destroy(iotHubClientHandle);
             }
+            free(trustedCerts);
+            command_table_destroy(g_commands);
+            g_commands = NULL;
             serializer_deinit();
         }
         platform_deinit();
     }
 }
 
+static void simplesample_amqp_usage(const char* program)
+{
+    printf("Usage: %s [options]\n", program);
+    printf("  --connection-string STRING   device connection string to use instead of the built-in one\n");
+    printf("  --trusted-certs FILE         PEM certificates to trust, e.g. of a local broker stand-in\n");
+    printf("  --transport amqp|amqp-ws     AMQP over port 5671 or over a WebSocket on port 443 (default amqp)\n");
+    printf("  --messages N                 send N messages, print the latency statistics and exit\n");
+    printf("                               instead of sending one message and waiting for commands\n");
+    printf("  --interval-ms MS             time between those messages (default 1000)\n");
+    printf("  --no-trace                   turn off the transport log\n");
+}
+
+int simplesample_amqp_parse_options(int argc, char** argv)
+{
+    static const struct option longOptions[] =
+    {
+        { "connection-string", required_argument, NULL, 's' },
+        { "trusted-certs", required_argument, NULL, 'T' },
+        { "transport", required_argument, NULL, 'p' },
+        { "messages", required_argument, NULL, 'n' },
+        { "interval-ms", required_argument, NULL, 'i' },
+        { "no-trace", no_argument, NULL, 'q' },
+        { "help", no_argument, NULL, 'h' },
+        { NULL, 0, NULL, 0 }
+    };
+    int result = 0;
+    int opt;
+
+    while (result == 0 && (opt = getopt_long(argc, argv, "h", longOptions, NULL)) != -1)
+    {
+        switch (opt)
+        {
+        case 's':
+            g_options.connectionString = optarg;
+            break;
+        case 'T':
+            g_options.trustedCertsFile = optarg;
+            break;
+        case 'p':
+            if (strcmp(optarg, "amqp") == 0)
+            {
+                g_options.protocol = AMQP_Protocol;
+            }
+            else if (strcmp(optarg, "amqp-ws") == 0)
+            {
+                g_options.protocol = AMQP_Protocol_over_WebSocketsTls;
+            }
+            else
+            {
+                printf("Unknown transport: %s\n", optarg);
+                result = 1;
+            }
+            break;
+        case 'n':
+            result = ParseUnsigned(optarg, &g_options.messageCount);
+            break;
+        case 'i':
+            result = ParseUnsigned(optarg, &g_options.intervalMs);
+            break;
+        case 'q':
+            g_options.trace = false;
+            break;
+        default:
+            result = 1;
+            break;
+        }
+    }
+
+    if (result != 0)
+    {
+        simplesample_amqp_usage(argv[0]);
+    }
+    return result;
+}
@@ -8,6 +8,7 @@
 extern "C" {
 #endif
 
+    int simplesample_amqp_parse_options(int argc, char** argv);
     void simplesample_amqp_run(void);
 
 #ifdef __cplusplus